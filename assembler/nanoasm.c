@@ -0,0 +1,224 @@
+#include "asmbuild.h"
+#include "assembler.h"
+#include "errno.h"
+#include "linker.h"
+#include "loader.h"
+#include "log.h"
+#include "writer.h"
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Prints errors and warnings as the bare "file:line: ..." message. */
+static void print_message(log_Event *ev) {
+  vfprintf(ev->udata, ev->fmt, ev->ap);
+  fputc('\n', ev->udata);
+}
+
+/* Maps the source read-only; an empty file maps to nothing. */
+static ErrorCode map_source(const char *filename, const char **source,
+                            size_t *size) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    log_error("Failed to open '%s'", filename);
+    return ERR_FILE_NOT_FOUND;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    log_error("Failed to stat '%s'", filename);
+    close(fd);
+    return ERR_FILE_READ;
+  }
+  *size = (size_t)st.st_size;
+  *source = NULL;
+  if (*size > 0) {
+    void *mapping = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+      log_error("Failed to map '%s'", filename);
+      close(fd);
+      return ERR_FILE_READ;
+    }
+    madvise(mapping, *size, MADV_SEQUENTIAL);
+    *source = mapping;
+  }
+  close(fd);
+  return SUCCESS;
+}
+
+/* Returns "<input>.nvo" with a trailing ".asm" dropped, from malloc. */
+static char *object_name(const char *input) {
+  size_t length = strlen(input);
+  if (length > 4 && 0 == strcmp(input + length - 4, ".asm")) {
+    length -= 4;
+  }
+  char *object = malloc(length + sizeof(".nvo"));
+  if (NULL != object) {
+    memcpy(object, input, length);
+    memcpy(object + length, ".nvo", sizeof(".nvo"));
+  }
+  return object;
+}
+
+/* Links objects into one program, the first holding the entry point. */
+static ErrorCode link_objects(char *const *objects, size_t count,
+                              const char *output) {
+  MappedBytecode *mapped = calloc(count, sizeof(MappedBytecode));
+  BytecodeImage *images = calloc(count, sizeof(BytecodeImage));
+  ErrorCode status = NULL == mapped || NULL == images ? ERR_OUT_OF_MEMORY
+                                                      : SUCCESS;
+  size_t opened = 0;
+  for (; status == SUCCESS && opened < count; opened++) {
+    status = map_bytecode(objects[opened], &mapped[opened]);
+    if (status == SUCCESS) {
+      images[opened] = mapped[opened].image;
+    } else {
+      fprintf(stderr, "%s: cannot read this object\n", objects[opened]);
+      break;
+    }
+  }
+  if (status == SUCCESS) {
+    BytecodeImage linked;
+    status = link_bytecode(images, count, &linked);
+    if (status == SUCCESS) {
+      status = write_bytecode(output, &linked, 0);
+      free_linked_bytecode(&linked);
+    } else {
+      fprintf(stderr, "%s: linking failed\n", output);
+    }
+  }
+  for (size_t i = 0; i < opened; i++) {
+    unmap_bytecode(&mapped[i]);
+  }
+  free(mapped);
+  free(images);
+  return status;
+}
+
+/* Assembles many sources into objects at once, then links them if asked. */
+static int assemble_many(char *const *inputs, size_t count,
+                         const AssembleFilesOptions *options,
+                         const char *output, bool verbose) {
+  char **objects = calloc(count, sizeof(char *));
+  ErrorCode status = NULL == objects ? ERR_OUT_OF_MEMORY : SUCCESS;
+  for (size_t i = 0; status == SUCCESS && i < count; i++) {
+    objects[i] = object_name(inputs[i]);
+    status = NULL == objects[i] ? ERR_OUT_OF_MEMORY : SUCCESS;
+  }
+  size_t rebuilt = 0;
+  if (status == SUCCESS) {
+    status = assemble_files((const char *const *)inputs,
+                            (const char *const *)objects, count, options,
+                            NULL, &rebuilt);
+  }
+  if (verbose) {
+    printf("%zu of %zu files assembled\n", rebuilt, count);
+  }
+  if (status == SUCCESS && NULL != output) {
+    status = link_objects(objects, count, output);
+  }
+  for (size_t i = 0; NULL != objects && i < count; i++) {
+    free(objects[i]);
+  }
+  free(objects);
+  return status;
+}
+
+static void usage(const char *program) {
+  fprintf(stderr, "Usage: %s [-n] [-g] [-v] <input.asm> <output.nvm>\n",
+          program);
+  fprintf(stderr,
+          "       %s -c [-n] [-g] [-v] [-i] [-j N] [-o output.nvm] "
+          "<input.asm>...\n",
+          program);
+  fprintf(stderr, "  -n  Leave out the peephole rules\n");
+  fprintf(stderr, "  -g  Add debug information mapping code to source lines "
+                  "(-o drops it)\n");
+  fprintf(stderr, "  -v  Report what the peephole rules removed, or how many "
+                  "files -c assembled\n");
+  fprintf(stderr, "  -c  Assemble each input.asm to the object input.nvo\n");
+  fprintf(stderr, "  -i  With -c, skip inputs whose object is up to date\n");
+  fprintf(stderr, "  -j  With -c, assemble N files at once (default: one "
+                  "per CPU)\n");
+  fprintf(stderr, "  -o  With -c, link the objects into output.nvm; the "
+                  "first input holds the entry point\n");
+}
+
+int main(int argc, char *argv[]) {
+  AssemblerOptions options = {.peephole = PEEPHOLE_ALL, .removed = 0};
+  AssembleFilesOptions many = {PEEPHOLE_ALL, 0, false, false};
+  bool verbose = false;
+  bool objects = false;
+  const char *linked = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "ngvcij:o:")) != -1) {
+    switch (opt) {
+    case 'n':
+      options.peephole = 0;
+      many.peephole = 0;
+      break;
+    case 'g':
+      options.debug_info = true;
+      many.debug_info = true;
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    case 'c':
+      objects = true;
+      break;
+    case 'i':
+      many.incremental = true;
+      break;
+    case 'j':
+      many.threads = (unsigned)strtoul(optarg, NULL, 10);
+      break;
+    case 'o':
+      linked = optarg;
+      break;
+    default:
+      optind = argc; // Falls through to the usage message
+      break;
+    }
+  }
+  bool valid = objects ? argc > optind : argc - optind == 2 && NULL == linked;
+  if (!valid) {
+    usage(argv[0]);
+    return ERR_INVALID_OPERAND;
+  }
+  log_set_quiet(true);
+  log_add_callback(print_message, stderr, LOG_WARN);
+  if (objects) {
+    return assemble_many(argv + optind, (size_t)(argc - optind), &many,
+                         linked, verbose);
+  }
+
+  const char *input = argv[optind];
+  const char *output = argv[optind + 1];
+  const char *source = NULL;
+  size_t size = 0;
+  ErrorCode status = map_source(input, &source, &size);
+  if (status != SUCCESS) {
+    return status;
+  }
+
+  BytecodeImage image;
+  status = assemble_image(source, size, input, &options, &image);
+  if (status == SUCCESS) {
+    status = write_bytecode(output, &image, 0);
+    if (verbose) {
+      printf("%s: %zu bytes of code, %zu instructions removed by peephole "
+             "rules\n",
+             input, image.code_size, options.removed);
+    }
+    free_assembled_image(&image);
+  }
+  if (size > 0) {
+    munmap((void *)source, size);
+  }
+  return status;
+}
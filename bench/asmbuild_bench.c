@@ -0,0 +1,128 @@
+/* Generates a source tree of 1000 files of 2000 lines each, all including
+ * one shared file and dated an hour back as a checkout would be, and
+ * assembles it with assemble_files: a full build on one thread and on
+ * every CPU, an incremental build with nothing changed, and an incremental
+ * build after editing one file.
+ */
+#include "asmbuild.h"
+#include "assembler.h"
+#include "log.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FILES 1000
+#define BLOCKS 250 // Eight lines each
+#define PATH_SIZE 64
+
+static char directory[] = "asmbuild_bench_XXXXXX";
+static char sources[FILES][PATH_SIZE];
+static char objects[FILES][PATH_SIZE];
+static char stamps[FILES][PATH_SIZE + sizeof(ASMBUILD_STAMP_SUFFIX)];
+static const char *source_paths[FILES];
+static const char *object_paths[FILES];
+
+static double elapsed(const struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (double)(end.tv_sec - start->tv_sec) +
+         (double)(end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Sets a file's access and modification times an hour back. */
+static int age(const char *path) {
+  struct timespec times[2];
+  clock_gettime(CLOCK_REALTIME, &times[0]);
+  times[0].tv_sec -= 3600;
+  times[1] = times[0];
+  return utimensat(AT_FDCWD, path, times, 0);
+}
+
+/* Writes one file of the tree; `seed` varies its constants. */
+static int write_source(int index, int seed) {
+  FILE *fp = fopen(sources[index], "w");
+  if (NULL == fp) {
+    return -1;
+  }
+  fprintf(fp, ".include \"common.inc\"\n");
+  for (int i = 0; i < BLOCKS; i++) {
+    fprintf(fp,
+            "L%d:\n    push %d\n    dup\n    jz L%d\n    load 3\n    add\n"
+            "    pop\n    jmp L%d\n",
+            i, i + seed, i + 1, i + 1);
+  }
+  fprintf(fp, "L%d:\n    halt\n", BLOCKS);
+  return fclose(fp);
+}
+
+static double build(unsigned threads, bool incremental, size_t *rebuilt) {
+  AssembleFilesOptions options = {PEEPHOLE_ALL, threads, incremental,
+                                  false};
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  ErrorCode status = assemble_files(source_paths, object_paths, FILES,
+                                    &options, NULL, rebuilt);
+  double seconds = elapsed(&start);
+  return status == SUCCESS ? seconds : -1;
+}
+
+static void remove_tree(const char *common) {
+  for (int i = 0; i < FILES; i++) {
+    remove(sources[i]);
+    remove(objects[i]);
+    remove(stamps[i]);
+  }
+  remove(common);
+  rmdir(directory);
+}
+
+int main(void) {
+  log_set_level(LOG_WARN);
+  log_set_quiet(true);
+  if (NULL == mkdtemp(directory)) {
+    return 1;
+  }
+  char common[PATH_SIZE];
+  snprintf(common, sizeof(common), "%s/common.inc", directory);
+  FILE *fp = fopen(common, "w");
+  if (NULL == fp) {
+    return 1;
+  }
+  fputs("    push 0\n    pop\n", fp);
+  int failed = fclose(fp) | age(common);
+  for (int i = 0; i < FILES; i++) {
+    snprintf(sources[i], PATH_SIZE, "%s/file%d.asm", directory, i);
+    snprintf(objects[i], PATH_SIZE, "%s/file%d.nvo", directory, i);
+    snprintf(stamps[i], sizeof(stamps[i]), "%s/file%d.nvo%s", directory, i,
+             ASMBUILD_STAMP_SUFFIX);
+    source_paths[i] = sources[i];
+    object_paths[i] = objects[i];
+    failed |= write_source(i, i) | age(sources[i]);
+  }
+
+  size_t full_rebuilt = 0;
+  size_t unchanged_rebuilt = 0;
+  size_t edit_rebuilt = 0;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  double serial = build(1, false, &full_rebuilt);
+  double parallel = build(0, false, &full_rebuilt);
+  double unchanged = build(0, true, &unchanged_rebuilt);
+  failed |= write_source(FILES / 2, FILES);
+  double edit = build(0, true, &edit_rebuilt);
+  remove_tree(common);
+  if (failed || serial < 0 || parallel < 0 || unchanged < 0 || edit < 0) {
+    return 1;
+  }
+  printf("%d files of %d lines: full build %.0f ms on 1 thread, %.0f ms on "
+         "%ld (%.1fx)\n",
+         FILES, BLOCKS * 8 + 3, serial * 1e3, parallel * 1e3, cpus,
+         serial / parallel);
+  printf("incremental: %.1f ms with nothing changed (%zu assembled), "
+         "%.1f ms after one edit (%zu assembled)\n",
+         unchanged * 1e3, unchanged_rebuilt, edit * 1e3, edit_rebuilt);
+  return 0;
+}
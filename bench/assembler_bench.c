@@ -0,0 +1,193 @@
+/* Generates and runs 2000 small programs, each a loop over a different
+ * count, the way a code generator iterating on its output would. The first
+ * round goes through a file per program (assemble_code, write_bytecode,
+ * open_program); the second assembles straight into a Program with
+ * assemble_program. Then times assemble_code on a 2,000,000-line source,
+ * and runs a loop full of the redundancy generated code tends to have with
+ * and without the peephole rules.
+ */
+#include "assembler.h"
+#include "bytecode_format.h"
+#include "log.h"
+#include "program.h"
+#include "vm.h"
+#include "writer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROGRAMS 2000
+#define LARGE_BLOCKS 250000 // Eight lines each
+#define SCRATCH_FILE "assembler_bench.nvm"
+#define LOOP_ITERATIONS 10000000
+
+// Counts down from LOOP_ITERATIONS through code a naive generator might emit
+static const char redundant_loop[] = "    push 7\n"
+                                     "    push 10000000\n"
+                                     "Loop:\n"
+                                     "    push 0\n"
+                                     "    add\n"
+                                     "    dup\n"
+                                     "    pop\n"
+                                     "    swap\n"
+                                     "    swap\n"
+                                     "    push 1\n"
+                                     "    sub\n"
+                                     "    dup\n"
+                                     "    jz End\n"
+                                     "    jmp Next\n"
+                                     "Next:\n"
+                                     "    jmp Loop\n"
+                                     "End:\n"
+                                     "    halt\n";
+
+static double elapsed(const struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (double)(end.tv_sec - start->tv_sec) +
+         (double)(end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int generate(char *source, size_t size, int count) {
+  return snprintf(source, size,
+                  "    push %d\n"
+                  "Loop:\n"
+                  "    dup\n"
+                  "    jz End\n"
+                  "    push8 1\n"
+                  "    sub\n"
+                  "    jmp Loop\n"
+                  "End:\n"
+                  "    halt\n",
+                  count);
+}
+
+static ErrorCode run(Program *program) {
+  Nano_VM vm;
+  ErrorCode status = init_vm(&vm);
+  if (status == SUCCESS) {
+    status = attach_program(&vm, program);
+  }
+  if (status == SUCCESS) {
+    status = execute_vm(&vm);
+  }
+  free_vm(&vm);
+  release_program(program);
+  return status;
+}
+
+static ErrorCode through_file(const char *source, size_t size) {
+  uint8_t *code = NULL;
+  size_t code_size = 0;
+  ErrorCode status = assemble_code(source, size, NULL, NULL, &code, &code_size);
+  if (status != SUCCESS) {
+    return status;
+  }
+  BytecodeImage image = {0};
+  image.version = BYTECODE_VERSION;
+  image.code = code;
+  image.code_size = code_size;
+  status = write_bytecode(SCRATCH_FILE, &image, 0);
+  free(code);
+  Program *program = NULL;
+  if (status == SUCCESS) {
+    status = open_program(SCRATCH_FILE, &program);
+  }
+  return status == SUCCESS ? run(program) : status;
+}
+
+static ErrorCode in_process(const char *source, size_t size) {
+  Program *program = NULL;
+  ErrorCode status = assemble_program(source, size, NULL, NULL, &program);
+  return status == SUCCESS ? run(program) : status;
+}
+
+static double time_programs(ErrorCode (*round)(const char *, size_t)) {
+  char source[256];
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < PROGRAMS; i++) {
+    int size = generate(source, sizeof(source), i % 100);
+    if (round(source, (size_t)size) != SUCCESS) {
+      return -1;
+    }
+  }
+  return elapsed(&start);
+}
+
+static double time_large(size_t *size) {
+  size_t capacity = (size_t)LARGE_BLOCKS * 128;
+  char *source = malloc(capacity);
+  if (NULL == source) {
+    return -1;
+  }
+  *size = 0;
+  for (int i = 0; i < LARGE_BLOCKS; i++) {
+    *size += (size_t)snprintf(source + *size, capacity - *size,
+                              "L%d:\n    push %d ; value\n    dup\n"
+                              "    jz L%d\n    load 3\n    add\n    pop\n"
+                              "    jmp L%d\n",
+                              i, i, i + 1, i + 1);
+  }
+  *size += (size_t)snprintf(source + *size, capacity - *size,
+                            "L%d:\n    halt\n", LARGE_BLOCKS);
+
+  uint8_t *code = NULL;
+  size_t code_size = 0;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  ErrorCode status =
+      assemble_code(source, *size, NULL, NULL, &code, &code_size);
+  double seconds = elapsed(&start);
+  free(code);
+  free(source);
+  return status == SUCCESS ? seconds : -1;
+}
+
+/* Runs the redundant loop assembled with the given peephole rules. */
+static double time_loop(uint32_t peephole, size_t *removed) {
+  AssemblerOptions options = {.peephole = peephole, .removed = 0};
+  Program *program = NULL;
+  Nano_VM vm;
+  if (assemble_program(redundant_loop, sizeof(redundant_loop) - 1, NULL,
+                       &options, &program) != SUCCESS ||
+      init_vm(&vm) != SUCCESS || attach_program(&vm, program) != SUCCESS) {
+    return -1;
+  }
+  *removed = options.removed;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  ErrorCode status = execute_vm(&vm);
+  double seconds = elapsed(&start);
+  free_vm(&vm);
+  release_program(program);
+  return status == SUCCESS ? seconds : -1;
+}
+
+int main(void) {
+  log_set_level(LOG_WARN);
+  log_set_quiet(true);
+
+  double file = time_programs(through_file);
+  unlink(SCRATCH_FILE);
+  double memory = time_programs(in_process);
+  size_t size = 0;
+  double large = time_large(&size);
+  size_t removed = 0;
+  double plain = time_loop(0, &removed);
+  double optimized = time_loop(PEEPHOLE_ALL, &removed);
+  if (file < 0 || memory < 0 || large < 0 || plain < 0 || optimized < 0) {
+    return 1;
+  }
+  printf("%d programs: through a file %.1f us, in process %.1f us each\n",
+         PROGRAMS, file * 1e6 / PROGRAMS, memory * 1e6 / PROGRAMS);
+  printf("%d lines (%.1f MB): assembled in %.0f ms (%.0f MB/s)\n",
+         LARGE_BLOCKS * 8 + 2, size / 1e6, large * 1e3, size / 1e6 / large);
+  printf("%d iterations: %.2f ns as written, %.2f ns with peephole rules "
+         "(%zu instructions removed)\n",
+         LOOP_ITERATIONS, plain * 1e9 / LOOP_ITERATIONS,
+         optimized * 1e9 / LOOP_ITERATIONS, removed);
+  return 0;
+}
@@ -0,0 +1,102 @@
+/* Opens thousands of small program files one at a time with open_program,
+ * then all at once through io_uring and through the thread pool, and
+ * compares the time per program. The files are written just before, so
+ * they are read from a warm page cache.
+ */
+#include "bulk.h"
+#include "bytecode.h"
+#include "log.h"
+#include "program.h"
+#include "writer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PROGRAM_COUNT 4000
+
+static double elapsed(const struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (double)(end.tv_sec - start->tv_sec) +
+         (double)(end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static char names[PROGRAM_COUNT][32];
+static const char *filenames[PROGRAM_COUNT];
+static Program *programs[PROGRAM_COUNT];
+
+/* Loads every file with `backend`; returns seconds, or -1 on failure. */
+static double time_bulk(BulkBackend backend) {
+  struct timespec start;
+  BulkLoadOptions options = {backend, 0, 0};
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (open_programs_bulk(filenames, PROGRAM_COUNT, &options, programs,
+                         NULL) != SUCCESS) {
+    return -1;
+  }
+  double seconds = elapsed(&start);
+  for (int i = 0; i < PROGRAM_COUNT; i++) {
+    release_program(programs[i]);
+  }
+  return seconds;
+}
+
+int main(void) {
+  log_set_level(LOG_WARN);
+  log_set_quiet(true);
+
+  static uint8_t code[1024];
+  memset(code, OP_NOP, sizeof(code));
+  code[sizeof(code) - 1] = OP_HALT;
+  BytecodeImage image = {0};
+  image.code = code;
+  image.code_size = sizeof(code);
+
+  for (int i = 0; i < PROGRAM_COUNT; i++) {
+    uint8_t *file = NULL;
+    size_t size = 0;
+    code[0] = (uint8_t)(i % 2 ? OP_NOP : OP_HALT);
+    if (serialize_bytecode(&image, 0, &vm_default_allocator, &file, &size) !=
+        SUCCESS) {
+      return 1;
+    }
+    snprintf(names[i], sizeof(names[i]), "bulk_bench_%d.nvm", i);
+    filenames[i] = names[i];
+    FILE *out = fopen(names[i], "wb");
+    if (NULL == out || fwrite(file, 1, size, out) != size) {
+      return 1;
+    }
+    fclose(out);
+    free(file);
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < PROGRAM_COUNT; i++) {
+    if (open_program(names[i], &programs[i]) != SUCCESS) {
+      return 1;
+    }
+    release_program(programs[i]);
+  }
+  double sequential = elapsed(&start);
+  double uring = bulk_io_uring_available() ? time_bulk(BULK_IO_URING) : -1;
+  double threads = time_bulk(BULK_THREADS);
+  if (threads < 0) {
+    return 1;
+  }
+
+  printf("%d programs  open_program %.1f us/program, ", PROGRAM_COUNT,
+         sequential / PROGRAM_COUNT * 1e6);
+  if (uring < 0) {
+    printf("io_uring unavailable, ");
+  } else {
+    printf("io_uring %.1f us/program, ", uring / PROGRAM_COUNT * 1e6);
+  }
+  printf("threads %.1f us/program\n", threads / PROGRAM_COUNT * 1e6);
+
+  for (int i = 0; i < PROGRAM_COUNT; i++) {
+    remove(names[i]);
+  }
+  return 0;
+}
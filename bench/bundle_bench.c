@@ -0,0 +1,92 @@
+/* Opens many small programs, each from its own file with open_program and
+ * then by name from a single bundle, and compares the time per program.
+ */
+#include "bundle.h"
+#include "bytecode.h"
+#include "log.h"
+#include "program.h"
+#include "writer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PROGRAM_COUNT 2000
+
+static double elapsed(const struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (double)(end.tv_sec - start->tv_sec) +
+         (double)(end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(void) {
+  log_set_level(LOG_WARN);
+  log_set_quiet(true);
+
+  static char names[PROGRAM_COUNT][32];
+  static BundleMember members[PROGRAM_COUNT];
+  static uint8_t code[256];
+  memset(code, OP_NOP, sizeof(code));
+  code[sizeof(code) - 1] = OP_HALT;
+  BytecodeImage image = {0};
+  image.code = code;
+  image.code_size = sizeof(code);
+
+  for (int i = 0; i < PROGRAM_COUNT; i++) {
+    uint8_t *file = NULL;
+    size_t size = 0;
+    code[0] = (uint8_t)(i % 2 ? OP_NOP : OP_HALT); // Members differ a little
+    if (serialize_bytecode(&image, 0, &vm_default_allocator, &file, &size) !=
+        SUCCESS) {
+      return 1;
+    }
+    snprintf(names[i], sizeof(names[i]), "bundle_bench_%d.nvm", i);
+    FILE *out = fopen(names[i], "wb");
+    if (NULL == out || fwrite(file, 1, size, out) != size) {
+      return 1;
+    }
+    fclose(out);
+    members[i] = (BundleMember){names[i], file, size};
+  }
+  if (write_bundle("bundle_bench.nvb", members, PROGRAM_COUNT) != SUCCESS) {
+    return 1;
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < PROGRAM_COUNT; i++) {
+    Program *program = NULL;
+    if (open_program(names[i], &program) != SUCCESS) {
+      return 1;
+    }
+    release_program(program);
+  }
+  double files = elapsed(&start);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  Bundle *bundle = NULL;
+  if (open_bundle("bundle_bench.nvb", &bundle) != SUCCESS) {
+    return 1;
+  }
+  for (int i = 0; i < PROGRAM_COUNT; i++) {
+    Program *program = NULL;
+    if (open_bundle_program(bundle, names[i], &program) != SUCCESS) {
+      return 1;
+    }
+    release_program(program);
+  }
+  release_bundle(bundle);
+  double bundled = elapsed(&start);
+
+  printf("%d programs  files %.1f us/program, bundle %.1f us/program\n",
+         PROGRAM_COUNT, files / PROGRAM_COUNT * 1e6,
+         bundled / PROGRAM_COUNT * 1e6);
+
+  for (int i = 0; i < PROGRAM_COUNT; i++) {
+    remove(names[i]);
+    free((void *)members[i].data);
+  }
+  remove("bundle_bench.nvb");
+  return 0;
+}
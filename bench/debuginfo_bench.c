@@ -0,0 +1,113 @@
+/* Assembles a generated source of 20000 small functions with and without
+ * debug information, and compares the time taken, the code and the size of
+ * the debug section. Then maps 1,000,000 code offsets spread over the
+ * program back to function:line with find_source_location, as a profiler
+ * symbolizing its samples would.
+ */
+#include "assembler.h"
+#include "debuginfo.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FUNCTIONS 20000
+#define LOOKUPS 1000000
+
+static double elapsed(const struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (double)(end.tv_sec - start->tv_sec) +
+         (double)(end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Writes a main that calls every function in turn, then the functions. */
+static char *generate(size_t *size) {
+  size_t capacity = (size_t)FUNCTIONS * 96 + 64;
+  char *source = malloc(capacity);
+  if (NULL == source) {
+    return NULL;
+  }
+  size_t length = 0;
+  for (int i = 0; i < FUNCTIONS; i++) {
+    length += (size_t)snprintf(source + length, capacity - length,
+                               "    push %d\n    call f%d\n    pop\n", i, i);
+  }
+  length += (size_t)snprintf(source + length, capacity - length, "    halt\n");
+  for (int i = 0; i < FUNCTIONS; i++) {
+    length += (size_t)snprintf(source + length, capacity - length,
+                               "f%d:\n    dup\n    add\n    inc\n    ret\n",
+                               i);
+  }
+  *size = length;
+  return source;
+}
+
+static double assemble(const char *source, size_t size, bool debug_info,
+                       BytecodeImage *image) {
+  AssemblerOptions options = {.peephole = PEEPHOLE_ALL,
+                              .debug_info = debug_info};
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  ErrorCode status = assemble_image(source, size, "generated.asm", &options,
+                                    image);
+  double seconds = elapsed(&start);
+  return status == SUCCESS ? seconds : -1;
+}
+
+/* Looks up offsets spread pseudo-randomly over the code. */
+static double time_lookups(const BytecodeImage *image, size_t *lines) {
+  uint32_t state = 2463534242u;
+  *lines = 0;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < LOOKUPS; i++) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    SourceLocation location;
+    if (find_source_location(image, state % image->code_size, &location) !=
+        SUCCESS) {
+      return -1;
+    }
+    *lines += location.line > 0;
+  }
+  return elapsed(&start);
+}
+
+int main(void) {
+  log_set_level(LOG_WARN);
+  log_set_quiet(true);
+  size_t size = 0;
+  char *source = generate(&size);
+  if (NULL == source) {
+    return 1;
+  }
+  BytecodeImage plain;
+  BytecodeImage debug;
+  double without = assemble(source, size, false, &plain);
+  double with = assemble(source, size, true, &debug);
+  free(source);
+  if (without < 0 || with < 0) {
+    return 1;
+  }
+  bool same = plain.code_size == debug.code_size &&
+              0 == memcmp(plain.code, debug.code, plain.code_size);
+  size_t lines = 0;
+  double lookups = time_lookups(&debug, &lines);
+  if (lookups < 0) {
+    return 1;
+  }
+  printf("%d functions, %zu bytes of code: assembled in %.1f ms, %.1f ms "
+         "with debug information (code %s)\n",
+         FUNCTIONS, plain.code_size, without * 1e3, with * 1e3,
+         same ? "identical" : "differs");
+  printf("debug section: %zu bytes (%.2f per byte of code)\n",
+         debug.debug_size, (double)debug.debug_size / debug.code_size);
+  printf("%d lookups: %.0f ns each, %zu found a line\n", LOOKUPS,
+         lookups * 1e9 / LOOKUPS, lines);
+  free_assembled_image(&plain);
+  free_assembled_image(&debug);
+  return same ? 0 : 1;
+}
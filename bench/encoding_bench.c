@@ -0,0 +1,116 @@
+/* Compares the fixed 32-bit operand encoding with the compact encoding
+ * produced by compact_bytecode: code size, and time spent in execute_vm on
+ * the same loop.
+ */
+#include "bytecode.h"
+#include "bytecode_format.h"
+#include "compact.h"
+#include "log.h"
+#include "program.h"
+#include "vm.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define ITERATIONS 1000000
+#define RUNS 5
+
+static uint8_t code[256];
+static size_t code_size;
+
+static size_t emit(Opcode opcode) {
+  size_t offset = code_size;
+  code[code_size++] = opcode;
+  return offset;
+}
+
+static size_t emit_u32(Opcode opcode, uint32_t operand) {
+  size_t offset = emit(opcode);
+  memcpy(code + code_size, &operand, sizeof(operand));
+  code_size += sizeof(operand);
+  return offset;
+}
+
+/* Counts down from ITERATIONS, doing some small-constant arithmetic and a
+ * global update on every pass.
+ */
+static void build_loop(void) {
+  emit_u32(OP_PUSH, ITERATIONS);
+  size_t loop = emit_u32(OP_PUSH, 3);
+  emit_u32(OP_PUSH, 1);
+  emit(OP_ADD);
+  emit_u32(OP_PUSHK, 0);
+  emit(OP_MUL);
+  emit_u32(OP_GLOAD, 0);
+  emit(OP_ADD);
+  emit_u32(OP_GSTORE, 0);
+  emit(OP_DEC);
+  emit(OP_DUP);
+  size_t skip = emit_u32(OP_JMPZ, 0);
+  emit_u32(OP_JMP, (uint32_t)loop);
+  uint32_t done = (uint32_t)emit(OP_HALT);
+  memcpy(code + skip + 1, &done, sizeof(done));
+}
+
+static double run_seconds(const BytecodeImage *image) {
+  Program *program = NULL;
+  Nano_VM vm;
+  if (create_program_from_image(image, &program) != SUCCESS ||
+      init_vm(&vm) != SUCCESS || attach_program(&vm, program) != SUCCESS) {
+    fprintf(stderr, "Failed to set up the benchmark VM\n");
+    return 0.0;
+  }
+
+  double best = 0.0;
+  for (int run = 0; run < RUNS; run++) {
+    struct timespec start, end;
+    reset_vm(&vm);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    execute_vm(&vm);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (double)(end.tv_sec - start.tv_sec) +
+                     (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    if (run == 0 || seconds < best) {
+      best = seconds;
+    }
+  }
+  free_vm(&vm);
+  release_program(program);
+  return best;
+}
+
+int main(void) {
+  log_set_level(LOG_WARN);
+  log_set_quiet(true);
+
+  const int32_t constants[] = {7};
+  const int32_t globals[] = {0};
+  build_loop();
+
+  BytecodeImage fixed = {0};
+  fixed.version = BYTECODE_VERSION_V1;
+  fixed.code = code;
+  fixed.code_size = code_size;
+  fixed.constants = constants;
+  fixed.constant_count = 1;
+  fixed.globals = globals;
+  fixed.global_count = 1;
+
+  BytecodeImage compact;
+  if (compact_bytecode(&fixed, &compact) != SUCCESS) {
+    fprintf(stderr, "Failed to compact the benchmark program\n");
+    return 1;
+  }
+
+  double fixed_time = run_seconds(&fixed);
+  double compact_time = run_seconds(&compact);
+  printf("encoding  code bytes  best of %d (s)\n", RUNS);
+  printf("fixed     %10zu  %.4f\n", fixed.code_size, fixed_time);
+  printf("compact   %10zu  %.4f\n", compact.code_size, compact_time);
+  printf("compact/fixed: size %.2f, time %.2f\n",
+         (double)compact.code_size / (double)fixed.code_size,
+         compact_time / fixed_time);
+
+  free_compacted_bytecode(&compact);
+  return 0;
+}
@@ -0,0 +1,96 @@
+/* Opens an 8 MB program of 4096 functions whose entry calls just one of
+ * them, verifying it up front with open_program and lazily with
+ * open_program_lazy, and compares the time to open and run it and the page
+ * faults taken along the way. The file is in the page cache, so the faults
+ * are minor ones: pages of the mapping the run touched.
+ */
+#include "bytecode.h"
+#include "log.h"
+#include "program.h"
+#include "vm.h"
+#include "writer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define FUNCTION_COUNT 4096
+#define FUNCTION_SIZE 2048
+#define MAIN_SIZE 16
+#define BENCH_FILE "lazy_bench.nvm"
+
+static double elapsed(const struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (double)(end.tv_sec - start->tv_sec) +
+         (double)(end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static long minor_faults(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_minflt;
+}
+
+/* Opens the program with `open`, runs it once and reports the cost. */
+static int measure(const char *label,
+                   ErrorCode (*open)(const char *, Program **)) {
+  struct timespec start;
+  long faults = minor_faults();
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  Program *program = NULL;
+  Nano_VM vm;
+  if (open(BENCH_FILE, &program) != SUCCESS || init_vm(&vm) != SUCCESS ||
+      attach_program(&vm, program) != SUCCESS ||
+      execute_vm(&vm) != SUCCESS) {
+    return 1;
+  }
+  double seconds = elapsed(&start);
+  printf("%-18s %8.3f ms, %6ld page faults\n", label, seconds * 1e3,
+         minor_faults() - faults);
+  free_vm(&vm);
+  release_program(program);
+  return 0;
+}
+
+int main(void) {
+  log_set_level(LOG_WARN);
+  log_set_quiet(true);
+
+  size_t code_size = MAIN_SIZE + (size_t)FUNCTION_COUNT * FUNCTION_SIZE;
+  uint8_t *code = malloc(code_size);
+  BytecodeFunction *functions =
+      calloc(FUNCTION_COUNT, sizeof(BytecodeFunction));
+  if (NULL == code || NULL == functions) {
+    return 1;
+  }
+  memset(code, OP_NOP, code_size);
+  uint32_t callee = MAIN_SIZE + (FUNCTION_COUNT / 2) * FUNCTION_SIZE;
+  code[3] = OP_CALL;
+  memcpy(code + 4, &callee, sizeof(callee));
+  code[MAIN_SIZE - 1] = OP_HALT;
+  for (uint32_t i = 0; i < FUNCTION_COUNT; i++) {
+    functions[i].entry = MAIN_SIZE + i * FUNCTION_SIZE;
+    functions[i].size = FUNCTION_SIZE;
+    code[functions[i].entry + FUNCTION_SIZE - 1] = OP_RET;
+  }
+
+  BytecodeImage image = {0};
+  image.code = code;
+  image.code_size = code_size;
+  image.functions = functions;
+  image.function_count = FUNCTION_COUNT;
+  if (write_bytecode(BENCH_FILE, &image, 0) != SUCCESS) {
+    return 1;
+  }
+  free(code);
+  free(functions);
+
+  printf("%zu bytes of code, %d functions, one called\n", code_size,
+         FUNCTION_COUNT);
+  int status = measure("open_program", open_program);
+  status |= measure("open_program_lazy", open_program_lazy);
+  remove(BENCH_FILE);
+  return status;
+}
@@ -0,0 +1,179 @@
+/* Compares load_bytecode on a plain and an LZ-compressed copy of the same
+ * large program: file size, and load time with the file in the page cache.
+ * Also times opening the compressed copy as a verified Program, directly
+ * and through a warm program cache.
+ */
+#include "bytecode.h"
+#include "bytecode_format.h"
+#include "cache.h"
+#include "crc32c.h"
+#include "loader.h"
+#include "log.h"
+#include "program.h"
+#include "writer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CODE_SIZE (8 * 1024 * 1024)
+#define RUNS 5
+
+/* Fills the code with a mix of short instructions and aligned 32-bit
+ * operands, roughly like generated straight-line code.
+ */
+static void generate_code(uint8_t *code, size_t size) {
+  uint32_t state = 12345;
+  size_t ip = 0;
+  while (ip + 5 <= size) {
+    state = state * 1103515245u + 12345u;
+    if ((state >> 16) % 3 == 0) {
+      // Pad so the operand is aligned and the program verifies
+      while ((ip + 1) % BYTECODE_OPERAND_ALIGNMENT != 0) {
+        code[ip++] = OP_NOP;
+      }
+      if (ip + 5 > size) {
+        break;
+      }
+      uint32_t operand = (state >> 8) % 1024;
+      code[ip] = OP_PUSH;
+      memcpy(code + ip + 1, &operand, sizeof(operand));
+      ip += 5;
+    } else {
+      code[ip++] = (uint8_t)(OP_ADD + (state >> 20) % 6);
+    }
+  }
+  memset(code + ip, OP_HALT, size - ip);
+}
+
+static double load_seconds(const char *filename) {
+  double best = 0.0;
+  for (int run = 0; run < RUNS; run++) {
+    uint8_t *code = NULL;
+    size_t size = 0;
+    uint32_t entry_point = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (load_bytecode(filename, &code, &size, &entry_point) != SUCCESS) {
+      fprintf(stderr, "Failed to load %s\n", filename);
+      return 0.0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free_bytecode(&code);
+    double seconds = (double)(end.tv_sec - start.tv_sec) +
+                     (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    if (run == 0 || seconds < best) {
+      best = seconds;
+    }
+  }
+  return best;
+}
+
+/* Best time to open a program, through the cache when options is given. */
+static double open_seconds(const char *filename,
+                           const ProgramCacheOptions *options) {
+  double best = 0.0;
+  for (int run = 0; run < RUNS; run++) {
+    Program *program = NULL;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ErrorCode status = NULL == options
+                           ? open_program(filename, &program)
+                           : open_program_cached(filename, options, &program);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (status != SUCCESS) {
+      fprintf(stderr, "Failed to open %s\n", filename);
+      return 0.0;
+    }
+    release_program(program);
+    double seconds = (double)(end.tv_sec - start.tv_sec) +
+                     (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    if (run == 0 || seconds < best) {
+      best = seconds;
+    }
+  }
+  return best;
+}
+
+static double checksum_seconds(const uint8_t *data, size_t size,
+                               uint32_t (*fn)(uint32_t, const void *,
+                                              size_t)) {
+  double best = 0.0;
+  volatile uint32_t sink = 0;
+  for (int run = 0; run < RUNS; run++) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sink ^= fn(0, data, size);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (double)(end.tv_sec - start.tv_sec) +
+                     (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    if (run == 0 || seconds < best) {
+      best = seconds;
+    }
+  }
+  (void)sink;
+  return best;
+}
+
+static size_t file_size(const char *filename) {
+  struct stat info;
+  return stat(filename, &info) == 0 ? (size_t)info.st_size : 0;
+}
+
+int main(void) {
+  log_set_level(LOG_WARN);
+  log_set_quiet(true);
+
+  uint8_t *code = malloc(CODE_SIZE);
+  if (NULL == code) {
+    return 1;
+  }
+  generate_code(code, CODE_SIZE);
+  BytecodeImage image = {0};
+  image.code = code;
+  image.code_size = CODE_SIZE;
+
+  const char *plain = "load_bench_plain.nvm";
+  const char *packed = "load_bench_compressed.nvm";
+  if (write_bytecode(plain, &image, 0) != SUCCESS ||
+      write_bytecode(packed, &image, BYTECODE_FLAG_COMPRESSED_CODE) !=
+          SUCCESS) {
+    fprintf(stderr, "Failed to write the benchmark files\n");
+    return 1;
+  }
+
+  double plain_time = load_seconds(plain);
+  double packed_time = load_seconds(packed);
+  printf("file        bytes      best of %d (s)  MB/s of code\n", RUNS);
+  printf("plain       %-9zu  %.4f          %.0f\n", file_size(plain),
+         plain_time, CODE_SIZE / plain_time / 1e6);
+  printf("compressed  %-9zu  %.4f          %.0f\n", file_size(packed),
+         packed_time, CODE_SIZE / packed_time / 1e6);
+
+  double hardware = checksum_seconds(code, CODE_SIZE, crc32c);
+  double portable = checksum_seconds(code, CODE_SIZE, crc32c_portable);
+  printf("crc32c      %s %.0f MB/s, table %.0f MB/s\n",
+         crc32c_hardware() ? "sse4.2" : "table ", CODE_SIZE / hardware / 1e6,
+         CODE_SIZE / portable / 1e6);
+
+  char directory[] = "load_bench_cache_XXXXXX";
+  if (NULL != mkdtemp(directory)) {
+    ProgramCacheOptions options = {.directory = directory, .compact = false};
+    double direct = open_seconds(packed, NULL);
+    Program *program = NULL;
+    if (open_program_cached(packed, &options, &program) == SUCCESS) {
+      release_program(program);
+    }
+    double cached = open_seconds(packed, &options);
+    printf("open        direct %.4f s, cached %.4f s\n", direct, cached);
+    clear_program_cache(&options);
+    rmdir(directory);
+  }
+
+  remove(plain);
+  remove(packed);
+  free(code);
+  return 0;
+}
@@ -0,0 +1,125 @@
+/* Runs a loop that calls an empty function ten million times, once with
+ * CALL inside the program and once with CALLX into an attached module. Only
+ * the first CALLX looks the name up; after that the difference is the
+ * switch of code, constants and globals on the way in and out.
+ */
+#include "bytecode.h"
+#include "log.h"
+#include "module.h"
+#include "program.h"
+#include "vm.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define ITERATIONS 10000000
+#define CALL_SITE 19
+#define CODE_SIZE 53
+#define CALLEE 52
+
+static const char names[] = "f";
+static const BytecodeSymbol import[] = {{0, 1, 0, SYMBOL_IMPORT, 0}};
+static const BytecodeSymbol export[] = {{0, 1, 0, SYMBOL_EXPORT, 0}};
+
+static double elapsed(const struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (double)(end.tv_sec - start->tv_sec) +
+         (double)(end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void put(uint8_t *code, size_t offset, uint8_t opcode,
+                uint32_t operand) {
+  code[offset] = opcode;
+  memcpy(code + offset + 1, &operand, sizeof(operand));
+}
+
+/* Counts global 0 down from ITERATIONS, calling at CALL_SITE each time. */
+static Program *create_loop(uint8_t call, uint32_t operand) {
+  uint8_t code[CODE_SIZE];
+  memset(code, OP_NOP, sizeof(code));
+  put(code, 3, OP_PUSHK, 0);
+  put(code, 11, OP_GSTORE, 0);
+  put(code, CALL_SITE, call, operand);
+  put(code, 27, OP_GLOAD, 0);
+  code[32] = OP_DEC;
+  code[33] = OP_DUP;
+  put(code, 35, OP_GSTORE, 0);
+  put(code, 43, OP_JMPNZ, 16);
+  code[48] = OP_HALT;
+  code[CALLEE] = OP_RET;
+
+  static const int32_t constants[] = {ITERATIONS};
+  static const int32_t globals[] = {0};
+  static const BytecodeFunction functions[] = {{CALLEE, 1, 0, 0, 0}};
+  BytecodeImage image = {0};
+  image.version = BYTECODE_VERSION;
+  image.code = code;
+  image.code_size = sizeof(code);
+  image.constants = constants;
+  image.constant_count = 1;
+  image.globals = globals;
+  image.global_count = 1;
+  image.functions = functions;
+  image.function_count = 1;
+  if (call == OP_CALLX) {
+    image.symbols = import;
+    image.symbol_count = 1;
+    image.names = names;
+    image.names_size = 1;
+  }
+  Program *program = NULL;
+  create_program_from_image(&image, &program);
+  return program;
+}
+
+static Program *create_library(void) {
+  static const uint8_t code[] = {OP_RET};
+  static const BytecodeFunction functions[] = {{0, 1, 0, 0, 0}};
+  BytecodeImage image = {0};
+  image.version = BYTECODE_VERSION;
+  image.code = code;
+  image.code_size = sizeof(code);
+  image.functions = functions;
+  image.function_count = 1;
+  image.symbols = export;
+  image.symbol_count = 1;
+  image.names = names;
+  image.names_size = 1;
+  Program *program = NULL;
+  create_program_from_image(&image, &program);
+  return program;
+}
+
+static double run(Program *program, Program *library) {
+  Nano_VM vm;
+  if (NULL == program || init_vm(&vm) != SUCCESS ||
+      attach_program(&vm, program) != SUCCESS ||
+      (NULL != library && attach_module(&vm, library) != SUCCESS)) {
+    return -1;
+  }
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  ErrorCode status = execute_vm(&vm);
+  double seconds = elapsed(&start);
+  free_vm(&vm);
+  release_program(program);
+  return status == SUCCESS ? seconds : -1;
+}
+
+int main(void) {
+  log_set_level(LOG_WARN);
+  log_set_quiet(true);
+
+  Program *library = create_library();
+  double direct = run(create_loop(OP_CALL, CALLEE), NULL);
+  double imported = run(create_loop(OP_CALLX, 0), library);
+  release_program(library);
+  if (direct < 0 || imported < 0 || NULL == library) {
+    return 1;
+  }
+  printf("%d iterations: CALL %.2f ns, CALLX into a module %.2f ns\n",
+         ITERATIONS, direct * 1e9 / ITERATIONS,
+         imported * 1e9 / ITERATIONS);
+  return 0;
+}
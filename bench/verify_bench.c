@@ -0,0 +1,88 @@
+/* Verifies an 8 MB program of 4096 functions on one thread and then on
+ * every online CPU, with verify_code_parallel. The code is a typical mix:
+ * aligned PUSHes with their NOP padding and short runs of single-byte
+ * instructions, which the scan skips in bulk.
+ */
+#include "bytecode.h"
+#include "log.h"
+#include "verify.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FUNCTION_COUNT 4096
+#define FUNCTION_SIZE 2048
+#define ROUNDS 5
+
+static double elapsed(const struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (double)(end.tv_sec - start->tv_sec) +
+         (double)(end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Returns the best time of a few rounds, or -1 if verification fails. */
+static double measure(const BytecodeImage *image, unsigned threads) {
+  double best = -1;
+  for (int round = 0; round < ROUNDS; round++) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (verify_code_parallel(image, threads) != SUCCESS) {
+      return -1;
+    }
+    double seconds = elapsed(&start);
+    if (best < 0 || seconds < best) {
+      best = seconds;
+    }
+  }
+  return best;
+}
+
+int main(void) {
+  log_set_level(LOG_WARN);
+  log_set_quiet(true);
+
+  // NOP NOP NOP PUSH imm DUP ADD POP PUSH imm, then RET to end each one
+  static const uint8_t block[16] = {OP_NOP, OP_NOP, OP_NOP,  OP_PUSH,
+                                    1,      0,      0,       0,
+                                    OP_DUP, OP_ADD, OP_POP,  OP_PUSH,
+                                    2,      0,      0,       0};
+  size_t code_size = (size_t)FUNCTION_COUNT * FUNCTION_SIZE;
+  uint8_t *code = malloc(code_size);
+  BytecodeFunction *functions =
+      calloc(FUNCTION_COUNT, sizeof(BytecodeFunction));
+  if (NULL == code || NULL == functions) {
+    return 1;
+  }
+  for (size_t offset = 0; offset < code_size; offset += sizeof(block)) {
+    memcpy(code + offset, block, sizeof(block));
+  }
+  for (uint32_t i = 0; i < FUNCTION_COUNT; i++) {
+    functions[i].entry = i * FUNCTION_SIZE;
+    functions[i].size = FUNCTION_SIZE;
+    code[functions[i].entry + FUNCTION_SIZE - 1] = OP_RET;
+  }
+
+  BytecodeImage image = {0};
+  image.version = BYTECODE_VERSION;
+  image.code = code;
+  image.code_size = code_size;
+  image.functions = functions;
+  image.function_count = FUNCTION_COUNT;
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned threads = cpus > 1 ? (unsigned)cpus : 1;
+  double single = measure(&image, 1);
+  double parallel = measure(&image, threads);
+  free(code);
+  free(functions);
+  if (single < 0 || parallel < 0) {
+    return 1;
+  }
+  printf("%zu bytes: 1 thread %.2f ms (%.0f MB/s), %u threads %.2f ms\n",
+         code_size, single * 1e3, code_size / single / 1e6, threads,
+         parallel * 1e3);
+  return 0;
+}
@@ -48,7 +48,32 @@ typedef enum {
   OP_INPUT,
 
   // Halt
-  OP_HALT
+  OP_HALT,
+
+  // Constants and globals
+  OP_PUSHK,
+  OP_GLOAD,
+  OP_GSTORE,
+
+  // Compact forms
+  OP_PUSH_0,
+  OP_PUSH_1,
+  OP_PUSH8,
+  OP_PUSH16,
+  OP_JMP8,
+  OP_JMP16,
+  OP_JMPZ8,
+  OP_JMPZ16,
+  OP_JMPNZ8,
+  OP_JMPNZ16,
+  OP_PUSHKV,
+  OP_GLOADV,
+  OP_GSTOREV,
+
+  // Modules
+  OP_CALLX,
+
+  OP_COUNT // Number of opcodes, not an instruction
 
 } Opcode;
 
@@ -58,14 +83,82 @@ typedef enum {
   OPERAND_INDEX,
   OPERAND_ADDRESS,
   OPERAND_FLAG,
+  OPERAND_OFFSET, // Signed displacement from the start of the instruction
+  OPERAND_VARINT, // Unsigned LEB128 index, 1 to 5 bytes
 } OperandType;
 
+#define LEB128_MAX_BYTES 5 // Enough for any uint32_t
+
 typedef struct {
   const char *name;
-  uint32_t length;
+  uint32_t length; // Opcode byte plus operand bytes; 0 if variable
   uint8_t operand_count;
   OperandType operand_types[MAX_OPERANDS];
 } InstructionInfo;
 
 extern InstructionInfo instruction_set[];
+
+/* Decodes an unsigned LEB128 value of at most LEB128_MAX_BYTES bytes.
+ * Parameters:
+ *   bytes - First byte of the encoded value
+ *   available - Number of readable bytes at `bytes`
+ *   value - Receives the decoded value
+ * Returns:
+ *   Number of bytes consumed, or 0 if the encoding is truncated, too long or
+ *   does not fit in 32 bits
+ */
+static inline size_t decode_uleb128(const uint8_t *bytes, size_t available,
+                                    uint32_t *value) {
+  uint32_t result = 0;
+  for (size_t i = 0; i < available && i < LEB128_MAX_BYTES; i++) {
+    uint8_t byte = bytes[i];
+    if (i == LEB128_MAX_BYTES - 1 && byte > 0x0F) {
+      return 0;
+    }
+    result |= (uint32_t)(byte & 0x7F) << (7 * i);
+    if ((byte & 0x80) == 0) {
+      *value = result;
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+/* Encodes an unsigned LEB128 value.
+ * Parameters:
+ *   value - Value to encode
+ *   bytes - Receives the encoding; needs room for LEB128_MAX_BYTES bytes
+ * Returns:
+ *   Number of bytes written
+ */
+static inline size_t encode_uleb128(uint32_t value, uint8_t *bytes) {
+  size_t length = 0;
+  do {
+    uint8_t byte = value & 0x7F;
+    value >>= 7;
+    bytes[length++] = value != 0 ? (byte | 0x80) : byte;
+  } while (value != 0);
+  return length;
+}
+
+/* Returns the number of bytes a value takes as unsigned LEB128. */
+static inline size_t uleb128_size(uint32_t value) {
+  size_t length = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    length++;
+  }
+  return length;
+}
+
+/* Works out the length of the instruction at `code`, including variable
+ * length operands.
+ * Parameters:
+ *   code - Opcode byte of the instruction
+ *   available - Number of readable bytes at `code`
+ * Returns:
+ *   Length in bytes, or 0 if the opcode is unknown or the instruction does
+ *   not fit in `available` bytes
+ */
+size_t instruction_length(const uint8_t *code, size_t available);
 #endif // BYTECODE_H
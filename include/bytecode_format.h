@@ -1,12 +1,14 @@
 #ifndef BYTECODE_FORMAT_H
 #define BYTECODE_FORMAT_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define BYTECODE_MAGIC "\x4E\x42\x56\x4D" // "NBVM" in ASCII
 #define BYTECODE_MAJOR_NUMER 0
-#define BYTECODE_MINOR_NUMER 1
+#define BYTECODE_MINOR_NUMER 2
 #define BYTECODE_VERSION ((BYTECODE_MAJOR_NUMER << 8) | (BYTECODE_MINOR_NUMER))
+#define BYTECODE_VERSION_V1 0x0001 // Bare code segment, still accepted
 
 #define BYTECODE_MAGIC_OFFSET 0
 #define BYTECODE_VERSION_OFFSET 4
@@ -17,6 +19,7 @@
 
 #define MAX_BYTECODE_SIZE (10 * 1024 * 1024) // 10 MB
 
+// Version 0.1 header, followed directly by the code segment
 typedef struct {
   char magic[4];        // Magic number to identify the bytecode format
   uint16_t version;     // Version of the bytecode format
@@ -26,4 +29,190 @@ typedef struct {
   // Additional fields can be added here (e.g., data segment size, entry point)
 } BytecodeHeader;
 
+/* Version 0.2 container. The header is followed by a table of sections, each
+ * starting on a BYTECODE_SECTION_ALIGNMENT boundary so that code, constants
+ * and tables can be read in place from a mapped file. Within the code
+ * section every 32-bit operand starts on a 4-byte boundary (the assembler
+ * pads with NOP), so the interpreter reads it with a single aligned load.
+ */
+#define BYTECODE_V2_HEADER_SIZE 32
+#define BYTECODE_SECTION_ENTRY_SIZE 16
+#define BYTECODE_SECTION_ALIGNMENT 8
+#define BYTECODE_OPERAND_ALIGNMENT 4
+#define BYTECODE_MAX_SECTIONS 16
+
+// Header flags
+#define BYTECODE_FLAG_COMPRESSED_CODE 0x0001 // Code section is LZ-compressed
+#define BYTECODE_FLAG_CHECKSUM 0x0002        // checksum field is valid
+#define BYTECODE_KNOWN_FLAGS                                                   \
+  (BYTECODE_FLAG_COMPRESSED_CODE | BYTECODE_FLAG_CHECKSUM)
+
+/* With BYTECODE_FLAG_CHECKSUM set, the header's checksum field holds the
+ * CRC-32C of the whole file, computed with the checksum field itself read
+ * as zero.
+ */
+#define BYTECODE_CHECKSUM_OFFSET 20
+
+typedef struct {
+  char magic[4];                 // BYTECODE_MAGIC
+  uint16_t version;              // BYTECODE_VERSION
+  uint16_t flags;                // BYTECODE_FLAG_* bits
+  uint32_t entry_point;          // Offset of the first instruction to run
+  uint32_t section_count;        // Entries in the section table
+  uint32_t section_table_offset; // File offset of the section table
+  uint32_t checksum;             // CRC-32C of the file, see above
+  uint32_t reserved[2];          // Must be zero
+} BytecodeHeaderV2;
+
+typedef enum {
+  SECTION_CODE = 1,        // Instructions (required, exactly one)
+  SECTION_CONSTANTS = 2,   // int32_t constant pool, read by PUSHK
+  SECTION_FUNCTIONS = 3,   // BytecodeFunction table sorted by entry
+  SECTION_GLOBALS = 4,     // int32_t initial values of the globals
+  SECTION_DEBUG = 5,       // Optional debug information
+  SECTION_SYMBOLS = 6,     // BytecodeSymbol table of a linkable module
+  SECTION_RELOCATIONS = 7, // BytecodeRelocation table, sorted by offset
+  SECTION_NAMES = 8,       // Symbol names the symbol table points into
+} BytecodeSectionType;
+
+/* With BYTECODE_FLAG_COMPRESSED_CODE set, the code section holds an LZ
+ * stream (see lz.h) and uncompressed_size gives the size of the code once
+ * decompressed. It is zero for every other section.
+ */
+typedef struct {
+  uint16_t type;              // BytecodeSectionType
+  uint16_t flags;             // Reserved, must be zero
+  uint32_t offset;            // File offset of the section contents
+  uint32_t size;              // Size of the stored contents in bytes
+  uint32_t uncompressed_size; // Decompressed size of a compressed section
+} BytecodeSection;
+
+typedef struct {
+  uint32_t entry;       // Code offset of the first instruction
+  uint32_t size;        // Size of the function's code in bytes
+  uint16_t local_count; // Locals the function may address
+  uint16_t max_stack;   // Deepest operand stack use of the function
+  uint32_t reserved;    // Must be zero
+} BytecodeFunction;
+
+/* Linkable modules (see linker.h) name the functions they export and the
+ * ones they import from other modules. Every CALL to an import is listed in
+ * the relocation table and carries a placeholder target until it is linked.
+ */
+typedef enum {
+  SYMBOL_EXPORT = 1, // value is the code offset of a function entry
+  SYMBOL_IMPORT = 2, // Defined by another module; value is zero
+} BytecodeSymbolKind;
+
+typedef struct {
+  uint32_t name_offset; // Offset of the name in the names section
+  uint32_t name_length; // Length of the name in bytes, not terminated
+  uint32_t value;       // Depends on kind, see BytecodeSymbolKind
+  uint16_t kind;        // BytecodeSymbolKind
+  uint16_t reserved;    // Must be zero
+} BytecodeSymbol;
+
+typedef struct {
+  uint32_t offset; // Code offset of a CALL instruction
+  uint32_t symbol; // Index of the imported symbol it calls
+} BytecodeRelocation;
+
+/* Debug section: maps code offsets back to the function and source line
+ * they came from. Layout: the header, the function table and the block
+ * table, both sorted by code offset, the file table, the line rows, and
+ * the strings the tables name. A function covers the code from its entry
+ * up to the next one. The rows list where each new source line starts;
+ * they are split into blocks of at most DEBUG_BLOCK_ROWS, and a block
+ * entry holds its first row in full, so a lookup decodes one block. Each
+ * row after the first starts with ULEB128 (offset delta << 1 | new file):
+ * the distance from the row before, and whether a ULEB128 file index
+ * follows. Then comes the line delta, zigzag-encoded as a ULEB128.
+ */
+#define DEBUG_INFO_VERSION 1
+#define DEBUG_BLOCK_ROWS 32
+
+typedef struct {
+  uint16_t version;        // DEBUG_INFO_VERSION
+  uint16_t reserved;       // Must be zero
+  uint32_t function_count; // Entries in the function table
+  uint32_t block_count;    // Entries in the block table
+  uint32_t file_count;     // Entries in the file table
+  uint32_t lines_size;     // Size of the line rows in bytes
+  uint32_t strings_size;   // Size of the strings in bytes
+} DebugInfoHeader;
+
+typedef struct {
+  uint32_t entry;       // Code offset of the function's first byte
+  uint32_t name_offset; // Offset of its name in the strings
+  uint32_t name_length; // Length of the name in bytes, not terminated
+} DebugFunction;
+
+typedef struct {
+  uint32_t offset;       // Code offset of the block's first row
+  uint32_t lines_offset; // Offset of the rows that follow it
+  uint32_t line;         // Source line of the first row, from 1
+  uint32_t file;         // File table index of the first row
+} DebugLineBlock;
+
+typedef struct {
+  uint32_t name_offset; // Offset of the path in the strings
+  uint32_t name_length; // Length of the path in bytes, not terminated
+} DebugFile;
+
+/* Bundle: many bytecode files in one, found by name through an index that
+ * is meant to be searched in place in a mapping. Layout: the header, the
+ * index (sorted by name_hash, then by name), the names block, and then the
+ * member files, each a complete version 0.1 or 0.2 file starting on a
+ * BUNDLE_MEMBER_ALIGNMENT boundary so its sections stay aligned.
+ */
+#define BUNDLE_MAGIC "\x4E\x42\x56\x42" // "NBVB" in ASCII
+#define BUNDLE_VERSION 0x0001
+#define BUNDLE_HEADER_SIZE 32
+#define BUNDLE_ENTRY_SIZE 24
+#define BUNDLE_MEMBER_ALIGNMENT 8
+#define BUNDLE_MAX_NAME_LENGTH 255
+
+typedef struct {
+  char magic[4];         // BUNDLE_MAGIC
+  uint16_t version;      // BUNDLE_VERSION
+  uint16_t flags;        // Reserved, must be zero
+  uint32_t entry_count;  // Entries in the index
+  uint32_t index_offset; // File offset of the BundleEntry array
+  uint32_t names_offset; // File offset of the names block
+  uint32_t names_size;   // Size of the names block in bytes
+  uint32_t checksum;     // CRC-32C of the index and the names block
+  uint32_t reserved;     // Must be zero
+} BundleHeader;
+
+typedef struct {
+  uint32_t name_hash;   // FNV-1a hash of the name
+  uint32_t name_offset; // Offset of the NUL-terminated name in the block
+  uint32_t name_length; // Length of the name, without the NUL
+  uint32_t offset;      // File offset of the member
+  uint32_t size;        // Size of the member in bytes
+  uint32_t checksum;    // CRC-32C of the member
+} BundleEntry;
+
+_Static_assert(sizeof(BytecodeHeaderV2) == BYTECODE_V2_HEADER_SIZE,
+               "BytecodeHeaderV2 must match the on-disk layout");
+_Static_assert(offsetof(BytecodeHeaderV2, checksum) ==
+                   BYTECODE_CHECKSUM_OFFSET,
+               "checksum must sit at BYTECODE_CHECKSUM_OFFSET");
+_Static_assert(sizeof(BytecodeSection) == BYTECODE_SECTION_ENTRY_SIZE,
+               "BytecodeSection must match the on-disk layout");
+_Static_assert(sizeof(BytecodeSymbol) == 16,
+               "BytecodeSymbol must match the on-disk layout");
+_Static_assert(sizeof(BytecodeRelocation) == 8,
+               "BytecodeRelocation must match the on-disk layout");
+_Static_assert(sizeof(DebugInfoHeader) == 24,
+               "DebugInfoHeader must match the on-disk layout");
+_Static_assert(sizeof(DebugFunction) == 12,
+               "DebugFunction must match the on-disk layout");
+_Static_assert(sizeof(DebugLineBlock) == 16,
+               "DebugLineBlock must match the on-disk layout");
+_Static_assert(sizeof(BundleHeader) == BUNDLE_HEADER_SIZE,
+               "BundleHeader must match the on-disk layout");
+_Static_assert(sizeof(BundleEntry) == BUNDLE_ENTRY_SIZE,
+               "BundleEntry must match the on-disk layout");
+
 #endif // BYTECODE_FORMAT_H
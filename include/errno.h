@@ -15,6 +15,8 @@ typedef enum {
   ERR_EXECUTION_HALTED,
   ERR_NULL_POINTER,
   ERR_DIVIDE_BY_ZERO,
+  ERR_FILE_WRITE,
+  ERR_CHECKSUM_MISMATCH,
   ERR_UNKNOWN
 } ErrorCode;
 
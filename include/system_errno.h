@@ -0,0 +1,8 @@
+#ifndef SYSTEM_ERRNO_H
+#define SYSTEM_ERRNO_H
+
+// errno.h in this directory holds ErrorCode and hides the C library's
+// <errno.h> on the include path; this reaches the library's errno and EINTR
+#include_next <errno.h>
+
+#endif // SYSTEM_ERRNO_H
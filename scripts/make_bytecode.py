@@ -6,7 +6,7 @@ RESERVED = 0
 CODE_SIZE = 1
 ENTRY_POINT = 0
 
-HALT_OPCODE = 19
+HALT_OPCODE = 30
 
 output_dir = "test/data"
 output_file = os.path.join(output_dir, "test_program.nvm")
@@ -1,10 +1,18 @@
+#include "bundle.h"
+#include "cache.h"
+#include "embed.h"
 #include "loader.h"
 #include "log.h"
+#include "module.h"
 #include "vm.h"
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
+#define MAX_MODULES 16
+
 ErrorCode init_logging(const char *log_file_path) {
   ErrorCode status = SUCCESS;
 
@@ -28,7 +36,9 @@ ErrorCode init_logging(const char *log_file_path) {
 }
 
 ErrorCode parse_args(int argc, char *argv[], char **bytecode_file,
-                     char **log_file_path) {
+                     char **log_file_path, char **cache_dir,
+                     char **bundle_file, bool *lazy, char **modules,
+                     size_t *module_count) {
   if (argc < 1) {
     log_error("No arguments provided.");
     return ERR_INVALID_OPERAND;
@@ -41,14 +51,25 @@ ErrorCode parse_args(int argc, char *argv[], char **bytecode_file,
   }
 
   int opts;
-  while ((opts = getopt(argc, argv, "hf:l:")) != -1) {
+  while ((opts = getopt(argc, argv, "hf:l:c:b:zm:")) != -1) {
     switch (opts) {
     case 'h':
-      printf("Usage: %s [options] <bytecode_file>\n", argv[0]);
+      printf("Usage: %s [options] <bytecode_file | ->\n", argv[0]);
       printf("Options:\n");
       printf("  -h                Show this help message\n");
-      printf("  -f <file>         Specify the bytecode file to load\n");
+      printf("  -f <file>         Specify the bytecode file to load "
+             "('-' reads stdin)\n");
       printf("  -l <file>  Output logs to specified file\n");
+      printf("  -c <dir>          Cache decoded programs in <dir>\n");
+      printf("  -b <bundle>       Run the program of that name from "
+             "<bundle>\n");
+      printf("  -z                Verify each function on its first call "
+             "instead of up front\n");
+      printf("  -m <file>         Attach a module the program calls into "
+             "(repeatable)\n");
+      if (find_embedded_image(NULL, NULL)) {
+        printf("Without a bytecode file, the embedded program runs.\n");
+      }
       exit(SUCCESS);
     case 'f':
       log_info("Bytecode file specified: %s", optarg);
@@ -58,6 +79,26 @@ ErrorCode parse_args(int argc, char *argv[], char **bytecode_file,
       log_info("Log file specified: %s", optarg);
       *log_file_path = optarg;
       break;
+    case 'c':
+      log_info("Cache directory specified: %s", optarg);
+      *cache_dir = optarg;
+      break;
+    case 'b':
+      log_info("Bundle specified: %s", optarg);
+      *bundle_file = optarg;
+      break;
+    case 'z':
+      log_info("Lazy verification requested");
+      *lazy = true;
+      break;
+    case 'm':
+      if (*module_count == MAX_MODULES) {
+        log_error("At most %d modules can be attached", MAX_MODULES);
+        return ERR_INVALID_OPERAND;
+      }
+      log_info("Module specified: %s", optarg);
+      modules[(*module_count)++] = optarg;
+      break;
     case '?':
     default:
       log_error("Unknown option: %c", optopt);
@@ -70,7 +111,8 @@ ErrorCode parse_args(int argc, char *argv[], char **bytecode_file,
     log_info("Bytecode file from positional argument: %s", *bytecode_file);
   }
 
-  if (*bytecode_file == NULL) {
+  // An executable built with `make embed` runs its own program by default
+  if (*bytecode_file == NULL && !find_embedded_image(NULL, NULL)) {
     log_error("No bytecode file specified.");
     return ERR_INVALID_OPERAND;
   }
@@ -82,12 +124,17 @@ int main(int argc, char *argv[]) {
   ErrorCode status = SUCCESS;
   char *log_file_path = NULL;
   char *bytecode_file = NULL;
-  Nano_VM vm;
-  uint32_t entry_point;
-  size_t size;
-  uint8_t *bytecode_buffer = NULL;
+  char *cache_dir = NULL;
+  char *bundle_file = NULL;
+  bool lazy = false;
+  char *modules[MAX_MODULES];
+  size_t module_count = 0;
+  Nano_VM vm = {0};
+  Program *program = NULL;
 
-  status = parse_args(argc, argv, &bytecode_file, &log_file_path);
+  status = parse_args(argc, argv, &bytecode_file, &log_file_path,
+                      &cache_dir, &bundle_file, &lazy, modules,
+                      &module_count);
   if (status != SUCCESS) {
     log_error("Failed to parse arguments");
     return status;
@@ -102,37 +149,60 @@ int main(int argc, char *argv[]) {
     log_error("Failed to initialize VM");
     goto CLEANUP;
   }
-  status = load_bytecode(bytecode_file, &bytecode_buffer, &size, &entry_point);
+  // With a bundle, the bytecode file names a program inside it
+  if (NULL == bytecode_file) {
+    status = open_embedded_program(&program);
+  } else if (NULL != bundle_file) {
+    Bundle *bundle = NULL;
+    status = open_bundle(bundle_file, &bundle);
+    if (status == SUCCESS) {
+      status = open_bundle_program(bundle, bytecode_file, &program);
+      release_bundle(bundle);
+    }
+  } else if (lazy) {
+    status = open_program_lazy(bytecode_file, &program);
+  } else if (NULL != cache_dir || NULL != getenv(PROGRAM_CACHE_ENV)) {
+    ProgramCacheOptions cache = {.directory = cache_dir, .compact = false};
+    status = open_program_cached(bytecode_file, &cache, &program);
+  } else {
+    status = open_program(bytecode_file, &program);
+  }
   if (status != SUCCESS) {
     log_error("Failed to load bytecode");
     goto CLEANUP;
   }
-  status = load_program(&vm, bytecode_buffer, size, entry_point);
+  status = attach_program(&vm, program);
   if (status != SUCCESS) {
     log_error("Failed to load program into VM");
     goto CLEANUP;
   }
+  for (size_t i = 0; i < module_count; i++) {
+    Program *module = NULL;
+    status = lazy ? open_program_lazy(modules[i], &module)
+                  : open_program(modules[i], &module);
+    if (status == SUCCESS) {
+      status = attach_module(&vm, module);
+      release_program(module);
+    }
+    if (status != SUCCESS) {
+      log_error("Failed to attach module '%s'", modules[i]);
+      goto CLEANUP;
+    }
+  }
   status = execute_vm(&vm);
   if (status != SUCCESS) {
     log_error("VM execution failed with error code: %d", status);
     goto CLEANUP;
   }
-  status = free_bytecode(&bytecode_buffer);
-  if (status != SUCCESS) {
-    log_error("Failed to free bytecode buffer");
-    goto CLEANUP;
-  }
   status = free_vm(&vm);
   if (status != SUCCESS) {
     log_error("Failed to free VM resources");
     goto CLEANUP;
   }
 CLEANUP:
-  if (bytecode_buffer) {
-    free_bytecode(&bytecode_buffer);
-  }
   if (vm.code || vm.stack) {
     free_vm(&vm);
   }
+  release_program(program);
   return status;
 }
@@ -0,0 +1,55 @@
+#include "alloc.h"
+#include <stdlib.h>
+
+#define ARENA_ALIGNMENT _Alignof(max_align_t)
+
+static void *heap_alloc(void *ctx, size_t size) {
+  (void)ctx;
+  return malloc(size);
+}
+
+static void heap_free(void *ctx, void *ptr) {
+  (void)ctx;
+  free(ptr);
+}
+
+const VM_Allocator vm_default_allocator = {heap_alloc, heap_free, NULL};
+
+void arena_init(VM_Arena *arena, void *buffer, size_t size) {
+  arena->base = (uint8_t *)buffer;
+  arena->size = size;
+  arena->used = 0;
+}
+
+void arena_reset(VM_Arena *arena) { arena->used = 0; }
+
+void arena_rewind(VM_Arena *arena, size_t used) {
+  if (used < arena->used) {
+    arena->used = used;
+  }
+}
+
+static void *arena_alloc(void *ctx, size_t size) {
+  VM_Arena *arena = (VM_Arena *)ctx;
+  // Align the address rather than the offset so unaligned buffers work too
+  uintptr_t start = (uintptr_t)(arena->base + arena->used);
+  size_t padding =
+      (ARENA_ALIGNMENT - start % ARENA_ALIGNMENT) % ARENA_ALIGNMENT;
+  if (padding > arena->size - arena->used ||
+      size > arena->size - arena->used - padding) {
+    return NULL;
+  }
+  void *ptr = arena->base + arena->used + padding;
+  arena->used += padding + size;
+  return ptr;
+}
+
+static void arena_free(void *ctx, void *ptr) {
+  (void)ctx;
+  (void)ptr;
+}
+
+VM_Allocator arena_allocator(VM_Arena *arena) {
+  VM_Allocator allocator = {arena_alloc, arena_free, arena};
+  return allocator;
+}
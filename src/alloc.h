@@ -0,0 +1,56 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Memory interface used by the VM and the loader in place of malloc/free.
+ * free may be a no-op (as it is for arenas) and is always passed a pointer
+ * obtained from alloc on the same allocator.
+ */
+typedef struct {
+  void *(*alloc)(void *ctx, size_t size); // Returns NULL on failure
+  void (*free)(void *ctx, void *ptr);     // Releases a block from alloc
+  void *ctx;                              // User context for both callbacks
+} VM_Allocator;
+
+/* Bump allocator over a caller-supplied buffer. Blocks are never freed
+ * individually; arena_reset releases everything at once.
+ */
+typedef struct {
+  uint8_t *base; // Start of the managed buffer
+  size_t size;   // Size of the managed buffer
+  size_t used;   // Bytes handed out so far, including alignment padding
+} VM_Arena;
+
+/* Allocator backed by malloc/free. Used whenever no allocator is supplied. */
+extern const VM_Allocator vm_default_allocator;
+
+/* Initializes an arena over a buffer.
+ * Parameters:
+ *   arena - Arena to initialize
+ *   buffer - Memory the arena hands out; must outlive every allocation
+ *   size - Size of buffer in bytes
+ */
+void arena_init(VM_Arena *arena, void *buffer, size_t size);
+
+/* Releases every allocation made from the arena. */
+void arena_reset(VM_Arena *arena);
+
+/* Releases every allocation made since the arena's used count was `used`,
+ * so that space can be handed out again.
+ * Parameters:
+ *   arena - Arena to rewind
+ *   used - Earlier value of arena->used
+ */
+void arena_rewind(VM_Arena *arena, size_t used);
+
+/* Returns an allocator that hands out memory from the arena.
+ * Parameters:
+ *   arena - Arena to allocate from; must outlive the allocator
+ * Returns:
+ *   Allocator whose free is a no-op
+ */
+VM_Allocator arena_allocator(VM_Arena *arena);
+
+#endif // ALLOC_H
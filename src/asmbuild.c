@@ -0,0 +1,362 @@
+#include "asmbuild.h"
+#include "assembler.h"
+#include "crc32c.h"
+#include "log.h"
+#include "writer.h"
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STAMP_HEADER "nanoasm-stamp"
+#define STAMP_VERSION 2
+#define STAMP_LINE_SIZE 4160 // A path of up to PATH_MAX and what precedes it
+#define NANOSECONDS 1000000000LL
+// A file changed this recently may change again without its modification
+// time moving on, so its time is not recorded and it is always hashed
+#define TRUSTED_AGE_NS NANOSECONDS
+
+// Whole file mapped read-only; an empty file maps to nothing
+typedef struct {
+  const char *data;
+  size_t size;
+} MappedSource;
+
+// Text of a stamp, built up while the file is assembled
+typedef struct {
+  char *text;
+  size_t size;
+  size_t capacity;
+  bool unusable;   // A path the stamp cannot hold, or no memory for it
+  int64_t started; // Wall-clock time assembly started, in nanoseconds
+} Stamp;
+
+typedef struct {
+  const char *const *sources;
+  const char *const *objects;
+  size_t count;
+  uint32_t peephole;
+  bool incremental;
+  bool debug_info;
+  ErrorCode *statuses;
+  atomic_size_t next;    // Next file a worker should take
+  atomic_size_t rebuilt; // Files assembled so far
+} BuildBatch;
+
+/* Maps a file without logging, since a missing dependency only means that
+ * an object is out of date.
+ */
+static bool map_source(const char *path, MappedSource *mapped) {
+  mapped->data = NULL;
+  mapped->size = 0;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  bool mapped_ok = fstat(fd, &st) == 0;
+  if (mapped_ok && st.st_size > 0) {
+    void *mapping =
+        mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    mapped_ok = mapping != MAP_FAILED;
+    if (mapped_ok) {
+      madvise(mapping, (size_t)st.st_size, MADV_SEQUENTIAL);
+      mapped->data = mapping;
+      mapped->size = (size_t)st.st_size;
+    }
+  }
+  close(fd);
+  return mapped_ok;
+}
+
+static void unmap_source(MappedSource *mapped) {
+  if (mapped->size > 0) {
+    munmap((void *)mapped->data, mapped->size);
+  }
+}
+
+/* Returns "<object>.dep", allocated with malloc, or NULL. */
+static char *stamp_path(const char *object) {
+  size_t length = strlen(object);
+  char *path = malloc(length + sizeof(ASMBUILD_STAMP_SUFFIX));
+  if (NULL == path) {
+    log_error("Failed to allocate memory for a stamp path");
+    return NULL;
+  }
+  memcpy(path, object, length);
+  memcpy(path + length, ASMBUILD_STAMP_SUFFIX, sizeof(ASMBUILD_STAMP_SUFFIX));
+  return path;
+}
+
+static int64_t modified_ns(const struct stat *st) {
+  return (int64_t)st->st_mtim.tv_sec * NANOSECONDS + st->st_mtim.tv_nsec;
+}
+
+/* Checks that a file still has the size and CRC-32C it had. When its size
+ * and modification time are the ones recorded, it is taken as unchanged
+ * without reading it, as git does with its index.
+ */
+static bool unchanged(const char *path, uint32_t crc, size_t size,
+                      int64_t modified) {
+  struct stat st;
+  if (stat(path, &st) != 0 || (size_t)st.st_size != size) {
+    return false;
+  }
+  if (modified != 0 && modified_ns(&st) == modified) {
+    return true;
+  }
+  MappedSource source;
+  if (!map_source(path, &source)) {
+    return false;
+  }
+  bool same = source.size == size && crc32c(0, source.data, size) == crc;
+  unmap_source(&source);
+  return same;
+}
+
+/* Checks an object against its stamp: the rules and whether it holds debug
+ * information must be the same, and every file listed must be unchanged.
+ */
+static bool up_to_date(const char *object, uint32_t peephole,
+                       bool debug_info) {
+  struct stat st;
+  char *path = stat(object, &st) == 0 ? stamp_path(object) : NULL;
+  FILE *fp = NULL == path ? NULL : fopen(path, "r");
+  free(path);
+  if (NULL == fp) {
+    return false;
+  }
+  char line[STAMP_LINE_SIZE];
+  unsigned version = 0;
+  unsigned rules = 0;
+  unsigned debug = 0;
+  bool current = NULL != fgets(line, sizeof(line), fp) &&
+                 3 == sscanf(line, STAMP_HEADER " %u %u %u", &version, &rules,
+                             &debug) &&
+                 version == STAMP_VERSION && rules == peephole &&
+                 debug == (unsigned)debug_info;
+  size_t files = 0;
+  while (current && NULL != fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\n")] = '\0';
+    uint32_t crc = 0;
+    size_t size = 0;
+    int64_t modified = 0;
+    int consumed = 0;
+    current = 3 == sscanf(line, "%" SCNx32 " %zu %" SCNd64 " %n", &crc,
+                          &size, &modified, &consumed) &&
+              consumed > 0 &&
+              unchanged(line + consumed, crc, size, modified);
+    files++;
+  }
+  fclose(fp);
+  return current && files > 0;
+}
+
+static void append_stamp(Stamp *stamp, const char *format, ...) {
+  if (stamp->unusable) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+  size_t needed = stamp->size + (size_t)length + 1;
+  if (needed > stamp->capacity) {
+    size_t capacity = needed * 2;
+    char *text = realloc(stamp->text, capacity);
+    if (NULL == text) {
+      log_error("Failed to grow a stamp to %zu bytes", capacity);
+      stamp->unusable = true;
+      return;
+    }
+    stamp->text = text;
+    stamp->capacity = capacity;
+  }
+  va_start(args, format);
+  vsnprintf(stamp->text + stamp->size, (size_t)length + 1, format, args);
+  va_end(args);
+  stamp->size += (size_t)length;
+}
+
+/* Adds a file the object depends on to its stamp. */
+static void stamp_file(void *context, const char *path, const char *data,
+                       size_t size) {
+  Stamp *stamp = context;
+  if (NULL != strchr(path, '\n') || strlen(path) >= STAMP_LINE_SIZE - 64) {
+    stamp->unusable = true; // The file would just be rebuilt every time
+    return;
+  }
+  // The time is only recorded if the file was last written well before it
+  // was read, so that it cannot describe other contents
+  struct stat st;
+  int64_t modified = 0;
+  if (stat(path, &st) == 0 &&
+      modified_ns(&st) < stamp->started - TRUSTED_AGE_NS) {
+    modified = modified_ns(&st);
+  }
+  append_stamp(stamp, "%08" PRIx32 " %zu %" PRId64 " %s\n",
+               crc32c(0, data, size), size, modified, path);
+}
+
+static void write_stamp(const char *path, const Stamp *stamp) {
+  FILE *fp = fopen(path, "w");
+  bool written = NULL != fp &&
+                 fwrite(stamp->text, 1, stamp->size, fp) == stamp->size;
+  if ((NULL != fp && fclose(fp) != 0) || !written) {
+    log_warn("Failed to write '%s'; the object will be rebuilt", path);
+    unlink(path);
+  }
+}
+
+/* Assembles one source into its object, unless it is up to date. */
+static ErrorCode build_file(const BuildBatch *batch, size_t index,
+                            bool *built) {
+  const char *source = batch->sources[index];
+  const char *object = batch->objects[index];
+  *built = false;
+  if (batch->incremental && up_to_date(object, batch->peephole,
+                                         batch->debug_info)) {
+    return SUCCESS;
+  }
+  char *stamp_name = stamp_path(object);
+  if (NULL == stamp_name) {
+    return ERR_OUT_OF_MEMORY;
+  }
+  // Whatever happens next, the old stamp no longer describes the object
+  unlink(stamp_name);
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  MappedSource mapped;
+  if (!map_source(source, &mapped)) {
+    log_error("Failed to read '%s'", source);
+    free(stamp_name);
+    return ERR_FILE_NOT_FOUND;
+  }
+  *built = true;
+  Stamp stamp = {NULL, 0, 0, false,
+                 (int64_t)now.tv_sec * NANOSECONDS + now.tv_nsec};
+  append_stamp(&stamp, STAMP_HEADER " %u %u %u\n", STAMP_VERSION,
+               (unsigned)batch->peephole, (unsigned)batch->debug_info);
+  stamp_file(&stamp, source, mapped.data, mapped.size);
+  AssemblerOptions options = {.peephole = batch->peephole,
+                              .debug_info = batch->debug_info,
+                              .on_include = stamp_file,
+                              .context = &stamp};
+  BytecodeImage image;
+  ErrorCode status =
+      assemble_image(mapped.data, mapped.size, source, &options, &image);
+  unmap_source(&mapped);
+  if (status == SUCCESS) {
+    status = write_bytecode(object, &image, 0);
+    free_assembled_image(&image);
+  }
+  if (status == SUCCESS && !stamp.unusable) {
+    write_stamp(stamp_name, &stamp);
+  }
+  free(stamp.text);
+  free(stamp_name);
+  return status;
+}
+
+static void *build_worker(void *arg) {
+  BuildBatch *batch = arg;
+  for (;;) {
+    size_t index =
+        atomic_fetch_add_explicit(&batch->next, 1, memory_order_relaxed);
+    if (index >= batch->count) {
+      return NULL;
+    }
+    bool built = false;
+    batch->statuses[index] = build_file(batch, index, &built);
+    if (built) {
+      atomic_fetch_add_explicit(&batch->rebuilt, 1, memory_order_relaxed);
+    }
+  }
+}
+
+ErrorCode assemble_files(const char *const *sources,
+                         const char *const *objects, size_t count,
+                         const AssembleFilesOptions *options,
+                         ErrorCode *statuses, size_t *rebuilt) {
+  if ((NULL == sources || NULL == objects) && count > 0) {
+    log_error("Source or object paths are NULL");
+    return ERR_NULL_POINTER;
+  }
+  if (NULL != rebuilt) {
+    *rebuilt = 0;
+  }
+  if (0 == count) {
+    return SUCCESS;
+  }
+
+  AssembleFilesOptions settings = {PEEPHOLE_ALL, 0, false, false};
+  if (NULL != options) {
+    settings = *options;
+  }
+  if (0 == settings.threads) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    settings.threads = cpus > 1 ? (unsigned)cpus : 1;
+  }
+  if (settings.threads > count) {
+    settings.threads = (unsigned)count;
+  }
+
+  ErrorCode *results = statuses;
+  if (NULL == results && NULL == (results = malloc(count * sizeof(*results)))) {
+    log_error("Failed to allocate memory for assembly results");
+    return ERR_OUT_OF_MEMORY;
+  }
+  pthread_t *workers = calloc(settings.threads, sizeof(pthread_t));
+  if (NULL == workers) {
+    log_error("Failed to allocate memory for the assembler threads");
+    if (results != statuses) {
+      free(results);
+    }
+    return ERR_OUT_OF_MEMORY;
+  }
+  BuildBatch batch = {.sources = sources,
+                      .objects = objects,
+                      .count = count,
+                      .peephole = settings.peephole,
+                      .incremental = settings.incremental,
+                      .debug_info = settings.debug_info,
+                      .statuses = results};
+  atomic_init(&batch.next, 0);
+  atomic_init(&batch.rebuilt, 0);
+
+  // The calling thread is one of the workers
+  unsigned started = 0;
+  while (started + 1 < settings.threads &&
+         pthread_create(&workers[started], NULL, build_worker, &batch) == 0) {
+    started++;
+  }
+  build_worker(&batch);
+  for (unsigned i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+
+  ErrorCode status = SUCCESS;
+  for (size_t i = 0; i < count && status == SUCCESS; i++) {
+    status = results[i];
+  }
+  if (results != statuses) {
+    free(results);
+  }
+  size_t assembled = atomic_load(&batch.rebuilt);
+  if (NULL != rebuilt) {
+    *rebuilt = assembled;
+  }
+  log_info("Assembled %zu of %zu files with %u threads, status %d",
+           assembled, count, settings.threads, status);
+  return status;
+}
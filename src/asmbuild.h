@@ -0,0 +1,50 @@
+#ifndef ASMBUILD_H
+#define ASMBUILD_H
+
+#include "errno.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ASMBUILD_STAMP_SUFFIX ".dep" // Appended to an object's path
+
+typedef struct {
+  uint32_t peephole; // PEEPHOLE_* rules, as for AssemblerOptions
+  unsigned threads;  // Files assembled at once; 0 for one per CPU
+  bool incremental;  // Skip files whose inputs have not changed
+  bool debug_info;   // Give each object a debug section, as -g does
+} AssembleFilesOptions;
+
+/* Assembles many source files into object files at once, each with
+ * assemble_image and write_bytecode, so the objects can be linked with
+ * link_bytecode or attached as modules. A pool of threads takes the files
+ * in turn. Next to each object goes a stamp, "<object>.dep", listing the
+ * CRC-32C and size of the source and of every file it included, the
+ * peephole rules used and whether debug information was asked for. In
+ * incremental mode a file is skipped when its object exists and its stamp
+ * still matches: the source and everything it includes hash the same, and
+ * the options are the same. Deciding by
+ * contents instead of times keeps checkouts and touched files from
+ * rebuilding anything that did not change. A file whose size and
+ * modification time match the stamp is not read again, as git does with
+ * its index; the time is only recorded for files written at least a second
+ * before they were assembled, so a quick second edit is still noticed.
+ * Parameters:
+ *   sources - Paths of the source files
+ *   objects - Path of the object file to write for each source
+ *   count - Number of files
+ *   options - Rules, threads, incremental mode and debug information;
+ *             NULL applies PEEPHOLE_ALL with a thread per CPU, without
+ *             debug information, and rebuilds everything
+ *   statuses - Receives the result per file; may be NULL
+ *   rebuilt - Receives the number of files assembled; may be NULL
+ * Returns:
+ *   SUCCESS if every file was assembled or up to date, otherwise the first
+ *   failure (by position in sources)
+ */
+ErrorCode assemble_files(const char *const *sources,
+                         const char *const *objects, size_t count,
+                         const AssembleFilesOptions *options,
+                         ErrorCode *statuses, size_t *rebuilt);
+
+#endif // ASMBUILD_H
@@ -0,0 +1,1497 @@
+#include "assembler.h"
+#include "bytecode.h"
+#include "log.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+#define MNEMONIC_TABLE_SIZE 256 // Power of two, well over the opcode count
+#define MAX_MNEMONIC_LENGTH 16
+#define MIN_LABEL_CAPACITY 1024
+#define UNDEFINED_LABEL UINT32_MAX
+#define ASSEMBLER_MESSAGE_SIZE 256
+#define PEEPHOLE_WINDOW 16 // Recent instructions the peephole rules can see
+#define MAX_INCLUDE_DEPTH 16
+
+typedef enum {
+  FIXUP_ABSOLUTE, // 32-bit code offset
+  FIXUP_REL8,     // 8-bit displacement from the instruction
+  FIXUP_REL16,    // 16-bit displacement from the instruction
+  FIXUP_SYMBOL,   // 32-bit symbol table index of an import, for CALLX
+} FixupKind;
+
+typedef enum {
+  LABEL_LOCAL,  // Only used inside this source
+  LABEL_EXPORT, // Named in the symbol table for other modules to call
+  LABEL_IMPORT, // Defined by another module
+} LabelKind;
+
+typedef struct {
+  const char *name; // Inside the source mapping; NULL if the slot is free
+  uint32_t length;  // Length of the name
+  uint32_t hash;    // FNV-1a hash of the name
+  uint32_t offset;  // Code offset, or UNDEFINED_LABEL until it is defined
+  uint32_t symbol;  // Symbol table index of an export or import
+  uint32_t order;   // How many labels were defined before it
+  LabelKind kind;
+} Label;
+
+// Operand that names a label not defined yet when it was assembled
+typedef struct {
+  uint32_t operand;     // Code offset of the operand bytes
+  uint32_t instruction; // Code offset of the instruction, for displacements
+  uint32_t label;       // Slot in the label table
+  uint32_t line;        // Source line, for errors
+  const char *file;     // Source file, for errors
+  FixupKind kind;
+} Fixup;
+
+// Label named by .export or .import, in the order the symbols are listed
+typedef struct {
+  const char *name;
+  uint32_t length;
+  uint32_t line;
+  const char *file;
+} Declared;
+
+// File read by .include; it stays mapped since labels point into it
+typedef struct {
+  char *path;
+  const char *data;
+  size_t size;
+} Included;
+
+// Source line of the instruction at a code offset, for the debug section
+typedef struct {
+  uint32_t offset; // Code offset, including the NOPs that align it
+  uint32_t line;
+  uint32_t file; // 0 for the source, i + 1 for includes[i]
+} LineRow;
+
+// Instruction emitted since the last label, which peephole rules may rewrite
+typedef struct {
+  uint32_t padded; // Code offset of the NOPs that align it, if any
+  uint32_t start;  // Code offset of its opcode
+  uint8_t opcode;
+} Emitted;
+
+typedef struct {
+  char name[MAX_MNEMONIC_LENGTH]; // Lower case; empty if the slot is free
+  uint8_t length;
+  uint8_t opcode;
+} Mnemonic;
+
+typedef struct {
+  const char *name;     // Name of the file being read, for error messages
+  const char *source;   // Start of the top-level source
+  const char *cursor;   // Next character to lex
+  const char *end;      // End of the source
+  uint32_t line;        // Line being assembled, from 1
+  size_t errors;        // Errors reported so far
+  uint8_t *code;        // Code emitted so far
+  size_t code_size;     // Bytes in code
+  size_t code_capacity; // Bytes allocated for code
+  Label *labels;        // Open-addressing table of every label seen
+  size_t label_capacity;
+  size_t label_count;
+  Fixup *fixups; // Forward references, patched once the source is read
+  size_t fixup_count;
+  size_t fixup_capacity;
+  uint32_t peephole;    // PEEPHOLE_* rules to apply
+  size_t removed;       // Instructions the peephole rules removed
+  bool numeric_targets; // Whether a jump or call names a code offset
+  Emitted window[PEEPHOLE_WINDOW]; // Oldest first
+  size_t window_count;
+  Included *includes; // Every file .include read
+  size_t include_count;
+  size_t include_capacity;
+  unsigned depth;      // .include nesting of the file being read
+  uint32_t file;       // Debug file index of the file being read
+  Declared *declared;  // Exports and imports, in declaration order
+  size_t declared_count;
+  size_t declared_capacity;
+  BytecodeRelocation *relocations; // CALLs to imports, by offset
+  size_t relocation_count;
+  size_t relocation_capacity;
+  BytecodeSymbol *symbols; // Built from declared once the source is read
+  size_t symbol_count;
+  char *names; // Symbol names, back to back
+  size_t names_size;
+  BytecodeFunction *functions; // Built when the source declares symbols
+  size_t function_count;
+  uint32_t defined;   // Labels defined so far
+  bool debug_info;    // Whether to record rows and build a debug section
+  LineRow *rows;      // By code offset, one per instruction still emitted
+  size_t row_count;
+  size_t row_capacity;
+  uint8_t *debug; // Debug section, built once the source is read
+  size_t debug_size;
+} Assembler;
+
+// Short names for conditional jumps, as used in Syntax.md
+static const struct {
+  const char *alias;
+  Opcode opcode;
+} aliases[] = {{"jz", OP_JMPZ},     {"jnz", OP_JMPNZ},   {"jz8", OP_JMPZ8},
+               {"jnz8", OP_JMPNZ8}, {"jz16", OP_JMPZ16}, {"jnz16", OP_JMPNZ16}};
+
+static Mnemonic mnemonics[MNEMONIC_TABLE_SIZE];
+static pthread_once_t mnemonics_once = PTHREAD_ONCE_INIT;
+
+static uint32_t hash_name(const char *name, size_t length) {
+  uint32_t hash = FNV_OFFSET_BASIS;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (uint8_t)name[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+static void add_mnemonic(const char *name, Opcode opcode) {
+  char lower[MAX_MNEMONIC_LENGTH] = {0};
+  size_t length = strlen(name);
+  for (size_t i = 0; i < length; i++) {
+    char c = name[i];
+    lower[i] = c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+  }
+  size_t slot = hash_name(lower, length) & (MNEMONIC_TABLE_SIZE - 1);
+  while (mnemonics[slot].length != 0) {
+    slot = (slot + 1) & (MNEMONIC_TABLE_SIZE - 1);
+  }
+  memcpy(mnemonics[slot].name, lower, sizeof(lower));
+  mnemonics[slot].length = (uint8_t)length;
+  mnemonics[slot].opcode = (uint8_t)opcode;
+}
+
+/* Fills the mnemonic table from instruction_set, lower-casing each name. */
+static void init_mnemonics(void) {
+  for (int opcode = 0; opcode < OP_COUNT; opcode++) {
+    add_mnemonic(instruction_set[opcode].name, (Opcode)opcode);
+  }
+  for (size_t i = 0; i < sizeof(aliases) / sizeof(aliases[0]); i++) {
+    add_mnemonic(aliases[i].alias, aliases[i].opcode);
+  }
+}
+
+/* Returns the opcode of a mnemonic, or -1 if there is none. */
+static int find_mnemonic(const char *name, size_t length) {
+  if (length >= MAX_MNEMONIC_LENGTH) {
+    return -1;
+  }
+  size_t slot = hash_name(name, length) & (MNEMONIC_TABLE_SIZE - 1);
+  while (mnemonics[slot].length != 0) {
+    if (mnemonics[slot].length == length &&
+        0 == memcmp(mnemonics[slot].name, name, length)) {
+      return mnemonics[slot].opcode;
+    }
+    slot = (slot + 1) & (MNEMONIC_TABLE_SIZE - 1);
+  }
+  return -1;
+}
+
+static void report_in(Assembler *as, const char *file, uint32_t line,
+                      const char *format, va_list args) {
+  as->errors++;
+  if (as->errors > ASSEMBLER_MAX_REPORTED_ERRORS) {
+    return;
+  }
+  char message[ASSEMBLER_MESSAGE_SIZE];
+  vsnprintf(message, sizeof(message), format, args);
+  log_error("%s:%u: error: %s", file, line, message);
+}
+
+/* Reports an error on a line of the file being read. */
+static void report(Assembler *as, uint32_t line, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  report_in(as, as->name, line, format, args);
+  va_end(args);
+}
+
+/* Reports an error on a line of some other file. */
+static void report_at(Assembler *as, const char *file, uint32_t line,
+                      const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  report_in(as, file, line, format, args);
+  va_end(args);
+}
+
+static bool is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+static bool is_name_start(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' ||
+         c == '.';
+}
+
+static bool is_name_char(char c) {
+  return is_name_start(c) || (c >= '0' && c <= '9');
+}
+
+static void skip_blanks(Assembler *as) {
+  while (as->cursor < as->end && is_blank(*as->cursor)) {
+    as->cursor++;
+  }
+}
+
+/* Skips what is left of the line, comment included, and the newline. */
+static void next_line(Assembler *as) {
+  const char *newline = memchr(as->cursor, '\n', as->end - as->cursor);
+  as->cursor = NULL == newline ? as->end : newline + 1;
+  as->line++;
+}
+
+static bool at_line_end(const Assembler *as) {
+  return as->cursor == as->end || *as->cursor == '\n' || *as->cursor == ';';
+}
+
+static const char *read_name(Assembler *as, size_t *length) {
+  const char *name = as->cursor;
+  while (as->cursor < as->end && is_name_char(*as->cursor)) {
+    as->cursor++;
+  }
+  *length = (size_t)(as->cursor - name);
+  return name;
+}
+
+/* Reads a decimal or 0x hexadecimal number, optionally negative. */
+static bool read_number(Assembler *as, int64_t *value) {
+  const char *p = as->cursor;
+  bool negative = p < as->end && *p == '-';
+  p += negative;
+  int base = 10;
+  if (as->end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+    base = 16;
+    p += 2;
+  }
+  const char *digits = p;
+  uint64_t result = 0;
+  for (; p < as->end; p++) {
+    int digit;
+    char c = *p;
+    if (c >= '0' && c <= '9') {
+      digit = c - '0';
+    } else if (base == 16 && c >= 'a' && c <= 'f') {
+      digit = c - 'a' + 10;
+    } else if (base == 16 && c >= 'A' && c <= 'F') {
+      digit = c - 'A' + 10;
+    } else {
+      break;
+    }
+    result = result * (uint64_t)base + (uint64_t)digit;
+    if (result > UINT32_MAX) {
+      return false;
+    }
+  }
+  if (p == digits || (p < as->end && is_name_char(*p))) {
+    return false;
+  }
+  as->cursor = p;
+  *value = negative ? -(int64_t)result : (int64_t)result;
+  return true;
+}
+
+static bool reserve_code(Assembler *as, size_t size) {
+  if (as->code_size + size <= as->code_capacity) {
+    return true;
+  }
+  size_t capacity = as->code_capacity * 2;
+  while (capacity < as->code_size + size) {
+    capacity *= 2;
+  }
+  uint8_t *code = realloc(as->code, capacity);
+  if (NULL == code) {
+    log_error("Failed to grow the code buffer to %zu bytes", capacity);
+    return false;
+  }
+  as->code = code;
+  as->code_capacity = capacity;
+  return true;
+}
+
+/* Returns the label's slot, adding it undefined if it is new. */
+static Label *find_label(Assembler *as, const char *name, size_t length) {
+  if (2 * (as->label_count + 1) > as->label_capacity) {
+    size_t capacity = as->label_capacity * 2;
+    Label *labels = calloc(capacity, sizeof(Label));
+    if (NULL == labels) {
+      log_error("Failed to grow the label table to %zu slots", capacity);
+      return NULL;
+    }
+    for (size_t i = 0; i < as->label_capacity; i++) {
+      const Label *label = &as->labels[i];
+      if (NULL == label->name) {
+        continue;
+      }
+      size_t slot = label->hash & (capacity - 1);
+      while (NULL != labels[slot].name) {
+        slot = (slot + 1) & (capacity - 1);
+      }
+      labels[slot] = *label;
+    }
+    // Fixups refer to labels by slot, so move them along
+    for (size_t i = 0; i < as->fixup_count; i++) {
+      const Label *old = &as->labels[as->fixups[i].label];
+      size_t slot = old->hash & (capacity - 1);
+      while (labels[slot].length != old->length ||
+             0 != memcmp(labels[slot].name, old->name, old->length)) {
+        slot = (slot + 1) & (capacity - 1);
+      }
+      as->fixups[i].label = (uint32_t)slot;
+    }
+    free(as->labels);
+    as->labels = labels;
+    as->label_capacity = capacity;
+  }
+
+  uint32_t hash = hash_name(name, length);
+  size_t slot = hash & (as->label_capacity - 1);
+  Label *label = &as->labels[slot];
+  while (NULL != label->name &&
+         (label->hash != hash || label->length != length ||
+          0 != memcmp(label->name, name, length))) {
+    slot = (slot + 1) & (as->label_capacity - 1);
+    label = &as->labels[slot];
+  }
+  if (NULL == label->name) {
+    *label = (Label){name, (uint32_t)length, hash, UNDEFINED_LABEL, 0, 0,
+                     LABEL_LOCAL};
+    as->label_count++;
+  }
+  return label;
+}
+
+/* Returns whether an emitted instruction pushes a constant, and which. */
+static bool pushed_constant(const Assembler *as, const Emitted *emitted,
+                            int32_t *value) {
+  const uint8_t *operand = as->code + emitted->start + 1;
+  switch (emitted->opcode) {
+  case OP_PUSH:
+    memcpy(value, operand, sizeof(*value));
+    return true;
+  case OP_PUSH8:
+    *value = (int8_t)operand[0];
+    return true;
+  case OP_PUSH16: {
+    int16_t narrow;
+    memcpy(&narrow, operand, sizeof(narrow));
+    *value = narrow;
+    return true;
+  }
+  case OP_PUSH_0:
+  case OP_PUSH_1:
+    *value = emitted->opcode == OP_PUSH_1;
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* Takes the last `count` instructions back out of the code, along with the
+ * NOPs that aligned them. No label lies within them, since a label empties
+ * the window.
+ */
+static void drop_emitted(Assembler *as, size_t count) {
+  as->window_count -= count;
+  as->code_size = as->window[as->window_count].padded;
+  // The first one's row stays for whatever is emitted in their place
+  while (as->row_count > 0 &&
+         as->rows[as->row_count - 1].offset > as->code_size) {
+    as->row_count--;
+  }
+}
+
+/* Emits an operand-less instruction in place of dropped ones; the room
+ * they took is still reserved.
+ */
+static void emit_replacement(Assembler *as, Opcode opcode) {
+  uint32_t start = (uint32_t)as->code_size;
+  as->window[as->window_count++] = (Emitted){start, start, (uint8_t)opcode};
+  as->code[as->code_size++] = (uint8_t)opcode;
+}
+
+/* Rewrites the last two instructions while a rule matches them:
+ *   push 0; add|sub  ->  (nothing)      PEEPHOLE_IDENTITIES
+ *   push k; pop      ->  (nothing)
+ *   dup; pop         ->  (nothing)
+ *   swap; swap       ->  (nothing)
+ *   push 1; add|sub  ->  inc|dec        PEEPHOLE_STRENGTH
+ * Each rewrite can expose another pair, as in "push 2; dup; pop; pop".
+ */
+static void apply_peephole(Assembler *as) {
+  while (as->window_count >= 2) {
+    const Emitted *first = &as->window[as->window_count - 2];
+    uint8_t second = as->window[as->window_count - 1].opcode;
+    int32_t constant = 0;
+    bool pushes = pushed_constant(as, first, &constant);
+    bool arithmetic = second == OP_ADD || second == OP_SUB;
+
+    if ((as->peephole & PEEPHOLE_IDENTITIES) &&
+        ((pushes && constant == 0 && arithmetic) ||
+         ((pushes || first->opcode == OP_DUP) && second == OP_POP) ||
+         (first->opcode == OP_SWAP && second == OP_SWAP))) {
+      drop_emitted(as, 2);
+      as->removed += 2;
+    } else if ((as->peephole & PEEPHOLE_STRENGTH) && pushes &&
+               constant == 1 && arithmetic) {
+      drop_emitted(as, 2);
+      emit_replacement(as, second == OP_ADD ? OP_INC : OP_DEC);
+      as->removed += 1;
+    } else {
+      return;
+    }
+  }
+}
+
+/* Removes a jump to the label about to be defined right after it, while its
+ * fixup is still pending. A conditional jump still pops its condition, so
+ * it becomes a POP.
+ */
+static void drop_jump_to_next(Assembler *as, const Label *label) {
+  if (!(as->peephole & PEEPHOLE_JUMPS) || 0 == as->window_count ||
+      0 == as->fixup_count) {
+    return;
+  }
+  const Emitted *last = &as->window[as->window_count - 1];
+  const Fixup *fixup = &as->fixups[as->fixup_count - 1];
+  if (fixup->instruction != last->start ||
+      fixup->label != (uint32_t)(label - as->labels)) {
+    return;
+  }
+  switch (last->opcode) {
+  case OP_JMP:
+  case OP_JMP8:
+  case OP_JMP16:
+    as->fixup_count--;
+    drop_emitted(as, 1);
+    as->removed += 1;
+    break;
+  case OP_JMPZ:
+  case OP_JMPZ8:
+  case OP_JMPZ16:
+  case OP_JMPNZ:
+  case OP_JMPNZ8:
+  case OP_JMPNZ16:
+    as->fixup_count--;
+    drop_emitted(as, 1);
+    emit_replacement(as, OP_POP);
+    break;
+  default:
+    return;
+  }
+  apply_peephole(as);
+}
+
+static void define_label(Assembler *as, const char *name, size_t length) {
+  Label *label = find_label(as, name, length);
+  if (NULL == label) {
+    as->errors++;
+  } else if (label->offset != UNDEFINED_LABEL) {
+    report(as, as->line, "label '%.*s' is already defined", (int)length,
+           name);
+  } else if (label->kind == LABEL_IMPORT) {
+    report(as, as->line, "label '%.*s' is imported, so it cannot be defined",
+           (int)length, name);
+  } else {
+    drop_jump_to_next(as, label);
+    label->offset = (uint32_t)as->code_size;
+    label->order = as->defined++;
+  }
+  // Code after a label can be reached from elsewhere, so rules stop here
+  as->window_count = 0;
+}
+
+/* Makes room for one more entry at the end of a growable array. */
+static bool grow(void *items, size_t *capacity, size_t count, size_t size) {
+  if (count < *capacity) {
+    return true;
+  }
+  size_t grown = 0 == *capacity ? 16 : *capacity * 2;
+  void *larger = realloc(*(void **)items, grown * size);
+  if (NULL == larger) {
+    log_error("Failed to grow a list to %zu entries", grown);
+    return false;
+  }
+  *(void **)items = larger;
+  *capacity = grown;
+  return true;
+}
+
+/* Records the line of an instruction emitted at `offset`. An instruction
+ * emitted where dropped ones started replaces their row.
+ */
+static bool add_row(Assembler *as, uint32_t offset) {
+  if (as->row_count > 0 && as->rows[as->row_count - 1].offset == offset) {
+    as->row_count--;
+  } else if (!grow(&as->rows, &as->row_capacity, as->row_count,
+                   sizeof(LineRow))) {
+    return false;
+  }
+  as->rows[as->row_count++] = (LineRow){offset, as->line, as->file};
+  return true;
+}
+
+static bool add_fixup(Assembler *as, Fixup fixup) {
+  if (!grow(&as->fixups, &as->fixup_capacity, as->fixup_count,
+            sizeof(Fixup))) {
+    return false;
+  }
+  as->fixups[as->fixup_count++] = fixup;
+  return true;
+}
+
+/* Writes a code offset, displacement or symbol index into an operand,
+ * checking that a displacement fits its width.
+ */
+static bool patch(Assembler *as, FixupKind kind, uint32_t operand,
+                  uint32_t instruction, uint32_t target) {
+  int64_t displacement = (int64_t)target - (int64_t)instruction;
+  switch (kind) {
+  case FIXUP_ABSOLUTE:
+  case FIXUP_SYMBOL:
+    memcpy(as->code + operand, &target, sizeof(target));
+    return true;
+  case FIXUP_REL8:
+    if (displacement < INT8_MIN || displacement > INT8_MAX) {
+      return false;
+    }
+    as->code[operand] = (uint8_t)(int8_t)displacement;
+    return true;
+  case FIXUP_REL16: {
+    if (displacement < INT16_MIN || displacement > INT16_MAX) {
+      return false;
+    }
+    int16_t wide = (int16_t)displacement;
+    memcpy(as->code + operand, &wide, sizeof(wide));
+    return true;
+  }
+  }
+  return false;
+}
+
+/* Assembles an operand that names a label: resolved now if the label is
+ * already defined, and patched once the source is read otherwise. An
+ * import's symbol index is only known then, so FIXUP_SYMBOL always waits.
+ */
+static bool reference_label(Assembler *as, FixupKind kind, uint32_t operand,
+                            uint32_t instruction) {
+  size_t length = 0;
+  const char *name = read_name(as, &length);
+  if (0 == length || !is_name_start(name[0])) {
+    report(as, as->line, "expected a label");
+    return false;
+  }
+  Label *label = find_label(as, name, length);
+  if (NULL == label) {
+    as->errors++;
+    return false;
+  }
+  if (label->offset != UNDEFINED_LABEL && kind != FIXUP_SYMBOL) {
+    if (!patch(as, kind, operand, instruction, label->offset)) {
+      report(as, as->line, "label '%.*s' is out of range", (int)length, name);
+      return false;
+    }
+    return true;
+  }
+  if (!add_fixup(as, (Fixup){operand, instruction,
+                             (uint32_t)(label - as->labels), as->line,
+                             as->name, kind})) {
+    as->errors++;
+    return false;
+  }
+  return true;
+}
+
+/* Assembles the operand of a jump or call: a label, or a code offset. */
+static bool assemble_target(Assembler *as, FixupKind kind, uint32_t operand,
+                            uint32_t instruction) {
+  int64_t value = 0;
+  if (kind == FIXUP_ABSOLUTE && !is_name_start(*as->cursor) &&
+      read_number(as, &value) && value >= 0) {
+    as->numeric_targets = true;
+    return patch(as, kind, operand, instruction, (uint32_t)value);
+  }
+  return reference_label(as, kind, operand, instruction);
+}
+
+/* Checks that a number fits `width` bytes: any 32-bit value for a 4-byte
+ * immediate, a signed value for narrower immediates, and an unsigned one
+ * for indices.
+ */
+static bool fits(int64_t value, size_t width, bool is_signed) {
+  if (width == 4) {
+    return is_signed ? value >= INT32_MIN && value <= UINT32_MAX
+                     : value >= 0 && value <= UINT32_MAX;
+  }
+  int64_t span = (int64_t)1 << (8 * width);
+  return is_signed ? value >= -span / 2 && value < span / 2
+                   : value >= 0 && value < span;
+}
+
+/* Emits one instruction and its operand. Returns false if it reported an
+ * error.
+ */
+static bool assemble_instruction(Assembler *as, Opcode opcode) {
+  InstructionInfo info = instruction_set[opcode];
+  size_t length = info.length == 0 ? 1 + LEB128_MAX_BYTES : info.length;
+
+  // Version 0.2 code keeps every 32-bit operand 4-byte aligned
+  size_t padding = 0;
+  if (info.length == 1 + sizeof(uint32_t)) {
+    padding = (BYTECODE_OPERAND_ALIGNMENT -
+               (as->code_size + 1) % BYTECODE_OPERAND_ALIGNMENT) %
+              BYTECODE_OPERAND_ALIGNMENT;
+  }
+  if (!reserve_code(as, padding + length) ||
+      (as->debug_info && !add_row(as, (uint32_t)as->code_size))) {
+    as->errors++;
+    return false;
+  }
+  memset(as->code + as->code_size, OP_NOP, padding);
+  as->code_size += padding;
+
+  uint32_t instruction = (uint32_t)as->code_size;
+  uint8_t *out = as->code + instruction;
+  out[0] = (uint8_t)opcode;
+  if (as->window_count == PEEPHOLE_WINDOW) {
+    memmove(as->window, as->window + 1,
+            (PEEPHOLE_WINDOW - 1) * sizeof(Emitted));
+    as->window_count--;
+  }
+  as->window[as->window_count++] =
+      (Emitted){(uint32_t)(as->code_size - padding), instruction,
+                (uint8_t)opcode};
+  if (info.operand_count == 0) {
+    as->code_size += 1;
+    return true;
+  }
+
+  skip_blanks(as);
+  if (at_line_end(as)) {
+    report(as, as->line, "%s needs an operand", info.name);
+    return false;
+  }
+  OperandType type = info.operand_types[0];
+  if (type == OPERAND_ADDRESS || type == OPERAND_OFFSET) {
+    FixupKind kind = type == OPERAND_ADDRESS ? FIXUP_ABSOLUTE
+                     : info.length == 2      ? FIXUP_REL8
+                                             : FIXUP_REL16;
+    memset(out + 1, 0, info.length - 1);
+    as->code_size += info.length;
+    return assemble_target(as, kind, instruction + 1, instruction);
+  }
+
+  if (opcode == OP_CALLX && is_name_start(*as->cursor)) {
+    memset(out + 1, 0, sizeof(uint32_t));
+    as->code_size += info.length;
+    return reference_label(as, FIXUP_SYMBOL, instruction + 1, instruction);
+  }
+
+  int64_t value = 0;
+  bool is_signed = type == OPERAND_IMMEDIATE;
+  size_t width = info.length == 0 ? sizeof(uint32_t) : info.length - 1;
+  if (!read_number(as, &value) || !fits(value, width, is_signed)) {
+    report(as, as->line, "%s operand is not a %s that fits %zu byte%s",
+           info.name, is_signed ? "number" : "non-negative number", width,
+           width == 1 ? "" : "s");
+    return false;
+  }
+  if (type == OPERAND_VARINT) {
+    as->code_size += 1 + encode_uleb128((uint32_t)value, out + 1);
+    return true;
+  }
+  uint32_t bits = (uint32_t)value;
+  memcpy(out + 1, &bits, width); // Little-endian, like the VM
+  as->code_size += info.length;
+  return true;
+}
+
+/* Marks a label as exported or imported, for ".export name" and
+ * ".import name". Returns false if it reported an error.
+ */
+static bool declare_symbol(Assembler *as, LabelKind kind,
+                           const char *directive) {
+  skip_blanks(as);
+  size_t length = 0;
+  const char *name = read_name(as, &length);
+  if (0 == length || !is_name_start(name[0])) {
+    report(as, as->line, "%s needs a label name", directive);
+    return false;
+  }
+  Label *label = find_label(as, name, length);
+  if (NULL == label) {
+    as->errors++;
+    return false;
+  }
+  if (label->kind == kind) {
+    return true; // Declared twice
+  }
+  if (label->kind != LABEL_LOCAL) {
+    report(as, as->line, "label '%.*s' is both exported and imported",
+           (int)length, name);
+    return false;
+  }
+  if (kind == LABEL_IMPORT && label->offset != UNDEFINED_LABEL) {
+    report(as, as->line, "label '%.*s' is defined, so it cannot be imported",
+           (int)length, name);
+    return false;
+  }
+  if (!grow(&as->declared, &as->declared_capacity, as->declared_count,
+            sizeof(Declared))) {
+    as->errors++;
+    return false;
+  }
+  label->kind = kind;
+  as->declared[as->declared_count++] =
+      (Declared){name, (uint32_t)length, as->line, as->name};
+  return true;
+}
+
+static void read_lines(Assembler *as);
+
+/* Maps a file read by .include and keeps it until assembly ends. The
+ * caller reports a failure.
+ */
+static bool map_included(Assembler *as, char *path) {
+  if (!grow(&as->includes, &as->include_capacity, as->include_count,
+            sizeof(Included))) {
+    free(path);
+    return false;
+  }
+  Included *included = &as->includes[as->include_count++];
+  *included = (Included){path, NULL, 0};
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+  if (st.st_size > 0) {
+    void *mapping =
+        mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    included->data = mapping;
+    included->size = (size_t)st.st_size;
+  }
+  close(fd);
+  return true;
+}
+
+/* Assembles the file named by `.include "path"` in place of the line. A
+ * relative path starts from the directory of the file that includes it.
+ * Returns false if it reported an error.
+ */
+static bool include_file(Assembler *as) {
+  skip_blanks(as);
+  const char *path = as->cursor + 1;
+  const char *close = NULL;
+  if (as->cursor < as->end && *as->cursor == '"') {
+    close = memchr(path, '"', (size_t)(as->end - path));
+  }
+  if (NULL == close || close == path ||
+      NULL != memchr(path, '\n', (size_t)(close - path))) {
+    report(as, as->line, ".include needs a quoted path");
+    return false;
+  }
+  as->cursor = close + 1;
+  if (as->depth == MAX_INCLUDE_DEPTH) {
+    report(as, as->line, ".include nests more than %d files deep",
+           MAX_INCLUDE_DEPTH);
+    return false;
+  }
+
+  size_t length = (size_t)(close - path);
+  const char *slash = strrchr(as->name, '/');
+  size_t directory = NULL == slash || path[0] == '/'
+                         ? 0
+                         : (size_t)(slash - as->name) + 1;
+  char *resolved = malloc(directory + length + 1);
+  if (NULL == resolved) {
+    log_error("Failed to allocate memory for an include path");
+    as->errors++;
+    return false;
+  }
+  memcpy(resolved, as->name, directory);
+  memcpy(resolved + directory, path, length);
+  resolved[directory + length] = '\0';
+  if (!map_included(as, resolved)) {
+    report(as, as->line, "cannot read included file '%.*s'", (int)length,
+           path);
+    return false;
+  }
+
+  const Included *included = &as->includes[as->include_count - 1];
+  if (0 == included->size) {
+    return true;
+  }
+  const char *name = as->name;
+  const char *cursor = as->cursor;
+  const char *end = as->end;
+  uint32_t line = as->line;
+  uint32_t file = as->file;
+  as->name = included->path;
+  as->cursor = included->data;
+  as->end = included->data + included->size;
+  as->line = 1;
+  as->file = (uint32_t)as->include_count;
+  as->depth++;
+  read_lines(as);
+  as->depth--;
+  as->name = name;
+  as->cursor = cursor;
+  as->end = end;
+  as->line = line;
+  as->file = file;
+  return true;
+}
+
+static bool is_directive(const char *name, size_t length,
+                         const char *directive) {
+  return length == strlen(directive) && 0 == memcmp(name, directive, length);
+}
+
+/* Assembles a line that starts with a directive. */
+static void assemble_directive(Assembler *as, const char *name,
+                               size_t length) {
+  bool done = false;
+  if (is_directive(name, length, ".export")) {
+    done = declare_symbol(as, LABEL_EXPORT, ".export");
+  } else if (is_directive(name, length, ".import")) {
+    done = declare_symbol(as, LABEL_IMPORT, ".import");
+  } else if (is_directive(name, length, ".include")) {
+    done = include_file(as);
+  } else {
+    report(as, as->line, "unknown directive '%.*s'", (int)length, name);
+  }
+  skip_blanks(as);
+  if (done && !at_line_end(as)) {
+    report(as, as->line, "unexpected text after %.*s", (int)length, name);
+  }
+}
+
+/* Assembles one line: an optional label, an optional instruction and an
+ * optional comment.
+ */
+static void assemble_line(Assembler *as) {
+  skip_blanks(as);
+  if (at_line_end(as)) {
+    return;
+  }
+  size_t length = 0;
+  const char *name = read_name(as, &length);
+  if (0 == length) {
+    report(as, as->line, "unexpected character '%c'", *as->cursor);
+    return;
+  }
+  if (as->cursor < as->end && *as->cursor == ':') {
+    if (!is_name_start(name[0])) {
+      report(as, as->line, "label '%.*s' must not start with a digit",
+             (int)length, name);
+      return;
+    }
+    define_label(as, name, length);
+    as->cursor++;
+    skip_blanks(as);
+    if (at_line_end(as)) {
+      return;
+    }
+    name = read_name(as, &length);
+  }
+  if (name[0] == '.') {
+    assemble_directive(as, name, length);
+    return;
+  }
+
+  int opcode = find_mnemonic(name, length);
+  if (opcode < 0) {
+    report(as, as->line, "unknown instruction '%.*s'", (int)length, name);
+    return;
+  }
+  if (!assemble_instruction(as, (Opcode)opcode)) {
+    as->window_count = 0; // Its operand may not have been written
+    return;
+  }
+  skip_blanks(as);
+  if (!at_line_end(as)) {
+    report(as, as->line, "unexpected text after %s",
+           instruction_set[opcode].name);
+  } else if (0 != as->peephole) {
+    apply_peephole(as);
+  }
+}
+
+/* Lists the exports and imports in the order they were declared, with
+ * their names back to back in one block.
+ */
+static void build_symbols(Assembler *as) {
+  if (0 == as->declared_count) {
+    return;
+  }
+  size_t names_size = 0;
+  for (size_t i = 0; i < as->declared_count; i++) {
+    names_size += as->declared[i].length;
+  }
+  as->symbols = calloc(as->declared_count, sizeof(BytecodeSymbol));
+  as->names = malloc(names_size);
+  if (NULL == as->symbols || NULL == as->names) {
+    log_error("Failed to allocate memory for %zu symbols",
+              as->declared_count);
+    as->errors++;
+    return;
+  }
+  for (size_t i = 0; i < as->declared_count; i++) {
+    const Declared *declared = &as->declared[i];
+    Label *label = find_label(as, declared->name, declared->length);
+    if (label->kind == LABEL_EXPORT && label->offset == UNDEFINED_LABEL) {
+      report_at(as, declared->file, declared->line,
+                "exported label '%.*s' is not defined", (int)declared->length,
+                declared->name);
+    } else if (label->kind == LABEL_EXPORT &&
+               label->offset >= as->code_size) {
+      report_at(as, declared->file, declared->line,
+                "exported label '%.*s' has no code after it",
+                (int)declared->length, declared->name);
+    }
+    label->symbol = (uint32_t)i;
+    as->symbols[i] = (BytecodeSymbol){
+        (uint32_t)as->names_size, declared->length,
+        label->kind == LABEL_EXPORT ? label->offset : 0,
+        label->kind == LABEL_EXPORT ? SYMBOL_EXPORT : SYMBOL_IMPORT, 0};
+    memcpy(as->names + as->names_size, declared->name, declared->length);
+    as->names_size += declared->length;
+  }
+  as->symbol_count = as->declared_count;
+}
+
+/* Patches every forward reference now that all labels are known. A CALL to
+ * an import keeps a zero target and gets a relocation for the linker
+ * instead; fixups are in code order, so the relocations come out sorted.
+ */
+static void resolve_fixups(Assembler *as) {
+  for (size_t i = 0; i < as->fixup_count; i++) {
+    const Fixup *fixup = &as->fixups[i];
+    const Label *label = &as->labels[fixup->label];
+    if (fixup->kind == FIXUP_SYMBOL) {
+      if (label->kind != LABEL_IMPORT) {
+        report_at(as, fixup->file, fixup->line,
+                  "CALLX needs an imported label, not '%.*s'",
+                  (int)label->length, label->name);
+      } else {
+        patch(as, fixup->kind, fixup->operand, fixup->instruction,
+              label->symbol);
+      }
+    } else if (label->kind == LABEL_IMPORT) {
+      if (fixup->kind != FIXUP_ABSOLUTE ||
+          as->code[fixup->instruction] != OP_CALL) {
+        report_at(as, fixup->file, fixup->line,
+                  "imported label '%.*s' can only be called",
+                  (int)label->length, label->name);
+      } else if (grow(&as->relocations, &as->relocation_capacity,
+                      as->relocation_count, sizeof(BytecodeRelocation))) {
+        as->relocations[as->relocation_count++] =
+            (BytecodeRelocation){fixup->instruction, label->symbol};
+      } else {
+        as->errors++;
+      }
+    } else if (label->offset == UNDEFINED_LABEL) {
+      report_at(as, fixup->file, fixup->line, "undefined label '%.*s'",
+                (int)label->length, label->name);
+    } else if (!patch(as, fixup->kind, fixup->operand, fixup->instruction,
+                      label->offset)) {
+      report_at(as, fixup->file, fixup->line,
+                "label '%.*s' is out of range", (int)label->length,
+                label->name);
+    }
+  }
+}
+
+static int compare_entries(const void *a, const void *b) {
+  uint32_t left = *(const uint32_t *)a;
+  uint32_t right = *(const uint32_t *)b;
+  return (left > right) - (left < right);
+}
+
+/* Collects the function entries: every export, and every CALL target that
+ * is not an import. Returns them sorted and without duplicates.
+ */
+static uint32_t *collect_entries(Assembler *as, size_t *count) {
+  uint32_t *entries = NULL;
+  size_t capacity = 0;
+  *count = 0;
+  for (size_t i = 0; i < as->symbol_count; i++) {
+    if (as->symbols[i].kind == SYMBOL_EXPORT) {
+      if (!grow(&entries, &capacity, *count, sizeof(uint32_t))) {
+        free(entries);
+        return NULL;
+      }
+      entries[(*count)++] = as->symbols[i].value;
+    }
+  }
+  size_t relocation = 0;
+  for (size_t ip = 0; ip < as->code_size;) {
+    if (as->code[ip] == OP_CALL) {
+      while (relocation < as->relocation_count &&
+             as->relocations[relocation].offset < ip) {
+        relocation++;
+      }
+      uint32_t target;
+      memcpy(&target, as->code + ip + 1, sizeof(target));
+      bool imported = relocation < as->relocation_count &&
+                      as->relocations[relocation].offset == ip;
+      if (!imported && target < as->code_size) {
+        if (!grow(&entries, &capacity, *count, sizeof(uint32_t))) {
+          free(entries);
+          return NULL;
+        }
+        entries[(*count)++] = target;
+      }
+    }
+    ip += instruction_length(as->code + ip, as->code_size - ip);
+  }
+  if (0 == *count) {
+    return entries; // Still NULL, which qsort must not be passed
+  }
+  qsort(entries, *count, sizeof(uint32_t), compare_entries);
+  size_t unique = 0;
+  for (size_t i = 0; i < *count; i++) {
+    if (0 == unique || entries[unique - 1] != entries[i]) {
+      entries[unique++] = entries[i];
+    }
+  }
+  *count = unique;
+  return entries;
+}
+
+/* Builds the function table that lets a source with symbols be linked or
+ * attached as a module. Each function runs to the next entry, and may use
+ * as many locals as its LOAD and STORE instructions address.
+ */
+static void build_functions(Assembler *as) {
+  size_t count = 0;
+  uint32_t *entries = collect_entries(as, &count);
+  if (0 == count) {
+    free(entries);
+    return;
+  }
+  as->functions = NULL == entries
+                      ? NULL
+                      : calloc(count, sizeof(BytecodeFunction));
+  if (NULL == as->functions) {
+    log_error("Failed to allocate memory for the function table");
+    free(entries);
+    as->errors++;
+    return;
+  }
+  for (size_t i = 0; i < count; i++) {
+    uint32_t end = i + 1 < count ? entries[i + 1] : (uint32_t)as->code_size;
+    as->functions[i].entry = entries[i];
+    as->functions[i].size = end - entries[i];
+  }
+  as->function_count = count;
+  free(entries);
+
+  size_t function = 0;
+  for (size_t ip = 0; ip < as->code_size;) {
+    while (function < count && ip >= as->functions[function].entry +
+                                          as->functions[function].size) {
+      function++;
+    }
+    uint8_t opcode = as->code[ip];
+    if ((opcode == OP_LOAD || opcode == OP_STORE) && function < count &&
+        ip >= as->functions[function].entry &&
+        as->code[ip + 1] >= as->functions[function].local_count) {
+      as->functions[function].local_count = (uint16_t)(as->code[ip + 1] + 1);
+    }
+    ip += instruction_length(as->code + ip, as->code_size - ip);
+  }
+}
+
+/* Appends one debug row: how far the code moved since the last, whether
+ * the file changed, and by how much the line did, zigzag encoded.
+ */
+static size_t encode_row(const LineRow *row, uint32_t address, uint32_t file,
+                         uint32_t line, uint8_t *out) {
+  bool new_file = row->file != file;
+  size_t size = encode_uleb128((row->offset - address) << 1 | new_file, out);
+  if (new_file) {
+    size += encode_uleb128(row->file, out + size);
+  }
+  int32_t delta = (int32_t)(row->line - line);
+  return size + encode_uleb128((uint32_t)delta << 1 ^ (uint32_t)(delta >> 31),
+                               out + size);
+}
+
+/* Names each debug function after the first label defined at its entry. */
+static void name_functions(const Assembler *as, const uint32_t *entries,
+                           size_t count, const Label **names) {
+  for (size_t i = 0; i < as->label_capacity; i++) {
+    const Label *label = &as->labels[i];
+    if (NULL == label->name || label->offset >= as->code_size) {
+      continue;
+    }
+    const uint32_t *entry = bsearch(&label->offset, entries, count,
+                                    sizeof(uint32_t), compare_entries);
+    if (NULL != entry && (NULL == names[entry - entries] ||
+                          label->order < names[entry - entries]->order)) {
+      names[entry - entries] = label;
+    }
+  }
+}
+
+/* Returns the name of the debug function at `entry`, given the label
+ * name_functions found for it.
+ */
+static const char *function_name(const Label *label, uint32_t entry,
+                                 uint32_t *length) {
+  const char *name = NULL != label ? label->name
+                     : 0 == entry  ? "<main>"
+                                   : "<anonymous>";
+  *length = NULL != label ? label->length : (uint32_t)strlen(name);
+  return name;
+}
+
+/* Builds the debug section: the function entries plus offset 0 with
+ * their names, the rows that start a new line in blocks of
+ * DEBUG_BLOCK_ROWS, and the names of the files.
+ */
+static void build_debug(Assembler *as) {
+  // Rows past the code belong to instructions dropped at the end, and rows
+  // that start no new line add nothing
+  size_t kept = 0;
+  for (size_t i = 0; i < as->row_count && as->rows[i].offset < as->code_size;
+       i++) {
+    if (0 == kept || as->rows[i].line != as->rows[kept - 1].line ||
+        as->rows[i].file != as->rows[kept - 1].file) {
+      as->rows[kept++] = as->rows[i];
+    }
+  }
+  as->row_count = kept;
+
+  size_t count = 0;
+  uint32_t *entries = collect_entries(as, &count);
+  size_t capacity = count;
+  // Without a function entry at 0 the code there belongs to "<main>"
+  if ((NULL != entries || 0 == count) && (0 == count || entries[0] != 0)) {
+    if (grow(&entries, &capacity, count, sizeof(uint32_t))) {
+      memmove(entries + 1, entries, count * sizeof(uint32_t));
+      entries[0] = 0;
+      count++;
+    } else {
+      free(entries);
+      entries = NULL;
+    }
+  }
+  size_t block_count = (kept + DEBUG_BLOCK_ROWS - 1) / DEBUG_BLOCK_ROWS;
+  size_t file_count = as->include_count + 1;
+  const Label **names = calloc(count + 1, sizeof(Label *));
+  DebugFunction *functions = calloc(count + 1, sizeof(DebugFunction));
+  DebugLineBlock *blocks = calloc(block_count + 1, sizeof(DebugLineBlock));
+  DebugFile *files = calloc(file_count, sizeof(DebugFile));
+  // A row takes at most three ULEB128 numbers
+  uint8_t *lines = malloc(kept * 3 * LEB128_MAX_BYTES + 1);
+  if (NULL == entries || NULL == names || NULL == functions ||
+      NULL == blocks || NULL == files || NULL == lines) {
+    log_error("Failed to allocate memory for the debug section");
+    as->errors++;
+    free(entries);
+    free(names);
+    free(functions);
+    free(blocks);
+    free(files);
+    free(lines);
+    return;
+  }
+  name_functions(as, entries, count, names);
+
+  size_t lines_size = 0;
+  for (size_t i = 0; i < kept; i++) {
+    const LineRow *row = &as->rows[i];
+    if (i % DEBUG_BLOCK_ROWS == 0) {
+      blocks[i / DEBUG_BLOCK_ROWS] = (DebugLineBlock){
+          row->offset, (uint32_t)lines_size, row->line, row->file};
+    } else {
+      const LineRow *previous = row - 1;
+      lines_size += encode_row(row, previous->offset, previous->file,
+                               previous->line, lines + lines_size);
+    }
+  }
+  size_t strings_size = 0;
+  for (size_t i = 0; i < count; i++) {
+    functions[i] = (DebugFunction){entries[i], (uint32_t)strings_size, 0};
+    function_name(names[i], entries[i], &functions[i].name_length);
+    strings_size += functions[i].name_length;
+  }
+  for (size_t i = 0; i < file_count; i++) {
+    const char *name = 0 == i ? as->name : as->includes[i - 1].path;
+    files[i] = (DebugFile){(uint32_t)strings_size, (uint32_t)strlen(name)};
+    strings_size += files[i].name_length;
+  }
+
+  DebugInfoHeader header = {DEBUG_INFO_VERSION, 0, (uint32_t)count,
+                            (uint32_t)block_count, (uint32_t)file_count,
+                            (uint32_t)lines_size, (uint32_t)strings_size};
+  as->debug_size = sizeof(header) + count * sizeof(DebugFunction) +
+                   block_count * sizeof(DebugLineBlock) +
+                   file_count * sizeof(DebugFile) + lines_size + strings_size;
+  as->debug = malloc(as->debug_size);
+  if (NULL == as->debug) {
+    log_error("Failed to allocate %zu bytes for the debug section",
+              as->debug_size);
+    as->errors++;
+  } else {
+    uint8_t *out = as->debug;
+    memcpy(out, &header, sizeof(header));
+    out += sizeof(header);
+    memcpy(out, functions, count * sizeof(DebugFunction));
+    out += count * sizeof(DebugFunction);
+    memcpy(out, blocks, block_count * sizeof(DebugLineBlock));
+    out += block_count * sizeof(DebugLineBlock);
+    memcpy(out, files, file_count * sizeof(DebugFile));
+    out += file_count * sizeof(DebugFile);
+    memcpy(out, lines, lines_size);
+    out += lines_size;
+    for (size_t i = 0; i < count; i++) {
+      uint32_t length = 0;
+      const char *name = function_name(names[i], entries[i], &length);
+      memcpy(out, name, length);
+      out += length;
+    }
+    for (size_t i = 0; i < file_count; i++) {
+      memcpy(out, 0 == i ? as->name : as->includes[i - 1].path,
+             files[i].name_length);
+      out += files[i].name_length;
+    }
+  }
+  free(entries);
+  free(names);
+  free(functions);
+  free(blocks);
+  free(files);
+  free(lines);
+}
+
+/* Reads lines up to the end of the file being read. */
+static void read_lines(Assembler *as) {
+  while (as->cursor < as->end) {
+    assemble_line(as);
+    next_line(as);
+  }
+}
+
+/* Frees what one pass built beyond the code, labels and fixups. */
+static void release_pass(Assembler *as) {
+  for (size_t i = 0; i < as->include_count; i++) {
+    if (as->includes[i].size > 0) {
+      munmap((void *)as->includes[i].data, as->includes[i].size);
+    }
+    free(as->includes[i].path);
+  }
+  free(as->symbols);
+  free(as->names);
+  free(as->functions);
+  free(as->debug);
+  as->include_count = 0;
+  as->declared_count = 0;
+  as->relocation_count = 0;
+  as->symbols = NULL;
+  as->symbol_count = 0;
+  as->names = NULL;
+  as->names_size = 0;
+  as->functions = NULL;
+  as->function_count = 0;
+  as->debug = NULL;
+  as->debug_size = 0;
+}
+
+/* Reads the whole source once, from the top. */
+static void run_pass(Assembler *as) {
+  release_pass(as);
+  as->cursor = as->source;
+  as->line = 1;
+  as->file = 0;
+  as->errors = 0;
+  as->code_size = 0;
+  as->label_count = 0;
+  as->fixup_count = 0;
+  as->removed = 0;
+  as->numeric_targets = false;
+  as->window_count = 0;
+  as->defined = 0;
+  as->row_count = 0;
+  memset(as->labels, 0, as->label_capacity * sizeof(Label));
+  read_lines(as);
+  build_symbols(as);
+  resolve_fixups(as);
+  if (as->errors == 0 && as->symbol_count > 0) {
+    build_functions(as);
+  }
+  if (as->errors == 0 && as->debug_info && as->code_size > 0) {
+    build_debug(as);
+  }
+}
+
+/* Assembles a whole source in one forward pass over it. */
+static ErrorCode assemble(Assembler *as) {
+  // Roughly a byte of code for every four of source
+  size_t estimate = (size_t)(as->end - as->source) / 4;
+  as->code_capacity = estimate > 64 ? estimate : 64;
+  as->label_capacity = MIN_LABEL_CAPACITY;
+  as->fixup_capacity = 64;
+  as->code = malloc(as->code_capacity);
+  as->labels = calloc(as->label_capacity, sizeof(Label));
+  as->fixups = malloc(as->fixup_capacity * sizeof(Fixup));
+  if (NULL == as->code || NULL == as->labels || NULL == as->fixups) {
+    log_error("Failed to allocate memory for the assembler");
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  run_pass(as);
+  // Peephole rules move code, so an offset written as a number could end up
+  // pointing somewhere else
+  if (as->errors == 0 && as->numeric_targets && as->removed > 0) {
+    log_warn("%s: a jump or call names a code offset, so the peephole rules "
+             "are off",
+             as->name);
+    as->peephole = 0;
+    run_pass(as);
+  }
+
+  if (as->errors == 0 && as->code_size == 0) {
+    report(as, as->line, "no instructions");
+  }
+  if (as->errors > ASSEMBLER_MAX_REPORTED_ERRORS) {
+    log_error("%s: %zu more errors", as->name,
+              as->errors - ASSEMBLER_MAX_REPORTED_ERRORS);
+  }
+  return as->errors == 0 ? SUCCESS : ERR_INVALID_FORMAT;
+}
+
+ErrorCode assemble_image(const char *source, size_t size, const char *name,
+                         AssemblerOptions *options, BytecodeImage *image) {
+  if ((NULL == source && size > 0) || NULL == image) {
+    log_error("Source or image is NULL");
+    return ERR_NULL_POINTER;
+  }
+  pthread_once(&mnemonics_once, init_mnemonics);
+
+  Assembler as;
+  memset(&as, 0, sizeof(as));
+  as.name = NULL == name ? "<source>" : name;
+  as.source = source;
+  as.end = NULL == source ? NULL : source + size;
+  as.peephole = NULL == options ? PEEPHOLE_ALL : options->peephole;
+  as.debug_info = NULL != options && options->debug_info;
+  ErrorCode status = assemble(&as);
+  if (NULL != options) {
+    options->removed = as.removed;
+    for (size_t i = 0; NULL != options->on_include && i < as.include_count;
+         i++) {
+      options->on_include(options->context, as.includes[i].path,
+                          as.includes[i].data, as.includes[i].size);
+    }
+  }
+  memset(image, 0, sizeof(*image));
+  if (status == SUCCESS) {
+    image->version = BYTECODE_VERSION;
+    image->code = as.code;
+    image->code_size = as.code_size;
+    image->functions = as.functions;
+    image->function_count = as.function_count;
+    image->symbols = as.symbols;
+    image->symbol_count = as.symbol_count;
+    image->relocations = as.relocations;
+    image->relocation_count = as.relocation_count;
+    image->names = as.names;
+    image->names_size = as.names_size;
+    image->debug = as.debug;
+    image->debug_size = as.debug_size;
+    as.code = NULL;
+    as.functions = NULL;
+    as.symbols = NULL;
+    as.relocations = NULL;
+    as.names = NULL;
+    as.debug = NULL;
+  }
+  release_pass(&as);
+  free(as.code);
+  free(as.relocations);
+  free(as.labels);
+  free(as.fixups);
+  free(as.includes);
+  free(as.declared);
+  free(as.rows);
+  return status;
+}
+
+void free_assembled_image(BytecodeImage *image) {
+  if (NULL == image) {
+    return;
+  }
+  free((void *)image->code);
+  free((void *)image->functions);
+  free((void *)image->symbols);
+  free((void *)image->relocations);
+  free((void *)image->names);
+  free((void *)image->debug);
+  memset(image, 0, sizeof(*image));
+}
+
+ErrorCode assemble_code(const char *source, size_t size, const char *name,
+                        AssemblerOptions *options, uint8_t **code,
+                        size_t *code_size) {
+  if (NULL == code || NULL == code_size) {
+    log_error("Code or code size is NULL");
+    return ERR_NULL_POINTER;
+  }
+  BytecodeImage image;
+  ErrorCode status = assemble_image(source, size, name, options, &image);
+  if (status != SUCCESS) {
+    return status;
+  }
+  if (image.symbol_count > 0) {
+    log_error("%s declares symbols, which plain code cannot hold",
+              NULL == name ? "<source>" : name);
+    free_assembled_image(&image);
+    return ERR_INVALID_OPERAND;
+  }
+  *code = (uint8_t *)image.code;
+  *code_size = image.code_size;
+  return SUCCESS;
+}
+
+ErrorCode assemble_program(const char *source, size_t size, const char *name,
+                           AssemblerOptions *options, Program **program) {
+  if (NULL == program) {
+    log_error("Program is NULL");
+    return ERR_NULL_POINTER;
+  }
+  BytecodeImage image;
+  ErrorCode status = assemble_image(source, size, name, options, &image);
+  if (status != SUCCESS) {
+    return status;
+  }
+  if (image.relocation_count > 0) {
+    log_error("%s calls an import with CALL, which only link_bytecode "
+              "resolves; use CALLX to call another module",
+              NULL == name ? "<source>" : name);
+    status = ERR_INVALID_OPERAND;
+  } else {
+    status = create_program_from_image(&image, program);
+  }
+  free_assembled_image(&image);
+  return status;
+}
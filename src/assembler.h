@@ -0,0 +1,116 @@
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include "errno.h"
+#include "loader.h"
+#include "program.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define ASSEMBLER_MAX_REPORTED_ERRORS 20 // Errors logged per source
+
+// Peephole rules, applied to each instruction as it is emitted
+#define PEEPHOLE_IDENTITIES 0x1 // Drop pairs that do nothing, as "dup; pop"
+#define PEEPHOLE_STRENGTH 0x2   // Turn "push 1; add|sub" into "inc|dec"
+#define PEEPHOLE_JUMPS 0x4      // Drop jumps to the next instruction
+#define PEEPHOLE_ALL (PEEPHOLE_IDENTITIES | PEEPHOLE_STRENGTH | PEEPHOLE_JUMPS)
+
+typedef struct {
+  uint32_t peephole; // PEEPHOLE_* rules to apply; 0 turns them all off
+  size_t removed;    // Set to the number of instructions the rules removed
+  bool debug_info;   // Give assemble_image a debug section, for
+                     // find_source_location
+  // Called once assembly ends for each file .include read, with its path
+  // and contents; may be NULL
+  void (*on_include)(void *context, const char *path, const char *data,
+                     size_t size);
+  void *context; // Passed to on_include
+} AssemblerOptions;
+
+/* Assembles NanoASM source text (see assembler/Syntax.md) held in memory
+ * into a bytecode image, as assemble_code describes. A source may also
+ * pull in other files with `.include "path"`, relative to the directory of
+ * the file that includes them, and declare symbols:
+ *  - `.export name` lists a label in the symbol table so other modules
+ *    can call it
+ *  - `.import name` names a function of another module; "callx name" calls
+ *    it through the symbol table at run time, and "call name" leaves a
+ *    relocation for link_bytecode to patch
+ * A source that declares symbols also gets a function table whose entries
+ * are its exports and CALL targets, each running to the next, so the image
+ * can be written out with write_bytecode as an object file that
+ * link_bytecode links, or attached to a VM as a module.
+ * With debug_info set the image also gets a debug section (see
+ * bytecode_format.h) mapping code back to source: a row per instruction
+ * that starts a new line, and a function for offset 0 and for each entry
+ * above, named by the first label defined there. The peephole rules keep
+ * it accurate: what they emit in place of a pair takes the first one's
+ * line. link_bytecode and compact_bytecode drop the section.
+ * Parameters:
+ *   source - Source text; need not be NUL-terminated
+ *   size - Length of the source in bytes
+ *   name - Name of the source in error messages and the path includes
+ *          start from, or NULL
+ *   options - As for assemble_code, plus the on_include callback; NULL
+ *             applies PEEPHOLE_ALL
+ *   image - Receives the image, with code at offset 0 as its entry point.
+ *           Its sections are newly allocated and released with
+ *           free_assembled_image
+ * Returns:
+ *   ErrorCode indicating success or type of failure; ERR_INVALID_FORMAT
+ *   if the source has errors
+ */
+ErrorCode assemble_image(const char *source, size_t size, const char *name,
+                         AssemblerOptions *options, BytecodeImage *image);
+
+/* Frees the sections allocated by assemble_image. */
+void free_assembled_image(BytecodeImage *image);
+
+/* Assembles NanoASM source text (see assembler/Syntax.md) held in memory.
+ * The source is read once, front to back. Jumps and calls to labels defined
+ * further down are patched once it has all been read, and instructions with
+ * a 32-bit operand are padded with NOPs so the operand is 4-byte aligned.
+ * Each error is logged as "name:line: error: ..." and assembly carries on,
+ * so one call reports up to ASSEMBLER_MAX_REPORTED_ERRORS of them.
+ * Peephole rules rewrite short sequences as they are emitted: "push 0; add",
+ * "push k; pop", "dup; pop" and "swap; swap" go, "push 1; add" becomes
+ * "inc" (and "sub", "dec"), and a jump to the very next instruction goes
+ * (a conditional one becomes "pop"). A label stops them, since the code
+ * after it may be reached from elsewhere. If the source jumps to or calls a
+ * numeric code offset, which moving code would break, the source is
+ * assembled again without them.
+ * Parameters:
+ *   source - Source text; need not be NUL-terminated
+ *   size - Length of the source in bytes
+ *   name - Name of the source in error messages, or NULL
+ *   options - Peephole rules to apply, and where to report what they
+ *             removed; NULL applies PEEPHOLE_ALL
+ *   code - Receives the code, which starts at offset 0, allocated with
+ *          malloc; the caller frees it
+ *   code_size - Receives the size of the code in bytes
+ * Returns:
+ *   ErrorCode indicating success or type of failure; ERR_INVALID_FORMAT
+ *   if the source has errors, ERR_INVALID_OPERAND if it declares symbols,
+ *   which only assemble_image keeps
+ */
+ErrorCode assemble_code(const char *source, size_t size, const char *name,
+                        AssemblerOptions *options, uint8_t **code,
+                        size_t *code_size);
+
+/* Assembles source text as assemble_image does, straight into a verified
+ * program that VMs can attach, as the main program or as a module. Only
+ * .include touches the filesystem.
+ * Parameters:
+ *   source - Source text; need not be NUL-terminated
+ *   size - Length of the source in bytes
+ *   name - Name of the source in error messages, or NULL
+ *   options - As for assemble_code; NULL applies PEEPHOLE_ALL
+ *   program - Receives the new program with a reference count of 1
+ * Returns:
+ *   ErrorCode indicating success or type of failure; ERR_INVALID_OPERAND
+ *   if the source calls an import with CALL, which needs linking
+ */
+ErrorCode assemble_program(const char *source, size_t size, const char *name,
+                           AssemblerOptions *options, Program **program);
+
+#endif // ASSEMBLER_H
@@ -0,0 +1,544 @@
+#define _GNU_SOURCE // struct statx
+#include "bulk.h"
+#include "bytecode_format.h"
+#include "log.h"
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define BULK_DEFAULT_DEPTH 64
+#define BULK_MIN_THREADS 4
+#define BULK_ENTER_RETRIES 3
+
+// What a completion belongs to, kept in the low bits of its user_data
+enum { BULK_OPEN, BULK_STATX, BULK_READ, BULK_CLOSE, BULK_OP_BITS = 2 };
+
+/* Rejects sizes that cannot be a bytecode file, as map_bytecode does. */
+static ErrorCode check_file_size(const char *filename, size_t size) {
+  if (size < BYTECODE_HEADER_SIZE) {
+    log_error("Bytecode file size is too small: %s (%zu bytes)", filename,
+              size);
+    return ERR_INVALID_FORMAT;
+  }
+  if (size > MAX_BYTECODE_SIZE) {
+    log_error("Bytecode file size is too large: %s (%zu bytes)", filename,
+              size);
+    return ERR_FILE_TOO_LARGE;
+  }
+  return SUCCESS;
+}
+
+/* Minimal io_uring over the raw system calls: one submission and one
+ * completion ring, shared with the kernel through mmap.
+ */
+typedef struct {
+  int fd;
+  unsigned entries;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sq_local_tail; // Prepared entries not yet published
+  unsigned to_submit;     // Published entries not yet submitted
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+} Ring;
+
+static void ring_free(Ring *ring) {
+  if (NULL != ring->sqes) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (NULL != ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  if (NULL != ring->sq_ring) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+  if (ring->fd >= 0) {
+    close(ring->fd);
+  }
+}
+
+static void *map_ring(int fd, size_t size, off_t offset) {
+  void *ring = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, offset);
+  return MAP_FAILED == ring ? NULL : ring;
+}
+
+static ErrorCode ring_init(Ring *ring, unsigned entries) {
+  struct io_uring_params params;
+  memset(ring, 0, sizeof(*ring));
+  memset(&params, 0, sizeof(params));
+  ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0) {
+    log_info("io_uring is not available");
+    return ERR_UNKNOWN;
+  }
+
+  ring->sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && ring->cq_ring_size > ring->sq_ring_size) {
+    ring->sq_ring_size = ring->cq_ring_size;
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_ring = map_ring(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+  ring->cq_ring = single ? ring->sq_ring
+                         : map_ring(ring->fd, ring->cq_ring_size,
+                                    IORING_OFF_CQ_RING);
+  ring->sqes = map_ring(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+  if (NULL == ring->sq_ring || NULL == ring->cq_ring || NULL == ring->sqes) {
+    ring_free(ring);
+    log_error("Failed to map the io_uring rings");
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  uint8_t *sq = ring->sq_ring;
+  uint8_t *cq = ring->cq_ring;
+  ring->entries = params.sq_entries;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->sq_local_tail = *ring->sq_tail;
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return SUCCESS;
+}
+
+/* Returns a cleared submission entry, or NULL if the ring is full. */
+static struct io_uring_sqe *ring_get_sqe(Ring *ring) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->sq_local_tail - head >= ring->entries) {
+    return NULL;
+  }
+  unsigned index = ring->sq_local_tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  ring->sq_local_tail++;
+  ring->to_submit++;
+  return sqe;
+}
+
+/* Publishes prepared entries, submits them and waits for `wait` events. */
+static ErrorCode ring_enter(Ring *ring, unsigned wait) {
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+  for (int attempt = 0; attempt < BULK_ENTER_RETRIES; attempt++) {
+    long submitted =
+        syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait,
+                wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (submitted >= 0) {
+      ring->to_submit -= (unsigned)submitted;
+      return SUCCESS;
+    }
+  }
+  log_error("io_uring_enter failed");
+  return ERR_FILE_READ;
+}
+
+/* Per-file state while it moves through open/statx, read and close. */
+typedef struct {
+  int fd;            // Descriptor once the open completes, or -1
+  int pending;       // Of the open and statx, how many are outstanding
+  struct statx info; // Filled in by the statx
+  uint8_t *buffer;   // Whole file, once its size is known
+  size_t size;       // Size of the file
+  size_t done;       // Bytes read so far
+  ErrorCode status;  // First failure for this file
+} BulkFile;
+
+typedef struct {
+  Ring ring;
+  const char *const *filenames;
+  Program **programs;
+  ErrorCode *statuses;
+  BulkFile *files;
+  ErrorCode status; // Set once the ring itself fails, stopping the batch
+} UringBatch;
+
+static void prepare(struct io_uring_sqe *sqe, uint8_t opcode, size_t index,
+                    int op) {
+  sqe->opcode = opcode;
+  sqe->user_data = ((uint64_t)index << BULK_OP_BITS) | (uint64_t)op;
+}
+
+/* Returns a submission entry for the batch. A full ring, which entries
+ * left queued by a partial io_uring_enter can cause, is flushed first; if
+ * that fails the batch is stopped and NULL is returned.
+ */
+static struct io_uring_sqe *batch_get_sqe(UringBatch *batch) {
+  struct io_uring_sqe *sqe = ring_get_sqe(&batch->ring);
+  for (int attempt = 0; NULL == sqe && attempt < BULK_ENTER_RETRIES;
+       attempt++) {
+    if (ring_enter(&batch->ring, 0) != SUCCESS) {
+      break;
+    }
+    sqe = ring_get_sqe(&batch->ring);
+  }
+  if (NULL == sqe) {
+    log_error("The io_uring submission queue stays full");
+    batch->status = ERR_FILE_READ;
+  }
+  return sqe;
+}
+
+static void submit_read(UringBatch *batch, size_t index) {
+  BulkFile *file = &batch->files[index];
+  struct io_uring_sqe *sqe = batch_get_sqe(batch);
+  if (NULL == sqe) {
+    return;
+  }
+  prepare(sqe, IORING_OP_READ, index, BULK_READ);
+  sqe->fd = file->fd;
+  sqe->addr = (uint64_t)(uintptr_t)(file->buffer + file->done);
+  sqe->len = (uint32_t)(file->size - file->done);
+  sqe->off = file->done;
+}
+
+static void submit_close(UringBatch *batch, size_t index) {
+  struct io_uring_sqe *sqe = batch_get_sqe(batch);
+  if (NULL == sqe) {
+    return;
+  }
+  prepare(sqe, IORING_OP_CLOSE, index, BULK_CLOSE);
+  sqe->fd = batch->files[index].fd;
+}
+
+/* Starts a file: its open and its statx go out together. */
+static void submit_open(UringBatch *batch, size_t index) {
+  BulkFile *file = &batch->files[index];
+  const char *filename = batch->filenames[index];
+  file->fd = -1;
+  file->pending = 2;
+  file->status = SUCCESS;
+
+  struct io_uring_sqe *sqe = batch_get_sqe(batch);
+  if (NULL == sqe) {
+    return;
+  }
+  prepare(sqe, IORING_OP_OPENAT, index, BULK_OPEN);
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uint64_t)(uintptr_t)filename;
+  sqe->open_flags = O_RDONLY | O_CLOEXEC;
+
+  sqe = batch_get_sqe(batch);
+  if (NULL == sqe) {
+    return;
+  }
+  prepare(sqe, IORING_OP_STATX, index, BULK_STATX);
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uint64_t)(uintptr_t)filename;
+  sqe->len = STATX_SIZE;
+  sqe->off = (uint64_t)(uintptr_t)&file->info;
+}
+
+/* Handles one completion. Returns true when the file is finished. */
+static bool complete(UringBatch *batch, size_t index, int op, int32_t res) {
+  BulkFile *file = &batch->files[index];
+  const char *filename = batch->filenames[index];
+  switch (op) {
+  case BULK_OPEN:
+  case BULK_STATX:
+    if (res < 0 && file->status == SUCCESS) {
+      log_error("Failed to open bytecode file: %s", filename);
+      file->status = ERR_FILE_NOT_FOUND;
+    }
+    if (op == BULK_OPEN && res >= 0) {
+      file->fd = res;
+    }
+    if (--file->pending > 0) {
+      return false;
+    }
+    if (file->status == SUCCESS) {
+      file->size = (size_t)file->info.stx_size;
+      file->status = check_file_size(filename, file->size);
+    }
+    if (file->status == SUCCESS &&
+        NULL == (file->buffer = malloc(file->size))) {
+      log_error("Failed to allocate memory for bytecode file: %s", filename);
+      file->status = ERR_OUT_OF_MEMORY;
+    }
+    break;
+  case BULK_READ:
+    if (res <= 0) {
+      log_error("Failed to read bytecode file: %s", filename);
+      file->status = res < 0 ? ERR_FILE_READ : ERR_INVALID_FORMAT;
+      break;
+    }
+    file->done += (size_t)res;
+    if (file->done < file->size) {
+      submit_read(batch, index); // Short read; ask for the rest
+      return false;
+    }
+    // Parsed and verified now, while other files are still being read
+    file->status =
+        create_program_from_buffer(file->buffer, file->size,
+                                   &batch->programs[index]);
+    file->buffer = NULL;
+    break;
+  case BULK_CLOSE:
+    batch->statuses[index] = file->status;
+    return true;
+  }
+
+  if (file->status == SUCCESS && file->done < file->size) {
+    submit_read(batch, index);
+    return false;
+  }
+  free(file->buffer);
+  file->buffer = NULL;
+  if (file->fd >= 0) {
+    submit_close(batch, index);
+    return false;
+  }
+  batch->statuses[index] = file->status;
+  return true;
+}
+
+/* Returns ERR_UNKNOWN, whatever the reason, if the ring cannot be set up,
+ * so that BULK_AUTO falls back to threads.
+ */
+static ErrorCode load_with_uring(const char *const *filenames, size_t count,
+                                 unsigned depth, Program **programs,
+                                 ErrorCode *statuses) {
+  UringBatch batch;
+  // Each file in flight has at most two operations outstanding
+  if (ring_init(&batch.ring, depth * 2) != SUCCESS) {
+    return ERR_UNKNOWN;
+  }
+  batch.files = calloc(count, sizeof(BulkFile));
+  if (NULL == batch.files) {
+    ring_free(&batch.ring);
+    log_error("Failed to allocate memory for the bulk load");
+    return ERR_OUT_OF_MEMORY;
+  }
+  batch.filenames = filenames;
+  batch.programs = programs;
+  batch.statuses = statuses;
+  batch.status = SUCCESS;
+
+  size_t next = 0;
+  size_t active = 0;
+  size_t finished = 0;
+  while (finished < count) {
+    while (batch.status == SUCCESS && active < depth && next < count) {
+      submit_open(&batch, next++);
+      active++;
+    }
+    if (batch.status == SUCCESS) {
+      batch.status = ring_enter(&batch.ring, 1);
+    }
+    if (batch.status != SUCCESS) {
+      // In-flight buffers may still be written by the kernel, so they are
+      // left alone rather than freed
+      for (size_t i = 0; i < count; i++) {
+        if (NULL == programs[i]) {
+          statuses[i] = ERR_FILE_READ;
+        }
+      }
+      break;
+    }
+
+    unsigned head = *batch.ring.cq_head;
+    unsigned tail = __atomic_load_n(batch.ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      const struct io_uring_cqe *cqe =
+          &batch.ring.cqes[head & *batch.ring.cq_mask];
+      size_t index = (size_t)(cqe->user_data >> BULK_OP_BITS);
+      int op = (int)(cqe->user_data & ((1u << BULK_OP_BITS) - 1));
+      if (complete(&batch, index, op, cqe->res)) {
+        active--;
+        finished++;
+      }
+    }
+    __atomic_store_n(batch.ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  if (batch.status == SUCCESS) {
+    free(batch.files);
+  }
+  ring_free(&batch.ring);
+  return batch.status;
+}
+
+bool bulk_io_uring_available(void) {
+  Ring ring;
+  if (ring_init(&ring, 2) != SUCCESS) {
+    return false;
+  }
+  ring_free(&ring);
+  return true;
+}
+
+/* Reads a whole file with blocking calls into a buffer of its size. */
+static ErrorCode read_whole_file(const char *filename, uint8_t **buffer,
+                                 size_t *size) {
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    log_error("Failed to open bytecode file: %s", filename);
+    return ERR_FILE_NOT_FOUND;
+  }
+  struct stat info;
+  ErrorCode status = SUCCESS;
+  if (fstat(fd, &info) != 0) {
+    log_error("Failed to stat bytecode file: %s", filename);
+    status = ERR_FILE_READ;
+  } else {
+    *size = (size_t)info.st_size;
+    status = check_file_size(filename, *size);
+  }
+  if (status == SUCCESS && NULL == (*buffer = malloc(*size))) {
+    log_error("Failed to allocate memory for bytecode file: %s", filename);
+    status = ERR_OUT_OF_MEMORY;
+  }
+
+  for (size_t done = 0; status == SUCCESS && done < *size;) {
+    ssize_t count = pread(fd, *buffer + done, *size - done, (off_t)done);
+    if (count <= 0) {
+      log_error("Failed to read bytecode file: %s", filename);
+      status = count < 0 ? ERR_FILE_READ : ERR_INVALID_FORMAT;
+      free(*buffer);
+      *buffer = NULL;
+      break;
+    }
+    done += (size_t)count;
+  }
+  close(fd);
+  return status;
+}
+
+typedef struct {
+  const char *const *filenames;
+  size_t count;
+  Program **programs;
+  ErrorCode *statuses;
+  atomic_size_t next; // Next file a worker should take
+} ThreadBatch;
+
+static void *load_worker(void *arg) {
+  ThreadBatch *batch = arg;
+  for (;;) {
+    size_t index =
+        atomic_fetch_add_explicit(&batch->next, 1, memory_order_relaxed);
+    if (index >= batch->count) {
+      return NULL;
+    }
+    uint8_t *buffer = NULL;
+    size_t size = 0;
+    ErrorCode status =
+        read_whole_file(batch->filenames[index], &buffer, &size);
+    if (status == SUCCESS) {
+      status = create_program_from_buffer(buffer, size,
+                                          &batch->programs[index]);
+    }
+    batch->statuses[index] = status;
+  }
+}
+
+static ErrorCode load_with_threads(const char *const *filenames,
+                                   size_t count, unsigned threads,
+                                   Program **programs, ErrorCode *statuses) {
+  ThreadBatch batch = {.filenames = filenames,
+                       .count = count,
+                       .programs = programs,
+                       .statuses = statuses};
+  atomic_init(&batch.next, 0);
+
+  pthread_t *workers = calloc(threads, sizeof(pthread_t));
+  if (NULL == workers) {
+    log_error("Failed to allocate memory for the bulk load threads");
+    return ERR_OUT_OF_MEMORY;
+  }
+  unsigned started = 0;
+  while (started < threads &&
+         pthread_create(&workers[started], NULL, load_worker, &batch) == 0) {
+    started++;
+  }
+  if (started == 0) {
+    load_worker(&batch); // No threads to be had; do the work here
+  }
+  for (unsigned i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+  return SUCCESS;
+}
+
+ErrorCode open_programs_bulk(const char *const *filenames, size_t count,
+                             const BulkLoadOptions *options,
+                             Program **programs, ErrorCode *statuses) {
+  if ((NULL == filenames || NULL == programs) && count > 0) {
+    log_error("Bulk load filenames or programs are NULL");
+    return ERR_NULL_POINTER;
+  }
+  if (0 == count) {
+    return SUCCESS;
+  }
+
+  BulkLoadOptions settings = {BULK_AUTO, 0, 0};
+  if (NULL != options) {
+    settings = *options;
+  }
+  if (0 == settings.depth) {
+    settings.depth = BULK_DEFAULT_DEPTH;
+  }
+  if (0 == settings.threads) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    settings.threads = cpus > BULK_MIN_THREADS ? (unsigned)cpus
+                                               : BULK_MIN_THREADS;
+  }
+  if (settings.threads > count) {
+    settings.threads = (unsigned)count;
+  }
+
+  ErrorCode *results = statuses;
+  if (NULL == results && NULL == (results = malloc(count * sizeof(*results)))) {
+    log_error("Failed to allocate memory for bulk load results");
+    return ERR_OUT_OF_MEMORY;
+  }
+  for (size_t i = 0; i < count; i++) {
+    programs[i] = NULL;
+    results[i] = ERR_UNKNOWN;
+  }
+
+  ErrorCode status = ERR_UNKNOWN;
+  if (settings.backend != BULK_THREADS) {
+    status = load_with_uring(filenames, count, settings.depth, programs,
+                             results);
+  }
+  if (status == ERR_UNKNOWN && settings.backend != BULK_IO_URING) {
+    status = load_with_threads(filenames, count, settings.threads, programs,
+                               results);
+  }
+  for (size_t i = 0; i < count && status == SUCCESS; i++) {
+    status = results[i];
+  }
+
+  if (results != statuses) {
+    free(results);
+  }
+  log_info("Bulk load of %zu files finished with status %d", count, status);
+  return status;
+}
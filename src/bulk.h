@@ -0,0 +1,45 @@
+#ifndef BULK_H
+#define BULK_H
+
+#include "errno.h"
+#include "program.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum {
+  BULK_AUTO,     // io_uring when the kernel allows it, threads otherwise
+  BULK_IO_URING, // Opens, statx calls and reads all go through io_uring
+  BULK_THREADS,  // A pool of threads doing blocking open/fstat/read
+} BulkBackend;
+
+typedef struct {
+  BulkBackend backend; // Which machinery to use
+  unsigned depth;      // Files in flight at once; 0 for the default
+  unsigned threads;    // Worker threads for BULK_THREADS; 0 for the default
+} BulkLoadOptions;
+
+/* Opens many bytecode files as verified programs at once. With io_uring,
+ * the open and statx of every file in flight are submitted together, each
+ * file is then read whole into a buffer of its size, and it is parsed and
+ * verified as soon as its read completes while other reads are still in
+ * progress. Without io_uring (or with BULK_THREADS) a pool of threads does
+ * the same with blocking calls. Each program runs from its file buffer, as
+ * create_program_from_buffer does.
+ * Parameters:
+ *   filenames - Paths of the files to open
+ *   count - Number of files
+ *   options - Backend and concurrency; may be NULL for the defaults
+ *   programs - Receives a program per file, or NULL where it failed
+ *   statuses - Receives the result per file; may be NULL
+ * Returns:
+ *   SUCCESS if every file was opened, otherwise the first failure (by
+ *   position in filenames), or the error that stopped the whole batch
+ */
+ErrorCode open_programs_bulk(const char *const *filenames, size_t count,
+                             const BulkLoadOptions *options,
+                             Program **programs, ErrorCode *statuses);
+
+/* Returns true if this kernel lets the process use io_uring. */
+bool bulk_io_uring_available(void);
+
+#endif // BULK_H
@@ -0,0 +1,445 @@
+#include "bundle.h"
+#include "crc32c.h"
+#include "log.h"
+#include "verify.h"
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+static uint32_t hash_name(const char *name, size_t length) {
+  uint32_t hash = FNV_OFFSET_BASIS;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (uint8_t)name[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+static size_t align_member(size_t offset) {
+  return (offset + BUNDLE_MEMBER_ALIGNMENT - 1) &
+         ~(size_t)(BUNDLE_MEMBER_ALIGNMENT - 1);
+}
+
+/* Index order: by hash, and by name between names with the same hash. */
+static int compare_key(uint32_t hash, const char *name, uint32_t other_hash,
+                       const char *other_name) {
+  if (hash != other_hash) {
+    return hash < other_hash ? -1 : 1;
+  }
+  return strcmp(name, other_name);
+}
+
+/* Checks one index entry against the names block and the file. */
+static ErrorCode check_entry(const BundleEntry *entry, uint32_t index,
+                             const BundleHeader *header, const char *names,
+                             size_t size) {
+  if (entry->name_offset >= header->names_size ||
+      entry->name_length >= header->names_size - entry->name_offset ||
+      names[entry->name_offset + entry->name_length] != '\0' ||
+      NULL != memchr(names + entry->name_offset, '\0', entry->name_length)) {
+    log_error("Bundle entry %u has an invalid name", index);
+    return ERR_INVALID_FORMAT;
+  }
+  if (entry->name_hash !=
+      hash_name(names + entry->name_offset, entry->name_length)) {
+    log_error("Bundle entry %u has the wrong name hash", index);
+    return ERR_INVALID_FORMAT;
+  }
+  if (entry->offset % BUNDLE_MEMBER_ALIGNMENT != 0 ||
+      entry->offset < BUNDLE_HEADER_SIZE || entry->offset > size ||
+      entry->size > size - entry->offset ||
+      entry->size < BYTECODE_HEADER_SIZE) {
+    log_error("Bundle member %u out of bounds: offset %u, size %u", index,
+              entry->offset, entry->size);
+    return ERR_INVALID_FORMAT;
+  }
+  return SUCCESS;
+}
+
+/* Checks the header, the checksum of the index and names, and every entry,
+ * including that the index is sorted, so that lookups can trust it.
+ */
+static ErrorCode check_bundle(const uint8_t *data, size_t size) {
+  BundleHeader header;
+  if (size < BUNDLE_HEADER_SIZE) {
+    log_error("Bundle too small to contain a header: %zu bytes", size);
+    return ERR_INVALID_FORMAT;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, BUNDLE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != BUNDLE_VERSION || header.flags != 0 ||
+      header.reserved != 0) {
+    log_error("Not a supported bundle: version 0x%04X, flags 0x%04X",
+              header.version, header.flags);
+    return ERR_INVALID_FORMAT;
+  }
+
+  size_t index_size = (size_t)header.entry_count * sizeof(BundleEntry);
+  if (header.index_offset % sizeof(uint32_t) != 0 ||
+      header.index_offset < BUNDLE_HEADER_SIZE ||
+      header.index_offset > size || index_size > size - header.index_offset ||
+      header.names_offset > size ||
+      header.names_size > size - header.names_offset ||
+      (header.entry_count > 0 &&
+       (header.names_size == 0 ||
+        data[header.names_offset + header.names_size - 1] != '\0'))) {
+    log_error("Bundle index or names out of bounds");
+    return ERR_INVALID_FORMAT;
+  }
+
+  uint32_t checksum = crc32c(0, data + header.index_offset, index_size);
+  checksum = crc32c(checksum, data + header.names_offset, header.names_size);
+  if (checksum != header.checksum) {
+    log_error("Bundle index checksum mismatch: 0x%08X, expected 0x%08X",
+              checksum, header.checksum);
+    return ERR_CHECKSUM_MISMATCH;
+  }
+
+  const BundleEntry *entries =
+      (const BundleEntry *)(data + header.index_offset);
+  const char *names = (const char *)data + header.names_offset;
+  for (uint32_t i = 0; i < header.entry_count; i++) {
+    ErrorCode status = check_entry(&entries[i], i, &header, names, size);
+    if (status != SUCCESS) {
+      return status;
+    }
+    if (i > 0 && compare_key(entries[i - 1].name_hash,
+                             names + entries[i - 1].name_offset,
+                             entries[i].name_hash,
+                             names + entries[i].name_offset) >= 0) {
+      log_error("Bundle index is unsorted or has duplicates at entry %u", i);
+      return ERR_INVALID_FORMAT;
+    }
+  }
+  return SUCCESS;
+}
+
+ErrorCode open_bundle(const char *filename, Bundle **bundle) {
+  if (NULL == filename || NULL == bundle) {
+    log_error("Bundle filename or output pointer is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    log_error("Failed to open bundle: %s", filename);
+    return ERR_FILE_NOT_FOUND;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    log_error("Failed to stat bundle: %s", filename);
+    return ERR_FILE_READ;
+  }
+  size_t size = (size_t)info.st_size;
+  if (size < BUNDLE_HEADER_SIZE || size > UINT32_MAX) {
+    close(fd);
+    log_error("Invalid bundle size: %zu bytes", size);
+    return size < BUNDLE_HEADER_SIZE ? ERR_INVALID_FORMAT
+                                     : ERR_FILE_TOO_LARGE;
+  }
+
+  uint8_t *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (MAP_FAILED == mapping) {
+    log_error("Failed to map bundle: %s", filename);
+    return ERR_FILE_READ;
+  }
+
+  ErrorCode status = check_bundle(mapping, size);
+  Bundle *created = NULL;
+  if (status == SUCCESS && NULL == (created = malloc(sizeof(Bundle)))) {
+    log_error("Failed to allocate memory for bundle");
+    status = ERR_OUT_OF_MEMORY;
+  }
+  if (status != SUCCESS) {
+    munmap(mapping, size);
+    return status;
+  }
+
+  const BundleHeader *header = (const BundleHeader *)mapping;
+  created->entries = (const BundleEntry *)(mapping + header->index_offset);
+  created->entry_count = header->entry_count;
+  created->names = (const char *)mapping + header->names_offset;
+  created->mapping = mapping;
+  created->mapping_size = size;
+  atomic_init(&created->refcount, 1);
+
+  *bundle = created;
+  log_info("Bundle '%s' opened (%zu programs)", filename,
+           created->entry_count);
+  return SUCCESS;
+}
+
+Bundle *retain_bundle(Bundle *bundle) {
+  if (NULL != bundle) {
+    atomic_fetch_add_explicit(&bundle->refcount, 1, memory_order_relaxed);
+  }
+  return bundle;
+}
+
+void release_bundle(Bundle *bundle) {
+  if (NULL == bundle) {
+    return;
+  }
+  if (atomic_fetch_sub_explicit(&bundle->refcount, 1,
+                                memory_order_acq_rel) != 1) {
+    return;
+  }
+  munmap(bundle->mapping, bundle->mapping_size);
+  free(bundle);
+  log_info("Bundle released");
+}
+
+/* Binary search of the index; NULL if there is no such member. */
+static const BundleEntry *lookup(const Bundle *bundle, const char *name) {
+  uint32_t hash = hash_name(name, strlen(name));
+  size_t low = 0;
+  size_t high = bundle->entry_count;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    const BundleEntry *entry = &bundle->entries[middle];
+    int order = compare_key(hash, name, entry->name_hash,
+                            bundle->names + entry->name_offset);
+    if (order == 0) {
+      return entry;
+    }
+    if (order < 0) {
+      high = middle;
+    } else {
+      low = middle + 1;
+    }
+  }
+  return NULL;
+}
+
+ErrorCode find_bundle_member(const Bundle *bundle, const char *name,
+                             const uint8_t **data, size_t *size) {
+  if (NULL == bundle || NULL == name || NULL == data || NULL == size) {
+    log_error("Bundle, name or output pointer is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+  const BundleEntry *entry = lookup(bundle, name);
+  if (NULL == entry) {
+    log_error("Bundle has no program named '%s'", name);
+    return ERR_FILE_NOT_FOUND;
+  }
+  *data = (const uint8_t *)bundle->mapping + entry->offset;
+  *size = entry->size;
+  return SUCCESS;
+}
+
+ErrorCode open_bundle_program(Bundle *bundle, const char *name,
+                              Program **program) {
+  if (NULL == program) {
+    log_error("Program output pointer is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+  if (NULL == bundle || NULL == name) {
+    log_error("Bundle or program name is NULL");
+    return ERR_NULL_POINTER;
+  }
+  const BundleEntry *entry = lookup(bundle, name);
+  if (NULL == entry) {
+    log_error("Bundle has no program named '%s'", name);
+    return ERR_FILE_NOT_FOUND;
+  }
+
+  const uint8_t *data = (const uint8_t *)bundle->mapping + entry->offset;
+  uint32_t checksum = crc32c(0, data, entry->size);
+  if (checksum != entry->checksum) {
+    log_error("Bundle member '%s' checksum mismatch: 0x%08X, expected "
+              "0x%08X",
+              name, checksum, entry->checksum);
+    return ERR_CHECKSUM_MISMATCH;
+  }
+
+  BytecodeImage image;
+  ErrorCode status = parse_bytecode(data, entry->size, &image);
+  if (status == SUCCESS && image.compressed_code_size != 0) {
+    return create_program_from_image(&image, program);
+  }
+  if (status == SUCCESS) {
+    status = verify_code(&image);
+  }
+  if (status != SUCCESS) {
+    log_error("Bundle member '%s' failed verification", name);
+    return status;
+  }
+
+  Program *created = malloc(sizeof(Program));
+  if (NULL == created) {
+    log_error("Failed to allocate memory for program");
+    return ERR_OUT_OF_MEMORY;
+  }
+  created->image = image;
+  created->backing = PROGRAM_BUNDLE;
+  created->mapping = retain_bundle(bundle);
+  created->mapping_size = 0;
+  created->verified = NULL;
+  atomic_init(&created->refcount, 1);
+
+  *program = created;
+  log_info("Program '%s' opened from bundle (%zu bytes of code)", name,
+           image.code_size);
+  return SUCCESS;
+}
+
+/* A member and its name hash, sorted into index order by the writer. */
+typedef struct {
+  const BundleMember *member;
+  uint32_t hash;
+} SortedMember;
+
+static int compare_members(const void *left, const void *right) {
+  const SortedMember *a = left;
+  const SortedMember *b = right;
+  return compare_key(a->hash, a->member->name, b->hash, b->member->name);
+}
+
+/* Lays out a bundle in memory: header, index, names, then the members. */
+static ErrorCode build_bundle(const SortedMember *sorted, size_t count,
+                              uint8_t **buffer, size_t *size) {
+  size_t index_offset = BUNDLE_HEADER_SIZE;
+  size_t names_offset = index_offset + count * sizeof(BundleEntry);
+  size_t names_size = 0;
+  for (size_t i = 0; i < count; i++) {
+    names_size += strlen(sorted[i].member->name) + 1;
+  }
+  size_t total = align_member(names_offset + names_size);
+  for (size_t i = 0; i < count; i++) {
+    total = align_member(total + sorted[i].member->size);
+  }
+  if (total > UINT32_MAX) {
+    log_error("Bundle would be too large: %zu bytes", total);
+    return ERR_FILE_TOO_LARGE;
+  }
+
+  uint8_t *out = calloc(1, total);
+  if (NULL == out) {
+    log_error("Failed to allocate memory for bundle");
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  size_t name_cursor = 0;
+  size_t member_cursor = align_member(names_offset + names_size);
+  for (size_t i = 0; i < count; i++) {
+    const BundleMember *member = sorted[i].member;
+    size_t length = strlen(member->name);
+    BundleEntry entry;
+    entry.name_hash = sorted[i].hash;
+    entry.name_offset = (uint32_t)name_cursor;
+    entry.name_length = (uint32_t)length;
+    entry.offset = (uint32_t)member_cursor;
+    entry.size = (uint32_t)member->size;
+    entry.checksum = crc32c(0, member->data, member->size);
+    memcpy(out + index_offset + i * sizeof(entry), &entry, sizeof(entry));
+    memcpy(out + names_offset + name_cursor, member->name, length + 1);
+    memcpy(out + member_cursor, member->data, member->size);
+    name_cursor += length + 1;
+    member_cursor = align_member(member_cursor + member->size);
+  }
+
+  BundleHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+  header.version = BUNDLE_VERSION;
+  header.entry_count = (uint32_t)count;
+  header.index_offset = (uint32_t)index_offset;
+  header.names_offset = (uint32_t)names_offset;
+  header.names_size = (uint32_t)names_size;
+  header.checksum = crc32c(0, out + index_offset, count * sizeof(BundleEntry));
+  header.checksum = crc32c(header.checksum, out + names_offset, names_size);
+  memcpy(out, &header, sizeof(header));
+
+  *buffer = out;
+  *size = total;
+  return SUCCESS;
+}
+
+ErrorCode write_bundle(const char *filename, const BundleMember *members,
+                       size_t count) {
+  if (NULL == filename || (NULL == members && count > 0)) {
+    log_error("Bundle filename or members are NULL");
+    return ERR_NULL_POINTER;
+  }
+  if (count > UINT32_MAX / sizeof(BundleEntry)) {
+    log_error("Too many bundle members: %zu", count);
+    return ERR_INVALID_OPERAND;
+  }
+
+  SortedMember *sorted = malloc((count > 0 ? count : 1) * sizeof(*sorted));
+  if (NULL == sorted) {
+    log_error("Failed to allocate memory for the bundle index");
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  ErrorCode status = SUCCESS;
+  for (size_t i = 0; i < count && status == SUCCESS; i++) {
+    const BundleMember *member = &members[i];
+    BytecodeImage image;
+    size_t length = NULL == member->name ? 0 : strlen(member->name);
+    if (length == 0 || length > BUNDLE_MAX_NAME_LENGTH) {
+      log_error("Bundle member %zu has an empty or too long name", i);
+      status = ERR_INVALID_OPERAND;
+    } else if (NULL == member->data ||
+               parse_bytecode(member->data, member->size, &image) !=
+                   SUCCESS) {
+      log_error("Bundle member '%s' is not a valid bytecode file",
+                member->name);
+      status = ERR_INVALID_FORMAT;
+    }
+    sorted[i].member = member;
+    sorted[i].hash = hash_name(member->name, length);
+  }
+  if (status == SUCCESS) {
+    qsort(sorted, count, sizeof(*sorted), compare_members);
+  }
+  for (size_t i = 1; i < count && status == SUCCESS; i++) {
+    if (compare_members(&sorted[i - 1], &sorted[i]) == 0) {
+      log_error("Duplicate bundle member name '%s'", sorted[i].member->name);
+      status = ERR_INVALID_OPERAND;
+    }
+  }
+
+  uint8_t *buffer = NULL;
+  size_t size = 0;
+  if (status == SUCCESS) {
+    status = build_bundle(sorted, count, &buffer, &size);
+  }
+  free(sorted);
+  if (status != SUCCESS) {
+    return status;
+  }
+
+  FILE *file = fopen(filename, "wb");
+  if (NULL == file) {
+    free(buffer);
+    log_error("Failed to create bundle: %s", filename);
+    return ERR_FILE_NOT_FOUND;
+  }
+  if (fwrite(buffer, 1, size, file) != size) {
+    status = ERR_FILE_WRITE;
+  }
+  if (fclose(file) != 0) {
+    status = ERR_FILE_WRITE;
+  }
+  free(buffer);
+  if (status != SUCCESS) {
+    log_error("Failed to write bundle: %s", filename);
+    return status;
+  }
+
+  log_info("Bundle written to '%s' (%zu programs, %zu bytes)", filename,
+           count, size);
+  return SUCCESS;
+}
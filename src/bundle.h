@@ -0,0 +1,86 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include "bytecode_format.h"
+#include "errno.h"
+#include "program.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bundle file mapped read-only. Lookups search the index in place; programs
+ * opened from the bundle run straight from the mapping and keep the bundle
+ * alive through its reference count.
+ */
+typedef struct {
+  const BundleEntry *entries; // Index, sorted by name_hash then name
+  size_t entry_count;         // Entries in the index
+  const char *names;          // Names block
+  atomic_size_t refcount;     // Owners: the opener plus every program
+  void *mapping;              // Start of the mapped file
+  size_t mapping_size;        // Length of the mapping
+} Bundle;
+
+/* One program to put in a bundle. */
+typedef struct {
+  const char *name;    // Name to look it up by; unique in the bundle
+  const uint8_t *data; // Whole bytecode file
+  size_t size;         // Size of the file in bytes
+} BundleMember;
+
+/* Maps a bundle and checks its header and index. The members themselves
+ * are only checked when they are opened.
+ * Parameters:
+ *   filename - Path to the bundle
+ *   bundle - Receives the bundle with a reference count of 1
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode open_bundle(const char *filename, Bundle **bundle);
+
+/* Adds a reference to a bundle and returns it. */
+Bundle *retain_bundle(Bundle *bundle);
+
+/* Drops a reference to a bundle, unmapping it when the last one goes. */
+void release_bundle(Bundle *bundle);
+
+/* Finds a member by name with a binary search of the index.
+ * Parameters:
+ *   bundle - Bundle to search
+ *   name - Name of the member
+ *   data - Receives the member's file inside the mapping
+ *   size - Receives the size of the member in bytes
+ * Returns:
+ *   ErrorCode indicating success or type of failure; ERR_FILE_NOT_FOUND
+ *   if the bundle has no such member
+ */
+ErrorCode find_bundle_member(const Bundle *bundle, const char *name,
+                             const uint8_t **data, size_t *size);
+
+/* Opens a member as a verified program. The member's checksum from the
+ * index is checked first. The program runs from the bundle's mapping and
+ * holds a reference to the bundle, unless its code is compressed, in which
+ * case it gets a heap copy as open_program does.
+ * Parameters:
+ *   bundle - Bundle holding the program
+ *   name - Name of the member
+ *   program - Receives the new program with a reference count of 1
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode open_bundle_program(Bundle *bundle, const char *name,
+                              Program **program);
+
+/* Writes a bundle. Every member must be a well-formed bytecode file; names
+ * must be unique and at most BUNDLE_MAX_NAME_LENGTH bytes long.
+ * Parameters:
+ *   filename - Path of the bundle to create or replace
+ *   members - Programs to include, in any order
+ *   count - Number of members
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode write_bundle(const char *filename, const BundleMember *members,
+                       size_t count);
+
+#endif // BUNDLE_H
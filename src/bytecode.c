@@ -2,7 +2,7 @@
 
 InstructionInfo instruction_set[] = {
     // Data
-    {"PUSH", 2, 1, {OPERAND_IMMEDIATE}},
+    {"PUSH", 5, 1, {OPERAND_IMMEDIATE}},
     {"POP", 1, 0, {OPERAND_NONE}},
     {"LOAD", 2, 1, {OPERAND_INDEX}},
     {"STORE", 2, 1, {OPERAND_INDEX}},
@@ -30,10 +30,10 @@ InstructionInfo instruction_set[] = {
     {"CMP_GTE", 1, 0, {OPERAND_NONE}},
 
     // Control Flow
-    {"JMP", 2, 1, {OPERAND_ADDRESS}},
-    {"JMPZ", 2, 1, {OPERAND_ADDRESS}},
-    {"JMPNZ", 2, 1, {OPERAND_ADDRESS}},
-    {"CALL", 2, 1, {OPERAND_ADDRESS}},
+    {"JMP", 5, 1, {OPERAND_ADDRESS}},
+    {"JMPZ", 5, 1, {OPERAND_ADDRESS}},
+    {"JMPNZ", 5, 1, {OPERAND_ADDRESS}},
+    {"CALL", 5, 1, {OPERAND_ADDRESS}},
     {"RET", 1, 0, {OPERAND_NONE}},
     {"NOP", 1, 0, {OPERAND_NONE}},
 
@@ -44,5 +44,45 @@ InstructionInfo instruction_set[] = {
     // Halt
     {"HALT", 1, 0, {OPERAND_NONE}},
 
+    // Constants and globals
+    {"PUSHK", 5, 1, {OPERAND_INDEX}},
+    {"GLOAD", 5, 1, {OPERAND_INDEX}},
+    {"GSTORE", 5, 1, {OPERAND_INDEX}},
+
+    // Compact forms
+    {"PUSH_0", 1, 0, {OPERAND_NONE}},
+    {"PUSH_1", 1, 0, {OPERAND_NONE}},
+    {"PUSH8", 2, 1, {OPERAND_IMMEDIATE}},
+    {"PUSH16", 3, 1, {OPERAND_IMMEDIATE}},
+    {"JMP8", 2, 1, {OPERAND_OFFSET}},
+    {"JMP16", 3, 1, {OPERAND_OFFSET}},
+    {"JMPZ8", 2, 1, {OPERAND_OFFSET}},
+    {"JMPZ16", 3, 1, {OPERAND_OFFSET}},
+    {"JMPNZ8", 2, 1, {OPERAND_OFFSET}},
+    {"JMPNZ16", 3, 1, {OPERAND_OFFSET}},
+    {"PUSHKV", 0, 1, {OPERAND_VARINT}},
+    {"GLOADV", 0, 1, {OPERAND_VARINT}},
+    {"GSTOREV", 0, 1, {OPERAND_VARINT}},
+
+    // Modules
+    {"CALLX", 5, 1, {OPERAND_INDEX}},
+
     // Sentinel to mark the end of the array
     {NULL, 0, 0, {OPERAND_NONE}}};
+
+_Static_assert(sizeof(instruction_set) / sizeof(instruction_set[0]) ==
+                   OP_COUNT + 1,
+               "instruction_set must describe every opcode");
+
+size_t instruction_length(const uint8_t *code, size_t available) {
+  if (available == 0 || code[0] >= OP_COUNT) {
+    return 0;
+  }
+  size_t length = instruction_set[code[0]].length;
+  if (length == 0) {
+    uint32_t value;
+    size_t operand = decode_uleb128(code + 1, available - 1, &value);
+    return operand == 0 ? 0 : 1 + operand;
+  }
+  return length <= available ? length : 0;
+}
@@ -0,0 +1,319 @@
+#include "cache.h"
+#include "compact.h"
+#include "log.h"
+#include "writer.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_HASH_MULTIPLIER 0xFF51AFD7ED558CCDull
+
+static uint64_t mix64(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= CACHE_HASH_MULTIPLIER;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+/* 64-bit hash of the source file, eight bytes per step. It only has to
+ * tell apart the files a user runs, not resist deliberate collisions.
+ */
+static uint64_t content_hash(const uint8_t *data, size_t size,
+                             uint64_t seed) {
+  uint64_t hash = mix64(seed ^ size);
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    hash = (hash ^ word) * CACHE_HASH_MULTIPLIER;
+    hash ^= hash >> 29;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, data + i, size - i);
+  return mix64(hash ^ tail);
+}
+
+ErrorCode program_cache_directory(const ProgramCacheOptions *options,
+                                  char *path, size_t size) {
+  if (NULL == path) {
+    log_error("Cache directory output is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+  int length;
+  const char *base;
+  if (NULL != options && NULL != options->directory) {
+    length = snprintf(path, size, "%s", options->directory);
+  } else if (NULL != (base = getenv(PROGRAM_CACHE_ENV)) && base[0] != '\0') {
+    length = snprintf(path, size, "%s", base);
+  } else if (NULL != (base = getenv("XDG_CACHE_HOME")) && base[0] != '\0') {
+    length = snprintf(path, size, "%s/nanovm", base);
+  } else if (NULL != (base = getenv("HOME")) && base[0] != '\0') {
+    length = snprintf(path, size, "%s/.cache/nanovm", base);
+  } else {
+    log_error("No cache directory configured and $HOME is not set");
+    return ERR_FILE_NOT_FOUND;
+  }
+
+  if (length < 0 || (size_t)length >= size) {
+    log_error("Cache directory path is too long");
+    return ERR_INVALID_OPERAND;
+  }
+  return SUCCESS;
+}
+
+/* Whether a cache directory can be trusted: anyone else who can write to it
+ * could plant an entry, and hits are run without being verified again.
+ */
+static bool private_directory(const struct stat *info) {
+  return info->st_uid == geteuid() &&
+         0 == (info->st_mode & (S_IWGRP | S_IWOTH));
+}
+
+/* Creates a directory and its missing parents, private to the user. An
+ * existing directory must already be private.
+ */
+static ErrorCode make_directories(const char *path) {
+  char partial[PATH_MAX];
+  size_t length = strlen(path);
+  if (length >= sizeof(partial)) {
+    log_error("Cache directory path is too long");
+    return ERR_INVALID_OPERAND;
+  }
+
+  memcpy(partial, path, length + 1);
+  for (size_t i = 1; i <= length; i++) {
+    if (partial[i] == '/' || partial[i] == '\0') {
+      char saved = partial[i];
+      partial[i] = '\0';
+      mkdir(partial, 0700); // Existing components are checked below
+      partial[i] = saved;
+    }
+  }
+
+  struct stat info;
+  if (stat(path, &info) != 0 || !S_ISDIR(info.st_mode)) {
+    log_error("Failed to create cache directory: %s", path);
+    return ERR_FILE_WRITE;
+  }
+  if (!private_directory(&info)) {
+    log_error("Cache directory '%s' is not private to this user", path);
+    return ERR_INVALID_OPERAND;
+  }
+  return SUCCESS;
+}
+
+/* Writes an entry under a temporary name and renames it into place, so
+ * that concurrent readers see either no entry or a complete one.
+ */
+static ErrorCode store_entry(const char *path, const BytecodeImage *image) {
+  uint8_t *buffer = NULL;
+  size_t size = 0;
+  ErrorCode status =
+      serialize_bytecode(image, 0, &vm_default_allocator, &buffer, &size);
+  if (status != SUCCESS) {
+    return status;
+  }
+
+  char temporary[PATH_MAX];
+  int length = snprintf(temporary, sizeof(temporary), "%s.%ld.tmp", path,
+                        (long)getpid());
+  int fd = -1;
+  if (length > 0 && (size_t)length < sizeof(temporary)) {
+    fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  }
+  if (fd < 0) {
+    free(buffer);
+    log_error("Failed to create cache entry: %s", path);
+    return ERR_FILE_WRITE;
+  }
+
+  size_t written = 0;
+  while (written < size) {
+    ssize_t count = write(fd, buffer + written, size - written);
+    if (count <= 0) {
+      break;
+    }
+    written += (size_t)count;
+  }
+  free(buffer);
+  if (close(fd) != 0 || written != size ||
+      rename(temporary, path) != 0) {
+    unlink(temporary);
+    log_error("Failed to write cache entry: %s", path);
+    return ERR_FILE_WRITE;
+  }
+  return SUCCESS;
+}
+
+/* Maps an entry and checks it is one the cache wrote: version 0.2,
+ * uncompressed and carrying a checksum that matches.
+ */
+static ErrorCode open_entry(const char *path, Program **program) {
+  MappedBytecode mapped;
+  ErrorCode status = map_bytecode(path, &mapped);
+  if (status != SUCCESS) {
+    return status;
+  }
+
+  const BytecodeHeaderV2 *header = mapped.mapping;
+  if (mapped.image.version != BYTECODE_VERSION ||
+      header->flags != BYTECODE_FLAG_CHECKSUM) {
+    log_error("Cache entry '%s' was not written by the cache", path);
+    unmap_bytecode(&mapped);
+    return ERR_INVALID_FORMAT;
+  }
+
+  status = create_program_from_mapping(&mapped, program);
+  if (status != SUCCESS) {
+    unmap_bytecode(&mapped);
+  }
+  return status;
+}
+
+/* Decodes and verifies the source, compacting it if asked, and stores the
+ * result when the entry path is known.
+ */
+static ErrorCode build_entry(const BytecodeImage *source,
+                             const ProgramCacheOptions *options,
+                             const char *directory, const char *path,
+                             Program **program) {
+  Program *decoded = NULL;
+  ErrorCode status = create_program_from_image(source, &decoded);
+  if (status != SUCCESS) {
+    return status;
+  }
+
+  bool compact = NULL != options && options->compact;
+  if (compact) {
+    BytecodeImage compacted;
+    status = compact_bytecode(&decoded->image, &compacted);
+    if (status == SUCCESS) {
+      Program *created = NULL;
+      status = create_program_from_image(&compacted, &created);
+      free_compacted_bytecode(&compacted);
+      release_program(decoded);
+      decoded = created;
+    } else {
+      release_program(decoded);
+      decoded = NULL;
+    }
+    if (status != SUCCESS) {
+      return status;
+    }
+  }
+
+  if (NULL != path && (compact || source->version == BYTECODE_VERSION) &&
+      (make_directories(directory) != SUCCESS ||
+       store_entry(path, &decoded->image) != SUCCESS)) {
+    log_warn("Program could not be cached; continuing without the cache");
+  }
+
+  *program = decoded;
+  return SUCCESS;
+}
+
+ErrorCode open_program_cached(const char *filename,
+                              const ProgramCacheOptions *options,
+                              Program **program) {
+  if (NULL == filename || NULL == program) {
+    log_error("Filename or program output pointer is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+  // A stream can only be read once, so it is never cached
+  if (0 == strcmp(filename, "-")) {
+    return open_program(filename, program);
+  }
+
+  MappedBytecode source;
+  ErrorCode status = map_bytecode(filename, &source);
+  if (status != SUCCESS) {
+    return status;
+  }
+
+  char directory[PATH_MAX];
+  char path[PATH_MAX];
+  const char *entry = NULL;
+  if (program_cache_directory(options, directory, sizeof(directory)) ==
+      SUCCESS) {
+    bool compact = NULL != options && options->compact;
+    uint64_t seed = ((uint64_t)PROGRAM_CACHE_VERSION << 32) |
+                    ((uint64_t)BYTECODE_VERSION << 8) | (compact ? 1 : 0);
+    uint64_t key =
+        content_hash(source.mapping, source.mapping_size, seed);
+    int length = snprintf(path, sizeof(path), "%s/%016llx%s", directory,
+                          (unsigned long long)key, PROGRAM_CACHE_SUFFIX);
+    if (length > 0 && (size_t)length < sizeof(path)) {
+      entry = path;
+    }
+  }
+
+  // A missing directory is created private to the user when storing
+  struct stat info;
+  if (NULL != entry && stat(directory, &info) == 0 &&
+      !private_directory(&info)) {
+    log_warn("Cache directory '%s' is writable by other users or not owned "
+             "by this one; continuing without the cache",
+             directory);
+    entry = NULL;
+  }
+
+  if (NULL != entry && access(entry, R_OK) == 0) {
+    status = open_entry(entry, program);
+    if (status == SUCCESS) {
+      unmap_bytecode(&source);
+      log_info("Program '%s' opened from cache entry '%s'", filename, entry);
+      return SUCCESS;
+    }
+    log_warn("Discarding damaged cache entry '%s'", entry);
+    unlink(entry);
+  }
+
+  status = build_entry(&source.image, options, directory, entry, program);
+  unmap_bytecode(&source);
+  if (status != SUCCESS) {
+    log_error("Program '%s' failed decoding or verification", filename);
+  }
+  return status;
+}
+
+ErrorCode clear_program_cache(const ProgramCacheOptions *options) {
+  char directory[PATH_MAX];
+  ErrorCode status =
+      program_cache_directory(options, directory, sizeof(directory));
+  if (status != SUCCESS) {
+    return status;
+  }
+
+  DIR *dir = opendir(directory);
+  if (NULL == dir) {
+    log_debug("Cache directory '%s' does not exist", directory);
+    return SUCCESS;
+  }
+
+  size_t suffix_length = strlen(PROGRAM_CACHE_SUFFIX);
+  struct dirent *item;
+  while (NULL != (item = readdir(dir))) {
+    size_t length = strlen(item->d_name);
+    if (length <= suffix_length ||
+        strcmp(item->d_name + length - suffix_length,
+               PROGRAM_CACHE_SUFFIX) != 0) {
+      continue;
+    }
+    char path[PATH_MAX];
+    int written =
+        snprintf(path, sizeof(path), "%s/%s", directory, item->d_name);
+    if (written > 0 && (size_t)written < sizeof(path) && unlink(path) != 0) {
+      status = ERR_FILE_WRITE;
+      log_error("Failed to remove cache entry: %s", path);
+    }
+  }
+  closedir(dir);
+  return status;
+}
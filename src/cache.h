@@ -0,0 +1,70 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "errno.h"
+#include "program.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/* On-disk cache of decoded, verified program images. An entry is an
+ * uncompressed version 0.2 file named after a hash of the source file's
+ * contents, the cache options and PROGRAM_CACHE_VERSION, so a changed
+ * source, a different option set or a new engine simply misses. A hit maps
+ * the entry and runs it in place: the source is not decompressed or
+ * verified again, only the entry's checksum is checked. So the directory
+ * must be owned by the user and not writable by group or others; if it is
+ * not, the cache is not used.
+ */
+
+/* Bump when the engine changes how it decodes or verifies code, so that
+ * entries written by an older engine are never used.
+ */
+#define PROGRAM_CACHE_VERSION 1
+#define PROGRAM_CACHE_SUFFIX ".nvc"
+#define PROGRAM_CACHE_ENV "NANOVM_CACHE_DIR"
+
+typedef struct {
+  const char *directory; // NULL: see program_cache_directory
+  bool compact;          // Cache the compact_bytecode form of the code
+} ProgramCacheOptions;
+
+/* Resolves the cache directory: options->directory if set, otherwise
+ * $NANOVM_CACHE_DIR, $XDG_CACHE_HOME/nanovm or $HOME/.cache/nanovm.
+ * Parameters:
+ *   options - Cache options; may be NULL
+ *   path - Receives the directory
+ *   size - Size of path in bytes
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode program_cache_directory(const ProgramCacheOptions *options,
+                                  char *path, size_t size);
+
+/* Opens a program through the cache. On a miss the source is decoded and
+ * verified as open_program would, and the result is stored for next time;
+ * failing to store it only logs a warning. A damaged entry is deleted and
+ * rebuilt. Version 0.1 files are not cached unless options->compact is set,
+ * since their code is not laid out for mapping. A cache directory that is
+ * not private to the user is neither read nor written; the program is
+ * opened as open_program would.
+ * Parameters:
+ *   filename - Path to the bytecode file
+ *   options - Cache options; may be NULL
+ *   program - Receives the new program with a reference count of 1
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode open_program_cached(const char *filename,
+                              const ProgramCacheOptions *options,
+                              Program **program);
+
+/* Deletes every entry in the cache directory. Programs opened from the
+ * cache stay valid, since they hold their own mapping.
+ * Parameters:
+ *   options - Cache options; may be NULL
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode clear_program_cache(const ProgramCacheOptions *options);
+
+#endif // CACHE_H
@@ -0,0 +1,395 @@
+#include "compact.h"
+#include "bytecode.h"
+#include "bytecode_format.h"
+#include "log.h"
+#include "verify.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum {
+  KIND_VERBATIM, // Copied unchanged
+  KIND_PUSH,     // Immediate, in the shortest PUSH form that holds it
+  KIND_JUMP,     // Relative when the target is in reach, absolute otherwise
+  KIND_CALL,     // Always an absolute 32-bit target
+  KIND_INDEX,    // LEB128 constant or global index
+} InstructionKind;
+
+typedef struct {
+  uint8_t kind;     // InstructionKind
+  uint8_t opcode;   // Opcode to emit; the absolute form for jumps
+  uint8_t size;     // Encoded size, not counting padding
+  uint8_t padding;  // NOPs in front that align a 32-bit operand
+  uint32_t operand; // Value or index; target instruction for jumps and calls
+  uint32_t source;  // Offset in the original code
+  uint32_t offset;  // Offset in the compacted code
+} CompactInstruction;
+
+static inline uint32_t read_u32(const uint8_t *operand) {
+  uint32_t value;
+  memcpy(&value, operand, sizeof(uint32_t));
+  return value;
+}
+
+static inline int16_t read_i16(const uint8_t *operand) {
+  int16_t value;
+  memcpy(&value, operand, sizeof(int16_t));
+  return value;
+}
+
+static uint8_t push_size(int32_t value) {
+  if (value == 0 || value == 1) {
+    return 1;
+  }
+  if (value >= INT8_MIN && value <= INT8_MAX) {
+    return 2;
+  }
+  if (value >= INT16_MIN && value <= INT16_MAX) {
+    return 3;
+  }
+  return 5;
+}
+
+static uint8_t jump_size(int64_t displacement) {
+  if (displacement >= INT8_MIN && displacement <= INT8_MAX) {
+    return 2;
+  }
+  if (displacement >= INT16_MIN && displacement <= INT16_MAX) {
+    return 3;
+  }
+  return 5;
+}
+
+/* Maps an absolute jump opcode to its relative form of the given size. */
+static uint8_t relative_jump(uint8_t opcode, uint8_t size) {
+  switch (opcode) {
+  case OP_JMP:
+    return size == 2 ? OP_JMP8 : OP_JMP16;
+  case OP_JMPZ:
+    return size == 2 ? OP_JMPZ8 : OP_JMPZ16;
+  default:
+    return size == 2 ? OP_JMPNZ8 : OP_JMPNZ16;
+  }
+}
+
+static bool has_wide_operand(const CompactInstruction *insn) {
+  return insn->kind == KIND_CALL ||
+         ((insn->kind == KIND_PUSH || insn->kind == KIND_JUMP) &&
+          insn->size == 5);
+}
+
+/* Decodes verified code into a list of instructions, dropping NOP padding.
+ * index_of maps every original instruction offset to the instruction that
+ * now starts there (the next one, for a dropped NOP).
+ */
+static size_t decode_instructions(const BytecodeImage *image,
+                                  CompactInstruction *insns,
+                                  uint32_t *index_of) {
+  const uint8_t *code = image->code;
+  size_t count = 0;
+  for (size_t ip = 0; ip < image->code_size;) {
+    uint8_t opcode = code[ip];
+    size_t length = instruction_length(code + ip, image->code_size - ip);
+    index_of[ip] = (uint32_t)count;
+    // A trailing NOP is kept so that every target maps to an instruction
+    if (opcode == OP_NOP && ip + length < image->code_size) {
+      ip += length;
+      continue;
+    }
+
+    CompactInstruction *insn = &insns[count++];
+    memset(insn, 0, sizeof(*insn));
+    insn->source = (uint32_t)ip;
+    insn->opcode = opcode;
+    switch (opcode) {
+    case OP_PUSH:
+      insn->kind = KIND_PUSH;
+      insn->operand = read_u32(code + ip + 1);
+      break;
+    case OP_PUSH_0:
+    case OP_PUSH_1:
+      insn->kind = KIND_PUSH;
+      insn->operand = opcode == OP_PUSH_1;
+      break;
+    case OP_PUSH8:
+      insn->kind = KIND_PUSH;
+      insn->operand = (uint32_t)(int32_t)(int8_t)code[ip + 1];
+      break;
+    case OP_PUSH16:
+      insn->kind = KIND_PUSH;
+      insn->operand = (uint32_t)(int32_t)read_i16(code + ip + 1);
+      break;
+    case OP_JMP:
+    case OP_JMPZ:
+    case OP_JMPNZ:
+      insn->kind = KIND_JUMP;
+      insn->operand = read_u32(code + ip + 1);
+      break;
+    case OP_JMP8:
+    case OP_JMPZ8:
+    case OP_JMPNZ8:
+      insn->kind = KIND_JUMP;
+      insn->opcode = opcode == OP_JMP8    ? OP_JMP
+                     : opcode == OP_JMPZ8 ? OP_JMPZ
+                                          : OP_JMPNZ;
+      insn->operand = (uint32_t)(ip + (int8_t)code[ip + 1]);
+      break;
+    case OP_JMP16:
+    case OP_JMPZ16:
+    case OP_JMPNZ16:
+      insn->kind = KIND_JUMP;
+      insn->opcode = opcode == OP_JMP16    ? OP_JMP
+                     : opcode == OP_JMPZ16 ? OP_JMPZ
+                                           : OP_JMPNZ;
+      insn->operand = (uint32_t)(ip + read_i16(code + ip + 1));
+      break;
+    case OP_CALL:
+      insn->kind = KIND_CALL;
+      insn->operand = read_u32(code + ip + 1);
+      break;
+    case OP_PUSHK:
+    case OP_GLOAD:
+    case OP_GSTORE:
+      insn->kind = KIND_INDEX;
+      insn->opcode = opcode == OP_PUSHK   ? OP_PUSHKV
+                     : opcode == OP_GLOAD ? OP_GLOADV
+                                          : OP_GSTOREV;
+      insn->operand = read_u32(code + ip + 1);
+      break;
+    case OP_PUSHKV:
+    case OP_GLOADV:
+    case OP_GSTOREV:
+      insn->kind = KIND_INDEX;
+      decode_uleb128(code + ip + 1, length - 1, &insn->operand);
+      break;
+    default:
+      insn->kind = KIND_VERBATIM;
+      insn->size = (uint8_t)length;
+      break;
+    }
+    ip += length;
+  }
+  return count;
+}
+
+/* Picks a size for every instruction and lays them out. Jumps start in
+ * their 8-bit form and only ever grow, so this settles after a few passes.
+ * Returns the size of the compacted code.
+ */
+static size_t layout_instructions(CompactInstruction *insns, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    CompactInstruction *insn = &insns[i];
+    switch (insn->kind) {
+    case KIND_PUSH:
+      insn->size = push_size((int32_t)insn->operand);
+      break;
+    case KIND_JUMP:
+      insn->size = 2;
+      break;
+    case KIND_CALL:
+      insn->size = 5;
+      break;
+    case KIND_INDEX:
+      insn->size = (uint8_t)(1 + uleb128_size(insn->operand));
+      break;
+    default:
+      break;
+    }
+  }
+
+  size_t offset;
+  bool changed;
+  do {
+    offset = 0;
+    for (size_t i = 0; i < count; i++) {
+      CompactInstruction *insn = &insns[i];
+      insn->padding = 0;
+      if (has_wide_operand(insn)) {
+        size_t misalignment = (offset + 1) % BYTECODE_OPERAND_ALIGNMENT;
+        if (misalignment != 0) {
+          insn->padding =
+              (uint8_t)(BYTECODE_OPERAND_ALIGNMENT - misalignment);
+        }
+      }
+      insn->offset = (uint32_t)(offset + insn->padding);
+      offset = insn->offset + insn->size;
+    }
+
+    changed = false;
+    for (size_t i = 0; i < count; i++) {
+      CompactInstruction *insn = &insns[i];
+      if (insn->kind != KIND_JUMP) {
+        continue;
+      }
+      int64_t displacement =
+          (int64_t)insns[insn->operand].offset - insn->offset;
+      uint8_t size = jump_size(displacement);
+      if (size > insn->size) {
+        insn->size = size;
+        changed = true;
+      }
+    }
+  } while (changed);
+  return offset;
+}
+
+static void emit_instructions(const BytecodeImage *image,
+                              const CompactInstruction *insns, size_t count,
+                              uint8_t *out) {
+  size_t position = 0;
+  for (size_t i = 0; i < count; i++) {
+    const CompactInstruction *insn = &insns[i];
+    memset(out + position, OP_NOP, insn->padding);
+    uint8_t *p = out + insn->offset;
+    position = insn->offset + insn->size;
+
+    switch (insn->kind) {
+    case KIND_PUSH: {
+      int32_t value = (int32_t)insn->operand;
+      if (insn->size == 1) {
+        p[0] = value == 0 ? OP_PUSH_0 : OP_PUSH_1;
+      } else if (insn->size == 2) {
+        p[0] = OP_PUSH8;
+        p[1] = (uint8_t)(int8_t)value;
+      } else if (insn->size == 3) {
+        int16_t narrow = (int16_t)value;
+        p[0] = OP_PUSH16;
+        memcpy(p + 1, &narrow, sizeof(narrow));
+      } else {
+        p[0] = OP_PUSH;
+        memcpy(p + 1, &insn->operand, sizeof(uint32_t));
+      }
+      break;
+    }
+    case KIND_JUMP: {
+      uint32_t target = insns[insn->operand].offset;
+      if (insn->size == 5) {
+        p[0] = insn->opcode;
+        memcpy(p + 1, &target, sizeof(target));
+        break;
+      }
+      int64_t displacement = (int64_t)target - insn->offset;
+      p[0] = relative_jump(insn->opcode, insn->size);
+      if (insn->size == 2) {
+        p[1] = (uint8_t)(int8_t)displacement;
+      } else {
+        int16_t narrow = (int16_t)displacement;
+        memcpy(p + 1, &narrow, sizeof(narrow));
+      }
+      break;
+    }
+    case KIND_CALL: {
+      uint32_t target = insns[insn->operand].offset;
+      p[0] = OP_CALL;
+      memcpy(p + 1, &target, sizeof(target));
+      break;
+    }
+    case KIND_INDEX:
+      p[0] = insn->opcode;
+      encode_uleb128(insn->operand, p + 1);
+      break;
+    default:
+      memcpy(p, image->code + insn->source, insn->size);
+      break;
+    }
+  }
+}
+
+ErrorCode compact_bytecode(const BytecodeImage *image,
+                           BytecodeImage *compacted) {
+  if (NULL == image || NULL == compacted) {
+    log_error("Bytecode image or output is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+  // Symbols and relocations name code offsets compaction would move
+  if (image->symbol_count > 0 || image->relocation_count > 0) {
+    log_error("Link a module before compacting it");
+    return ERR_INVALID_OPERAND;
+  }
+
+  ErrorCode status = verify_code(image);
+  if (status != SUCCESS) {
+    return status;
+  }
+
+  CompactInstruction *insns = malloc(image->code_size * sizeof(*insns));
+  uint32_t *index_of = malloc(image->code_size * sizeof(uint32_t));
+  BytecodeFunction *functions = NULL;
+  uint8_t *code = NULL;
+  if (NULL == insns || NULL == index_of) {
+    log_error("Failed to allocate memory for compaction");
+    status = ERR_OUT_OF_MEMORY;
+    goto CLEANUP;
+  }
+
+  size_t count = decode_instructions(image, insns, index_of);
+  for (size_t i = 0; i < count; i++) {
+    if (insns[i].kind == KIND_JUMP || insns[i].kind == KIND_CALL) {
+      insns[i].operand = index_of[insns[i].operand];
+    }
+  }
+
+  size_t code_size = layout_instructions(insns, count);
+  if (code_size > MAX_BYTECODE_SIZE) {
+    log_error("Compacted code would be too large: %zu bytes", code_size);
+    status = ERR_FILE_TOO_LARGE;
+    goto CLEANUP;
+  }
+
+  code = malloc(code_size);
+  if (image->function_count > 0) {
+    functions = malloc(image->function_count * sizeof(BytecodeFunction));
+  }
+  if (NULL == code || (image->function_count > 0 && NULL == functions)) {
+    log_error("Failed to allocate memory for compacted code");
+    status = ERR_OUT_OF_MEMORY;
+    goto CLEANUP;
+  }
+  emit_instructions(image, insns, count, code);
+
+  // Each function runs up to where the next instruction's padding starts
+  for (size_t i = 0; i < image->function_count; i++) {
+    const BytecodeFunction *source = &image->functions[i];
+    size_t end = (size_t)source->entry + source->size;
+    const CompactInstruction *last =
+        end < image->code_size ? &insns[index_of[end]] : NULL;
+    functions[i] = *source;
+    functions[i].entry = insns[index_of[source->entry]].offset;
+    functions[i].size =
+        (NULL == last ? (uint32_t)code_size : last->offset - last->padding) -
+        functions[i].entry;
+  }
+
+  *compacted = *image;
+  compacted->version = BYTECODE_VERSION;
+  compacted->entry_point = insns[index_of[image->entry_point]].offset;
+  compacted->code = code;
+  compacted->code_size = code_size;
+  compacted->functions = functions;
+  compacted->debug = NULL;
+  compacted->debug_size = 0;
+  log_info("Compacted code from %zu to %zu bytes", image->code_size,
+           code_size);
+  code = NULL;
+  functions = NULL;
+
+CLEANUP:
+  free(code);
+  free(functions);
+  free(index_of);
+  free(insns);
+  return status;
+}
+
+void free_compacted_bytecode(BytecodeImage *compacted) {
+  if (NULL == compacted) {
+    return;
+  }
+  free((void *)compacted->code);
+  free((void *)compacted->functions);
+  compacted->code = NULL;
+  compacted->code_size = 0;
+  compacted->functions = NULL;
+  compacted->function_count = 0;
+}
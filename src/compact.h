@@ -0,0 +1,33 @@
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include "errno.h"
+#include "loader.h"
+
+/* Re-encodes the code section of an image using the shortest form of every
+ * instruction:
+ *  - PUSH becomes PUSH_0, PUSH_1, PUSH8 or PUSH16 when the value fits
+ *  - JMP, JMPZ and JMPNZ become 8- or 16-bit relative jumps when the target
+ *    is close enough
+ *  - constant and global indices become LEB128 (PUSHKV, GLOADV, GSTOREV)
+ *  - NOP padding is dropped, and re-inserted only where a 32-bit operand
+ *    still needs aligning
+ * Jump and call targets, the entry point and the function table are
+ * rewritten to match. The debug section is dropped, since the code offsets
+ * it refers to no longer apply. Compacting compact code is a no-op.
+ * Parameters:
+ *   image - Image to compact; it is verified first
+ *   compacted - Receives the compacted image. Its code and function table
+ *               are newly allocated and released with
+ *               free_compacted_bytecode; constants and globals still point
+ *               into `image`
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode compact_bytecode(const BytecodeImage *image,
+                           BytecodeImage *compacted);
+
+/* Frees the code and function table allocated by compact_bytecode. */
+void free_compacted_bytecode(BytecodeImage *compacted);
+
+#endif // COMPACT_H
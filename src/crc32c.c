@@ -0,0 +1,116 @@
+#include "crc32c.h"
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42_PATH 1
+#endif
+
+#define CRC32C_POLYNOMIAL 0x82F63B78u // Reflected Castagnoli polynomial
+
+typedef uint32_t (*Crc32cFn)(uint32_t crc, const uint8_t *p, size_t size);
+
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t crc32c_table[8][256];
+static Crc32cFn crc32c_update;
+
+static uint32_t update_portable(uint32_t crc, const uint8_t *p, size_t size) {
+  while (size > 0 && ((uintptr_t)p & 7) != 0) {
+    crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    size--;
+  }
+  while (size >= 8) {
+    uint32_t low;
+    uint32_t high;
+    memcpy(&low, p, sizeof(low));
+    memcpy(&high, p + 4, sizeof(high));
+    low ^= crc;
+    crc = crc32c_table[7][low & 0xFF] ^ crc32c_table[6][(low >> 8) & 0xFF] ^
+          crc32c_table[5][(low >> 16) & 0xFF] ^ crc32c_table[4][low >> 24] ^
+          crc32c_table[3][high & 0xFF] ^
+          crc32c_table[2][(high >> 8) & 0xFF] ^
+          crc32c_table[1][(high >> 16) & 0xFF] ^ crc32c_table[0][high >> 24];
+    p += 8;
+    size -= 8;
+  }
+  while (size > 0) {
+    crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    size--;
+  }
+  return crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42_PATH
+__attribute__((target("sse4.2"))) static uint32_t
+update_sse42(uint32_t crc, const uint8_t *p, size_t size) {
+  while (size > 0 && ((uintptr_t)p & 7) != 0) {
+    crc = _mm_crc32_u8(crc, *p++);
+    size--;
+  }
+#ifdef __x86_64__
+  uint64_t crc64 = crc;
+  while (size >= 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+    p += 8;
+    size -= 8;
+  }
+  crc = (uint32_t)crc64;
+#endif
+  while (size >= 4) {
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    crc = _mm_crc32_u32(crc, word);
+    p += 4;
+    size -= 4;
+  }
+  while (size > 0) {
+    crc = _mm_crc32_u8(crc, *p++);
+    size--;
+  }
+  return crc;
+}
+#endif
+
+/* Builds the slicing tables and picks the implementation once. */
+static void crc32c_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (CRC32C_POLYNOMIAL & (0u - (crc & 1)));
+    }
+    crc32c_table[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; i++) {
+    for (int slice = 1; slice < 8; slice++) {
+      uint32_t previous = crc32c_table[slice - 1][i];
+      crc32c_table[slice][i] =
+          (previous >> 8) ^ crc32c_table[0][previous & 0xFF];
+    }
+  }
+
+  crc32c_update = update_portable;
+#ifdef CRC32C_HAVE_SSE42_PATH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32c_update = update_sse42;
+  }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size) {
+  pthread_once(&crc32c_once, crc32c_init);
+  return ~crc32c_update(~crc, data, size);
+}
+
+uint32_t crc32c_portable(uint32_t crc, const void *data, size_t size) {
+  pthread_once(&crc32c_once, crc32c_init);
+  return ~update_portable(~crc, data, size);
+}
+
+bool crc32c_hardware(void) {
+  pthread_once(&crc32c_once, crc32c_init);
+  return crc32c_update != update_portable;
+}
@@ -0,0 +1,26 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32C (Castagnoli), as used for bytecode file checksums. Uses the SSE4.2
+ * crc32 instruction when the CPU has it and a slicing-by-8 table otherwise;
+ * both give the same result.
+ * Parameters:
+ *   crc - Checksum of the preceding data, or 0 to start
+ *   data - Bytes to add
+ *   size - Number of bytes
+ * Returns:
+ *   Checksum of everything passed so far
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+
+/* Table-driven crc32c, used when the CPU has no crc32 instruction. */
+uint32_t crc32c_portable(uint32_t crc, const void *data, size_t size);
+
+/* Returns true if crc32c runs on the hardware crc32 instruction. */
+bool crc32c_hardware(void);
+
+#endif // CRC32C_H
@@ -0,0 +1,194 @@
+#include "debuginfo.h"
+#include "bytecode.h"
+#include "bytecode_format.h"
+#include "log.h"
+#include <stdbool.h>
+#include <string.h>
+
+// Parts of a debug section, once its header has been checked
+typedef struct {
+  const uint8_t *functions;
+  uint32_t function_count;
+  const uint8_t *blocks;
+  uint32_t block_count;
+  const uint8_t *files;
+  uint32_t file_count;
+  const uint8_t *lines;
+  uint32_t lines_size;
+  const char *strings;
+  uint32_t strings_size;
+} DebugTables;
+
+/* Checks the header against the section size and locates the tables. */
+static ErrorCode open_tables(const BytecodeImage *image, DebugTables *tables) {
+  DebugInfoHeader header;
+  if (NULL == image->debug || image->debug_size < sizeof(header)) {
+    log_error("The image has no debug information");
+    return ERR_INVALID_OPERAND;
+  }
+  memcpy(&header, image->debug, sizeof(header));
+  size_t functions_size = (size_t)header.function_count * sizeof(DebugFunction);
+  size_t blocks_size = (size_t)header.block_count * sizeof(DebugLineBlock);
+  size_t files_size = (size_t)header.file_count * sizeof(DebugFile);
+  if (header.version != DEBUG_INFO_VERSION ||
+      sizeof(header) + functions_size + blocks_size + files_size +
+              header.lines_size + header.strings_size !=
+          image->debug_size) {
+    log_error("Debug section version %u of %zu bytes does not match its "
+              "header",
+              header.version, image->debug_size);
+    return ERR_INVALID_FORMAT;
+  }
+  tables->functions = image->debug + sizeof(header);
+  tables->function_count = header.function_count;
+  tables->blocks = tables->functions + functions_size;
+  tables->block_count = header.block_count;
+  tables->files = tables->blocks + blocks_size;
+  tables->file_count = header.file_count;
+  tables->lines = tables->files + files_size;
+  tables->lines_size = header.lines_size;
+  tables->strings = (const char *)tables->lines + header.lines_size;
+  tables->strings_size = header.strings_size;
+  return SUCCESS;
+}
+
+/* Binary searches a table sorted by the code offset each entry starts
+ * with. Returns how many entries start at or before `offset`.
+ */
+static size_t count_at_or_before(const uint8_t *table, size_t count,
+                                 size_t stride, uint32_t offset) {
+  size_t low = 0;
+  size_t high = count;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    uint32_t start;
+    memcpy(&start, table + mid * stride, sizeof(start));
+    if (start <= offset) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+static bool in_strings(const DebugTables *tables, uint32_t offset,
+                       uint32_t length) {
+  return offset <= tables->strings_size &&
+         length <= tables->strings_size - offset;
+}
+
+/* Decodes the rows that follow a block up to `offset`, leaving the line
+ * and file of the last row at or before it. Returns false if the rows are
+ * damaged.
+ */
+static bool decode_block(const DebugTables *tables, const uint8_t *rows,
+                         size_t size, uint32_t offset, uint32_t *address,
+                         uint32_t *line, uint32_t *file) {
+  size_t position = 0;
+  while (position < size) {
+    uint32_t step = 0;
+    uint32_t delta = 0;
+    uint32_t next_file = *file;
+    size_t used = decode_uleb128(rows + position, size - position, &step);
+    position += used;
+    if (used > 0 && (step & 1)) {
+      used = decode_uleb128(rows + position, size - position, &next_file);
+      position += used;
+    }
+    if (used > 0) {
+      used = decode_uleb128(rows + position, size - position, &delta);
+      position += used;
+    }
+    if (0 == used || next_file >= tables->file_count) {
+      return false;
+    }
+    *address += step >> 1;
+    if (*address > offset) {
+      break;
+    }
+    // Zigzag: even values are non-negative deltas, odd ones negative
+    *line += (delta >> 1) ^ (0u - (delta & 1));
+    *file = next_file;
+  }
+  return true;
+}
+
+/* Finds the source line of an offset, or line 0 if no row covers it. */
+static bool find_line(const DebugTables *tables, uint32_t offset,
+                      uint32_t *line, uint32_t *file) {
+  *line = 0;
+  *file = 0;
+  size_t block = count_at_or_before(tables->blocks, tables->block_count,
+                                    sizeof(DebugLineBlock), offset);
+  if (0 == block) {
+    return true;
+  }
+  DebugLineBlock first;
+  memcpy(&first, tables->blocks + (block - 1) * sizeof(first), sizeof(first));
+  uint32_t rows_end = tables->lines_size;
+  if (block < tables->block_count) {
+    DebugLineBlock next;
+    memcpy(&next, tables->blocks + block * sizeof(next), sizeof(next));
+    rows_end = next.lines_offset;
+  }
+  if (first.file >= tables->file_count || first.lines_offset > rows_end ||
+      rows_end > tables->lines_size) {
+    return false;
+  }
+  uint32_t address = first.offset;
+  *line = first.line;
+  *file = first.file;
+  return decode_block(tables, tables->lines + first.lines_offset,
+                      rows_end - first.lines_offset, offset, &address, line,
+                      file);
+}
+
+ErrorCode find_source_location(const BytecodeImage *image, uint32_t offset,
+                               SourceLocation *location) {
+  if (NULL == image || NULL == location) {
+    log_error("Image or location is NULL");
+    return ERR_NULL_POINTER;
+  }
+  DebugTables tables;
+  ErrorCode status = open_tables(image, &tables);
+  if (status != SUCCESS) {
+    return status;
+  }
+
+  size_t count = count_at_or_before(tables.functions, tables.function_count,
+                                    sizeof(DebugFunction), offset);
+  if (0 == count) {
+    log_error("No function in the debug information covers offset %u",
+              offset);
+    return ERR_INVALID_OPERAND;
+  }
+  DebugFunction function;
+  memcpy(&function, tables.functions + (count - 1) * sizeof(function),
+         sizeof(function));
+  uint32_t line = 0;
+  uint32_t file = 0;
+  if (!in_strings(&tables, function.name_offset, function.name_length) ||
+      !find_line(&tables, offset, &line, &file)) {
+    log_error("Debug information for offset %u is damaged", offset);
+    return ERR_INVALID_FORMAT;
+  }
+
+  location->function = tables.strings + function.name_offset;
+  location->function_length = function.name_length;
+  location->entry = function.entry;
+  location->file = NULL;
+  location->file_length = 0;
+  location->line = line;
+  if (line > 0) {
+    DebugFile source;
+    memcpy(&source, tables.files + file * sizeof(source), sizeof(source));
+    if (!in_strings(&tables, source.name_offset, source.name_length)) {
+      log_error("Debug information names a file outside its strings");
+      return ERR_INVALID_FORMAT;
+    }
+    location->file = tables.strings + source.name_offset;
+    location->file_length = source.name_length;
+  }
+  return SUCCESS;
+}
@@ -0,0 +1,38 @@
+#ifndef DEBUGINFO_H
+#define DEBUGINFO_H
+
+#include "errno.h"
+#include "loader.h"
+#include <stdint.h>
+
+// Where a code offset came from, with names pointing into the debug section
+typedef struct {
+  const char *function;     // Name of the function, not NUL-terminated
+  uint32_t function_length; // Length of the name
+  uint32_t entry;           // Code offset where the function starts
+  const char *file;         // Source file, not NUL-terminated; NULL if no
+                            // line row covers the offset
+  uint32_t file_length;     // Length of the file name
+  uint32_t line;            // Source line, or 0 if no line row covers it
+} SourceLocation;
+
+/* Maps a code offset back to the function and source line it was
+ * assembled from, through the image's debug section (see
+ * bytecode_format.h). Nothing loads or parses the section ahead of time:
+ * this reads its header, binary searches the function and block tables
+ * and decodes the rows of one block, so a mapped program's debug pages are
+ * only read once something asks, and the interpreter never touches them.
+ * Each part of the section is bounds-checked as it is read.
+ * Parameters:
+ *   image - Image whose debug section to search
+ *   offset - Code offset, such as a VM's ip
+ *   location - Receives the function, file and line
+ * Returns:
+ *   ErrorCode indicating success or type of failure; ERR_INVALID_OPERAND
+ *   if the image has no debug section or no function covers the offset,
+ *   ERR_INVALID_FORMAT if the section is damaged
+ */
+ErrorCode find_source_location(const BytecodeImage *image, uint32_t offset,
+                               SourceLocation *location);
+
+#endif // DEBUGINFO_H
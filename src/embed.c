@@ -0,0 +1,38 @@
+#include "embed.h"
+#include "log.h"
+
+bool find_embedded_image(const uint8_t **data, size_t *size) {
+  uintptr_t start = (uintptr_t)nanovm_embedded_image;
+  uintptr_t end = (uintptr_t)nanovm_embedded_image_end;
+  if (0 == start || end <= start) {
+    return false;
+  }
+  if (NULL != data) {
+    *data = nanovm_embedded_image;
+  }
+  if (NULL != size) {
+    *size = (size_t)(end - start);
+  }
+  return true;
+}
+
+ErrorCode open_embedded_program(Program **program) {
+  if (NULL == program) {
+    log_error("Program output pointer is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+  const uint8_t *data = NULL;
+  size_t size = 0;
+  if (!find_embedded_image(&data, &size)) {
+    log_error("No program is embedded in this executable");
+    return ERR_FILE_NOT_FOUND;
+  }
+  ErrorCode status = create_program_from_static(data, size, program);
+  if (status != SUCCESS) {
+    log_error("Embedded program is invalid");
+    return status;
+  }
+  log_info("Program opened from the executable (%zu bytes)", size);
+  return SUCCESS;
+}
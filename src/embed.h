@@ -0,0 +1,36 @@
+#ifndef EMBED_H
+#define EMBED_H
+
+#include "errno.h"
+#include "program.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bounds of a bytecode file linked into the executable by `make embed`
+ * (see embed_image.S). Both are weak, so they are NULL in a plain build.
+ */
+extern const uint8_t nanovm_embedded_image[] __attribute__((weak));
+extern const uint8_t nanovm_embedded_image_end[] __attribute__((weak));
+
+/* Finds the bytecode file linked into the executable, if there is one.
+ * Parameters:
+ *   data - Receives the start of the file in the read-only image section;
+ *          may be NULL
+ *   size - Receives the size of the file in bytes; may be NULL
+ * Returns:
+ *   true if the executable carries an embedded program
+ */
+bool find_embedded_image(const uint8_t **data, size_t *size);
+
+/* Opens the embedded bytecode file as a verified program. It runs straight
+ * from the executable's read-only section, with no file to open or read.
+ * Parameters:
+ *   program - Receives the new program with a reference count of 1
+ * Returns:
+ *   ErrorCode indicating success or type of failure; ERR_FILE_NOT_FOUND
+ *   if the executable carries no program
+ */
+ErrorCode open_embedded_program(Program **program);
+
+#endif // EMBED_H
@@ -0,0 +1,570 @@
+#include "linker.h"
+#include "bytecode.h"
+#include "bytecode_format.h"
+#include "log.h"
+#include "verify.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A stretch of one module's code that is kept or dropped as a whole: a
+ * function from its table, or the code between two functions.
+ */
+typedef struct {
+  uint32_t module;  // Module the piece comes from
+  uint32_t start;   // Offset of its first byte in the module's code
+  uint32_t end;     // Offset just past it
+  int32_t function; // Index in the module's function table, or -1
+  bool reached;     // Reachable from the entry point
+  uint32_t offset;  // Offset of its first byte in the linked code
+} LinkPiece;
+
+typedef struct {
+  const char *name; // Inside the module's names section
+  uint32_t length;  // Length of the name
+  uint32_t module;  // Module defining it
+  uint32_t value;   // Code offset of the function in that module
+} LinkExport;
+
+typedef struct {
+  const BytecodeImage *modules;
+  size_t module_count;
+  LinkPiece *pieces;       // Every module's pieces, in code order
+  size_t piece_count;      // Entries in pieces
+  size_t *first_piece;     // Per module, its first piece; then piece_count
+  LinkExport *exports;     // Every export, sorted by name
+  size_t export_count;     // Entries in exports
+  size_t *worklist;        // Reached pieces still to be scanned
+  size_t pending;          // Entries in worklist
+  uint32_t *constant_base; // Per module, where its constants now start
+  uint32_t *global_base;   // Per module, where its globals now start
+} Linker;
+
+static inline uint32_t read_u32(const uint8_t *operand) {
+  uint32_t value;
+  memcpy(&value, operand, sizeof(uint32_t));
+  return value;
+}
+
+static int compare_names(const char *a, uint32_t a_length, const char *b,
+                         uint32_t b_length) {
+  int order = memcmp(a, b, a_length < b_length ? a_length : b_length);
+  if (order != 0) {
+    return order;
+  }
+  return (a_length > b_length) - (a_length < b_length);
+}
+
+static int compare_exports(const void *left, const void *right) {
+  const LinkExport *a = left;
+  const LinkExport *b = right;
+  return compare_names(a->name, a->length, b->name, b->length);
+}
+
+/* Checks the parts of a module the linker relies on before reading it. */
+static ErrorCode check_module(const BytecodeImage *module, size_t index) {
+  if (NULL == module->code || module->version != BYTECODE_VERSION ||
+      module->compressed_code_size != 0) {
+    log_error("Module %zu is not an uncompressed version 0.2 image", index);
+    return ERR_INVALID_FORMAT;
+  }
+  for (size_t i = 0; i < module->function_count; i++) {
+    if (0 == module->functions[i].size) {
+      log_error("Module %zu has an empty function %zu", index, i);
+      return ERR_INVALID_FORMAT;
+    }
+  }
+
+  for (size_t i = 0; i < module->symbol_count; i++) {
+    const BytecodeSymbol *symbol = &module->symbols[i];
+    bool named = symbol->name_length > 0 &&
+                 symbol->name_offset <= module->names_size &&
+                 symbol->name_length <=
+                     module->names_size - symbol->name_offset;
+    bool exported = symbol->kind == SYMBOL_EXPORT &&
+                    is_function_entry(module, symbol->value);
+    bool imported = symbol->kind == SYMBOL_IMPORT && symbol->value == 0;
+    if (!named || (!exported && !imported) || symbol->reserved != 0) {
+      log_error("Module %zu has an invalid symbol %zu", index, i);
+      return ERR_INVALID_FORMAT;
+    }
+  }
+
+  for (size_t i = 0; i < module->relocation_count; i++) {
+    const BytecodeRelocation *relocation = &module->relocations[i];
+    if ((i > 0 && relocation->offset <= module->relocations[i - 1].offset) ||
+        relocation->offset >= module->code_size ||
+        module->code[relocation->offset] != OP_CALL ||
+        relocation->symbol >= module->symbol_count ||
+        module->symbols[relocation->symbol].kind != SYMBOL_IMPORT) {
+      log_error("Module %zu has an invalid relocation %zu", index, i);
+      return ERR_INVALID_FORMAT;
+    }
+  }
+  return SUCCESS;
+}
+
+static void add_piece(Linker *linker, uint32_t module, uint32_t start,
+                      uint32_t end, int32_t function) {
+  LinkPiece *piece = &linker->pieces[linker->piece_count++];
+  memset(piece, 0, sizeof(*piece));
+  piece->module = module;
+  piece->start = start;
+  piece->end = end;
+  piece->function = function;
+}
+
+/* Cuts every module into pieces and gathers the exports. */
+static ErrorCode collect(Linker *linker) {
+  size_t piece_bound = 0;
+  size_t export_bound = 0;
+  for (size_t m = 0; m < linker->module_count; m++) {
+    piece_bound += 2 * linker->modules[m].function_count + 1;
+    export_bound += linker->modules[m].symbol_count;
+  }
+  linker->pieces = malloc(piece_bound * sizeof(LinkPiece));
+  linker->worklist = malloc(piece_bound * sizeof(size_t));
+  linker->exports = malloc((export_bound + 1) * sizeof(LinkExport));
+  if (NULL == linker->pieces || NULL == linker->worklist ||
+      NULL == linker->exports) {
+    log_error("Failed to allocate memory for linking");
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  for (uint32_t m = 0; m < linker->module_count; m++) {
+    const BytecodeImage *module = &linker->modules[m];
+    linker->first_piece[m] = linker->piece_count;
+    uint32_t cursor = 0;
+    for (size_t f = 0; f < module->function_count; f++) {
+      const BytecodeFunction *function = &module->functions[f];
+      if (function->entry > cursor) {
+        add_piece(linker, m, cursor, function->entry, -1);
+      }
+      cursor = function->entry + function->size;
+      add_piece(linker, m, function->entry, cursor, (int32_t)f);
+    }
+    if (cursor < module->code_size) {
+      add_piece(linker, m, cursor, (uint32_t)module->code_size, -1);
+    }
+
+    for (size_t i = 0; i < module->symbol_count; i++) {
+      const BytecodeSymbol *symbol = &module->symbols[i];
+      if (symbol->kind == SYMBOL_EXPORT) {
+        linker->exports[linker->export_count++] =
+            (LinkExport){module->names + symbol->name_offset,
+                         symbol->name_length, m, symbol->value};
+      }
+    }
+  }
+  linker->first_piece[linker->module_count] = linker->piece_count;
+
+  qsort(linker->exports, linker->export_count, sizeof(LinkExport),
+        compare_exports);
+  for (size_t i = 1; i < linker->export_count; i++) {
+    if (compare_exports(&linker->exports[i - 1], &linker->exports[i]) == 0) {
+      log_error("Symbol '%.*s' is exported more than once",
+                (int)linker->exports[i].length, linker->exports[i].name);
+      return ERR_INVALID_OPERAND;
+    }
+  }
+  return SUCCESS;
+}
+
+/* Returns the piece of `module` holding `offset`, which is in its code. */
+static size_t find_piece(const Linker *linker, uint32_t module,
+                         uint32_t offset) {
+  size_t low = linker->first_piece[module];
+  size_t high = linker->first_piece[module + 1];
+  while (high - low > 1) {
+    size_t mid = low + (high - low) / 2;
+    if (linker->pieces[mid].start <= offset) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+/* Works out where the CALL or absolute jump at `ip` goes: the module and
+ * code offset, following the relocation table for a call to an import.
+ */
+static ErrorCode resolve_target(const Linker *linker, uint32_t module,
+                                uint32_t ip, uint32_t *target_module,
+                                uint32_t *target) {
+  const BytecodeImage *image = &linker->modules[module];
+  *target_module = module;
+  *target = read_u32(image->code + ip + 1);
+
+  const BytecodeRelocation *relocation = NULL;
+  size_t low = 0;
+  size_t high = image->relocation_count;
+  while (low < high && NULL == relocation) {
+    size_t mid = low + (high - low) / 2;
+    if (image->relocations[mid].offset == ip) {
+      relocation = &image->relocations[mid];
+    } else if (image->relocations[mid].offset < ip) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  if (NULL != relocation) {
+    const BytecodeSymbol *symbol = &image->symbols[relocation->symbol];
+    LinkExport key = {image->names + symbol->name_offset,
+                      symbol->name_length, 0, 0};
+    const LinkExport *definition =
+        bsearch(&key, linker->exports, linker->export_count,
+                sizeof(LinkExport), compare_exports);
+    if (NULL == definition) {
+      log_error("Undefined symbol '%.*s' called from module %u",
+                (int)key.length, key.name, module);
+      return ERR_INVALID_OPERAND;
+    }
+    *target_module = definition->module;
+    *target = definition->value;
+  }
+
+  if (*target >= linker->modules[*target_module].code_size) {
+    log_error("Module %u branches outside its code at offset %u", module,
+              ip);
+    return ERR_INVALID_OPERAND;
+  }
+  return SUCCESS;
+}
+
+static void reach(Linker *linker, size_t piece) {
+  if (!linker->pieces[piece].reached) {
+    linker->pieces[piece].reached = true;
+    linker->worklist[linker->pending++] = piece;
+  }
+}
+
+/* Walks the instructions of a piece. Without `out` it marks every piece
+ * control can move on to as reached; with it, it rewrites the piece's copy
+ * in the linked code to match the new layout.
+ */
+static ErrorCode walk_piece(Linker *linker, size_t index, uint8_t *out) {
+  const LinkPiece *piece = &linker->pieces[index];
+  const BytecodeImage *image = &linker->modules[piece->module];
+  const uint8_t *code = image->code;
+  uint8_t last = OP_NOP;
+
+  for (uint32_t ip = piece->start; ip < piece->end;) {
+    size_t length = instruction_length(code + ip, piece->end - ip);
+    if (0 == length) {
+      log_error("Invalid instruction at offset %u of module %u", ip,
+                piece->module);
+      return ERR_INVALID_FORMAT;
+    }
+    uint8_t *copy =
+        NULL == out ? NULL : out + piece->offset + (ip - piece->start);
+    uint32_t target_module = 0;
+    uint32_t target = 0;
+    last = code[ip];
+
+    switch (code[ip]) {
+    case OP_JMP:
+    case OP_JMPZ:
+    case OP_JMPNZ:
+    case OP_CALL: {
+      ErrorCode status =
+          resolve_target(linker, piece->module, ip, &target_module, &target);
+      if (status != SUCCESS) {
+        return status;
+      }
+      size_t reached = find_piece(linker, target_module, target);
+      if (NULL == out) {
+        reach(linker, reached);
+        break;
+      }
+      uint32_t moved = linker->pieces[reached].offset + target -
+                       linker->pieces[reached].start;
+      memcpy(copy + 1, &moved, sizeof(moved));
+      break;
+    }
+    case OP_JMP8:
+    case OP_JMPZ8:
+    case OP_JMPNZ8:
+    case OP_JMP16:
+    case OP_JMPZ16:
+    case OP_JMPNZ16: {
+      int64_t displacement = (int8_t)code[ip + 1];
+      if (length == 3) {
+        int16_t wide;
+        memcpy(&wide, code + ip + 1, sizeof(wide));
+        displacement = wide;
+      }
+      int64_t destination = (int64_t)ip + displacement;
+      if (destination < piece->start || destination >= piece->end) {
+        log_error("Relative jump at offset %u of module %u leaves its "
+                  "function; link before compacting",
+                  ip, piece->module);
+        return ERR_INVALID_OPERAND;
+      }
+      break;
+    }
+    case OP_PUSHK:
+    case OP_GLOAD:
+    case OP_GSTORE:
+      if (NULL != out) {
+        uint32_t base = code[ip] == OP_PUSHK
+                            ? linker->constant_base[piece->module]
+                            : linker->global_base[piece->module];
+        uint32_t rebased = read_u32(code + ip + 1) + base;
+        memcpy(copy + 1, &rebased, sizeof(rebased));
+      }
+      break;
+    case OP_PUSHKV:
+    case OP_GLOADV:
+    case OP_GSTOREV:
+      log_error("Compact index at offset %u of module %u; link before "
+                "compacting",
+                ip, piece->module);
+      return ERR_INVALID_OPERAND;
+    case OP_CALLX:
+      log_error("CALLX at offset %u of module %u is resolved at run time; "
+                "use CALL with a relocation to link statically",
+                ip, piece->module);
+      return ERR_INVALID_OPERAND;
+    default:
+      break;
+    }
+    ip += (uint32_t)length;
+  }
+
+  // Control that runs off the end continues in the next piece
+  bool falls_through = last != OP_RET && last != OP_HALT && last != OP_JMP &&
+                       last != OP_JMP8 && last != OP_JMP16;
+  if (NULL == out && falls_through &&
+      index + 1 < linker->first_piece[piece->module + 1]) {
+    reach(linker, index + 1);
+  }
+  return SUCCESS;
+}
+
+/* Marks everything reachable from the first module's entry point. */
+static ErrorCode mark_reachable(Linker *linker) {
+  const BytecodeImage *main = &linker->modules[0];
+  if (main->entry_point >= main->code_size) {
+    log_error("Entry point %u is outside the code", main->entry_point);
+    return ERR_INVALID_FORMAT;
+  }
+  reach(linker, find_piece(linker, 0, main->entry_point));
+  while (linker->pending > 0) {
+    ErrorCode status =
+        walk_piece(linker, linker->worklist[--linker->pending], NULL);
+    if (status != SUCCESS) {
+      return status;
+    }
+  }
+  return SUCCESS;
+}
+
+/* Places the kept pieces, each at its original offset modulo the operand
+ * alignment. Returns the size of the linked code.
+ */
+static size_t layout_pieces(Linker *linker) {
+  size_t offset = 0;
+  for (size_t i = 0; i < linker->piece_count; i++) {
+    LinkPiece *piece = &linker->pieces[i];
+    if (!piece->reached) {
+      continue;
+    }
+    while (offset % BYTECODE_OPERAND_ALIGNMENT !=
+           piece->start % BYTECODE_OPERAND_ALIGNMENT) {
+      offset++;
+    }
+    piece->offset = (uint32_t)offset;
+    offset += piece->end - piece->start;
+  }
+  return offset;
+}
+
+/* Merges the constants and globals of every module that keeps code. */
+static ErrorCode merge_data(Linker *linker, BytecodeImage *linked) {
+  size_t constant_count = 0;
+  size_t global_count = 0;
+  bool *used = calloc(linker->module_count, sizeof(bool));
+  if (NULL == used) {
+    log_error("Failed to allocate memory for linking");
+    return ERR_OUT_OF_MEMORY;
+  }
+  for (size_t i = 0; i < linker->piece_count; i++) {
+    used[linker->pieces[i].module] |= linker->pieces[i].reached;
+  }
+  for (size_t m = 0; m < linker->module_count; m++) {
+    linker->constant_base[m] = (uint32_t)constant_count;
+    linker->global_base[m] = (uint32_t)global_count;
+    if (used[m]) {
+      constant_count += linker->modules[m].constant_count;
+      global_count += linker->modules[m].global_count;
+    }
+  }
+
+  int32_t *constants =
+      constant_count > 0 ? malloc(constant_count * sizeof(int32_t)) : NULL;
+  int32_t *globals =
+      global_count > 0 ? malloc(global_count * sizeof(int32_t)) : NULL;
+  if ((constant_count > 0 && NULL == constants) ||
+      (global_count > 0 && NULL == globals)) {
+    log_error("Failed to allocate memory for linked data");
+    free(constants);
+    free(globals);
+    free(used);
+    return ERR_OUT_OF_MEMORY;
+  }
+  for (size_t m = 0; m < linker->module_count; m++) {
+    const BytecodeImage *module = &linker->modules[m];
+    if (used[m] && module->constant_count > 0) {
+      memcpy(constants + linker->constant_base[m], module->constants,
+             module->constant_count * sizeof(int32_t));
+    }
+    if (used[m] && module->global_count > 0) {
+      memcpy(globals + linker->global_base[m], module->globals,
+             module->global_count * sizeof(int32_t));
+    }
+  }
+  free(used);
+
+  linked->constants = constants;
+  linked->constant_count = constant_count;
+  linked->globals = globals;
+  linked->global_count = global_count;
+  return SUCCESS;
+}
+
+/* Copies the kept pieces into place, rewrites them and builds the function
+ * table of the linked code.
+ */
+static ErrorCode emit_code(Linker *linker, size_t code_size,
+                           BytecodeImage *linked) {
+  size_t function_count = 0;
+  for (size_t i = 0; i < linker->piece_count; i++) {
+    function_count +=
+        linker->pieces[i].reached && linker->pieces[i].function >= 0;
+  }
+
+  uint8_t *code = malloc(code_size);
+  BytecodeFunction *functions =
+      function_count > 0 ? malloc(function_count * sizeof(BytecodeFunction))
+                         : NULL;
+  if (NULL == code || (function_count > 0 && NULL == functions)) {
+    log_error("Failed to allocate memory for linked code");
+    free(code);
+    free(functions);
+    return ERR_OUT_OF_MEMORY;
+  }
+  memset(code, OP_NOP, code_size);
+  // Stored before the walk so that free_linked_bytecode releases them
+  linked->code = code;
+  linked->code_size = code_size;
+  linked->functions = functions;
+  linked->function_count = function_count;
+
+  size_t function = 0;
+  for (size_t i = 0; i < linker->piece_count; i++) {
+    const LinkPiece *piece = &linker->pieces[i];
+    if (!piece->reached) {
+      continue;
+    }
+    const BytecodeImage *module = &linker->modules[piece->module];
+    memcpy(code + piece->offset, module->code + piece->start,
+           piece->end - piece->start);
+    ErrorCode status = walk_piece(linker, i, code);
+    if (status != SUCCESS) {
+      return status;
+    }
+    if (piece->function >= 0) {
+      functions[function] = module->functions[piece->function];
+      functions[function++].entry = piece->offset;
+    }
+  }
+
+  const BytecodeImage *main = &linker->modules[0];
+  const LinkPiece *entry =
+      &linker->pieces[find_piece(linker, 0, main->entry_point)];
+  linked->entry_point = entry->offset + main->entry_point - entry->start;
+  return SUCCESS;
+}
+
+ErrorCode link_bytecode(const BytecodeImage *modules, size_t count,
+                        BytecodeImage *linked) {
+  if (NULL == modules || NULL == linked || 0 == count) {
+    log_error("No modules to link or no output");
+    return ERR_NULL_POINTER;
+  }
+  for (size_t m = 0; m < count; m++) {
+    ErrorCode status = check_module(&modules[m], m);
+    if (status != SUCCESS) {
+      return status;
+    }
+  }
+
+  Linker linker;
+  memset(&linker, 0, sizeof(linker));
+  linker.modules = modules;
+  linker.module_count = count;
+  linker.first_piece = malloc((count + 1) * sizeof(size_t));
+  linker.constant_base = malloc(count * sizeof(uint32_t));
+  linker.global_base = malloc(count * sizeof(uint32_t));
+  memset(linked, 0, sizeof(*linked));
+  linked->version = BYTECODE_VERSION;
+
+  ErrorCode status = SUCCESS;
+  if (NULL == linker.first_piece || NULL == linker.constant_base ||
+      NULL == linker.global_base) {
+    log_error("Failed to allocate memory for linking");
+    status = ERR_OUT_OF_MEMORY;
+  }
+  if (status == SUCCESS) {
+    status = collect(&linker);
+  }
+  if (status == SUCCESS) {
+    status = mark_reachable(&linker);
+  }
+  size_t code_size = status == SUCCESS ? layout_pieces(&linker) : 0;
+  if (status == SUCCESS && code_size > MAX_BYTECODE_SIZE) {
+    log_error("Linked code would be too large: %zu bytes", code_size);
+    status = ERR_FILE_TOO_LARGE;
+  }
+  if (status == SUCCESS) {
+    status = merge_data(&linker, linked);
+  }
+  if (status == SUCCESS) {
+    status = emit_code(&linker, code_size, linked);
+  }
+  if (status == SUCCESS) {
+    status = verify_code(linked);
+  }
+
+  if (status == SUCCESS) {
+    size_t total = 0;
+    for (size_t m = 0; m < count; m++) {
+      total += modules[m].code_size;
+    }
+    log_info("Linked %zu modules: %zu bytes of code kept of %zu", count,
+             linked->code_size, total);
+  } else {
+    free_linked_bytecode(linked);
+  }
+  free(linker.pieces);
+  free(linker.worklist);
+  free(linker.exports);
+  free(linker.first_piece);
+  free(linker.constant_base);
+  free(linker.global_base);
+  return status;
+}
+
+void free_linked_bytecode(BytecodeImage *linked) {
+  if (NULL == linked) {
+    return;
+  }
+  free((void *)linked->code);
+  free((void *)linked->functions);
+  free((void *)linked->constants);
+  free((void *)linked->globals);
+  memset(linked, 0, sizeof(*linked));
+}
@@ -0,0 +1,40 @@
+#ifndef LINKER_H
+#define LINKER_H
+
+#include "errno.h"
+#include "loader.h"
+#include <stddef.h>
+
+/* Links modules into one program. A module is a version 0.2 image whose
+ * symbol table exports some of its functions by name and imports others;
+ * each CALL to an import is listed in its relocation table. The linker:
+ *  - resolves every import against the exports of all the modules
+ *  - keeps only the code reachable from the first module's entry point
+ *    through calls, jumps and fall-through, a function (or the code
+ *    between two functions) at a time, and drops the rest
+ *  - lays the kept code out module by module, keeping each piece's offset
+ *    modulo 4 so that 32-bit operands stay aligned
+ *  - rewrites CALL and JMP targets, and the constant and global indices
+ *    of each module, to match the merged code, constant pool and globals
+ * Only modules that keep some code contribute constants and globals. The
+ * result is verified before it is returned. Modules have to be linked
+ * before they are compacted: relative jumps may not leave their function,
+ * and LEB128 index forms are rejected.
+ * Parameters:
+ *   modules - Modules to link; the first one holds the entry point
+ *   count - Number of modules
+ *   linked - Receives the program, without symbols, relocations or debug
+ *            information, since its code has moved. Its code, function
+ *            table, constants and globals are newly allocated and
+ *            released with free_linked_bytecode
+ * Returns:
+ *   ErrorCode indicating success or type of failure; ERR_INVALID_OPERAND
+ *   for an undefined or duplicate symbol
+ */
+ErrorCode link_bytecode(const BytecodeImage *modules, size_t count,
+                        BytecodeImage *linked);
+
+/* Frees the sections allocated by link_bytecode. */
+void free_linked_bytecode(BytecodeImage *linked);
+
+#endif // LINKER_H
@@ -1,139 +1,800 @@
 #include "loader.h"
 #include "bytecode_format.h"
+#include "crc32c.h"
 #include "errno.h"
 #include "log.h"
+#include "lz.h"
+#include "system_errno.h"
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
+
+// Compressed code is read and decoded this many bytes at a time
+#define LOADER_CHUNK_SIZE (64 * 1024)
+
+/* Checks the fields of a version 0.2 header against the size of the file
+ * it came from.
+ */
+static ErrorCode check_header_v2(const BytecodeHeaderV2 *header,
+                                 size_t size) {
+  if ((header->flags & ~BYTECODE_KNOWN_FLAGS) != 0) {
+    log_error("Unsupported bytecode flags: 0x%04X", header->flags);
+    return ERR_INVALID_FORMAT;
+  }
+
+  if (header->section_count == 0 ||
+      header->section_count > BYTECODE_MAX_SECTIONS) {
+    log_error("Invalid section count: %u", header->section_count);
+    return ERR_INVALID_FORMAT;
+  }
+
+  size_t table_size = (size_t)header->section_count * sizeof(BytecodeSection);
+  if (header->section_table_offset % BYTECODE_SECTION_ALIGNMENT != 0 ||
+      header->section_table_offset < BYTECODE_V2_HEADER_SIZE ||
+      header->section_table_offset > size ||
+      table_size > size - header->section_table_offset) {
+    log_error("Section table out of bounds: offset %u, %u sections",
+              header->section_table_offset, header->section_count);
+    return ERR_INVALID_FORMAT;
+  }
+  return SUCCESS;
+}
+
+/* Checks one section table entry: it must lie inside the file, past the
+ * header, on a BYTECODE_SECTION_ALIGNMENT boundary, and only a compressed
+ * code section may declare an uncompressed size.
+ */
+static ErrorCode check_section(const BytecodeSection *section, uint32_t index,
+                               const BytecodeHeaderV2 *header, size_t size) {
+  if (section->offset % BYTECODE_SECTION_ALIGNMENT != 0 ||
+      section->offset < BYTECODE_V2_HEADER_SIZE || section->offset > size ||
+      section->size > size - section->offset) {
+    log_error("Section %u out of bounds: offset %u, size %u", index,
+              section->offset, section->size);
+    return ERR_INVALID_FORMAT;
+  }
+  if (section->flags != 0) {
+    log_error("Unsupported flags 0x%04X on section %u", section->flags,
+              index);
+    return ERR_INVALID_FORMAT;
+  }
+
+  bool compressed = section->type == SECTION_CODE &&
+                    (header->flags & BYTECODE_FLAG_COMPRESSED_CODE);
+  if (compressed && (section->uncompressed_size == 0 ||
+                     section->uncompressed_size > MAX_BYTECODE_SIZE)) {
+    log_error("Invalid uncompressed code size: %u",
+              section->uncompressed_size);
+    return ERR_INVALID_FORMAT;
+  }
+  if (!compressed && section->uncompressed_size != 0) {
+    log_error("Section %u is not compressed but declares a size", index);
+    return ERR_INVALID_FORMAT;
+  }
+  return SUCCESS;
+}
 
 ErrorCode load_bytecode(const char *filename, uint8_t **code_buffer,
                         size_t *code_size, uint32_t *entry_point) {
-  FILE *file;
+  return load_bytecode_with_allocator(filename, &vm_default_allocator,
+                                      code_buffer, code_size, entry_point);
+}
+
+/* Forward-only reader over a descriptor, which need not be seekable. */
+typedef struct {
+  int fd;
+  size_t position; // Bytes consumed so far
+  bool sum;        // Whether consumed bytes are added to crc
+  uint32_t crc;    // CRC-32C of the bytes consumed while sum was set
+} FdStream;
+
+/* Reads exactly `size` bytes, retrying short and interrupted reads from
+ * pipes.
+ */
+static ErrorCode stream_read(FdStream *stream, void *buffer, size_t size) {
+  uint8_t *out = buffer;
+  for (size_t done = 0; done < size;) {
+    ssize_t count = read(stream->fd, out + done, size - done);
+    if (count < 0 && EINTR == errno) {
+      continue; // A signal arrived before any data did
+    }
+    if (count < 0) {
+      log_error("Failed to read bytecode at offset %zu: %s",
+                stream->position + done, strerror(errno));
+      return ERR_FILE_READ;
+    }
+    if (count == 0) {
+      log_error("Bytecode ends early: expected %zu bytes, got %zu",
+                stream->position + size, stream->position + done);
+      return ERR_INVALID_FORMAT;
+    }
+    done += (size_t)count;
+  }
+  if (stream->sum) {
+    stream->crc = crc32c(stream->crc, out, size);
+  }
+  stream->position += size;
+  return SUCCESS;
+}
+
+/* Reads and discards bytes up to `offset`, which may not lie behind the
+ * current position.
+ */
+static ErrorCode stream_skip(FdStream *stream, size_t offset) {
+  uint8_t scratch[4096];
+  if (offset < stream->position) {
+    log_error("Section at offset %zu precedes the section table; the file "
+              "cannot be read sequentially",
+              offset);
+    return ERR_INVALID_FORMAT;
+  }
+  while (stream->position < offset) {
+    size_t count = offset - stream->position;
+    count = count < sizeof(scratch) ? count : sizeof(scratch);
+    ErrorCode status = stream_read(stream, scratch, count);
+    if (status != SUCCESS) {
+      return status;
+    }
+  }
+  return SUCCESS;
+}
+
+/* Checks every section table entry and finds the code section and the end
+ * of the file's contents (the end of the last section or of the table).
+ */
+static ErrorCode check_table(const BytecodeHeaderV2 *header,
+                             const BytecodeSection *table, size_t size,
+                             BytecodeSection *code, size_t *end) {
+  memset(code, 0, sizeof(*code));
+  *end = header->section_table_offset +
+         header->section_count * sizeof(BytecodeSection);
+  for (uint32_t i = 0; i < header->section_count; i++) {
+    ErrorCode status = check_section(&table[i], i, header, size);
+    if (status != SUCCESS) {
+      return status;
+    }
+    if (table[i].type == SECTION_CODE) {
+      if (code->type == SECTION_CODE) {
+        log_error("Duplicate code section");
+        return ERR_INVALID_FORMAT;
+      }
+      *code = table[i];
+    }
+    if ((size_t)table[i].offset + table[i].size > *end) {
+      *end = (size_t)table[i].offset + table[i].size;
+    }
+  }
+  if (code->type != SECTION_CODE) {
+    log_error("Bytecode has no code section");
+    return ERR_INVALID_FORMAT;
+  }
+  return SUCCESS;
+}
+
+/* Reads the version 0.1 header, or the version 0.2 header and section
+ * table, checking them against `size`, the most the file may hold. prefix
+ * receives the first BYTECODE_HEADER_SIZE bytes as read. The stream is left
+ * just past the table. From here on the stream sums what it
+ * reads if the file carries a checksum.
+ */
+static ErrorCode read_layout(FdStream *stream, size_t size,
+                             uint8_t prefix[BYTECODE_HEADER_SIZE],
+                             BytecodeHeaderV2 *header,
+                             BytecodeSection *table, BytecodeSection *code,
+                             size_t *end) {
+  ErrorCode status = stream_read(stream, prefix, BYTECODE_HEADER_SIZE);
+  if (status != SUCCESS) {
+    return status;
+  }
+  if (memcmp(prefix + BYTECODE_MAGIC_OFFSET, BYTECODE_MAGIC, 4) != 0) {
+    log_error("Invalid magic number: %02X %02X %02X %02X",
+              prefix[BYTECODE_MAGIC_OFFSET], prefix[BYTECODE_MAGIC_OFFSET + 1],
+              prefix[BYTECODE_MAGIC_OFFSET + 2],
+              prefix[BYTECODE_MAGIC_OFFSET + 3]);
+    return ERR_INVALID_FORMAT;
+  }
+
+  memset(header, 0, sizeof(*header));
+  memcpy(&header->version, prefix + BYTECODE_VERSION_OFFSET,
+         sizeof(uint16_t));
+  memset(code, 0, sizeof(*code));
+
+  if (header->version == BYTECODE_VERSION_V1) {
+    uint32_t code_size;
+    memcpy(&code_size, prefix + BYTECODE_CODE_SIZE_OFFSET, sizeof(uint32_t));
+    memcpy(&header->entry_point, prefix + BYTECODE_ENTRY_POINT_OFFSET,
+           sizeof(uint32_t));
+    if ((size_t)code_size + BYTECODE_HEADER_SIZE > size) {
+      log_error("Declared code size exceeds file size: %zu > %zu",
+                (size_t)code_size + BYTECODE_HEADER_SIZE, size);
+      return ERR_INVALID_FORMAT;
+    }
+    code->type = SECTION_CODE;
+    code->offset = BYTECODE_HEADER_SIZE;
+    code->size = code_size;
+    *end = BYTECODE_HEADER_SIZE + (size_t)code_size;
+    return SUCCESS;
+  }
+  if (header->version != BYTECODE_VERSION) {
+    log_error("Unsupported bytecode version: 0x%04X\nCurrent version: 0x%04X",
+              header->version, BYTECODE_VERSION);
+    return ERR_INVALID_FORMAT;
+  }
+
+  memcpy(header, prefix, BYTECODE_HEADER_SIZE);
+  status = stream_read(stream, (uint8_t *)header + BYTECODE_HEADER_SIZE,
+                       sizeof(*header) - BYTECODE_HEADER_SIZE);
+  if (status != SUCCESS) {
+    return status;
+  }
+  status = check_header_v2(header, size);
+  if (status != SUCCESS) {
+    return status;
+  }
+
+  if (header->flags & BYTECODE_FLAG_CHECKSUM) {
+    BytecodeHeaderV2 summed = *header;
+    summed.checksum = 0;
+    stream->sum = true;
+    stream->crc = crc32c(0, &summed, sizeof(summed));
+  }
+  status = stream_skip(stream, header->section_table_offset);
+  if (status == SUCCESS) {
+    status = stream_read(stream, table,
+                         header->section_count * sizeof(BytecodeSection));
+  }
+  if (status != SUCCESS) {
+    log_error("Failed to read the section table");
+    return status;
+  }
+  return check_table(header, table, size, code, end);
+}
+
+/* Reads the rest of the file up to `end` and compares its checksum. */
+static ErrorCode finish_checksum(FdStream *stream, uint32_t expected,
+                                 size_t end) {
+  ErrorCode status = stream_skip(stream, end);
+  if (status == SUCCESS && stream->crc != expected) {
+    log_error("Checksum mismatch: file has 0x%08X, contents give 0x%08X",
+              expected, stream->crc);
+    status = ERR_CHECKSUM_MISMATCH;
+  }
+  return status;
+}
+
+/* Streams an LZ-compressed code section through a small buffer, decoding
+ * each chunk into `out` as soon as it is read.
+ */
+static ErrorCode read_compressed_code(FdStream *stream,
+                                      const VM_Allocator *allocator,
+                                      const BytecodeSection *code,
+                                      uint8_t *out) {
+  size_t chunk_size =
+      code->size < LOADER_CHUNK_SIZE ? code->size : LOADER_CHUNK_SIZE;
+  uint8_t *chunk = allocator->alloc(allocator->ctx, chunk_size);
+  if (NULL == chunk) {
+    log_error("Failed to allocate memory for the read buffer");
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  LZ_Decoder decoder;
+  lz_decoder_init(&decoder, out, code->uncompressed_size);
   ErrorCode status = SUCCESS;
-  uint8_t *full_buffer = NULL;
-  size_t file_size = 0;
+  for (size_t remaining = code->size; status == SUCCESS && remaining > 0;) {
+    size_t count = remaining < chunk_size ? remaining : chunk_size;
+    status = stream_read(stream, chunk, count);
+    if (status == SUCCESS) {
+      status = lz_decode(&decoder, chunk, count);
+    }
+    remaining -= count;
+  }
+  if (status == SUCCESS) {
+    status = lz_decoder_finish(&decoder);
+  }
+  allocator->free(allocator->ctx, chunk);
+  return status;
+}
 
-  file = fopen(filename, "rb");
-  if (NULL == file) {
+/* Reads the code of a file in one forward pass: header, section table,
+ * code (decoded on the way if compressed), and then, for a file with a
+ * checksum, the remaining sections up to `size` so that they are summed.
+ * `size` is the file size when known; a file read from a stream ends with
+ * its last section instead.
+ */
+static ErrorCode stream_code(FdStream *stream, size_t size, bool sized,
+                             const VM_Allocator *allocator,
+                             uint8_t **code_buffer, size_t *code_size,
+                             uint32_t *entry_point, bool *compressed) {
+  BytecodeHeaderV2 header;
+  BytecodeSection table[BYTECODE_MAX_SECTIONS];
+  BytecodeSection code;
+  size_t end;
+  uint8_t prefix[BYTECODE_HEADER_SIZE];
+  ErrorCode status =
+      read_layout(stream, size, prefix, &header, table, &code, &end);
+  if (status != SUCCESS) {
+    log_error("Bytecode format verification failed");
+    return status;
+  }
+
+  *compressed = (header.flags & BYTECODE_FLAG_COMPRESSED_CODE) != 0;
+  size_t length = *compressed ? code.uncompressed_size : code.size;
+  if (header.entry_point >= length) {
+    log_error("Invalid entry point: %u", header.entry_point);
+    return ERR_INVALID_FORMAT;
+  }
+
+  uint8_t *buffer = allocator->alloc(allocator->ctx, length);
+  if (NULL == buffer) {
+    log_error("Failed to allocate memory for code segment");
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  status = stream_skip(stream, code.offset);
+  if (status == SUCCESS && *compressed) {
+    status = read_compressed_code(stream, allocator, &code, buffer);
+  } else if (status == SUCCESS) {
+    status = stream_read(stream, buffer, length);
+  }
+  if (status == SUCCESS && (header.flags & BYTECODE_FLAG_CHECKSUM)) {
+    status = finish_checksum(stream, header.checksum, sized ? size : end);
+  }
+  if (status != SUCCESS) {
+    allocator->free(allocator->ctx, buffer);
+    return status;
+  }
+
+  *code_buffer = buffer;
+  *code_size = length;
+  *entry_point = header.entry_point;
+  return SUCCESS;
+}
+
+ErrorCode load_bytecode_fd(int fd, const VM_Allocator *allocator,
+                           uint8_t **code_buffer, size_t *code_size,
+                           uint32_t *entry_point) {
+  if (fd < 0 || NULL == allocator || NULL == code_buffer ||
+      NULL == code_size || NULL == entry_point) {
+    log_error("Invalid descriptor or NULL output for streamed bytecode");
+    return ERR_NULL_POINTER;
+  }
+
+  FdStream stream = {.fd = fd, .position = 0, .sum = false, .crc = 0};
+  bool compressed;
+  ErrorCode status =
+      stream_code(&stream, MAX_BYTECODE_SIZE, false, allocator, code_buffer,
+                  code_size, entry_point, &compressed);
+  if (status != SUCCESS) {
+    log_error("Failed to read bytecode from descriptor %d", fd);
+    return status;
+  }
+
+  log_info("Bytecode streamed from descriptor %d (code size: %zu bytes, "
+           "entry point: %u%s)",
+           fd, *code_size, *entry_point, compressed ? ", decompressed" : "");
+  return SUCCESS;
+}
+
+ErrorCode load_bytecode_with_allocator(const char *filename,
+                                       const VM_Allocator *allocator,
+                                       uint8_t **code_buffer,
+                                       size_t *code_size,
+                                       uint32_t *entry_point) {
+  if (0 == strcmp(filename, "-")) {
+    return load_bytecode_fd(STDIN_FILENO, allocator, code_buffer, code_size,
+                            entry_point);
+  }
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
     log_error("Failed to open bytecode file: %s", filename);
     return ERR_FILE_NOT_FOUND;
   }
 
-  fseek(file, 0, SEEK_END);
-  file_size = (size_t)ftell(file);
-  fseek(file, 0, SEEK_SET);
-  log_debug("Bytecode file size: %zu bytes", file_size);
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    log_error("Failed to stat bytecode file: %s", filename);
+    return ERR_FILE_READ;
+  }
 
+  size_t file_size = (size_t)info.st_size;
+  log_debug("Bytecode file size: %zu bytes", file_size);
   if (file_size < BYTECODE_HEADER_SIZE) {
-    fclose(file);
+    close(fd);
     log_error("Bytecode file size is too small: %zu bytes", file_size);
     return ERR_INVALID_FORMAT;
   }
   if (file_size > MAX_BYTECODE_SIZE) {
-    fclose(file);
+    close(fd);
     log_error("Bytecode file size is too large: %zu bytes", file_size);
     return ERR_FILE_TOO_LARGE;
   }
 
-  full_buffer = (uint8_t *)malloc(file_size);
-  if (NULL == full_buffer) {
-    fclose(file);
-    log_error("Failed to allocate memory for bytecode buffer");
+  // Let the kernel read ahead while the previous chunk is being decoded
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  FdStream stream = {.fd = fd, .position = 0, .sum = false, .crc = 0};
+  bool compressed;
+  ErrorCode status = stream_code(&stream, file_size, true, allocator,
+                                 code_buffer, code_size, entry_point,
+                                 &compressed);
+  close(fd);
+  if (status != SUCCESS) {
+    log_error("Failed to read code from bytecode file: %s", filename);
+    return status;
+  }
+
+  log_info("Bytecode file '%s' loaded successfully (code size: %zu bytes, "
+           "entry point: %u%s)",
+           filename, *code_size, *entry_point,
+           compressed ? ", decompressed" : "");
+  return SUCCESS;
+}
+
+ErrorCode read_bytecode_fd(int fd, const VM_Allocator *allocator,
+                           uint8_t **buffer, size_t *size) {
+  if (fd < 0 || NULL == allocator || NULL == buffer || NULL == size) {
+    log_error("Invalid descriptor or NULL output for streamed bytecode");
+    return ERR_NULL_POINTER;
+  }
+
+  // The header and table are kept so they can head the file buffer
+  FdStream stream = {.fd = fd, .position = 0, .sum = false, .crc = 0};
+  BytecodeHeaderV2 header;
+  BytecodeSection table[BYTECODE_MAX_SECTIONS];
+  BytecodeSection code;
+  uint8_t prefix[BYTECODE_HEADER_SIZE];
+  size_t end;
+  ErrorCode status = read_layout(&stream, MAX_BYTECODE_SIZE, prefix, &header,
+                                 table, &code, &end);
+  if (status == SUCCESS && header.version != BYTECODE_VERSION_V1 &&
+      header.section_table_offset != BYTECODE_V2_HEADER_SIZE) {
+    log_error("Section table does not follow the header; the file cannot "
+              "be read from a stream");
+    status = ERR_INVALID_FORMAT;
+  }
+  if (status != SUCCESS) {
+    log_error("Failed to read bytecode from descriptor %d", fd);
+    return status;
+  }
+
+  uint8_t *file = allocator->alloc(allocator->ctx, end);
+  if (NULL == file) {
+    log_error("Failed to allocate memory for streamed bytecode");
     return ERR_OUT_OF_MEMORY;
   }
 
-  if (fread(full_buffer, 1, file_size, file) != file_size) {
-    free(full_buffer);
-    fclose(file);
-    log_error("Failed to read bytecode file: %s", filename);
+  // Everything after the table is read straight into place; parse_bytecode
+  // checks the checksum once the whole file is in
+  size_t head = stream.position;
+  stream.sum = false;
+  if (header.version == BYTECODE_VERSION_V1) {
+    memcpy(file, prefix, sizeof(prefix));
+  } else {
+    memcpy(file, &header, sizeof(header));
+    memcpy(file + sizeof(header), table, head - sizeof(header));
+  }
+  status = stream_read(&stream, file + head, end - head);
+  if (status != SUCCESS) {
+    allocator->free(allocator->ctx, file);
+    log_error("Failed to read bytecode from descriptor %d", fd);
+    return status;
+  }
+
+  *buffer = file;
+  *size = end;
+  log_info("Bytecode streamed from descriptor %d (%zu bytes)", fd, end);
+  return SUCCESS;
+}
+
+static ErrorCode parse_image(const uint8_t *buffer, size_t size,
+                             bool checksum, BytecodeImage *image);
+
+/* Maps and parses a file, checking its checksum only if asked to. */
+static ErrorCode map_file(const char *filename, bool checksum,
+                          MappedBytecode *mapped) {
+  ErrorCode status = SUCCESS;
+  struct stat info;
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    log_error("Failed to open bytecode file: %s", filename);
+    return ERR_FILE_NOT_FOUND;
+  }
+
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    log_error("Failed to stat bytecode file: %s", filename);
     return ERR_FILE_READ;
   }
-  fclose(file);
 
-  status = verify_bytecode_format(full_buffer, file_size);
+  size_t file_size = (size_t)info.st_size;
+  log_debug("Bytecode file size: %zu bytes", file_size);
+  if (file_size < BYTECODE_HEADER_SIZE) {
+    close(fd);
+    log_error("Bytecode file size is too small: %zu bytes", file_size);
+    return ERR_INVALID_FORMAT;
+  }
+  if (file_size > MAX_BYTECODE_SIZE) {
+    close(fd);
+    log_error("Bytecode file size is too large: %zu bytes", file_size);
+    return ERR_FILE_TOO_LARGE;
+  }
+
+  // The mapping keeps its own reference to the file
+  uint8_t *mapping = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (MAP_FAILED == mapping) {
+    log_error("Failed to map bytecode file: %s", filename);
+    return ERR_FILE_READ;
+  }
+
+  status = parse_image(mapping, file_size, checksum, &mapped->image);
   if (status != SUCCESS) {
-    free(full_buffer);
+    munmap(mapping, file_size);
     log_error("Bytecode format verification failed");
     return status;
   }
 
-  uint32_t code_sz;
-  memcpy(&code_sz, full_buffer + BYTECODE_CODE_SIZE_OFFSET, sizeof(uint32_t));
-  memcpy(entry_point, full_buffer + BYTECODE_ENTRY_POINT_OFFSET,
+  mapped->mapping = mapping;
+  mapped->mapping_size = file_size;
+
+  log_info("Bytecode file '%s' mapped (code size: %zu bytes, entry point: %u)",
+           filename, mapped->image.code_size, mapped->image.entry_point);
+  return SUCCESS;
+}
+
+ErrorCode map_bytecode(const char *filename, MappedBytecode *mapped) {
+  return map_file(filename, true, mapped);
+}
+
+ErrorCode map_bytecode_lazy(const char *filename, MappedBytecode *mapped) {
+  return map_file(filename, false, mapped);
+}
+
+ErrorCode unmap_bytecode(MappedBytecode *mapped) {
+  if (NULL == mapped || NULL == mapped->mapping) {
+    log_warn("Attempted to unmap a NULL bytecode mapping");
+    return ERR_NULL_POINTER;
+  }
+
+  munmap(mapped->mapping, mapped->mapping_size);
+  mapped->mapping = NULL;
+  mapped->mapping_size = 0;
+  memset(&mapped->image, 0, sizeof(mapped->image));
+  log_info("Bytecode mapping released");
+  return SUCCESS;
+}
+
+uint32_t bytecode_checksum(const uint8_t *buffer, size_t size) {
+  static const uint8_t zero[sizeof(uint32_t)] = {0};
+  uint32_t crc = crc32c(0, buffer, BYTECODE_CHECKSUM_OFFSET);
+  crc = crc32c(crc, zero, sizeof(zero));
+  size_t rest = BYTECODE_CHECKSUM_OFFSET + sizeof(zero);
+  return crc32c(crc, buffer + rest, size - rest);
+}
+
+ErrorCode verify_bytecode_format(const uint8_t *buffer, size_t size) {
+  BytecodeImage image;
+  return parse_bytecode(buffer, size, &image);
+}
+
+/* Version 0.1: a fixed header followed directly by the code segment. */
+static ErrorCode parse_bytecode_v1(const uint8_t *buffer, size_t size,
+                                   BytecodeImage *image) {
+  uint32_t code_size;
+  memcpy(&code_size, buffer + BYTECODE_CODE_SIZE_OFFSET, sizeof(uint32_t));
+  if ((size_t)code_size + BYTECODE_HEADER_SIZE > size) {
+    log_error("Declared code size exceeds file size: %zu > %zu",
+              (size_t)code_size + BYTECODE_HEADER_SIZE, size);
+    return ERR_INVALID_FORMAT;
+  }
+
+  memcpy(&image->entry_point, buffer + BYTECODE_ENTRY_POINT_OFFSET,
          sizeof(uint32_t));
+  image->code = buffer + BYTECODE_HEADER_SIZE;
+  image->code_size = code_size;
+  return SUCCESS;
+}
 
-  if (code_sz + BYTECODE_HEADER_SIZE > file_size) {
-    free(full_buffer);
-    log_error("Declared code size exceeds file size: %u > %zu",
-              code_sz + BYTECODE_HEADER_SIZE, file_size);
+/* Version 0.2: a header and a section table locating each section. Every
+ * section must lie inside the buffer on a BYTECODE_SECTION_ALIGNMENT
+ * boundary and hold a whole number of entries.
+ */
+static ErrorCode parse_bytecode_v2(const uint8_t *buffer, size_t size,
+                                   bool checksum, BytecodeImage *image) {
+  BytecodeHeaderV2 header;
+  if (size < BYTECODE_V2_HEADER_SIZE) {
+    log_error("Bytecode file too small to contain a version 0.2 header");
     return ERR_INVALID_FORMAT;
   }
+  memcpy(&header, buffer, sizeof(header));
 
-  *code_buffer = (uint8_t *)malloc(code_sz);
-  if (NULL == *code_buffer) {
-    free(full_buffer);
-    log_error("Failed to allocate memory for code segment");
-    return ERR_OUT_OF_MEMORY;
+  ErrorCode status = check_header_v2(&header, size);
+  if (status != SUCCESS) {
+    return status;
   }
 
-  memcpy(*code_buffer, full_buffer + BYTECODE_HEADER_SIZE, code_sz);
-  *code_size = code_sz;
+  for (uint32_t i = 0; i < header.section_count; i++) {
+    BytecodeSection section;
+    memcpy(&section,
+           buffer + header.section_table_offset + i * sizeof(BytecodeSection),
+           sizeof(section));
+    status = check_section(&section, i, &header, size);
+    if (status != SUCCESS) {
+      return status;
+    }
 
-  free(full_buffer);
+    const uint8_t *contents = buffer + section.offset;
+    switch (section.type) {
+    case SECTION_CODE:
+      if (NULL != image->code) {
+        log_error("Duplicate code section");
+        return ERR_INVALID_FORMAT;
+      }
+      image->code = contents;
+      image->code_size = section.size;
+      if (header.flags & BYTECODE_FLAG_COMPRESSED_CODE) {
+        image->code_size = section.uncompressed_size;
+        image->compressed_code_size = section.size;
+      }
+      break;
+    case SECTION_CONSTANTS:
+      if (section.size % sizeof(int32_t) != 0) {
+        log_error("Constant pool size is not a multiple of 4: %u",
+                  section.size);
+        return ERR_INVALID_FORMAT;
+      }
+      image->constants = (const int32_t *)contents;
+      image->constant_count = section.size / sizeof(int32_t);
+      break;
+    case SECTION_FUNCTIONS:
+      if (section.size % sizeof(BytecodeFunction) != 0) {
+        log_error("Function table size is not a multiple of %zu: %u",
+                  sizeof(BytecodeFunction), section.size);
+        return ERR_INVALID_FORMAT;
+      }
+      image->functions = (const BytecodeFunction *)contents;
+      image->function_count = section.size / sizeof(BytecodeFunction);
+      break;
+    case SECTION_GLOBALS:
+      if (section.size % sizeof(int32_t) != 0) {
+        log_error("Globals size is not a multiple of 4: %u", section.size);
+        return ERR_INVALID_FORMAT;
+      }
+      image->globals = (const int32_t *)contents;
+      image->global_count = section.size / sizeof(int32_t);
+      break;
+    case SECTION_DEBUG:
+      image->debug = contents;
+      image->debug_size = section.size;
+      break;
+    case SECTION_SYMBOLS:
+      if (section.size % sizeof(BytecodeSymbol) != 0) {
+        log_error("Symbol table size is not a multiple of %zu: %u",
+                  sizeof(BytecodeSymbol), section.size);
+        return ERR_INVALID_FORMAT;
+      }
+      image->symbols = (const BytecodeSymbol *)contents;
+      image->symbol_count = section.size / sizeof(BytecodeSymbol);
+      break;
+    case SECTION_RELOCATIONS:
+      if (section.size % sizeof(BytecodeRelocation) != 0) {
+        log_error("Relocation table size is not a multiple of %zu: %u",
+                  sizeof(BytecodeRelocation), section.size);
+        return ERR_INVALID_FORMAT;
+      }
+      image->relocations = (const BytecodeRelocation *)contents;
+      image->relocation_count = section.size / sizeof(BytecodeRelocation);
+      break;
+    case SECTION_NAMES:
+      image->names = (const char *)contents;
+      image->names_size = section.size;
+      break;
+    default:
+      log_warn("Skipping unknown section type %u", section.type);
+      break;
+    }
+  }
 
-  log_info("Bytecode file '%s' loaded successfully (code size: %zu bytes, "
-           "entry point: %u)",
-           filename, *code_size, *entry_point);
+  if (NULL == image->code) {
+    log_error("Bytecode has no code section");
+    return ERR_INVALID_FORMAT;
+  }
+
+  // Checked after the structure, which is cheaper and more specific
+  if (checksum && (header.flags & BYTECODE_FLAG_CHECKSUM)) {
+    uint32_t actual = bytecode_checksum(buffer, size);
+    if (actual != header.checksum) {
+      log_error("Checksum mismatch: file has 0x%08X, contents give 0x%08X",
+                header.checksum, actual);
+      return ERR_CHECKSUM_MISMATCH;
+    }
+  }
+
+  for (size_t i = 0; i < image->function_count; i++) {
+    const BytecodeFunction *function = &image->functions[i];
+    if (function->entry > image->code_size ||
+        function->size > image->code_size - function->entry) {
+      log_error("Function %zu lies outside the code section", i);
+      return ERR_INVALID_FORMAT;
+    }
+    if (i > 0 && function->entry < image->functions[i - 1].entry +
+                                       image->functions[i - 1].size) {
+      log_error("Function table is unsorted or overlapping at entry %zu", i);
+      return ERR_INVALID_FORMAT;
+    }
+  }
+
+  image->entry_point = header.entry_point;
   return SUCCESS;
 }
 
-ErrorCode verify_bytecode_format(const uint8_t *buffer, size_t size) {
+/* Parses a file held in memory, checking its checksum only if asked to. */
+static ErrorCode parse_image(const uint8_t *buffer, size_t size,
+                             bool checksum, BytecodeImage *image) {
+  memset(image, 0, sizeof(*image));
   if (size < BYTECODE_HEADER_SIZE) {
     log_error("Bytecode file too small to contain valid header");
     return ERR_INVALID_FORMAT;
   }
 
-  uint8_t magic[4];
-  memcpy(&magic, buffer + BYTECODE_MAGIC_OFFSET, 4);
-  if (memcmp(magic, BYTECODE_MAGIC, 4) != 0) {
-    log_error("Invalid magic number: 0x%X expected: 0x%X", magic,
-              BYTECODE_MAGIC);
+  if (memcmp(buffer + BYTECODE_MAGIC_OFFSET, BYTECODE_MAGIC, 4) != 0) {
+    log_error("Invalid magic number: %02X %02X %02X %02X",
+              buffer[BYTECODE_MAGIC_OFFSET], buffer[BYTECODE_MAGIC_OFFSET + 1],
+              buffer[BYTECODE_MAGIC_OFFSET + 2],
+              buffer[BYTECODE_MAGIC_OFFSET + 3]);
     return ERR_INVALID_FORMAT;
   }
 
+  ErrorCode status;
   uint16_t version;
   memcpy(&version, buffer + BYTECODE_VERSION_OFFSET, sizeof(uint16_t));
-  if (version != BYTECODE_VERSION) {
+  if (version == BYTECODE_VERSION) {
+    status = parse_bytecode_v2(buffer, size, checksum, image);
+  } else if (version == BYTECODE_VERSION_V1) {
+    status = parse_bytecode_v1(buffer, size, image);
+  } else {
     log_error("Unsupported bytecode version: 0x%04X\nCurrent version: 0x%04X",
               version, BYTECODE_VERSION);
     return ERR_INVALID_FORMAT;
   }
-
-  uint32_t code_size;
-  memcpy(&code_size, buffer + BYTECODE_CODE_SIZE_OFFSET, sizeof(uint32_t));
-  if (code_size + 12 > size) { // 12 bytes for header
-    log_error("Declared code size exceeds file size: %u > %zu", code_size + 12,
-              size);
-    return ERR_INVALID_FORMAT;
+  if (status != SUCCESS) {
+    return status;
   }
 
-  uint32_t entry_point;
-  memcpy(&entry_point, buffer + BYTECODE_ENTRY_POINT_OFFSET, sizeof(uint32_t));
-  if (entry_point >= code_size) {
-    log_error("Invalid entry point: %u", entry_point);
+  if (image->entry_point >= image->code_size) {
+    log_error("Invalid entry point: %u", image->entry_point);
     return ERR_INVALID_FORMAT;
   }
 
+  image->version = version;
   log_info(
-      "Bytecode format verified: version 0x%04X, code size %u, entry point %u",
-      version, code_size, entry_point);
+      "Bytecode format verified: version 0x%04X, code size %zu, entry point %u",
+      version, image->code_size, image->entry_point);
   return SUCCESS;
 }
 
+ErrorCode parse_bytecode(const uint8_t *buffer, size_t size,
+                         BytecodeImage *image) {
+  return parse_image(buffer, size, true, image);
+}
+
 ErrorCode free_bytecode(uint8_t **buffer) {
+  return free_bytecode_with_allocator(&vm_default_allocator, buffer);
+}
+
+ErrorCode free_bytecode_with_allocator(const VM_Allocator *allocator,
+                                       uint8_t **buffer) {
   if (NULL != *buffer) {
-    free(*buffer);
+    allocator->free(allocator->ctx, *buffer);
     *buffer = NULL;
     log_info("Bytecode buffer freed");
     return SUCCESS;
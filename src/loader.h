@@ -5,13 +5,54 @@
  * 5. Prepare the bytecode for execution in vm loop
  */
 
+#ifndef LOADER_H
+#define LOADER_H
+
+#include "alloc.h"
+#include "bytecode_format.h"
 #include "errno.h"
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
-/* Loads bytecode from a file into a buffer.
+/* Parsed view of a bytecode file. Every pointer refers into the buffer that
+ * was parsed; sections a file does not have are NULL with a zero count.
+ * When compressed_code_size is non-zero, code points at the LZ stream and
+ * code_size is the size it decompresses to; such an image has to be
+ * decompressed (create_program_from_image does this) before it is verified
+ * or run.
+ */
+typedef struct {
+  uint16_t version;                      // Format version of the source file
+  uint32_t entry_point;                  // Entry point of the bytecode
+  const uint8_t *code;                   // Code section
+  size_t code_size;                      // Size of the code in bytes
+  size_t compressed_code_size;           // Stored size if code is LZ-compressed
+  const int32_t *constants;              // Constant pool
+  size_t constant_count;                 // Entries in constants
+  const BytecodeFunction *functions;     // Function table, sorted by entry
+  size_t function_count;                 // Entries in functions
+  const int32_t *globals;                // Initial values of the globals
+  size_t global_count;                   // Entries in globals
+  const uint8_t *debug;                  // Debug section contents
+  size_t debug_size;                     // Size of the debug section in bytes
+  const BytecodeSymbol *symbols;         // Exports and imports of a module
+  size_t symbol_count;                   // Entries in symbols
+  const BytecodeRelocation *relocations; // Calls to imports, by offset
+  size_t relocation_count;               // Entries in relocations
+  const char *names;                     // Names the symbols point into
+  size_t names_size;                     // Size of names in bytes
+} BytecodeImage;
+
+/* Loads bytecode from a file into a buffer. The file is read front to back
+ * in one pass and never seeked, so it may be a pipe; "-" reads standard
+ * input. Only the header, the section table and the code are kept: the code
+ * is read straight into code_buffer, decompressing it on the way if the
+ * file stores it compressed, and the rest is only read to be checksummed.
+ * The code section has to follow the section table, as it does in every
+ * file write_bytecode produces.
  * Parameters:
- *  filename - Path to the bytecode file
+ *  filename - Path to the bytecode file, or "-" for standard input
  *  code_buffer - Pointer to the buffer where bytecode will be stored
  *  code_size - Pointer to size variable where the size of the bytecode will be
  *  entry_point - Pointer to variable where the entry point will be
@@ -20,6 +61,110 @@
 ErrorCode load_bytecode(const char *filename, uint8_t **code_buffer,
                         size_t *code_size, uint32_t *entry_point);
 
+/* Same as load_bytecode, but every buffer (including the read buffer used
+ * for compressed code) comes from the given allocator. Release the result with
+ * free_bytecode_with_allocator on the same allocator.
+ */
+ErrorCode load_bytecode_with_allocator(const char *filename,
+                                       const VM_Allocator *allocator,
+                                       uint8_t **code_buffer,
+                                       size_t *code_size,
+                                       uint32_t *entry_point);
+
+/* Loads bytecode from a descriptor that need not be seekable, such as a
+ * pipe, a socket or standard input. The code is read into a buffer of
+ * exactly its size; nothing past the file's last section is consumed, so
+ * further data on the descriptor is left for the caller.
+ * Parameters:
+ *   fd - Descriptor positioned at the start of a bytecode file
+ *   allocator - Allocator for the code buffer and the read buffer
+ *   code_buffer - Receives the code; free with free_bytecode_with_allocator
+ *   code_size - Receives the size of the code in bytes
+ *   entry_point - Receives the entry point
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode load_bytecode_fd(int fd, const VM_Allocator *allocator,
+                           uint8_t **code_buffer, size_t *code_size,
+                           uint32_t *entry_point);
+
+/* Reads a whole bytecode file from a descriptor that need not be seekable
+ * into one buffer of exactly the file's size, which the header and section
+ * table give. Pass the result to parse_bytecode. The section table has to
+ * follow the header directly, as write_bytecode lays it out.
+ * Parameters:
+ *   fd - Descriptor positioned at the start of a bytecode file
+ *   allocator - Allocator for the buffer
+ *   buffer - Receives the file
+ *   size - Receives the size of the file in bytes
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode read_bytecode_fd(int fd, const VM_Allocator *allocator,
+                           uint8_t **buffer, size_t *size);
+
+/* Bytecode file mapped read-only into memory. The image points into the
+ * mapping, so it stays valid until unmap_bytecode and is shared with the
+ * page cache.
+ */
+typedef struct {
+  BytecodeImage image; // Sections inside the mapping
+  void *mapping;       // Start of the mapped file
+  size_t mapping_size; // Length of the mapping
+} MappedBytecode;
+
+/* Maps a bytecode file read-only and parses it in place, without copying
+ * any section. Pair with bind_program to run it. A compressed code section
+ * is left compressed.
+ * Parameters:
+ *   filename - Path to the bytecode file
+ *   mapped - Receives the mapping and the parsed image
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode map_bytecode(const char *filename, MappedBytecode *mapped);
+
+/* Maps and parses a bytecode file like map_bytecode, but leaves its
+ * checksum unchecked: summing the file would read every page of it, while
+ * this touches only the header, section table and function table. For
+ * callers that verify the code before running it, such as
+ * open_program_lazy.
+ * Parameters:
+ *   filename - Path to the bytecode file
+ *   mapped - Receives the mapping and the parsed image
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode map_bytecode_lazy(const char *filename, MappedBytecode *mapped);
+
+/* Unmaps a file mapped by map_bytecode. Any VM bound to its code must be
+ * freed or rebound first.
+ */
+ErrorCode unmap_bytecode(MappedBytecode *mapped);
+
+/* Checks the header, section layout and (when the file carries one) the
+ * checksum of a bytecode file held in memory, and locates its sections.
+ * Accepts version 0.1 and 0.2 files.
+ * Parameters:
+ *   buffer - Pointer to the buffer containing the whole file
+ *   size - Size of the buffer in bytes
+ *   image - Receives pointers into buffer for each section
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode parse_bytecode(const uint8_t *buffer, size_t size,
+                         BytecodeImage *image);
+
+/* Computes the CRC-32C of a version 0.2 file held in memory, reading the
+ * header's checksum field as zero.
+ * Parameters:
+ *   buffer - Whole file; at least BYTECODE_V2_HEADER_SIZE bytes
+ *   size - Size of the file in bytes
+ * Returns:
+ *   Value that belongs in the header's checksum field
+ */
+uint32_t bytecode_checksum(const uint8_t *buffer, size_t size);
+
 /* Verifies the format of the loaded bytecode.
  * Parameters:
  *   buffer - Pointer to the buffer containing the bytecode
@@ -36,3 +181,15 @@ ErrorCode verify_bytecode_format(const uint8_t *buffer, size_t size);
  *   ErrorCode indicating success or type of failure
  */
 ErrorCode free_bytecode(uint8_t **buffer);
+
+/* Frees a bytecode buffer obtained from load_bytecode_with_allocator.
+ * Parameters:
+ *   allocator - Allocator the buffer came from
+ *   buffer - Pointer to the buffer to be freed
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode free_bytecode_with_allocator(const VM_Allocator *allocator,
+                                       uint8_t **buffer);
+
+#endif // LOADER_H
@@ -0,0 +1,330 @@
+#include "lz.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define LZ_HASH_BITS 16
+#define LZ_LAST_LITERALS 5 // The stream always ends with literals
+
+static inline uint32_t read_u32(const uint8_t *bytes) {
+  uint32_t value;
+  memcpy(&value, bytes, sizeof(uint32_t));
+  return value;
+}
+
+static inline uint32_t hash_u32(uint32_t value) {
+  return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+size_t lz_compress_bound(size_t size) { return size + size / 255 + 16; }
+
+/* Appends a length that did not fit in its token nibble. */
+static uint8_t *put_length(uint8_t *out, size_t length) {
+  while (length >= 255) {
+    *out++ = 255;
+    length -= 255;
+  }
+  *out++ = (uint8_t)length;
+  return out;
+}
+
+/* Appends one sequence; a match_length of 0 marks the final sequence. */
+static uint8_t *put_sequence(uint8_t *out, const uint8_t *literals,
+                             size_t literal_length, uint32_t offset,
+                             size_t match_length) {
+  size_t match_code = match_length == 0 ? 0 : match_length - LZ_MIN_MATCH;
+  uint8_t *token = out++;
+  *token = (uint8_t)((literal_length < 15 ? literal_length : 15) << 4);
+  if (literal_length >= 15) {
+    out = put_length(out, literal_length - 15);
+  }
+  memcpy(out, literals, literal_length);
+  out += literal_length;
+  if (match_length == 0) {
+    return out;
+  }
+
+  *token |= (uint8_t)(match_code < 15 ? match_code : 15);
+  *out++ = (uint8_t)(offset & 0xFF);
+  *out++ = (uint8_t)(offset >> 8);
+  if (match_code >= 15) {
+    out = put_length(out, match_code - 15);
+  }
+  return out;
+}
+
+ErrorCode lz_compress(const uint8_t *input, size_t size, uint8_t *output,
+                      size_t capacity, size_t *compressed_size) {
+  if (NULL == input || NULL == output || NULL == compressed_size) {
+    log_error("Compression input or output is NULL");
+    return ERR_NULL_POINTER;
+  }
+  if (capacity < lz_compress_bound(size)) {
+    log_error("Compression buffer too small: %zu < %zu bytes", capacity,
+              lz_compress_bound(size));
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  // Positions are stored + 1 so that zero means "no earlier occurrence"
+  uint32_t *table = calloc((size_t)1 << LZ_HASH_BITS, sizeof(uint32_t));
+  if (NULL == table) {
+    log_error("Failed to allocate memory for the compression table");
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  uint8_t *out = output;
+  size_t anchor = 0;
+  size_t ip = 0;
+  size_t limit = size > LZ_LAST_LITERALS ? size - LZ_LAST_LITERALS : 0;
+  while (ip + LZ_MIN_MATCH <= limit) {
+    uint32_t sequence = read_u32(input + ip);
+    uint32_t *slot = &table[hash_u32(sequence)];
+    size_t candidate = *slot;
+    *slot = (uint32_t)(ip + 1);
+    if (candidate == 0 || ip - (candidate - 1) > LZ_MAX_OFFSET ||
+        read_u32(input + candidate - 1) != sequence) {
+      ip++;
+      continue;
+    }
+
+    size_t match = candidate - 1;
+    size_t length = LZ_MIN_MATCH;
+    while (ip + length < limit &&
+           input[match + length] == input[ip + length]) {
+      length++;
+    }
+    out = put_sequence(out, input + anchor, ip - anchor,
+                       (uint32_t)(ip - match), length);
+    ip += length;
+    anchor = ip;
+  }
+  out = put_sequence(out, input + anchor, size - anchor, 0, 0);
+  free(table);
+
+  *compressed_size = (size_t)(out - output);
+  return SUCCESS;
+}
+
+void lz_decoder_init(LZ_Decoder *decoder, uint8_t *out, size_t capacity) {
+  memset(decoder, 0, sizeof(*decoder));
+  decoder->out = out;
+  decoder->capacity = capacity;
+  decoder->state = LZ_TOKEN;
+}
+
+/* Called once a sequence's literals are copied: the stream either ends here
+ * or continues with a match offset.
+ */
+static void end_literals(LZ_Decoder *decoder) {
+  if (decoder->position == decoder->capacity) {
+    decoder->state = LZ_DONE;
+  } else {
+    decoder->offset = 0;
+    decoder->offset_bytes = 0;
+    decoder->state = LZ_OFFSET;
+  }
+}
+
+static ErrorCode start_literals(LZ_Decoder *decoder) {
+  if (decoder->literal_length > decoder->capacity - decoder->position) {
+    log_error("Compressed stream overruns its declared size");
+    return ERR_INVALID_FORMAT;
+  }
+  if (decoder->literal_length == 0) {
+    end_literals(decoder);
+  } else {
+    decoder->state = LZ_LITERALS;
+  }
+  return SUCCESS;
+}
+
+static ErrorCode copy_match(LZ_Decoder *decoder) {
+  size_t length = decoder->match_length;
+  if (length > decoder->capacity - decoder->position) {
+    log_error("Compressed stream overruns its declared size");
+    return ERR_INVALID_FORMAT;
+  }
+
+  uint8_t *dst = decoder->out + decoder->position;
+  const uint8_t *src = dst - decoder->offset;
+  if (decoder->offset >= length) {
+    memcpy(dst, src, length);
+  } else {
+    // Overlapping match: repeats the last `offset` bytes
+    for (size_t i = 0; i < length; i++) {
+      dst[i] = src[i];
+    }
+  }
+  decoder->position += length;
+  decoder->state = LZ_TOKEN;
+  return SUCCESS;
+}
+
+/* Reads a length extension from p, or returns NULL if it runs past end. */
+static const uint8_t *get_length(const uint8_t *p, const uint8_t *end,
+                                 size_t *length) {
+  uint8_t byte;
+  do {
+    if (p >= end) {
+      return NULL;
+    }
+    byte = *p++;
+    *length += byte;
+  } while (byte == 255);
+  return p;
+}
+
+/* Decodes one whole sequence when it lies entirely inside the current
+ * chunk, skipping the byte-at-a-time state machine. Returns the input
+ * position after the sequence, or NULL (with the decoder untouched) if the
+ * sequence is incomplete or is the last one; the slow path then handles it.
+ */
+static const uint8_t *decode_sequence(LZ_Decoder *decoder, const uint8_t *p,
+                                      const uint8_t *end,
+                                      ErrorCode *status) {
+  uint8_t token = *p++;
+  size_t literal_length = token >> 4;
+  size_t match_length = (size_t)(token & 0x0F) + LZ_MIN_MATCH;
+  if (literal_length == 15 &&
+      NULL == (p = get_length(p, end, &literal_length))) {
+    return NULL;
+  }
+
+  size_t room = decoder->capacity - decoder->position;
+  if ((size_t)(end - p) < literal_length + 2 || literal_length >= room) {
+    return NULL;
+  }
+  const uint8_t *literals = p;
+  p += literal_length;
+  uint32_t offset = (uint32_t)p[0] | ((uint32_t)p[1] << 8);
+  p += 2;
+  if ((token & 0x0F) == 15 &&
+      NULL == (p = get_length(p, end, &match_length))) {
+    return NULL;
+  }
+
+  if (offset == 0 || offset > decoder->position + literal_length ||
+      match_length > room - literal_length) {
+    log_error("Invalid match at output position %zu",
+              decoder->position + literal_length);
+    *status = ERR_INVALID_FORMAT;
+    return NULL;
+  }
+  memcpy(decoder->out + decoder->position, literals, literal_length);
+  decoder->position += literal_length;
+  decoder->token = token;
+  decoder->offset = offset;
+  decoder->match_length = match_length;
+  *status = copy_match(decoder);
+  return p;
+}
+
+ErrorCode lz_decode(LZ_Decoder *decoder, const uint8_t *input, size_t size) {
+  if (NULL == decoder || (NULL == input && size > 0)) {
+    log_error("Decoder or input is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+  const uint8_t *end = input + size;
+  ErrorCode status = SUCCESS;
+  while (input < end && status == SUCCESS) {
+    if (decoder->state == LZ_TOKEN) {
+      const uint8_t *next = decode_sequence(decoder, input, end, &status);
+      if (NULL != next) {
+        input = next;
+        continue;
+      }
+      if (status != SUCCESS) {
+        return status;
+      }
+    }
+    switch (decoder->state) {
+    case LZ_TOKEN: {
+      decoder->token = *input++;
+      decoder->literal_length = decoder->token >> 4;
+      decoder->match_length = (decoder->token & 0x0F) + LZ_MIN_MATCH;
+      if (decoder->literal_length == 15) {
+        decoder->state = LZ_LITERAL_LENGTH;
+      } else {
+        status = start_literals(decoder);
+      }
+      break;
+    }
+    case LZ_LITERAL_LENGTH: {
+      uint8_t byte = *input++;
+      decoder->literal_length += byte;
+      if (byte != 255) {
+        status = start_literals(decoder);
+      }
+      break;
+    }
+    case LZ_LITERALS: {
+      size_t count = (size_t)(end - input);
+      if (count > decoder->literal_length) {
+        count = decoder->literal_length;
+      }
+      memcpy(decoder->out + decoder->position, input, count);
+      input += count;
+      decoder->position += count;
+      decoder->literal_length -= count;
+      if (decoder->literal_length == 0) {
+        end_literals(decoder);
+      }
+      break;
+    }
+    case LZ_OFFSET: {
+      decoder->offset |= (uint32_t)*input++ << (8 * decoder->offset_bytes++);
+      if (decoder->offset_bytes < 2) {
+        break;
+      }
+      if (decoder->offset == 0 || decoder->offset > decoder->position) {
+        log_error("Invalid match offset %u at output position %zu",
+                  decoder->offset, decoder->position);
+        return ERR_INVALID_FORMAT;
+      }
+      if ((decoder->token & 0x0F) == 15) {
+        decoder->state = LZ_MATCH_LENGTH;
+      } else {
+        status = copy_match(decoder);
+      }
+      break;
+    }
+    case LZ_MATCH_LENGTH: {
+      uint8_t byte = *input++;
+      decoder->match_length += byte;
+      if (byte != 255) {
+        status = copy_match(decoder);
+      }
+      break;
+    }
+    case LZ_DONE:
+      log_error("Trailing data after the end of the compressed stream");
+      return ERR_INVALID_FORMAT;
+    }
+  }
+  return status;
+}
+
+ErrorCode lz_decoder_finish(const LZ_Decoder *decoder) {
+  if (NULL == decoder) {
+    log_error("Decoder is NULL");
+    return ERR_NULL_POINTER;
+  }
+  if (decoder->state != LZ_DONE) {
+    log_error("Compressed stream ended early: %zu of %zu bytes",
+              decoder->position, decoder->capacity);
+    return ERR_INVALID_FORMAT;
+  }
+  return SUCCESS;
+}
+
+ErrorCode lz_decompress(const uint8_t *input, size_t size, uint8_t *output,
+                        size_t output_size) {
+  LZ_Decoder decoder;
+  lz_decoder_init(&decoder, output, output_size);
+  ErrorCode status = lz_decode(&decoder, input, size);
+  if (status != SUCCESS) {
+    return status;
+  }
+  return lz_decoder_finish(&decoder);
+}
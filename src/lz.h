@@ -0,0 +1,94 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include "errno.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Byte-oriented LZ77 codec used for compressed code sections. A stream is a
+ * series of sequences, each made of:
+ *  - a token: literal count in the high nibble, match length - 4 in the low
+ *    nibble; 15 in either means "add the following bytes", which continue
+ *    while they are 255
+ *  - the literals
+ *  - a 16-bit little-endian match offset (1 to 65535 bytes back) and any
+ *    match length bytes
+ * The last sequence has literals only; the stream ends once the declared
+ * uncompressed size has been produced. Matches are copied from the output
+ * itself, so decoding needs no window beyond the destination buffer.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+typedef enum {
+  LZ_TOKEN,
+  LZ_LITERAL_LENGTH,
+  LZ_LITERALS,
+  LZ_OFFSET,
+  LZ_MATCH_LENGTH,
+  LZ_DONE,
+} LZ_State;
+
+/* Incremental decoder: input may be fed in chunks of any size, and output
+ * goes straight into the caller's buffer.
+ */
+typedef struct {
+  uint8_t *out;          // Destination buffer
+  size_t capacity;       // Uncompressed size the stream must produce
+  size_t position;       // Bytes produced so far
+  LZ_State state;        // Where decoding resumes with the next input byte
+  uint8_t token;         // Token of the sequence being decoded
+  uint8_t offset_bytes;  // Match offset bytes read so far
+  uint32_t offset;       // Match offset being read
+  size_t literal_length; // Literals still to copy
+  size_t match_length;   // Length of the pending match
+} LZ_Decoder;
+
+/* Returns the largest compressed size `size` input bytes can produce. */
+size_t lz_compress_bound(size_t size);
+
+/* Compresses a buffer.
+ * Parameters:
+ *   input - Bytes to compress
+ *   size - Number of input bytes
+ *   output - Receives the compressed stream
+ *   capacity - Size of output; lz_compress_bound(size) always suffices
+ *   compressed_size - Receives the size of the compressed stream
+ * Returns:
+ *   ErrorCode indicating success or type of failure (ERR_OUT_OF_MEMORY if
+ *   output is too small)
+ */
+ErrorCode lz_compress(const uint8_t *input, size_t size, uint8_t *output,
+                      size_t capacity, size_t *compressed_size);
+
+/* Prepares a decoder that writes exactly `capacity` bytes to `out`. */
+void lz_decoder_init(LZ_Decoder *decoder, uint8_t *out, size_t capacity);
+
+/* Decodes the next chunk of a compressed stream.
+ * Parameters:
+ *   decoder - Decoder state
+ *   input - Next compressed bytes
+ *   size - Number of bytes in input
+ * Returns:
+ *   ErrorCode indicating success or type of failure (ERR_INVALID_FORMAT for
+ *   a corrupt stream)
+ */
+ErrorCode lz_decode(LZ_Decoder *decoder, const uint8_t *input, size_t size);
+
+/* Checks that the stream fed to a decoder was complete. */
+ErrorCode lz_decoder_finish(const LZ_Decoder *decoder);
+
+/* Decompresses a whole stream held in memory.
+ * Parameters:
+ *   input - Compressed stream
+ *   size - Size of the compressed stream
+ *   output - Receives the uncompressed bytes
+ *   output_size - Exact uncompressed size
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode lz_decompress(const uint8_t *input, size_t size, uint8_t *output,
+                        size_t output_size);
+
+#endif // LZ_H
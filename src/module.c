@@ -0,0 +1,294 @@
+#include "module.h"
+#include "bytecode_format.h"
+#include "log.h"
+#include "verify.h"
+#include <stdbool.h>
+#include <string.h>
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+#define MIN_EXPORT_CAPACITY 16
+
+static uint32_t hash_name(const char *name, size_t length) {
+  uint32_t hash = FNV_OFFSET_BASIS;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (uint8_t)name[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+/* Probes for a name, returning its slot or the free slot where it would
+ * go. The table always has free slots, so the probe ends.
+ */
+static VM_Export *find_slot(VM_Export *table, size_t capacity,
+                            const char *name, uint32_t length,
+                            uint32_t hash) {
+  size_t slot = hash & (capacity - 1);
+  while (NULL != table[slot].name &&
+         (table[slot].hash != hash || table[slot].length != length ||
+          0 != memcmp(table[slot].name, name, length))) {
+    slot = (slot + 1) & (capacity - 1);
+  }
+  return &table[slot];
+}
+
+/* Checks that every name fits in the names section and every export is a
+ * function entry, before the VM relies on either.
+ */
+static ErrorCode check_symbols(const BytecodeImage *image) {
+  for (size_t i = 0; i < image->symbol_count; i++) {
+    const BytecodeSymbol *symbol = &image->symbols[i];
+    bool named = symbol->name_length > 0 &&
+                 symbol->name_offset <= image->names_size &&
+                 symbol->name_length <= image->names_size - symbol->name_offset;
+    bool valid = symbol->kind == SYMBOL_IMPORT ||
+                 (symbol->kind == SYMBOL_EXPORT &&
+                  is_function_entry(image, symbol->value));
+    if (!named || !valid) {
+      log_error("Symbol %zu is not a named import or function export", i);
+      return ERR_INVALID_FORMAT;
+    }
+  }
+  return SUCCESS;
+}
+
+/* Adds a module's exports to a table with room for them. */
+static ErrorCode insert_exports(VM_Export *table, size_t capacity,
+                                const BytecodeImage *image, uint32_t module) {
+  for (size_t i = 0; i < image->symbol_count; i++) {
+    const BytecodeSymbol *symbol = &image->symbols[i];
+    if (symbol->kind != SYMBOL_EXPORT) {
+      continue;
+    }
+    const char *name = image->names + symbol->name_offset;
+    uint32_t hash = hash_name(name, symbol->name_length);
+    VM_Export *slot =
+        find_slot(table, capacity, name, symbol->name_length, hash);
+    if (NULL != slot->name) {
+      log_error("Symbol '%.*s' is already exported by module %u",
+                (int)symbol->name_length, name, slot->module);
+      return ERR_INVALID_OPERAND;
+    }
+    *slot = (VM_Export){name, symbol->name_length, hash, module,
+                        symbol->value};
+  }
+  return SUCCESS;
+}
+
+static size_t count_exports(const Program *program) {
+  size_t count = 0;
+  for (size_t i = 0; NULL != program && i < program->image.symbol_count;
+       i++) {
+    count += program->image.symbols[i].kind == SYMBOL_EXPORT;
+  }
+  return count;
+}
+
+/* Allocates a module's import slots, one per symbol, all unresolved. */
+static ErrorCode init_imports(Nano_VM *vm, VM_Module *module) {
+  module->imports = NULL;
+  module->import_count =
+      NULL == module->program ? 0 : module->program->image.symbol_count;
+  if (0 == module->import_count) {
+    return SUCCESS;
+  }
+  module->imports = vm->allocator.alloc(
+      vm->allocator.ctx, sizeof(VM_Import) * module->import_count);
+  if (NULL == module->imports) {
+    log_error("Failed to allocate %zu import slots", module->import_count);
+    return ERR_OUT_OF_MEMORY;
+  }
+  for (size_t i = 0; i < module->import_count; i++) {
+    module->imports[i].module = VM_UNRESOLVED_IMPORT;
+    module->imports[i].entry = 0;
+  }
+  return SUCCESS;
+}
+
+/* Describes an attached program as a module with its own globals. */
+static ErrorCode init_module(Nano_VM *vm, VM_Module *module,
+                             Program *program) {
+  const BytecodeImage *image = &program->image;
+  module->program = program;
+  module->code = image->code;
+  module->code_size = image->code_size;
+  module->constants = image->constants;
+  module->constant_count = image->constant_count;
+  module->globals = NULL;
+  module->global_count = image->global_count;
+  if (image->global_count > 0) {
+    module->globals = vm->allocator.alloc(
+        vm->allocator.ctx, sizeof(int32_t) * image->global_count);
+    if (NULL == module->globals) {
+      log_error("Failed to allocate memory for %zu globals",
+                image->global_count);
+      return ERR_OUT_OF_MEMORY;
+    }
+    memcpy(module->globals, image->globals,
+           sizeof(int32_t) * image->global_count);
+  }
+  return init_imports(vm, module);
+}
+
+static void free_module(Nano_VM *vm, VM_Module *module, bool main) {
+  if (!main && NULL != module->globals) {
+    vm->allocator.free(vm->allocator.ctx, module->globals);
+  }
+  if (NULL != module->imports) {
+    vm->allocator.free(vm->allocator.ctx, module->imports);
+  }
+}
+
+ErrorCode attach_module(Nano_VM *vm, Program *module) {
+  if (NULL == vm || NULL == module) {
+    log_error("VM instance or module is NULL");
+    return ERR_NULL_POINTER;
+  }
+  if (NULL == vm->code) {
+    log_error("Attach the main program before its modules");
+    return ERR_INVALID_OPERAND;
+  }
+
+  bool first = NULL == vm->modules;
+  ErrorCode status = check_symbols(&module->image);
+  if (status == SUCCESS && first && NULL != vm->program) {
+    status = check_symbols(&vm->program->image);
+  }
+  if (status != SUCCESS) {
+    return status;
+  }
+
+  // The table is rebuilt at no more than half full, so probes stay short
+  size_t exports = vm->export_count + count_exports(module) +
+                   (first ? count_exports(vm->program) : 0);
+  size_t capacity = MIN_EXPORT_CAPACITY;
+  while (capacity < 2 * exports) {
+    capacity *= 2;
+  }
+  size_t count = first ? 2 : vm->module_count + 1;
+  VM_Export *table =
+      vm->allocator.alloc(vm->allocator.ctx, sizeof(VM_Export) * capacity);
+  VM_Module *modules =
+      vm->allocator.alloc(vm->allocator.ctx, sizeof(VM_Module) * count);
+  if (NULL == table || NULL == modules) {
+    log_error("Failed to allocate memory for %zu modules", count);
+    status = ERR_OUT_OF_MEMORY;
+    goto FAIL;
+  }
+  memset(table, 0, sizeof(VM_Export) * capacity);
+  memset(modules, 0, sizeof(VM_Module) * count);
+
+  if (first) {
+    // The main program becomes module 0, keeping the globals it has
+    modules[0].program = vm->program;
+    modules[0].code = vm->code;
+    modules[0].code_size = vm->code_size;
+    modules[0].constants = vm->constants;
+    modules[0].constant_count = vm->constant_count;
+    modules[0].globals = vm->globals;
+    modules[0].global_count = vm->global_count;
+    status = init_imports(vm, &modules[0]);
+    if (status == SUCCESS && NULL != vm->program) {
+      status = insert_exports(table, capacity, &vm->program->image, 0);
+    }
+  } else {
+    memcpy(modules, vm->modules, sizeof(VM_Module) * vm->module_count);
+    for (size_t i = 0; i < vm->export_capacity; i++) {
+      if (NULL != vm->exports[i].name) {
+        *find_slot(table, capacity, vm->exports[i].name,
+                   vm->exports[i].length, vm->exports[i].hash) =
+            vm->exports[i];
+      }
+    }
+  }
+  if (status == SUCCESS) {
+    status = insert_exports(table, capacity, &module->image,
+                            (uint32_t)(count - 1));
+  }
+  if (status == SUCCESS) {
+    status = init_module(vm, &modules[count - 1], module);
+  }
+  if (status != SUCCESS) {
+    free_module(vm, &modules[count - 1], false);
+    if (first) {
+      free_module(vm, &modules[0], true);
+    }
+    goto FAIL;
+  }
+
+  if (!first) {
+    vm->allocator.free(vm->allocator.ctx, vm->modules);
+    vm->allocator.free(vm->allocator.ctx, vm->exports);
+  }
+  vm->modules = modules;
+  vm->module_count = count;
+  vm->exports = table;
+  vm->export_capacity = capacity;
+  vm->export_count = exports;
+  retain_program(module);
+  log_debug("Module %zu attached (%zu bytes, %zu exports in the VM)",
+            count - 1, module->image.code_size, exports);
+  return SUCCESS;
+
+FAIL:
+  if (NULL != table) {
+    vm->allocator.free(vm->allocator.ctx, table);
+  }
+  if (NULL != modules) {
+    vm->allocator.free(vm->allocator.ctx, modules);
+  }
+  return status;
+}
+
+ErrorCode resolve_import(Nano_VM *vm, size_t module, uint32_t index) {
+  const BytecodeImage *image = &vm->modules[module].program->image;
+  const BytecodeSymbol *symbol = &image->symbols[index];
+  const char *name = image->names + symbol->name_offset;
+  if (symbol->kind != SYMBOL_IMPORT) {
+    log_error("Symbol %u of module %zu is not an import", index, module);
+    return ERR_INVALID_OPERAND;
+  }
+
+  const VM_Export *definition =
+      find_slot(vm->exports, vm->export_capacity, name, symbol->name_length,
+                hash_name(name, symbol->name_length));
+  if (NULL == definition->name) {
+    log_error("Undefined symbol '%.*s' called from module %zu",
+              (int)symbol->name_length, name, module);
+    return ERR_INVALID_OPERAND;
+  }
+  vm->modules[module].imports[index].module = definition->module;
+  vm->modules[module].imports[index].entry = definition->entry;
+  log_debug("Import '%.*s' of module %zu resolved to module %u offset %u",
+            (int)symbol->name_length, name, module, definition->module,
+            definition->entry);
+  return SUCCESS;
+}
+
+void reset_modules(Nano_VM *vm) {
+  enter_module(vm, 0);
+  for (size_t i = 1; i < vm->module_count; i++) {
+    VM_Module *module = &vm->modules[i];
+    if (module->global_count > 0) {
+      memcpy(module->globals, module->program->image.globals,
+             sizeof(int32_t) * module->global_count);
+    }
+  }
+}
+
+void release_modules(Nano_VM *vm) {
+  enter_module(vm, 0);
+  for (size_t i = 0; i < vm->module_count; i++) {
+    free_module(vm, &vm->modules[i], i == 0);
+    if (i > 0) {
+      release_program(vm->modules[i].program);
+    }
+  }
+  vm->allocator.free(vm->allocator.ctx, vm->modules);
+  vm->allocator.free(vm->allocator.ctx, vm->exports);
+  vm->modules = NULL;
+  vm->module_count = 0;
+  vm->exports = NULL;
+  vm->export_capacity = 0;
+  vm->export_count = 0;
+}
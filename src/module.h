@@ -0,0 +1,63 @@
+#ifndef MODULE_H
+#define MODULE_H
+
+#include "errno.h"
+#include "program.h"
+#include "vm.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Attaches an extra program to a VM as a module whose exported functions the
+ * VM's code can call with CALLX. The module is shared, not copied: the VM
+ * takes a reference to it and gets its own copy of its globals, so one
+ * loaded library can serve any number of VMs. Every module's exports go
+ * into one hash table on the VM. A CALLX looks its import up there on first
+ * use and stores the result in the module's import slot, so later calls
+ * through the slot go straight to the function. The main program has to be
+ * attached (or loaded) first; attaching, loading or freeing the main
+ * program detaches every module.
+ * Parameters:
+ *   vm - VM with its main program attached
+ *   module - Program whose symbol table exports function entries by name
+ * Returns:
+ *   ErrorCode indicating success or type of failure; ERR_INVALID_OPERAND
+ *   if a name is already exported by another module
+ */
+ErrorCode attach_module(Nano_VM *vm, Program *module);
+
+/* Looks up the import in slot `index` of a module's symbol table and fills
+ * the slot in. The VM calls this on the first CALLX through a slot.
+ * Parameters:
+ *   vm - VM with modules attached
+ *   module - Index of the calling module in vm->modules
+ *   index - Symbol table index of the import
+ * Returns:
+ *   ErrorCode indicating success or type of failure; ERR_INVALID_OPERAND
+ *   if no module exports the name
+ */
+ErrorCode resolve_import(Nano_VM *vm, size_t module, uint32_t index);
+
+/* Returns to the main program and restores every module's globals, as part
+ * of reset_vm. Resolved imports stay resolved.
+ */
+void reset_modules(Nano_VM *vm);
+
+/* Returns to the main program and detaches every module. */
+void release_modules(Nano_VM *vm);
+
+/* Points the interpreter registers at a module's code, constants and
+ * globals. Called when a CALLX or RET crosses into another module.
+ */
+static inline void enter_module(Nano_VM *vm, size_t index) {
+  const VM_Module *module = &vm->modules[index];
+  vm->code = module->code;
+  vm->code_size = module->code_size;
+  vm->constants = module->constants;
+  vm->constant_count = module->constant_count;
+  vm->globals = module->globals;
+  vm->global_count = module->global_count;
+  vm->program = module->program;
+  vm->module = index;
+}
+
+#endif // MODULE_H
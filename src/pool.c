@@ -0,0 +1,138 @@
+#include "pool.h"
+#include "log.h"
+#include <stdlib.h>
+
+ErrorCode init_vm_pool(VM_Pool *pool, size_t count, Program *program) {
+  ErrorCode status = SUCCESS;
+  if (NULL == pool || NULL == program) {
+    log_error("VM pool or program is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+  if (0 == count) {
+    log_error("VM pool must hold at least one VM");
+    return ERR_INVALID_OPERAND;
+  }
+
+  // Nano_VM is cache-line aligned, so its size is a multiple of the alignment
+  pool->vms = aligned_alloc(_Alignof(Nano_VM), sizeof(Nano_VM) * count);
+  pool->free_list = malloc(sizeof(Nano_VM *) * count);
+  pool->acquired = calloc(count, sizeof(bool));
+  if (NULL == pool->vms || NULL == pool->free_list || NULL == pool->acquired) {
+    log_error("Failed to allocate memory for a pool of %zu VMs", count);
+    free(pool->vms);
+    free(pool->free_list);
+    free(pool->acquired);
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  size_t ready = 0;
+  for (; ready < count; ready++) {
+    Nano_VM *vm = &pool->vms[ready];
+    status = init_vm(vm);
+    if (status != SUCCESS) {
+      break;
+    }
+    status = attach_program(vm, program);
+    if (status != SUCCESS) {
+      free_vm(vm);
+      break;
+    }
+    pool->free_list[ready] = vm;
+  }
+
+  if (status != SUCCESS) {
+    log_error("Failed to prepare VM %zu of %zu for the pool", ready, count);
+    while (ready > 0) {
+      free_vm(&pool->vms[--ready]);
+    }
+    free(pool->vms);
+    free(pool->free_list);
+    free(pool->acquired);
+    return status;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pool->free_count = count;
+  pool->capacity = count;
+  log_info("VM pool ready with %zu instances", count);
+  return SUCCESS;
+}
+
+ErrorCode acquire_vm(VM_Pool *pool, Nano_VM **vm) {
+  if (NULL == pool || NULL == vm) {
+    log_error("VM pool or output pointer is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  if (0 == pool->free_count) {
+    pthread_mutex_unlock(&pool->lock);
+    log_warn("VM pool exhausted (%zu instances in use)", pool->capacity);
+    return ERR_OUT_OF_MEMORY;
+  }
+  *vm = pool->free_list[--pool->free_count];
+  pool->acquired[*vm - pool->vms] = true;
+  pthread_mutex_unlock(&pool->lock);
+  return SUCCESS;
+}
+
+ErrorCode release_vm(VM_Pool *pool, Nano_VM *vm) {
+  if (NULL == pool || NULL == vm) {
+    log_error("VM pool or VM instance is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+  uintptr_t offset = (uintptr_t)vm - (uintptr_t)pool->vms;
+  if (vm < pool->vms || vm >= pool->vms + pool->capacity ||
+      offset % sizeof(Nano_VM) != 0) {
+    log_error("VM was not acquired from this pool");
+    return ERR_INVALID_OPERAND;
+  }
+
+  // Clearing the flag first makes a second release fail, while the VM is
+  // neither handed out nor on the free list
+  size_t index = offset / sizeof(Nano_VM);
+  pthread_mutex_lock(&pool->lock);
+  bool acquired = pool->acquired[index];
+  pool->acquired[index] = false;
+  pthread_mutex_unlock(&pool->lock);
+  if (!acquired) {
+    log_error("VM %zu is not acquired, so it cannot be released", index);
+    return ERR_INVALID_OPERAND;
+  }
+
+  // Reset outside the lock; the VM is still exclusively ours
+  reset_vm(vm);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->free_list[pool->free_count++] = vm;
+  pthread_mutex_unlock(&pool->lock);
+  return SUCCESS;
+}
+
+ErrorCode free_vm_pool(VM_Pool *pool) {
+  if (NULL == pool) {
+    log_error("VM pool is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+  if (pool->free_count != pool->capacity) {
+    log_warn("Freeing VM pool with %zu instances still acquired",
+             pool->capacity - pool->free_count);
+  }
+
+  for (size_t i = 0; i < pool->capacity; i++) {
+    free_vm(&pool->vms[i]);
+  }
+  free(pool->vms);
+  free(pool->free_list);
+  free(pool->acquired);
+  pthread_mutex_destroy(&pool->lock);
+  pool->vms = NULL;
+  pool->free_list = NULL;
+  pool->acquired = NULL;
+  pool->free_count = 0;
+  pool->capacity = 0;
+  return SUCCESS;
+}
@@ -0,0 +1,56 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "errno.h"
+#include "program.h"
+#include "vm.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Fixed-size set of VMs attached to one shared program. Instances are
+ * initialized once up front and share the program's code; acquire hands out
+ * a ready-to-run VM and release resets it with reset_vm, so a request pays a
+ * lock and a few stores instead of init_vm, load_program and free_vm. Safe
+ * to use from multiple threads.
+ */
+typedef struct {
+  pthread_mutex_t lock; // Guards free_list, free_count and acquired
+  Nano_VM *vms;         // All instances, cache-line aligned
+  Nano_VM **free_list;  // Instances not currently handed out
+  bool *acquired;       // Per instance, whether it is handed out
+  size_t free_count;    // Number of entries in free_list
+  size_t capacity;      // Number of instances in vms
+} VM_Pool;
+
+/* Creates `count` VMs and attaches each of them to the program.
+ * Parameters:
+ *   pool - Pool to initialize
+ *   count - Number of VMs in the pool
+ *   program - Program every VM runs; each VM holds a reference to it
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode init_vm_pool(VM_Pool *pool, size_t count, Program *program);
+
+/* Takes a VM from the pool.
+ * Parameters:
+ *   pool - Pool to take from
+ *   vm - Receives a VM positioned at the program entry point
+ * Returns:
+ *   ErrorCode indicating success or type of failure (ERR_OUT_OF_MEMORY if
+ *   every VM is in use)
+ */
+ErrorCode acquire_vm(VM_Pool *pool, Nano_VM **vm);
+
+/* Resets a VM and returns it to the pool it was acquired from.
+ * Returns:
+ *   ErrorCode indicating success or type of failure (ERR_INVALID_OPERAND
+ *   if the VM is not one of the pool's or is not currently acquired)
+ */
+ErrorCode release_vm(VM_Pool *pool, Nano_VM *vm);
+
+/* Frees every VM in the pool. No VM may still be acquired. */
+ErrorCode free_vm_pool(VM_Pool *pool);
+
+#endif // POOL_H
@@ -0,0 +1,431 @@
+#include "program.h"
+#include "bundle.h"
+#include "log.h"
+#include "lz.h"
+#include "verify.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Sections are packed behind the Program at this alignment
+#define PROGRAM_SECTION_ALIGNMENT 8
+
+static size_t align_section(size_t size) {
+  return (size + PROGRAM_SECTION_ALIGNMENT - 1) &
+         ~(size_t)(PROGRAM_SECTION_ALIGNMENT - 1);
+}
+
+/* Copies one section to `*cursor` and advances it past the copy. */
+static const void *copy_section(uint8_t **cursor, const void *source,
+                                size_t size) {
+  if (NULL == source || 0 == size) {
+    return NULL;
+  }
+  void *copy = *cursor;
+  memcpy(copy, source, size);
+  *cursor += align_section(size);
+  return copy;
+}
+
+ErrorCode create_program(const uint8_t *code, size_t code_size,
+                         uint32_t entry_point, Program **program) {
+  if (NULL == code || code_size == 0) {
+    log_error("Invalid code or code size");
+    return ERR_INVALID_OPERAND;
+  }
+
+  if (entry_point >= code_size) {
+    log_error("Invalid entry point: %u", entry_point);
+    return ERR_INVALID_OPERAND;
+  }
+
+  // Bare code has no alignment guarantees, so verify it as version 0.1
+  BytecodeImage image;
+  memset(&image, 0, sizeof(image));
+  image.version = BYTECODE_VERSION_V1;
+  image.entry_point = entry_point;
+  image.code = code;
+  image.code_size = code_size;
+  return create_program_from_image(&image, program);
+}
+
+ErrorCode create_program_from_image(const BytecodeImage *image,
+                                    Program **program) {
+  if (NULL == image || NULL == program) {
+    log_error("Bytecode image or program output pointer is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+  // Compressed code can only be checked once it is in the program
+  bool compressed = image->compressed_code_size != 0;
+  ErrorCode status = compressed ? SUCCESS : verify_code(image);
+  if (status != SUCCESS) {
+    log_error("Program failed verification");
+    return status;
+  }
+
+  size_t constants_size = image->constant_count * sizeof(int32_t);
+  size_t functions_size = image->function_count * sizeof(BytecodeFunction);
+  size_t globals_size = image->global_count * sizeof(int32_t);
+  size_t symbols_size = image->symbol_count * sizeof(BytecodeSymbol);
+  size_t total = align_section(sizeof(Program)) +
+                 align_section(image->code_size) +
+                 align_section(constants_size) +
+                 align_section(functions_size) + align_section(globals_size) +
+                 align_section(symbols_size) +
+                 align_section(image->names_size) +
+                 align_section(image->debug_size);
+
+  // The sections are stored right behind the Program in the same allocation
+  Program *created = malloc(total);
+  if (NULL == created) {
+    log_error("Failed to allocate memory for program");
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  uint8_t *cursor = (uint8_t *)created + align_section(sizeof(Program));
+  created->image = *image;
+  if (compressed) {
+    created->image.code = cursor;
+    created->image.compressed_code_size = 0;
+    status = lz_decompress(image->code, image->compressed_code_size, cursor,
+                           image->code_size);
+    cursor += align_section(image->code_size);
+  } else {
+    created->image.code = copy_section(&cursor, image->code, image->code_size);
+  }
+  created->image.constants =
+      copy_section(&cursor, image->constants, constants_size);
+  created->image.functions =
+      copy_section(&cursor, image->functions, functions_size);
+  created->image.globals = copy_section(&cursor, image->globals, globals_size);
+  // Symbols name the program's imports and exports for attach_module;
+  // relocations only matter to the static linker and are not kept
+  created->image.symbols =
+      copy_section(&cursor, image->symbols, symbols_size);
+  created->image.names =
+      copy_section(&cursor, image->names, image->names_size);
+  // Debug information is only read when something asks where an offset
+  // came from, so it goes last, clear of the sections execution uses
+  created->image.debug = copy_section(&cursor, image->debug, image->debug_size);
+  created->image.relocations = NULL;
+  created->image.relocation_count = 0;
+  created->backing = PROGRAM_HEAP;
+  created->mapping = NULL;
+  created->mapping_size = 0;
+  created->verified = NULL;
+  atomic_init(&created->refcount, 1);
+
+  if (compressed && status == SUCCESS) {
+    status = verify_code(&created->image);
+  }
+  if (status != SUCCESS) {
+    log_error("Program failed decompression or verification");
+    free(created);
+    return status;
+  }
+
+  *program = created;
+  log_info("Program created (%zu bytes of code)", image->code_size);
+  return SUCCESS;
+}
+
+ErrorCode open_program(const char *filename, Program **program) {
+  if (NULL == program) {
+    log_error("Program output pointer is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+  if (NULL != filename && 0 == strcmp(filename, "-")) {
+    return read_program_fd(STDIN_FILENO, program);
+  }
+
+  MappedBytecode mapped;
+  ErrorCode status = map_bytecode(filename, &mapped);
+  if (status != SUCCESS) {
+    return status;
+  }
+
+  // Compressed code cannot run from the mapping; decompress it into a copy
+  if (mapped.image.compressed_code_size != 0) {
+    status = create_program_from_image(&mapped.image, program);
+    unmap_bytecode(&mapped);
+    return status;
+  }
+
+  status = verify_code(&mapped.image);
+  if (status != SUCCESS) {
+    log_error("Program '%s' failed verification", filename);
+    unmap_bytecode(&mapped);
+    return status;
+  }
+
+  status = create_program_from_mapping(&mapped, program);
+  if (status != SUCCESS) {
+    unmap_bytecode(&mapped);
+    return status;
+  }
+  log_info("Program opened from '%s' (%zu bytes of code)", filename,
+           (*program)->image.code_size);
+  return SUCCESS;
+}
+
+/* Verifies the region starting at `start` and every region control can fall
+ * through into after it, then marks them verified for every VM.
+ */
+static ErrorCode verify_regions_from(Program *program, size_t start,
+                                     size_t entry) {
+  const BytecodeImage *image = &program->image;
+  bool falls_through = true;
+  while (falls_through && start < image->code_size &&
+         !program_region_verified(program, start)) {
+    size_t region_start = 0;
+    size_t end = 0;
+    find_code_region(image, start, &region_start, &end);
+    if (region_start != start) {
+      log_error("Code offset %zu does not start a function", start);
+      return ERR_INVALID_OPERAND;
+    }
+    ErrorCode status =
+        verify_code_region(image, start, end, entry, &falls_through);
+    if (status != SUCCESS) {
+      return status;
+    }
+    // Release ordering publishes the check before any VM relies on it
+    atomic_fetch_or_explicit(&program->verified[start / 8],
+                             (unsigned char)(1u << (start % 8)),
+                             memory_order_release);
+    start = end;
+    entry = end;
+  }
+  return SUCCESS;
+}
+
+ErrorCode verify_program_call(Program *program, size_t target) {
+  if (NULL == program) {
+    log_error("Program is NULL");
+    return ERR_NULL_POINTER;
+  }
+  if (target >= program->image.code_size) {
+    log_error("CALL target %zu is outside the code", target);
+    return ERR_INVALID_OPERAND;
+  }
+  ErrorCode status = verify_regions_from(program, target, target);
+  if (status != SUCCESS) {
+    log_error("Function at %zu failed verification", target);
+  }
+  return status;
+}
+
+ErrorCode open_program_lazy(const char *filename, Program **program) {
+  if (NULL == program) {
+    log_error("Program output pointer is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+  MappedBytecode mapped;
+  ErrorCode status = map_bytecode_lazy(filename, &mapped);
+  if (status != SUCCESS) {
+    return status;
+  }
+  if (mapped.image.compressed_code_size != 0 ||
+      0 == mapped.image.function_count) {
+    log_info("'%s' cannot be verified lazily; verifying it whole", filename);
+    unmap_bytecode(&mapped);
+    return open_program(filename, program);
+  }
+
+  size_t code_size = mapped.image.code_size;
+  atomic_uchar *verified = calloc((code_size + 7) / 8, sizeof(*verified));
+  if (NULL == verified) {
+    log_error("Failed to allocate memory for verification state");
+    unmap_bytecode(&mapped);
+    return ERR_OUT_OF_MEMORY;
+  }
+  Program *created = NULL;
+  status = create_program_from_mapping(&mapped, &created);
+  if (status != SUCCESS) {
+    free(verified);
+    unmap_bytecode(&mapped);
+    return status;
+  }
+  created->verified = verified;
+
+  // Only the code the entry point runs in is needed before the first step
+  size_t start = 0;
+  size_t end = 0;
+  find_code_region(&created->image, created->image.entry_point, &start, &end);
+  status = verify_regions_from(created, start, created->image.entry_point);
+  if (status != SUCCESS) {
+    log_error("Program '%s' failed verification", filename);
+    release_program(created);
+    return status;
+  }
+
+  *program = created;
+  log_info("Program opened lazily from '%s' (%zu bytes of code)", filename,
+           code_size);
+  return SUCCESS;
+}
+
+ErrorCode read_program_fd(int fd, Program **program) {
+  if (NULL == program) {
+    log_error("Program output pointer is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+  uint8_t *buffer = NULL;
+  size_t size = 0;
+  ErrorCode status = read_bytecode_fd(fd, &vm_default_allocator, &buffer,
+                                      &size);
+  if (status != SUCCESS) {
+    return status;
+  }
+  status = create_program_from_buffer(buffer, size, program);
+  if (status != SUCCESS) {
+    log_error("Program read from descriptor %d is invalid", fd);
+  }
+  return status;
+}
+
+ErrorCode create_program_from_buffer(uint8_t *buffer, size_t size,
+                                     Program **program) {
+  if (NULL == buffer || NULL == program) {
+    log_error("Bytecode buffer or program output pointer is NULL");
+    free(buffer);
+    return ERR_NULL_POINTER;
+  }
+
+  BytecodeImage image;
+  ErrorCode status = parse_bytecode(buffer, size, &image);
+
+  // Compressed code is decompressed into a copy, as for mapped files
+  if (status == SUCCESS && image.compressed_code_size != 0) {
+    status = create_program_from_image(&image, program);
+    free(buffer);
+    return status;
+  }
+  if (status == SUCCESS) {
+    status = verify_code(&image);
+  }
+
+  Program *created = NULL;
+  if (status == SUCCESS && NULL == (created = malloc(sizeof(Program)))) {
+    log_error("Failed to allocate memory for program");
+    status = ERR_OUT_OF_MEMORY;
+  }
+  if (status != SUCCESS) {
+    free(buffer);
+    return status;
+  }
+
+  created->image = image;
+  created->backing = PROGRAM_READ;
+  created->mapping = buffer;
+  created->mapping_size = size;
+  created->verified = NULL;
+  atomic_init(&created->refcount, 1);
+
+  *program = created;
+  log_info("Program created from a %zu byte file buffer (%zu bytes of code)",
+           size, image.code_size);
+  return SUCCESS;
+}
+
+ErrorCode create_program_from_static(const uint8_t *data, size_t size,
+                                     Program **program) {
+  if (NULL == data || NULL == program) {
+    log_error("Bytecode data or program output pointer is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+  BytecodeImage image;
+  ErrorCode status = parse_bytecode(data, size, &image);
+  if (status == SUCCESS && image.compressed_code_size != 0) {
+    return create_program_from_image(&image, program);
+  }
+  if (status == SUCCESS) {
+    status = verify_code(&image);
+  }
+  if (status != SUCCESS) {
+    log_error("Static program image is invalid");
+    return status;
+  }
+
+  Program *created = malloc(sizeof(Program));
+  if (NULL == created) {
+    log_error("Failed to allocate memory for program");
+    return ERR_OUT_OF_MEMORY;
+  }
+  created->image = image;
+  created->backing = PROGRAM_STATIC;
+  created->mapping = NULL;
+  created->mapping_size = size;
+  created->verified = NULL;
+  atomic_init(&created->refcount, 1);
+
+  *program = created;
+  log_info("Program created in place (%zu bytes of code)", image.code_size);
+  return SUCCESS;
+}
+
+ErrorCode create_program_from_mapping(MappedBytecode *mapped,
+                                      Program **program) {
+  if (NULL == mapped || NULL == mapped->mapping || NULL == program) {
+    log_error("Mapping or program output pointer is NULL");
+    return ERR_NULL_POINTER;
+  }
+  if (mapped->image.compressed_code_size != 0) {
+    log_error("Compressed code cannot run from a mapping");
+    return ERR_INVALID_FORMAT;
+  }
+
+  Program *created = malloc(sizeof(Program));
+  if (NULL == created) {
+    log_error("Failed to allocate memory for program");
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  created->image = mapped->image;
+  created->backing = PROGRAM_MAPPED;
+  created->mapping = mapped->mapping;
+  created->mapping_size = mapped->mapping_size;
+  created->verified = NULL;
+  atomic_init(&created->refcount, 1);
+  memset(mapped, 0, sizeof(*mapped));
+
+  *program = created;
+  return SUCCESS;
+}
+
+Program *retain_program(Program *program) {
+  if (NULL != program) {
+    atomic_fetch_add_explicit(&program->refcount, 1, memory_order_relaxed);
+  }
+  return program;
+}
+
+void release_program(Program *program) {
+  if (NULL == program) {
+    return;
+  }
+
+  // Release ordering publishes this owner's reads before the final free
+  if (atomic_fetch_sub_explicit(&program->refcount, 1,
+                                memory_order_acq_rel) != 1) {
+    return;
+  }
+
+  free(program->verified);
+  if (PROGRAM_MAPPED == program->backing) {
+    munmap(program->mapping, program->mapping_size);
+  } else if (PROGRAM_READ == program->backing) {
+    free(program->mapping);
+  } else if (PROGRAM_BUNDLE == program->backing) {
+    release_bundle(program->mapping);
+  }
+  free(program);
+  log_info("Program released");
+}
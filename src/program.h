@@ -0,0 +1,168 @@
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#include "errno.h"
+#include "loader.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+  PROGRAM_HEAP,   // Sections copied into a private heap buffer
+  PROGRAM_MAPPED, // Sections live in a read-only file mapping
+  PROGRAM_READ,   // Sections live in the buffer a stream was read into
+  PROGRAM_BUNDLE, // Sections live in a bundle's mapping (see bundle.h)
+  PROGRAM_STATIC, // Sections live in memory that outlives the program
+} ProgramBacking;
+
+/* Read-only, reference-counted, verified program image. Any number of VMs,
+ * on any number of threads, can attach to one Program and execute its code
+ * without copying it. Nothing in a Program changes after creation except
+ * the reference count and, for a lazy program (see open_program_lazy), the
+ * record of which code regions have been verified so far.
+ */
+typedef struct {
+  BytecodeImage image;    // Code, constants, functions, globals and debug
+  atomic_size_t refcount; // Owners: the creator plus every attached VM
+  ProgramBacking backing; // How image is stored, and so how it is released
+  void *mapping;          // File mapping, PROGRAM_READ buffer or Bundle
+  size_t mapping_size;    // Length of the mapping or buffer
+  atomic_uchar *verified; // Lazy programs: a bit per code offset, set once
+                          // the region starting there is verified; NULL
+                          // when the whole program was verified up front
+} Program;
+
+/* Returns whether a CALL to `target` can go ahead without verifying first:
+ * the program was verified up front, or the function at target already
+ * has been.
+ */
+static inline bool program_region_verified(const Program *program,
+                                           size_t target) {
+  return NULL == program->verified ||
+         (atomic_load_explicit(&program->verified[target / 8],
+                               memory_order_acquire) >>
+          (target % 8)) & 1;
+}
+
+/* Creates a program from an in-memory code segment, copying it once.
+ * Parameters:
+ *   code - Bytecode instructions
+ *   code_size - Size of the bytecode in bytes
+ *   entry_point - Entry point of the bytecode
+ *   program - Receives the new program with a reference count of 1
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode create_program(const uint8_t *code, size_t code_size,
+                         uint32_t entry_point, Program **program);
+
+/* Creates a program from a parsed image, copying every section once into a
+ * single allocation. Compressed code is decompressed straight into it.
+ * Parameters:
+ *   image - Parsed bytecode image; need not outlive the program
+ *   program - Receives the new program with a reference count of 1
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode create_program_from_image(const BytecodeImage *image,
+                                    Program **program);
+
+/* Creates a program backed by a read-only mapping of a bytecode file. A
+ * file with compressed code gets a heap program holding the decompressed
+ * code instead. "-" reads the program from standard input, as
+ * read_program_fd does.
+ * Parameters:
+ *   filename - Path to the bytecode file, or "-" for standard input
+ *   program - Receives the new program with a reference count of 1
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode open_program(const char *filename, Program **program);
+
+/* Opens a program like open_program, but verifies it lazily: only the code
+ * around the entry point is checked before it returns, and every other
+ * function is checked by verify_program_call on its first CALL. Untouched
+ * functions are never read, so the time to the first instruction and the
+ * resident memory follow what a run actually uses. For the same reason the
+ * file's checksum is not checked (see map_bytecode_lazy). Needs a function
+ * table and uncompressed code; other files are opened as open_program does.
+ * Parameters:
+ *   filename - Path to the bytecode file
+ *   program - Receives the new program with a reference count of 1
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode open_program_lazy(const char *filename, Program **program);
+
+/* Verifies the function a CALL is about to enter in a lazy program, along
+ * with any region control can fall through into from it. Safe to call from
+ * several threads at once; the VM calls it whenever
+ * program_region_verified is false.
+ * Parameters:
+ *   program - Lazy program
+ *   target - Code offset of the function entry being called
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode verify_program_call(Program *program, size_t target);
+
+/* Reads a program from a descriptor that need not be seekable, such as a
+ * pipe. The file is read once into a buffer of exactly its size, and the
+ * program runs from that buffer (decompressing its code into a copy if the
+ * file stores it compressed).
+ * Parameters:
+ *   fd - Descriptor positioned at the start of a bytecode file
+ *   program - Receives the new program with a reference count of 1
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode read_program_fd(int fd, Program **program);
+
+/* Creates a program that runs from a whole bytecode file held in a malloc'd
+ * buffer. The file is parsed and verified in place; compressed code is
+ * decompressed into a copy as open_program does.
+ * Parameters:
+ *   buffer - Whole bytecode file from malloc. Ownership passes to the
+ *            program, or the buffer is freed if creation fails
+ *   size - Size of the file in bytes
+ *   program - Receives the new program with a reference count of 1
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode create_program_from_buffer(uint8_t *buffer, size_t size,
+                                     Program **program);
+
+/* Creates a program that runs from a whole bytecode file the caller keeps
+ * alive and unchanged for as long as the program exists, such as an image
+ * linked into the executable. The file is parsed and verified in place and
+ * never copied, unless its code is compressed.
+ * Parameters:
+ *   data - Whole bytecode file, aligned to BYTECODE_SECTION_ALIGNMENT
+ *   size - Size of the file in bytes
+ *   program - Receives the new program with a reference count of 1
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode create_program_from_static(const uint8_t *data, size_t size,
+                                     Program **program);
+
+/* Wraps a parsed, already verified mapping in a program. The program takes
+ * over the mapping and unmaps it when the last reference goes.
+ * Parameters:
+ *   mapped - Mapping from map_bytecode with uncompressed code; cleared on
+ *            success
+ *   program - Receives the new program with a reference count of 1
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode create_program_from_mapping(MappedBytecode *mapped,
+                                      Program **program);
+
+/* Adds a reference to a program and returns it. */
+Program *retain_program(Program *program);
+
+/* Drops a reference to a program, freeing it when the last one goes. */
+void release_program(Program *program);
+
+#endif // PROGRAM_H
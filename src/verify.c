@@ -0,0 +1,633 @@
+#include "verify.h"
+#include "bytecode.h"
+#include "log.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Build with -DVERIFY_NO_SIMD to compare against the scalar scan
+#if defined(__SSE2__) && !defined(VERIFY_NO_SIMD)
+#define VERIFY_SIMD
+#include <emmintrin.h>
+#endif
+
+#define MAX_PLAIN_RANGES 16
+
+/* One stretch of code verified by one worker. Stretches start at function
+ * entries, so each decodes exactly as the whole code would.
+ */
+typedef struct {
+  size_t start;     // Offset of the first byte
+  size_t end;       // Offset just past the last byte
+  uint8_t *starts;  // A bit per byte, set where an instruction starts
+  ErrorCode status; // Result of the passes run on it so far
+} CodeChunk;
+
+/* Single-byte instructions need no checks in either pass, so runs of them
+ * are skipped in bulk. Which opcodes those are comes from instruction_set:
+ * a table for the scalar scan and, for the SIMD one, the contiguous ranges
+ * of opcode values they make up.
+ */
+static bool plain_opcode[256];
+#ifdef VERIFY_SIMD
+static __m128i plain_low[MAX_PLAIN_RANGES];  // First opcode of each range
+static __m128i plain_span[MAX_PLAIN_RANGES]; // Last opcode minus first
+#endif
+static size_t plain_range_count;
+static pthread_once_t plain_once = PTHREAD_ONCE_INIT;
+
+static void init_plain_opcodes(void) {
+  uint8_t low[MAX_PLAIN_RANGES];
+  uint8_t span[MAX_PLAIN_RANGES];
+  for (int opcode = 0; opcode < OP_COUNT; opcode++) {
+    plain_opcode[opcode] = instruction_set[opcode].length == 1;
+  }
+  for (int opcode = 0; opcode < OP_COUNT; opcode++) {
+    if (!plain_opcode[opcode]) {
+      continue;
+    }
+    if (opcode > 0 && plain_opcode[opcode - 1]) {
+      span[plain_range_count - 1]++;
+      continue;
+    }
+    if (plain_range_count == MAX_PLAIN_RANGES) {
+      plain_range_count = 0; // Too scattered to be worth it: scalar only
+      return;
+    }
+    low[plain_range_count] = (uint8_t)opcode;
+    span[plain_range_count++] = 0;
+  }
+#ifdef VERIFY_SIMD
+  for (size_t i = 0; i < plain_range_count; i++) {
+    plain_low[i] = _mm_set1_epi8((char)low[i]);
+    plain_span[i] = _mm_set1_epi8((char)span[i]);
+  }
+#else
+  (void)low;
+  (void)span;
+#endif
+}
+
+/* Returns how many bytes from `ip` on are single-byte instructions, each
+ * starting where the previous one ends.
+ */
+static size_t plain_run(const uint8_t *code, size_t ip, size_t end) {
+  // Most runs are a few bytes of padding, over before a vector would pay
+  size_t from = ip;
+  while (ip < end && ip - from < 16 && plain_opcode[code[ip]]) {
+    ip++;
+  }
+  if (ip - from < 16) {
+    return ip - from;
+  }
+#ifdef VERIFY_SIMD
+  while (plain_range_count > 0 && end - ip >= 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)(code + ip));
+    __m128i plain = _mm_setzero_si128();
+    for (size_t i = 0; i < plain_range_count; i++) {
+      // In [low, low + span] exactly when bytes - low wraps to <= span
+      __m128i over =
+          _mm_subs_epu8(_mm_sub_epi8(bytes, plain_low[i]), plain_span[i]);
+      plain =
+          _mm_or_si128(plain, _mm_cmpeq_epi8(over, _mm_setzero_si128()));
+    }
+    unsigned mask = (unsigned)_mm_movemask_epi8(plain);
+    if (mask != 0xFFFF) {
+      return ip - from + (size_t)__builtin_ctz(~mask);
+    }
+    ip += 16;
+  }
+#endif
+  while (ip < end && plain_opcode[code[ip]]) {
+    ip++;
+  }
+  return ip - from;
+}
+
+/* Sets `count` bits of a bitmap from bit `first` on. */
+static void set_bits(uint8_t *bits, size_t first, size_t count) {
+  while (count > 0 && first % 8 != 0) {
+    bits[first / 8] |= (uint8_t)(1u << (first % 8));
+    first++;
+    count--;
+  }
+  memset(bits + first / 8, 0xFF, count / 8);
+  first += count / 8 * 8;
+  for (count %= 8; count > 0; count--, first++) {
+    bits[first / 8] |= (uint8_t)(1u << (first % 8));
+  }
+}
+
+static inline uint32_t read_u32(const uint8_t *operand) {
+  uint32_t value;
+  memcpy(&value, operand, sizeof(uint32_t));
+  return value;
+}
+
+/* Returns where a jump or call transfers control to, or -1 for any other
+ * instruction. Relative targets may fall outside the code section; callers
+ * range check the result.
+ */
+static int64_t branch_target(const uint8_t *code, size_t ip) {
+  switch (code[ip]) {
+  case OP_JMP:
+  case OP_JMPZ:
+  case OP_JMPNZ:
+  case OP_CALL:
+    return read_u32(code + ip + 1);
+  case OP_JMP8:
+  case OP_JMPZ8:
+  case OP_JMPNZ8:
+    return (int64_t)ip + (int8_t)code[ip + 1];
+  case OP_JMP16:
+  case OP_JMPZ16:
+  case OP_JMPNZ16: {
+    int16_t offset;
+    memcpy(&offset, code + ip + 1, sizeof(int16_t));
+    return (int64_t)ip + offset;
+  }
+  default:
+    return -1;
+  }
+}
+
+/* Reads the index operand of a fixed (32-bit) or LEB128 index instruction
+ * already known to fit in `length` bytes.
+ */
+static uint32_t read_index(const uint8_t *instruction, size_t length) {
+  if (instruction_set[instruction[0]].length != 0) {
+    return read_u32(instruction + 1);
+  }
+  uint32_t index = 0;
+  decode_uleb128(instruction + 1, length - 1, &index);
+  return index;
+}
+
+static inline bool is_boundary(const uint8_t *starts, size_t offset) {
+  return (starts[offset / 8] >> (offset % 8)) & 1;
+}
+
+bool is_function_entry(const BytecodeImage *image, uint32_t target) {
+  size_t low = 0;
+  size_t high = image->function_count;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (image->functions[mid].entry == target) {
+      return true;
+    }
+    if (image->functions[mid].entry < target) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return false;
+}
+
+/* Returns the index of the first function that ends after `offset`. */
+static size_t function_after(const BytecodeImage *image, size_t offset) {
+  size_t low = 0;
+  size_t high = image->function_count;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (image->functions[mid].entry + image->functions[mid].size <= offset) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+/* First pass: decodes every instruction of [start, end), records where each
+ * one starts (relative to start) and checks everything that does not depend
+ * on other instructions.
+ */
+static ErrorCode check_instructions(const BytecodeImage *image, size_t start,
+                                    size_t end, uint8_t *starts) {
+  const uint8_t *code = image->code;
+  bool aligned = image->version >= BYTECODE_VERSION;
+  size_t function = function_after(image, start);
+
+  for (size_t ip = start; ip < end;) {
+    size_t run = plain_run(code, ip, end);
+    if (run > 0) {
+      set_bits(starts, ip - start, run);
+      ip += run;
+      continue;
+    }
+
+    Opcode opcode = code[ip];
+    if (opcode >= OP_COUNT) {
+      log_error("Unsupported opcode 0x%02X at offset %zu", opcode, ip);
+      return ERR_UNSUPPORTED_OPCODE;
+    }
+
+    InstructionInfo info = instruction_set[opcode];
+    size_t length = instruction_length(code + ip, end - ip);
+    if (length == 0) {
+      log_error("%s at offset %zu runs past the end of its code", info.name,
+                ip);
+      return ERR_INVALID_FORMAT;
+    }
+    if (aligned && info.length == 1 + sizeof(uint32_t) &&
+        (ip + 1) % BYTECODE_OPERAND_ALIGNMENT != 0) {
+      log_error("%s at offset %zu has a misaligned operand", info.name, ip);
+      return ERR_INVALID_FORMAT;
+    }
+    starts[(ip - start) / 8] |= (uint8_t)(1u << ((ip - start) % 8));
+
+    while (function < image->function_count &&
+           ip >= image->functions[function].entry +
+                     image->functions[function].size) {
+      function++;
+    }
+
+    switch (opcode) {
+    case OP_LOAD:
+    case OP_STORE:
+      if (function < image->function_count &&
+          ip >= image->functions[function].entry &&
+          code[ip + 1] >= image->functions[function].local_count) {
+        log_error("%s at offset %zu uses local %u of %u", info.name, ip,
+                  code[ip + 1], image->functions[function].local_count);
+        return ERR_INVALID_OPERAND;
+      }
+      break;
+    case OP_PUSHK:
+    case OP_PUSHKV:
+      if (read_index(code + ip, length) >= image->constant_count) {
+        log_error("%s at offset %zu reads past the constant pool", info.name,
+                  ip);
+        return ERR_INVALID_OPERAND;
+      }
+      break;
+    case OP_GLOAD:
+    case OP_GSTORE:
+    case OP_GLOADV:
+    case OP_GSTOREV:
+      if (read_index(code + ip, length) >= image->global_count) {
+        log_error("%s at offset %zu uses an undefined global", info.name, ip);
+        return ERR_INVALID_OPERAND;
+      }
+      break;
+    case OP_CALLX: {
+      uint32_t symbol = read_u32(code + ip + 1);
+      if (symbol >= image->symbol_count ||
+          image->symbols[symbol].kind != SYMBOL_IMPORT) {
+        log_error("CALLX at offset %zu calls symbol %u, which is not an "
+                  "import",
+                  ip, symbol);
+        return ERR_INVALID_OPERAND;
+      }
+      break;
+    }
+    default:
+      break;
+    }
+
+    ip += length;
+  }
+  return SUCCESS;
+}
+
+/* Returns whether `target` starts an instruction in one of the chunks. */
+static bool chunk_boundary(const CodeChunk *chunks, size_t count,
+                           int64_t target) {
+  if (0 == count || target < 0 || (uint64_t)target >= chunks[count - 1].end) {
+    return false;
+  }
+  size_t low = 0;
+  size_t high = count;
+  while (high - low > 1) {
+    size_t mid = low + (high - low) / 2;
+    if (chunks[mid].start <= (uint64_t)target) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  return is_boundary(chunks[low].starts, (size_t)target - chunks[low].start);
+}
+
+/* Second pass: with every boundary of [start, end) known, checks that jumps
+ * only ever land on the start of an instruction inside it, or inside one of
+ * `chunks` when the whole code is checked a chunk at a time. Calls may leave
+ * it, but only for a function entry when the image has a function table.
+ */
+static ErrorCode check_targets(const BytecodeImage *image, size_t start,
+                               size_t end, const uint8_t *starts,
+                               const CodeChunk *chunks, size_t chunk_count) {
+  const uint8_t *code = image->code;
+  for (size_t ip = start; ip < end;) {
+    ip += plain_run(code, ip, end);
+    if (ip == end) {
+      break;
+    }
+    Opcode opcode = code[ip];
+    InstructionInfo info = instruction_set[opcode];
+
+    int64_t target = branch_target(code, ip);
+    bool inside = target >= (int64_t)start && target < (int64_t)end;
+    bool call = opcode == OP_CALL && image->function_count > 0;
+    if (call && (target < 0 || (uint64_t)target >= image->code_size ||
+                 !is_function_entry(image, (uint32_t)target))) {
+      log_error("CALL at offset %zu targets %lld, which is not a function",
+                ip, (long long)target);
+      return ERR_INVALID_OPERAND;
+    }
+    // Function entries outside the range are checked with their function
+    bool boundary = inside ? is_boundary(starts, (size_t)target - start)
+                           : chunk_boundary(chunks, chunk_count, target);
+    if (target != -1 && (inside || !call) && !boundary) {
+      log_error("%s at offset %zu targets %lld, which is not an instruction",
+                info.name, ip, (long long)target);
+      return ERR_INVALID_OPERAND;
+    }
+
+    ip += instruction_length(code + ip, end - ip);
+  }
+  return SUCCESS;
+}
+
+/* Checks what only the whole image can: the entry point and every function
+ * entry land on instructions.
+ */
+static ErrorCode check_entries(const BytecodeImage *image,
+                               const uint8_t *starts) {
+  if (!is_boundary(starts, image->entry_point)) {
+    log_error("Entry point %u is not an instruction", image->entry_point);
+    return ERR_INVALID_FORMAT;
+  }
+
+  for (size_t i = 0; i < image->function_count; i++) {
+    uint32_t entry = image->functions[i].entry;
+    if (entry >= image->code_size || !is_boundary(starts, entry)) {
+      log_error("Function %zu entry %u is not an instruction", i, entry);
+      return ERR_INVALID_FORMAT;
+    }
+  }
+  return SUCCESS;
+}
+
+/* Checks the whole code in one pass each, on the calling thread. */
+static ErrorCode verify_sequential(const BytecodeImage *image) {
+  uint8_t *starts = calloc((image->code_size + 7) / 8, 1);
+  if (NULL == starts) {
+    log_error("Failed to allocate memory for instruction boundaries");
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  ErrorCode status = check_instructions(image, 0, image->code_size, starts);
+  if (status == SUCCESS) {
+    status = check_targets(image, 0, image->code_size, starts, NULL, 0);
+  }
+  if (status == SUCCESS) {
+    status = check_entries(image, starts);
+  }
+  free(starts);
+  return status;
+}
+
+typedef struct {
+  const BytecodeImage *image;
+  CodeChunk *chunks;
+  size_t chunk_count;
+  bool targets;       // Which pass the workers run
+  atomic_size_t next; // Next chunk a worker should take
+} VerifyJob;
+
+static void *verify_worker(void *arg) {
+  VerifyJob *job = arg;
+  const BytecodeImage *image = job->image;
+  for (;;) {
+    size_t index =
+        atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed);
+    if (index >= job->chunk_count) {
+      return NULL;
+    }
+    CodeChunk *chunk = &job->chunks[index];
+    if (!job->targets) {
+      chunk->status =
+          check_instructions(image, chunk->start, chunk->end, chunk->starts);
+      continue;
+    }
+
+    chunk->status = check_targets(image, chunk->start, chunk->end,
+                                  chunk->starts, job->chunks,
+                                  job->chunk_count);
+    // Function entries inside the chunk; the first one starts it
+    for (size_t f = function_after(image, chunk->start);
+         chunk->status == SUCCESS && f < image->function_count &&
+         image->functions[f].entry < chunk->end;
+         f++) {
+      uint32_t entry = image->functions[f].entry;
+      if (entry >= chunk->start &&
+          !is_boundary(chunk->starts, entry - chunk->start)) {
+        log_error("Function %zu entry %u is not an instruction", f, entry);
+        chunk->status = ERR_INVALID_FORMAT;
+      }
+    }
+  }
+}
+
+/* Runs one pass over every chunk on `threads` threads, the caller's
+ * included, and returns the first failure in code order.
+ */
+static ErrorCode run_pass(VerifyJob *job, bool targets, unsigned threads) {
+  job->targets = targets;
+  atomic_store_explicit(&job->next, 0, memory_order_relaxed);
+  pthread_t workers[VERIFY_MAX_THREADS];
+  unsigned started = 0;
+  while (started + 1 < threads &&
+         pthread_create(&workers[started], NULL, verify_worker, job) == 0) {
+    started++;
+  }
+  verify_worker(job);
+  for (unsigned i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  for (size_t i = 0; i < job->chunk_count; i++) {
+    if (job->chunks[i].status != SUCCESS) {
+      return job->chunks[i].status;
+    }
+  }
+  return SUCCESS;
+}
+
+/* Cuts the code at function entries into chunks of about `target` bytes,
+ * each with its own boundary bitmap in `bits`. Returns the chunk count.
+ */
+static size_t cut_chunks(const BytecodeImage *image, size_t target,
+                         CodeChunk *chunks, uint8_t *bits) {
+  size_t count = 0;
+  size_t start = 0;
+  for (size_t f = 0; f <= image->function_count; f++) {
+    size_t entry =
+        f < image->function_count ? image->functions[f].entry : SIZE_MAX;
+    if (entry >= image->code_size) {
+      entry = image->code_size;
+    } else if (entry <= start || entry - start < target) {
+      continue;
+    }
+    chunks[count].start = start;
+    chunks[count].end = entry;
+    chunks[count].starts = bits;
+    chunks[count++].status = SUCCESS;
+    bits += (entry - start + 7) / 8;
+    start = entry;
+    if (start == image->code_size) {
+      break;
+    }
+  }
+  return count;
+}
+
+static ErrorCode verify_chunked(const BytecodeImage *image,
+                                unsigned threads) {
+  for (size_t i = 0; i < image->function_count; i++) {
+    if (image->functions[i].entry >= image->code_size) {
+      log_error("Function %zu entry %u is not an instruction", i,
+                image->functions[i].entry);
+      return ERR_INVALID_FORMAT;
+    }
+  }
+
+  // Several chunks per thread even out functions of different cost
+  size_t target = image->code_size / (threads * 4);
+  if (target < VERIFY_MIN_CHUNK_SIZE) {
+    target = VERIFY_MIN_CHUNK_SIZE;
+  }
+  size_t limit = image->function_count + 1;
+  CodeChunk *chunks = malloc(limit * sizeof(CodeChunk));
+  uint8_t *bits = calloc(image->code_size / 8 + limit, 1);
+  if (NULL == chunks || NULL == bits) {
+    log_error("Failed to allocate memory for instruction boundaries");
+    free(chunks);
+    free(bits);
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  VerifyJob job = {.image = image,
+                   .chunks = chunks,
+                   .chunk_count = cut_chunks(image, target, chunks, bits)};
+  if (threads > job.chunk_count) {
+    threads = (unsigned)job.chunk_count;
+  }
+  ErrorCode status = run_pass(&job, false, threads);
+  if (status == SUCCESS &&
+      !chunk_boundary(chunks, job.chunk_count, image->entry_point)) {
+    log_error("Entry point %u is not an instruction", image->entry_point);
+    status = ERR_INVALID_FORMAT;
+  }
+  if (status == SUCCESS) {
+    status = run_pass(&job, true, threads);
+  }
+  log_debug("Verified %zu bytes in %zu chunks on %u threads",
+            image->code_size, job.chunk_count, threads);
+  free(chunks);
+  free(bits);
+  return status;
+}
+
+ErrorCode verify_code(const BytecodeImage *image) {
+  return verify_code_parallel(image, 0);
+}
+
+ErrorCode verify_code_parallel(const BytecodeImage *image, unsigned threads) {
+  if (NULL == image || NULL == image->code) {
+    log_error("Bytecode image is NULL");
+    return ERR_NULL_POINTER;
+  }
+  if (image->compressed_code_size != 0) {
+    log_error("Compressed code must be decompressed before verification");
+    return ERR_INVALID_FORMAT;
+  }
+  pthread_once(&plain_once, init_plain_opcodes);
+
+  if (0 == threads) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = image->code_size < VERIFY_PARALLEL_MIN_SIZE || cpus < 1
+                  ? 1
+                  : (unsigned)cpus;
+  }
+  if (threads > VERIFY_MAX_THREADS) {
+    threads = VERIFY_MAX_THREADS;
+  }
+
+  // Chunks are cut at function entries, so they need a function table
+  ErrorCode status = threads > 1 && image->function_count > 0
+                         ? verify_chunked(image, threads)
+                         : verify_sequential(image);
+  if (status == SUCCESS) {
+    log_info("Bytecode verified: %zu bytes of code", image->code_size);
+  }
+  return status;
+}
+
+void find_code_region(const BytecodeImage *image, size_t offset,
+                      size_t *start, size_t *end) {
+  size_t function = function_after(image, offset);
+  if (function < image->function_count &&
+      offset >= image->functions[function].entry) {
+    *start = image->functions[function].entry;
+    *end = *start + image->functions[function].size;
+    return;
+  }
+  // Between functions: from the end of the one before to the next entry
+  *start = function > 0 ? image->functions[function - 1].entry +
+                              image->functions[function - 1].size
+                        : 0;
+  *end = function < image->function_count ? image->functions[function].entry
+                                          : image->code_size;
+}
+
+ErrorCode verify_code_region(const BytecodeImage *image, size_t start,
+                             size_t end, size_t entry, bool *falls_through) {
+  if (NULL == image || NULL == image->code || NULL == falls_through) {
+    log_error("Bytecode image or output pointer is NULL");
+    return ERR_NULL_POINTER;
+  }
+  if (start >= end || end > image->code_size || entry < start ||
+      entry >= end) {
+    log_error("Invalid code region [%zu, %zu) with entry %zu", start, end,
+              entry);
+    return ERR_INVALID_OPERAND;
+  }
+
+  pthread_once(&plain_once, init_plain_opcodes);
+  uint8_t *starts = calloc((end - start + 7) / 8, 1);
+  if (NULL == starts) {
+    log_error("Failed to allocate memory for instruction boundaries");
+    return ERR_OUT_OF_MEMORY;
+  }
+  ErrorCode status = check_instructions(image, start, end, starts);
+  if (status == SUCCESS) {
+    status = check_targets(image, start, end, starts, NULL, 0);
+  }
+  if (status == SUCCESS && !is_boundary(starts, entry - start)) {
+    log_error("Entry %zu of region [%zu, %zu) is not an instruction", entry,
+              start, end);
+    status = ERR_INVALID_FORMAT;
+  }
+
+  // The last instruction is the one whose start bit is highest
+  size_t last = end - start - 1;
+  while (status == SUCCESS && !is_boundary(starts, last)) {
+    last--;
+  }
+  free(starts);
+  if (status != SUCCESS) {
+    return status;
+  }
+
+  Opcode opcode = image->code[start + last];
+  *falls_through = opcode != OP_RET && opcode != OP_HALT &&
+                   opcode != OP_JMP && opcode != OP_JMP8 &&
+                   opcode != OP_JMP16;
+  log_debug("Code region [%zu, %zu) verified", start, end);
+  return SUCCESS;
+}
@@ -0,0 +1,82 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "errno.h"
+#include "loader.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#define VERIFY_PARALLEL_MIN_SIZE (1024 * 1024) // Smaller code: one thread
+#define VERIFY_MIN_CHUNK_SIZE 4096             // Least code given a thread
+#define VERIFY_MAX_THREADS 64
+
+/* Checks every instruction of a parsed image before it is run:
+ *  - each opcode is known and its operands fit inside the code section
+ *  - 32-bit operands are 4-byte aligned in version 0.2 code
+ *  - jump and call targets, the entry point and function entries all land
+ *    on instruction boundaries (and calls on function entries when the image
+ *    has a function table)
+ *  - constant, global and local indices are in range, and CALLX names an
+ *    import in the symbol table
+ * Runs of single-byte instructions are skipped 16 bytes at a time with
+ * SSE2 where available. Code of VERIFY_PARALLEL_MIN_SIZE bytes or more with
+ * a function table is checked on every online CPU, as
+ * verify_code_parallel does.
+ * Parameters:
+ *   image - Parsed bytecode image
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode verify_code(const BytecodeImage *image);
+
+/* Checks an image as verify_code does, on several threads. The code is cut
+ * at function entries into chunks of at least VERIFY_MIN_CHUNK_SIZE bytes;
+ * the threads decode the chunks, then check the jump targets and function
+ * entries in them against every chunk's instruction boundaries. Without a
+ * function table the code is checked on the calling thread.
+ * Parameters:
+ *   image - Parsed bytecode image
+ *   threads - Threads to use, the caller's included, up to
+ *             VERIFY_MAX_THREADS; 0 picks one per online CPU for code of
+ *             VERIFY_PARALLEL_MIN_SIZE bytes or more, and one otherwise
+ * Returns:
+ *   ErrorCode indicating success or type of failure; the first failure in
+ *   code order when several chunks fail
+ */
+ErrorCode verify_code_parallel(const BytecodeImage *image, unsigned threads);
+
+/* Returns whether `target` is the entry of a function in the image's
+ * function table, which is sorted by entry.
+ */
+bool is_function_entry(const BytecodeImage *image, uint32_t target);
+
+/* Finds the code region holding an offset, the unit verify_code_region
+ * checks: the function containing it or, outside every function, the gap
+ * between the functions around it.
+ * Parameters:
+ *   image - Parsed bytecode image
+ *   offset - Offset inside the code section
+ *   start - Receives the offset of the region's first byte
+ *   end - Receives the offset just past the region
+ */
+void find_code_region(const BytecodeImage *image, size_t offset,
+                      size_t *start, size_t *end);
+
+/* Checks one region of the code the way verify_code checks all of it, so
+ * that a program can be verified a function at a time as it runs. Jumps
+ * have to stay inside the region; calls may leave it only for a function
+ * entry, which is verified with its own function.
+ * Parameters:
+ *   image - Parsed bytecode image with a function table
+ *   start - Offset of the region's first byte
+ *   end - Offset just past the region
+ *   entry - Offset in the region where execution will start
+ *   falls_through - Receives whether control can run off the end of the
+ *                   region into the next one
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode verify_code_region(const BytecodeImage *image, size_t start,
+                             size_t end, size_t entry, bool *falls_through);
+
+#endif // VERIFY_H
@@ -1,35 +1,376 @@
 #include "vm.h"
 #include "bytecode.h"
+#include "debuginfo.h"
 #include "errno.h"
 #include "log.h"
+#include "module.h"
 #include <stdint.h>
 #include <string.h>
 
+#ifdef VM_GUARDED_STACK
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/* Operand stack bounds checks used by the dispatch loop. In a
+ * VM_GUARDED_STACK build the stack is bracketed by PROT_NONE pages, so an
+ * out-of-range access faults into stack_fault_handler instead and the checks
+ * compile away. Instructions that move sp without touching the stack, like
+ * POP, use CHECK_STACK, which is kept in every build since no access would
+ * reach a guard page.
+ */
+#define CHECK_STACK(count, name)                                               \
+  do {                                                                         \
+    if (vm->sp < (count)) {                                                    \
+      log_error("Stack underflow on " name);                                   \
+      status = ERR_STACK_UNDERFLOW;                                            \
+      goto VM_EXIT;                                                            \
+    }                                                                          \
+  } while (0)
+#ifdef VM_GUARDED_STACK
+#define REQUIRE_STACK(count, name) ((void)0)
+#define REQUIRE_SPACE(count, name) ((void)0)
+#else
+#define REQUIRE_STACK(count, name) CHECK_STACK(count, name)
+#define REQUIRE_SPACE(count, name)                                             \
+  do {                                                                         \
+    if (vm->sp + (count) > vm->stack_size) {                                   \
+      log_error("Stack overflow on " name);                                    \
+      status = ERR_STACK_OVERFLOW;                                             \
+      goto VM_EXIT;                                                            \
+    }                                                                          \
+  } while (0)
+#endif
+
+/* Reads a 32-bit instruction operand. Operands in version 0.2 code are
+ * 4-byte aligned; memcpy keeps older, unaligned code working and still
+ * compiles to a single load.
+ */
+static inline uint32_t read_operand_u32(const uint8_t *operand) {
+  uint32_t value;
+  memcpy(&value, operand, sizeof(uint32_t));
+  return value;
+}
+
+/* Reads a signed 16-bit operand of a compact instruction. */
+static inline int16_t read_operand_i16(const uint8_t *operand) {
+  int16_t value;
+  memcpy(&value, operand, sizeof(int16_t));
+  return value;
+}
+
+#ifdef VM_GUARDED_STACK
+static pthread_once_t fault_handler_once = PTHREAD_ONCE_INIT;
+static struct sigaction previous_segv_action;
+static _Thread_local Nano_VM *faulting_vm = NULL;
+static _Thread_local sigjmp_buf stack_fault_jmp;
+
+/* Turns a fault in one of the running VM's guard pages into a stack error and
+ * unwinds to execute_vm. Any other fault is handed back to the previous
+ * handler by restoring it and letting the instruction fault again.
+ */
+static void stack_fault_handler(int sig, siginfo_t *info, void *context) {
+  (void)sig;
+  (void)context;
+  Nano_VM *vm = faulting_vm;
+  if (NULL != vm) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    uint8_t *addr = (uint8_t *)info->si_addr;
+    uint8_t *bottom = (uint8_t *)vm->stack;
+    uint8_t *top = (uint8_t *)(vm->stack + vm->stack_size);
+    if (addr >= bottom - page && addr < bottom) {
+      siglongjmp(stack_fault_jmp, ERR_STACK_UNDERFLOW);
+    }
+    if (addr >= top && addr < top + page) {
+      siglongjmp(stack_fault_jmp, ERR_STACK_OVERFLOW);
+    }
+  }
+  sigaction(SIGSEGV, &previous_segv_action, NULL);
+}
+
+static void install_fault_handler(void) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = stack_fault_handler;
+  // SA_NODEFER keeps SIGSEGV unblocked after siglongjmp, which lets
+  // execute_vm use sigsetjmp without saving the signal mask on every run.
+  action.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGSEGV, &action, &previous_segv_action) != 0) {
+    log_error("Failed to install stack guard fault handler");
+  }
+}
+
+/* Maps `slots` stack slots between two PROT_NONE guard pages. The usable
+ * region is rounded up to whole pages so the upper guard starts right at
+ * stack[stack_size].
+ */
+static int32_t *map_guarded_stack(size_t slots, size_t *stack_size) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t usable = (slots * sizeof(int32_t) + page - 1) & ~(page - 1);
+  uint8_t *base = mmap(NULL, usable + 2 * page, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (MAP_FAILED == base) {
+    return NULL;
+  }
+  if (mprotect(base + page, usable, PROT_READ | PROT_WRITE) != 0) {
+    munmap(base, usable + 2 * page);
+    return NULL;
+  }
+  *stack_size = usable / sizeof(int32_t);
+  return (int32_t *)(base + page);
+}
+
+static void unmap_guarded_stack(int32_t *stack, size_t stack_size) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  munmap((uint8_t *)stack - page, stack_size * sizeof(int32_t) + 2 * page);
+}
+#endif
+
+static void free_operand_stack(Nano_VM *vm) {
+#ifdef VM_GUARDED_STACK
+  unmap_guarded_stack(vm->stack, vm->stack_size);
+#else
+  vm->allocator.free(vm->allocator.ctx, vm->stack);
+#endif
+  vm->stack = NULL;
+  vm->stack_size = 0;
+}
+
 ErrorCode init_vm(Nano_VM *vm) {
+  return init_vm_with_allocator(vm, &vm_default_allocator);
+}
+
+ErrorCode init_vm_in_buffer(Nano_VM *vm, void *buffer, size_t size) {
+  if (NULL == vm || NULL == buffer) {
+    log_error("VM instance or buffer is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+#ifdef VM_GUARDED_STACK
+  // The guarded operand stack is always mapped, so it cannot live in here
+  log_error("A guarded-stack build cannot keep a VM inside a buffer");
+  return ERR_INVALID_OPERAND;
+#endif
+
+  // The arena bookkeeping lives at the front of the buffer it manages
+  VM_Arena bootstrap;
+  arena_init(&bootstrap, buffer, size);
+  VM_Allocator allocator = arena_allocator(&bootstrap);
+  VM_Arena *arena = allocator.alloc(allocator.ctx, sizeof(VM_Arena));
+  if (NULL == arena) {
+    log_error("Buffer of %zu bytes is too small for a VM", size);
+    return ERR_OUT_OF_MEMORY;
+  }
+  *arena = bootstrap;
+
+  allocator = arena_allocator(arena);
+  ErrorCode status = init_vm_with_allocator(vm, &allocator);
+  if (status == SUCCESS) {
+    // The stack, frames and locals stay below the mark; code goes above it
+    vm->arena = arena;
+    vm->arena_mark = arena->used;
+  }
+  return status;
+}
+
+ErrorCode init_vm_with_allocator(Nano_VM *vm, const VM_Allocator *allocator) {
   ErrorCode status = SUCCESS;
-  vm->stack = malloc(sizeof(int32_t) * VM_STACK_SIZE);
+  if (NULL == vm || NULL == allocator) {
+    log_error("VM instance or allocator is NULL");
+    return ERR_NULL_POINTER;
+  }
+  vm->allocator = *allocator;
+  vm->arena = NULL;
+  vm->arena_mark = 0;
+
+#ifdef VM_GUARDED_STACK
+  pthread_once(&fault_handler_once, install_fault_handler);
+  vm->stack = map_guarded_stack(VM_STACK_SIZE, &vm->stack_size);
+#else
+  vm->stack =
+      allocator->alloc(allocator->ctx, sizeof(int32_t) * VM_STACK_SIZE);
+  vm->stack_size = VM_STACK_SIZE;
+#endif
   if (NULL == vm->stack) {
     log_error("Failed to allocate memory for VM stack.");
     return ERR_OUT_OF_MEMORY;
   }
 
-  vm->stack_size = VM_STACK_SIZE;
+  vm->call_stack = allocator->alloc(allocator->ctx,
+                                    sizeof(VM_Frame) * VM_INITIAL_CALL_DEPTH);
+  if (NULL == vm->call_stack) {
+    log_error("Failed to allocate memory for VM call stack.");
+    free_operand_stack(vm);
+    return ERR_OUT_OF_MEMORY;
+  }
+
+  vm->locals =
+      allocator->alloc(allocator->ctx, sizeof(int32_t) * VM_INITIAL_LOCALS);
+  if (NULL == vm->locals) {
+    log_error("Failed to allocate memory for VM locals.");
+    allocator->free(allocator->ctx, vm->call_stack);
+    vm->call_stack = NULL;
+    free_operand_stack(vm);
+    return ERR_OUT_OF_MEMORY;
+  }
+
   vm->sp = 0;
 
+  vm->call_capacity = VM_INITIAL_CALL_DEPTH;
+  vm->max_call_depth = VM_MAX_CALL_DEPTH;
   vm->call_sp = 1;
-  memset(&vm->call_stack, 0, sizeof(VM_Frame));
   vm->call_stack[0].prev_sp = 0;
   vm->call_stack[0].return_address = 0;
-  vm->max_call_sp = 0;
+  vm->call_stack[0].locals_base = 0;
+  vm->call_stack[0].module = 0;
+  vm->diag.max_call_sp = 0;
+
+  // Locals are zeroed lazily as frames first touch them
+  vm->locals_capacity = VM_INITIAL_LOCALS;
+  vm->locals_top = 0;
 
   vm->code = NULL;
   vm->code_size = 0;
+  vm->owns_code = false;
+  vm->program = NULL;
+  vm->constants = NULL;
+  vm->constant_count = 0;
+  vm->globals = NULL;
+  vm->global_count = 0;
+  vm->module = 0;
+  vm->modules = NULL;
+  vm->module_count = 0;
+  vm->exports = NULL;
+  vm->export_capacity = 0;
+  vm->export_count = 0;
   vm->ip = 0;
-  vm->error = SUCCESS;
+  vm->entry_point = 0;
+  vm->diag.error = SUCCESS;
 
   return status;
 }
 
+ErrorCode set_call_depth_limit(Nano_VM *vm, size_t max_depth) {
+  if (NULL == vm) {
+    log_error("VM instance is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+  if (max_depth < vm->call_sp) {
+    log_error("Call depth limit %zu is below the current depth %zu",
+              max_depth, vm->call_sp);
+    return ERR_INVALID_OPERAND;
+  }
+
+  vm->max_call_depth = max_depth;
+  return SUCCESS;
+}
+
+/* Raises the arena mark over a grown call stack or locals, so that releasing
+ * the code does not rewind past them. Whatever lay below, such as the code
+ * loaded before the growth, is stranded until the VM is rebuilt.
+ */
+static void keep_arena_blocks(Nano_VM *vm) {
+  if (NULL != vm->arena) {
+    vm->arena_mark = vm->arena->used;
+  }
+}
+
+/* Makes room for one more frame on the call stack, doubling the allocation
+ * until max_call_depth is reached.
+ */
+static ErrorCode grow_call_stack(Nano_VM *vm) {
+  if (vm->call_sp >= vm->max_call_depth) {
+    log_error("Call stack depth limit reached: %zu", vm->max_call_depth);
+    return ERR_STACK_OVERFLOW;
+  }
+
+  size_t capacity = vm->call_capacity * 2;
+  if (capacity > vm->max_call_depth) {
+    capacity = vm->max_call_depth;
+  }
+
+  VM_Frame *frames =
+      vm->allocator.alloc(vm->allocator.ctx, sizeof(VM_Frame) * capacity);
+  if (NULL == frames) {
+    log_error("Failed to grow call stack to %zu frames", capacity);
+    return ERR_OUT_OF_MEMORY;
+  }
+  memcpy(frames, vm->call_stack, sizeof(VM_Frame) * vm->call_sp);
+  vm->allocator.free(vm->allocator.ctx, vm->call_stack);
+  keep_arena_blocks(vm);
+
+  log_debug("Call stack grown to %zu frames", capacity);
+  vm->call_stack = frames;
+  vm->call_capacity = capacity;
+  return SUCCESS;
+}
+
+/* Extends the locals of the active (topmost) frame so that `top` slots are
+ * in use, zeroing only the newly exposed slots.
+ */
+static ErrorCode grow_frame_locals(Nano_VM *vm, size_t top) {
+  if (top > vm->locals_capacity) {
+    size_t capacity = vm->locals_capacity * 2;
+    while (capacity < top) {
+      capacity *= 2;
+    }
+
+    int32_t *locals =
+        vm->allocator.alloc(vm->allocator.ctx, sizeof(int32_t) * capacity);
+    if (NULL == locals) {
+      log_error("Failed to grow locals to %zu slots", capacity);
+      return ERR_OUT_OF_MEMORY;
+    }
+    memcpy(locals, vm->locals, sizeof(int32_t) * vm->locals_top);
+    vm->allocator.free(vm->allocator.ctx, vm->locals);
+    keep_arena_blocks(vm);
+
+    log_debug("Locals grown to %zu slots", capacity);
+    vm->locals = locals;
+    vm->locals_capacity = capacity;
+  }
+
+  memset(vm->locals + vm->locals_top, 0,
+         sizeof(int32_t) * (top - vm->locals_top));
+  vm->locals_top = top;
+  return SUCCESS;
+}
+
+/* Drops the VM's reference to its code, freeing it if load_program made the
+ * copy and releasing the attached program and its globals, if any.
+ */
+static void release_code(Nano_VM *vm) {
+  if (NULL != vm->modules) {
+    release_modules(vm);
+  }
+  if (vm->owns_code) {
+    vm->allocator.free(vm->allocator.ctx, (void *)vm->code);
+  }
+  if (NULL != vm->globals) {
+    vm->allocator.free(vm->allocator.ctx, vm->globals);
+  }
+  if (NULL != vm->program) {
+    release_program(vm->program);
+    vm->program = NULL;
+  }
+  vm->code = NULL;
+  vm->code_size = 0;
+  vm->owns_code = false;
+  vm->constants = NULL;
+  vm->constant_count = 0;
+  vm->globals = NULL;
+  vm->global_count = 0;
+  // Everything above the mark belonged to the code, which is gone now
+  if (NULL != vm->arena) {
+    arena_rewind(vm->arena, vm->arena_mark);
+  }
+}
+
 ErrorCode load_program(Nano_VM *vm, const uint8_t *code, size_t code_size,
                        uint32_t entry_point) {
   ErrorCode status = SUCCESS;
@@ -44,27 +385,122 @@ ErrorCode load_program(Nano_VM *vm, const uint8_t *code, size_t code_size,
   }
 
   if (NULL != vm->code) {
-    free(vm->code);
-    vm->code = NULL;
-    vm->code_size = 0;
+    release_code(vm);
     log_warn("Existing bytecode in VM was overwritten");
   }
 
-  vm->code = malloc(code_size);
-  if (NULL == vm->code) {
+  uint8_t *copy = vm->allocator.alloc(vm->allocator.ctx, code_size);
+  if (NULL == copy) {
     log_error("Failed to allocate memory for bytecode");
     return ERR_OUT_OF_MEMORY;
   }
 
+  memcpy(copy, code, code_size);
+  vm->code = copy;
   vm->code_size = code_size;
-  memcpy(vm->code, code, code_size);
+  vm->owns_code = true;
   log_info("Bytecode loaded into VM (%zu bytes)", code_size);
 
   vm->ip = entry_point;
+  vm->entry_point = entry_point;
   log_info("Entry point set to: %zu", entry_point);
   return status;
 }
 
+ErrorCode bind_program(Nano_VM *vm, const uint8_t *code, size_t code_size,
+                       uint32_t entry_point) {
+  if (NULL == vm) {
+    log_error("VM instance is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+  if (NULL == code || code_size == 0) {
+    log_error("Invalid code or code size");
+    return ERR_INVALID_OPERAND;
+  }
+
+  if (NULL != vm->code) {
+    release_code(vm);
+    log_warn("Existing bytecode in VM was overwritten");
+  }
+
+  vm->code = code;
+  vm->code_size = code_size;
+  vm->owns_code = false;
+  vm->ip = entry_point;
+  vm->entry_point = entry_point;
+  log_info("Bytecode bound to VM without copying (%zu bytes, entry point %u)",
+           code_size, entry_point);
+  return SUCCESS;
+}
+
+ErrorCode attach_program(Nano_VM *vm, Program *program) {
+  if (NULL == vm || NULL == program) {
+    log_error("VM instance or program is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+  // Retain first in case the VM is already attached to this program
+  retain_program(program);
+  if (NULL != vm->arena && NULL != vm->code) {
+    // Releasing rewinds the arena, so it must come before the globals
+    release_code(vm);
+  }
+
+  const BytecodeImage *image = &program->image;
+  int32_t *globals = NULL;
+  if (image->global_count > 0) {
+    globals = vm->allocator.alloc(vm->allocator.ctx,
+                                  sizeof(int32_t) * image->global_count);
+    if (NULL == globals) {
+      log_error("Failed to allocate memory for %zu globals",
+                image->global_count);
+      release_program(program);
+      return ERR_OUT_OF_MEMORY;
+    }
+    memcpy(globals, image->globals, sizeof(int32_t) * image->global_count);
+  }
+
+  if (NULL != vm->code) {
+    release_code(vm);
+  }
+
+  vm->program = program;
+  vm->code = image->code;
+  vm->code_size = image->code_size;
+  vm->owns_code = false;
+  vm->constants = image->constants;
+  vm->constant_count = image->constant_count;
+  vm->globals = globals;
+  vm->global_count = image->global_count;
+  vm->ip = image->entry_point;
+  vm->entry_point = image->entry_point;
+  log_debug("Program attached to VM (%zu bytes)", image->code_size);
+  return SUCCESS;
+}
+
+ErrorCode reset_vm(Nano_VM *vm) {
+  if (NULL == vm) {
+    log_error("VM instance is NULL");
+    return ERR_NULL_POINTER;
+  }
+
+  if (NULL != vm->modules) {
+    reset_modules(vm);
+  }
+  vm->ip = vm->entry_point;
+  vm->sp = 0;
+  vm->call_sp = 1;
+  vm->locals_top = 0;
+  if (vm->global_count > 0) {
+    memcpy(vm->globals, vm->program->image.globals,
+           sizeof(int32_t) * vm->global_count);
+  }
+  vm->diag.max_call_sp = 0;
+  vm->diag.error = SUCCESS;
+  return SUCCESS;
+}
+
 ErrorCode free_vm(Nano_VM *vm) {
   ErrorCode status = SUCCESS;
   if (NULL == vm) {
@@ -73,22 +509,55 @@ ErrorCode free_vm(Nano_VM *vm) {
   }
 
   if (NULL != vm->code) {
-    free(vm->code);
-    vm->code = NULL;
-    vm->code_size = 0;
+    release_code(vm);
   }
 
   if (NULL != vm->stack) {
-    free(vm->stack);
-    vm->stack = NULL;
-    vm->stack_size = 0;
+    free_operand_stack(vm);
     vm->sp = 0;
   }
 
+  if (NULL != vm->call_stack) {
+    vm->allocator.free(vm->allocator.ctx, vm->call_stack);
+    vm->call_stack = NULL;
+    vm->call_capacity = 0;
+    vm->call_sp = 0;
+  }
+
+  if (NULL != vm->locals) {
+    vm->allocator.free(vm->allocator.ctx, vm->locals);
+    vm->locals = NULL;
+    vm->locals_capacity = 0;
+    vm->locals_top = 0;
+  }
+
   log_info("VM resources freed");
   return status;
 }
 
+/* Logs the function and source line the VM stopped at, if its program
+ * carries debug information. Only a failed run gets here, so the section
+ * is never read while code runs.
+ */
+static void report_source_location(const Nano_VM *vm) {
+  if (NULL == vm->program || NULL == vm->program->image.debug) {
+    return;
+  }
+  SourceLocation location;
+  if (find_source_location(&vm->program->image, (uint32_t)vm->ip,
+                           &location) != SUCCESS) {
+    return;
+  }
+  if (NULL == location.file) {
+    log_error("  at %.*s+%zu", (int)location.function_length,
+              location.function, vm->ip - location.entry);
+  } else {
+    log_error("  at %.*s (%.*s:%u)", (int)location.function_length,
+              location.function, (int)location.file_length, location.file,
+              location.line);
+  }
+}
+
 /* Instruction dispatch loop
  * 1. Fetch the next instruction using the instruction pointer (ip).
  * 2. Decode the instruction to determine the opcode and operands.
@@ -116,9 +585,26 @@ ErrorCode execute_vm(Nano_VM *vm) {
     return ERR_INVALID_OPERAND;
   }
 
+#ifdef VM_GUARDED_STACK
+  Nano_VM *previous_vm = faulting_vm;
+  faulting_vm = vm;
+  int fault = sigsetjmp(stack_fault_jmp, 0);
+  if (fault != 0) {
+    log_error("Operand stack %s at IP %zu",
+              fault == ERR_STACK_OVERFLOW ? "overflow" : "underflow", vm->ip);
+    status = (ErrorCode)fault;
+    goto VM_EXIT;
+  }
+#endif
+
   while (1) {
     log_debug("IP: %zu, SP: %zu", vm->ip, vm->sp);
     Opcode opcode = vm->code[vm->ip];
+    if (opcode >= OP_COUNT) {
+      log_error("Unsupported opcode 0x%02X at IP %zu", opcode, vm->ip);
+      status = ERR_UNSUPPORTED_OPCODE;
+      goto VM_EXIT;
+    }
     InstructionInfo info = instruction_set[opcode];
 
     switch (opcode) {
@@ -128,13 +614,8 @@ ErrorCode execute_vm(Nano_VM *vm) {
         status = ERR_INVALID_OPERAND;
         goto VM_EXIT;
       }
-      if (vm->sp >= vm->stack_size) {
-        log_error("Stack overflow on PUSH");
-        status = ERR_STACK_OVERFLOW;
-        goto VM_EXIT;
-      }
-      int32_t value;
-      memcpy(&value, vm->code + vm->ip + 1, sizeof(int32_t));
+      REQUIRE_SPACE(1, "PUSH");
+      int32_t value = (int32_t)read_operand_u32(vm->code + vm->ip + 1);
       vm->stack[vm->sp++] = value;
       vm->ip += info.length;
       break;
@@ -145,11 +626,7 @@ ErrorCode execute_vm(Nano_VM *vm) {
         status = ERR_INVALID_OPERAND;
         goto VM_EXIT;
       }
-      if (vm->sp == 0) {
-        log_error("Stack underflow on POP");
-        status = ERR_STACK_UNDERFLOW;
-        goto VM_EXIT;
-      }
+      CHECK_STACK(1, "POP");
       --vm->sp;
       vm->ip += info.length;
       break;
@@ -166,13 +643,15 @@ ErrorCode execute_vm(Nano_VM *vm) {
         status = ERR_INVALID_OPERAND;
         goto VM_EXIT;
       }
-      if (vm->sp >= vm->stack_size) {
-        log_error("LOAD instruction stack overflow");
-        status = ERR_STACK_OVERFLOW;
-        goto VM_EXIT;
+      REQUIRE_SPACE(1, "LOAD");
+      size_t slot = vm->call_stack[vm->call_sp - 1].locals_base + index;
+      if (slot >= vm->locals_top) {
+        status = grow_frame_locals(vm, slot + 1);
+        if (status != SUCCESS) {
+          goto VM_EXIT;
+        }
       }
-      vm->stack[vm->sp++] =
-          vm->call_stack[vm->call_sp - 1].locals[vm->code[vm->ip + 1]];
+      vm->stack[vm->sp++] = vm->locals[slot];
       vm->ip += info.length;
       break;
     }
@@ -188,12 +667,15 @@ ErrorCode execute_vm(Nano_VM *vm) {
         status = ERR_INVALID_OPERAND;
         goto VM_EXIT;
       }
-      if (vm->sp == 0) {
-        log_error("Stack underflow on STORE");
-        status = ERR_STACK_UNDERFLOW;
-        goto VM_EXIT;
+      REQUIRE_STACK(1, "STORE");
+      size_t slot = vm->call_stack[vm->call_sp - 1].locals_base + index;
+      if (slot >= vm->locals_top) {
+        status = grow_frame_locals(vm, slot + 1);
+        if (status != SUCCESS) {
+          goto VM_EXIT;
+        }
       }
-      vm->call_stack[vm->call_sp - 1].locals[index] = vm->stack[--vm->sp];
+      vm->locals[slot] = vm->stack[--vm->sp];
       vm->ip += info.length;
       break;
     }
@@ -203,16 +685,8 @@ ErrorCode execute_vm(Nano_VM *vm) {
         status = ERR_INVALID_OPERAND;
         goto VM_EXIT;
       }
-      if (vm->sp == 0) {
-        log_error("Stack underflow on DUP");
-        status = ERR_STACK_UNDERFLOW;
-        goto VM_EXIT;
-      }
-      if (vm->sp >= vm->stack_size) {
-        log_error("Stack overflow on DUP");
-        status = ERR_STACK_OVERFLOW;
-        goto VM_EXIT;
-      }
+      REQUIRE_STACK(1, "DUP");
+      REQUIRE_SPACE(1, "DUP");
       vm->stack[vm->sp] = vm->stack[vm->sp - 1];
       vm->sp++;
       vm->ip += info.length;
@@ -224,11 +698,7 @@ ErrorCode execute_vm(Nano_VM *vm) {
         status = ERR_INVALID_OPERAND;
         goto VM_EXIT;
       }
-      if (vm->sp < 2) {
-        log_error("Stack underflow on SWAP");
-        status = ERR_STACK_UNDERFLOW;
-        goto VM_EXIT;
-      }
+      REQUIRE_STACK(2, "SWAP");
       int32_t temp = vm->stack[vm->sp - 1];
       vm->stack[vm->sp - 1] = vm->stack[vm->sp - 2];
       vm->stack[vm->sp - 2] = temp;
@@ -241,16 +711,8 @@ ErrorCode execute_vm(Nano_VM *vm) {
         status = ERR_INVALID_OPERAND;
         goto VM_EXIT;
       }
-      if (vm->sp < 2) {
-        log_error("Stack underflow on OVER");
-        status = ERR_STACK_UNDERFLOW;
-        goto VM_EXIT;
-      }
-      if (vm->sp >= vm->stack_size) {
-        log_error("Stack overflow on OVER");
-        status = ERR_STACK_OVERFLOW;
-        goto VM_EXIT;
-      }
+      REQUIRE_STACK(2, "OVER");
+      REQUIRE_SPACE(1, "OVER");
       vm->stack[vm->sp] = vm->stack[vm->sp - 2];
       vm->sp++;
       vm->ip += info.length;
@@ -262,11 +724,7 @@ ErrorCode execute_vm(Nano_VM *vm) {
         status = ERR_INVALID_OPERAND;
         goto VM_EXIT;
       }
-      if (vm->sp < 2) {
-        log_error("Stack underflow on ADD");
-        status = ERR_STACK_UNDERFLOW;
-        goto VM_EXIT;
-      }
+      REQUIRE_STACK(2, "ADD");
       uint32_t b = vm->stack[--vm->sp];
       uint32_t a = vm->stack[--vm->sp];
       vm->stack[vm->sp++] = a + b;
@@ -279,11 +737,7 @@ ErrorCode execute_vm(Nano_VM *vm) {
         status = ERR_INVALID_OPERAND;
         goto VM_EXIT;
       }
-      if (vm->sp < 2) {
-        log_error("Stack underflow on SUB");
-        status = ERR_STACK_UNDERFLOW;
-        goto VM_EXIT;
-      }
+      REQUIRE_STACK(2, "SUB");
       uint32_t b = vm->stack[--vm->sp];
       uint32_t a = vm->stack[--vm->sp];
       vm->stack[vm->sp++] = a - b;
@@ -296,11 +750,7 @@ ErrorCode execute_vm(Nano_VM *vm) {
         status = ERR_INVALID_OPERAND;
         goto VM_EXIT;
       }
-      if (vm->sp < 2) {
-        log_error("Stack underflow on MUL");
-        status = ERR_STACK_UNDERFLOW;
-        goto VM_EXIT;
-      }
+      REQUIRE_STACK(2, "MUL");
       uint32_t b = vm->stack[--vm->sp];
       uint32_t a = vm->stack[--vm->sp];
       vm->stack[vm->sp++] = a * b;
@@ -313,11 +763,7 @@ ErrorCode execute_vm(Nano_VM *vm) {
         status = ERR_INVALID_OPERAND;
         goto VM_EXIT;
       }
-      if (vm->sp < 2) {
-        log_error("Stack underflow on DIV");
-        status = ERR_STACK_UNDERFLOW;
-        goto VM_EXIT;
-      }
+      REQUIRE_STACK(2, "DIV");
       uint32_t b = vm->stack[--vm->sp];
       uint32_t a = vm->stack[--vm->sp];
       if (b == 0) {
@@ -335,11 +781,7 @@ ErrorCode execute_vm(Nano_VM *vm) {
         status = ERR_INVALID_OPERAND;
         goto VM_EXIT;
       }
-      if (vm->sp < 2) {
-        log_error("Stack underflow on CMP_EQ");
-        status = ERR_STACK_UNDERFLOW;
-        goto VM_EXIT;
-      }
+      REQUIRE_STACK(2, "CMP_EQ");
       uint32_t b = vm->stack[--vm->sp];
       uint32_t a = vm->stack[--vm->sp];
       vm->stack[vm->sp++] = (a == b) ? 1 : 0;
@@ -352,11 +794,7 @@ ErrorCode execute_vm(Nano_VM *vm) {
         status = ERR_INVALID_OPERAND;
         goto VM_EXIT;
       }
-      if (vm->sp < 2) {
-        log_error("Stack underflow on CMP_NEQ");
-        status = ERR_STACK_UNDERFLOW;
-        goto VM_EXIT;
-      }
+      REQUIRE_STACK(2, "CMP_NEQ");
       uint32_t b = vm->stack[--vm->sp];
       uint32_t a = vm->stack[--vm->sp];
       vm->stack[vm->sp++] = (a != b) ? 1 : 0;
@@ -369,11 +807,7 @@ ErrorCode execute_vm(Nano_VM *vm) {
         status = ERR_INVALID_OPERAND;
         goto VM_EXIT;
       }
-      if (vm->sp < 2) {
-        log_error("Stack underflow on CMP_LT");
-        status = ERR_STACK_UNDERFLOW;
-        goto VM_EXIT;
-      }
+      REQUIRE_STACK(2, "CMP_LT");
       uint32_t b = vm->stack[--vm->sp];
       uint32_t a = vm->stack[--vm->sp];
       vm->stack[vm->sp++] = (a < b) ? 1 : 0;
@@ -386,11 +820,7 @@ ErrorCode execute_vm(Nano_VM *vm) {
         status = ERR_INVALID_OPERAND;
         goto VM_EXIT;
       }
-      if (vm->sp < 2) {
-        log_error("Stack underflow on CMP_LTE");
-        status = ERR_STACK_UNDERFLOW;
-        goto VM_EXIT;
-      }
+      REQUIRE_STACK(2, "CMP_LTE");
       uint32_t b = vm->stack[--vm->sp];
       uint32_t a = vm->stack[--vm->sp];
       vm->stack[vm->sp++] = (a <= b) ? 1 : 0;
@@ -403,11 +833,7 @@ ErrorCode execute_vm(Nano_VM *vm) {
         status = ERR_INVALID_OPERAND;
         goto VM_EXIT;
       }
-      if (vm->sp < 2) {
-        log_error("Stack underflow on CMP_GT");
-        status = ERR_STACK_UNDERFLOW;
-        goto VM_EXIT;
-      }
+      REQUIRE_STACK(2, "CMP_GT");
       uint32_t b = vm->stack[--vm->sp];
       uint32_t a = vm->stack[--vm->sp];
       vm->stack[vm->sp++] = (a > b) ? 1 : 0;
@@ -420,11 +846,7 @@ ErrorCode execute_vm(Nano_VM *vm) {
         status = ERR_INVALID_OPERAND;
         goto VM_EXIT;
       }
-      if (vm->sp < 2) {
-        log_error("Stack underflow on CMP_GTE");
-        status = ERR_STACK_UNDERFLOW;
-        goto VM_EXIT;
-      }
+      REQUIRE_STACK(2, "CMP_GTE");
       uint32_t b = vm->stack[--vm->sp];
       uint32_t a = vm->stack[--vm->sp];
       vm->stack[vm->sp++] = (a >= b) ? 1 : 0;
@@ -438,31 +860,35 @@ ErrorCode execute_vm(Nano_VM *vm) {
         goto VM_EXIT;
       }
 
-      if (vm->ip + 1 >= vm->code_size) {
+      size_t target = read_operand_u32(vm->code + vm->ip + 1);
+      if (target >= vm->code_size) {
         log_error("JMP destination out of bounds");
         status = ERR_INVALID_OPERAND;
         goto VM_EXIT;
       }
 
-      vm->ip = *((uint32_t *)(vm->code + vm->ip + 1));
+      vm->ip = target;
       break;
     }
-    case OP_JMPZ: {
+    case OP_JMPZ:
+    case OP_JMPNZ: {
       if (vm->ip + info.length > vm->code_size) {
-        log_error("JMPZ instruction out of bounds");
+        log_error("%s instruction out of bounds", info.name);
         status = ERR_INVALID_OPERAND;
         goto VM_EXIT;
       }
 
-      if (vm->sp < 1) {
-        log_error("Stack underflow on JMPZ");
-        status = ERR_STACK_UNDERFLOW;
-        goto VM_EXIT;
-      }
+      REQUIRE_STACK(1, "conditional jump");
 
       uint32_t stack_value = vm->stack[--vm->sp];
-      if (stack_value == 0) {
-        vm->ip = *((uint32_t *)(vm->code + vm->ip + 1));
+      if ((stack_value == 0) == (opcode == OP_JMPZ)) {
+        size_t target = read_operand_u32(vm->code + vm->ip + 1);
+        if (target >= vm->code_size) {
+          log_error("%s destination out of bounds", info.name);
+          status = ERR_INVALID_OPERAND;
+          goto VM_EXIT;
+        }
+        vm->ip = target;
       } else {
         vm->ip += info.length;
       }
@@ -475,16 +901,92 @@ ErrorCode execute_vm(Nano_VM *vm) {
         goto VM_EXIT;
       }
 
-      if (vm->call_sp >= VM_MAX_CALL_DEPTH) {
-        log_error("Call stack overflow on CALL");
-        status = ERR_STACK_OVERFLOW;
+      size_t target = read_operand_u32(vm->code + vm->ip + 1);
+      if (target >= vm->code_size) {
+        log_error("CALL destination out of bounds");
+        status = ERR_INVALID_OPERAND;
         goto VM_EXIT;
       }
 
+      // A lazy program's functions are verified on their first call
+      if (NULL != vm->program &&
+          !program_region_verified(vm->program, target)) {
+        status = verify_program_call(vm->program, target);
+        if (status != SUCCESS) {
+          goto VM_EXIT;
+        }
+      }
+
+      if (vm->call_sp >= vm->call_capacity) {
+        status = grow_call_stack(vm);
+        if (status != SUCCESS) {
+          log_error("Call stack overflow on CALL");
+          goto VM_EXIT;
+        }
+      }
+
+      VM_Frame *new_frame = &vm->call_stack[vm->call_sp++];
+      new_frame->return_address = vm->ip + info.length;
+      new_frame->prev_sp = vm->sp;
+      new_frame->locals_base = vm->locals_top;
+      new_frame->module = vm->module;
+      if (vm->call_sp > vm->diag.max_call_sp) {
+        vm->diag.max_call_sp = vm->call_sp;
+      }
+      vm->ip = target;
+      break;
+    }
+    case OP_CALLX: {
+      if (vm->ip + info.length > vm->code_size) {
+        log_error("CALLX instruction out of bounds");
+        status = ERR_INVALID_OPERAND;
+        goto VM_EXIT;
+      }
+
+      uint32_t index = read_operand_u32(vm->code + vm->ip + 1);
+      if (NULL == vm->modules ||
+          index >= vm->modules[vm->module].import_count) {
+        log_error("CALLX at IP %zu calls import %u with no modules attached",
+                  vm->ip, index);
+        status = ERR_INVALID_OPERAND;
+        goto VM_EXIT;
+      }
+
+      // The name is looked up once; later calls go straight to the slot
+      VM_Import *import = &vm->modules[vm->module].imports[index];
+      if (import->module == VM_UNRESOLVED_IMPORT) {
+        status = resolve_import(vm, vm->module, index);
+        if (status != SUCCESS) {
+          goto VM_EXIT;
+        }
+      }
+
+      Program *callee = vm->modules[import->module].program;
+      if (NULL != callee && !program_region_verified(callee, import->entry)) {
+        status = verify_program_call(callee, import->entry);
+        if (status != SUCCESS) {
+          goto VM_EXIT;
+        }
+      }
+
+      if (vm->call_sp >= vm->call_capacity) {
+        status = grow_call_stack(vm);
+        if (status != SUCCESS) {
+          log_error("Call stack overflow on CALLX");
+          goto VM_EXIT;
+        }
+      }
+
       VM_Frame *new_frame = &vm->call_stack[vm->call_sp++];
       new_frame->return_address = vm->ip + info.length;
       new_frame->prev_sp = vm->sp;
-      vm->ip = *((uint32_t *)(vm->code + vm->ip + 1));
+      new_frame->locals_base = vm->locals_top;
+      new_frame->module = vm->module;
+      if (vm->call_sp > vm->diag.max_call_sp) {
+        vm->diag.max_call_sp = vm->call_sp;
+      }
+      enter_module(vm, import->module);
+      vm->ip = import->entry;
       break;
     }
     case OP_RET: {
@@ -498,8 +1000,13 @@ ErrorCode execute_vm(Nano_VM *vm) {
         status = ERR_STACK_UNDERFLOW;
         goto VM_EXIT;
       }
-      vm->sp = vm->call_stack[--vm->call_sp].prev_sp;
-      vm->ip = vm->call_stack[vm->call_sp].return_address;
+      VM_Frame *frame = &vm->call_stack[--vm->call_sp];
+      if (frame->module != vm->module) {
+        enter_module(vm, frame->module);
+      }
+      vm->sp = frame->prev_sp;
+      vm->ip = frame->return_address;
+      vm->locals_top = frame->locals_base;
       break;
     }
     case OP_PRINT: {
@@ -508,25 +1015,274 @@ ErrorCode execute_vm(Nano_VM *vm) {
         status = ERR_INVALID_OPERAND;
         goto VM_EXIT;
       }
-      if (vm->sp == 0) {
-        log_error("Stack underflow on PRINT");
+      REQUIRE_STACK(1, "PRINT");
+      int32_t value = vm->stack[--vm->sp];
+      printf("%d\n", value);
+      vm->ip += info.length;
+      break;
+    }
+    case OP_CLEAR: {
+      if (vm->ip + info.length > vm->code_size) {
+        log_error("CLEAR instruction out of bounds");
+        status = ERR_INVALID_OPERAND;
+        goto VM_EXIT;
+      }
+      // Only the current frame's operands; callers' values stay put
+      vm->sp = vm->call_stack[vm->call_sp - 1].prev_sp;
+      vm->ip += info.length;
+      break;
+    }
+    case OP_PICK: {
+      if (vm->ip + info.length > vm->code_size) {
+        log_error("PICK instruction out of bounds");
+        status = ERR_INVALID_OPERAND;
+        goto VM_EXIT;
+      }
+      uint32_t depth = vm->code[vm->ip + 1];
+      if (vm->sp <= depth) {
+        log_error("Stack underflow on PICK %u", depth);
         status = ERR_STACK_UNDERFLOW;
         goto VM_EXIT;
       }
-      int32_t value = vm->stack[--vm->sp];
-      printf("%d\n", value);
+      REQUIRE_SPACE(1, "PICK");
+      vm->stack[vm->sp] = vm->stack[vm->sp - 1 - depth];
+      vm->sp++;
       vm->ip += info.length;
       break;
     }
+    case OP_MOD: {
+      if (vm->ip + info.length > vm->code_size) {
+        log_error("MOD instruction out of bounds");
+        status = ERR_INVALID_OPERAND;
+        goto VM_EXIT;
+      }
+      REQUIRE_STACK(2, "MOD");
+      uint32_t b = vm->stack[--vm->sp];
+      uint32_t a = vm->stack[--vm->sp];
+      if (b == 0) {
+        log_error("Division by zero");
+        status = ERR_DIVIDE_BY_ZERO;
+        goto VM_EXIT;
+      }
+      vm->stack[vm->sp++] = a % b;
+      vm->ip += info.length;
+      break;
+    }
+    case OP_INC: {
+      if (vm->ip + info.length > vm->code_size) {
+        log_error("INC instruction out of bounds");
+        status = ERR_INVALID_OPERAND;
+        goto VM_EXIT;
+      }
+      REQUIRE_STACK(1, "INC");
+      vm->stack[vm->sp - 1] = (uint32_t)vm->stack[vm->sp - 1] + 1;
+      vm->ip += info.length;
+      break;
+    }
+    case OP_DEC: {
+      if (vm->ip + info.length > vm->code_size) {
+        log_error("DEC instruction out of bounds");
+        status = ERR_INVALID_OPERAND;
+        goto VM_EXIT;
+      }
+      REQUIRE_STACK(1, "DEC");
+      vm->stack[vm->sp - 1] = (uint32_t)vm->stack[vm->sp - 1] - 1;
+      vm->ip += info.length;
+      break;
+    }
+    case OP_NOP: {
+      vm->ip += info.length;
+      break;
+    }
+    case OP_INPUT: {
+      if (vm->ip + info.length > vm->code_size) {
+        log_error("INPUT instruction out of bounds");
+        status = ERR_INVALID_OPERAND;
+        goto VM_EXIT;
+      }
+      REQUIRE_SPACE(1, "INPUT");
+      int32_t value;
+      if (scanf("%d", &value) != 1) {
+        log_error("Failed to read an integer for INPUT");
+        status = ERR_FILE_READ;
+        goto VM_EXIT;
+      }
+      vm->stack[vm->sp++] = value;
+      vm->ip += info.length;
+      break;
+    }
+    case OP_PUSHK: {
+      if (vm->ip + info.length > vm->code_size) {
+        log_error("PUSHK instruction out of bounds");
+        status = ERR_INVALID_OPERAND;
+        goto VM_EXIT;
+      }
+      uint32_t index = read_operand_u32(vm->code + vm->ip + 1);
+      if (index >= vm->constant_count) {
+        log_error("Constant index out of bounds: %u", index);
+        status = ERR_INVALID_OPERAND;
+        goto VM_EXIT;
+      }
+      REQUIRE_SPACE(1, "PUSHK");
+      vm->stack[vm->sp++] = vm->constants[index];
+      vm->ip += info.length;
+      break;
+    }
+    case OP_GLOAD: {
+      if (vm->ip + info.length > vm->code_size) {
+        log_error("GLOAD instruction out of bounds");
+        status = ERR_INVALID_OPERAND;
+        goto VM_EXIT;
+      }
+      uint32_t index = read_operand_u32(vm->code + vm->ip + 1);
+      if (index >= vm->global_count) {
+        log_error("Global index out of bounds: %u", index);
+        status = ERR_INVALID_OPERAND;
+        goto VM_EXIT;
+      }
+      REQUIRE_SPACE(1, "GLOAD");
+      vm->stack[vm->sp++] = vm->globals[index];
+      vm->ip += info.length;
+      break;
+    }
+    case OP_GSTORE: {
+      if (vm->ip + info.length > vm->code_size) {
+        log_error("GSTORE instruction out of bounds");
+        status = ERR_INVALID_OPERAND;
+        goto VM_EXIT;
+      }
+      uint32_t index = read_operand_u32(vm->code + vm->ip + 1);
+      if (index >= vm->global_count) {
+        log_error("Global index out of bounds: %u", index);
+        status = ERR_INVALID_OPERAND;
+        goto VM_EXIT;
+      }
+      REQUIRE_STACK(1, "GSTORE");
+      vm->globals[index] = vm->stack[--vm->sp];
+      vm->ip += info.length;
+      break;
+    }
+    case OP_PUSH_0:
+    case OP_PUSH_1: {
+      REQUIRE_SPACE(1, "PUSH_0/PUSH_1");
+      vm->stack[vm->sp++] = opcode == OP_PUSH_1;
+      vm->ip += info.length;
+      break;
+    }
+    case OP_PUSH8: {
+      if (vm->ip + info.length > vm->code_size) {
+        log_error("PUSH8 instruction out of bounds");
+        status = ERR_INVALID_OPERAND;
+        goto VM_EXIT;
+      }
+      REQUIRE_SPACE(1, "PUSH8");
+      vm->stack[vm->sp++] = (int8_t)vm->code[vm->ip + 1];
+      vm->ip += info.length;
+      break;
+    }
+    case OP_PUSH16: {
+      if (vm->ip + info.length > vm->code_size) {
+        log_error("PUSH16 instruction out of bounds");
+        status = ERR_INVALID_OPERAND;
+        goto VM_EXIT;
+      }
+      REQUIRE_SPACE(1, "PUSH16");
+      vm->stack[vm->sp++] = read_operand_i16(vm->code + vm->ip + 1);
+      vm->ip += info.length;
+      break;
+    }
+    case OP_JMP8:
+    case OP_JMP16:
+    case OP_JMPZ8:
+    case OP_JMPZ16:
+    case OP_JMPNZ8:
+    case OP_JMPNZ16: {
+      if (vm->ip + info.length > vm->code_size) {
+        log_error("%s instruction out of bounds", info.name);
+        status = ERR_INVALID_OPERAND;
+        goto VM_EXIT;
+      }
+
+      bool taken = true;
+      if (opcode >= OP_JMPZ8) {
+        REQUIRE_STACK(1, "conditional jump");
+        uint32_t stack_value = vm->stack[--vm->sp];
+        taken = (stack_value == 0) ==
+                (opcode == OP_JMPZ8 || opcode == OP_JMPZ16);
+      }
+      if (!taken) {
+        vm->ip += info.length;
+        break;
+      }
+
+      int32_t offset = info.length == 2
+                           ? (int8_t)vm->code[vm->ip + 1]
+                           : read_operand_i16(vm->code + vm->ip + 1);
+      size_t target = vm->ip + (size_t)(ptrdiff_t)offset;
+      if (target >= vm->code_size) {
+        log_error("%s destination out of bounds", info.name);
+        status = ERR_INVALID_OPERAND;
+        goto VM_EXIT;
+      }
+      vm->ip = target;
+      break;
+    }
+    case OP_PUSHKV:
+    case OP_GLOADV:
+    case OP_GSTOREV: {
+      uint32_t index;
+      size_t operand = decode_uleb128(vm->code + vm->ip + 1,
+                                      vm->code_size - vm->ip - 1, &index);
+      if (operand == 0) {
+        log_error("%s instruction out of bounds", info.name);
+        status = ERR_INVALID_OPERAND;
+        goto VM_EXIT;
+      }
+      if (opcode == OP_PUSHKV) {
+        if (index >= vm->constant_count) {
+          log_error("Constant index out of bounds: %u", index);
+          status = ERR_INVALID_OPERAND;
+          goto VM_EXIT;
+        }
+        REQUIRE_SPACE(1, "PUSHKV");
+        vm->stack[vm->sp++] = vm->constants[index];
+      } else {
+        if (index >= vm->global_count) {
+          log_error("Global index out of bounds: %u", index);
+          status = ERR_INVALID_OPERAND;
+          goto VM_EXIT;
+        }
+        if (opcode == OP_GLOADV) {
+          REQUIRE_SPACE(1, "GLOADV");
+          vm->stack[vm->sp++] = vm->globals[index];
+        } else {
+          REQUIRE_STACK(1, "GSTOREV");
+          vm->globals[index] = vm->stack[--vm->sp];
+        }
+      }
+      vm->ip += 1 + operand;
+      break;
+    }
     case OP_HALT: {
       status = SUCCESS;
       log_info("HALT instruction encountered. Stopping execution.");
       goto VM_EXIT;
     }
+    case OP_COUNT: {
+      log_error("Unsupported opcode 0x%02X at IP %zu", opcode, vm->ip);
+      status = ERR_UNSUPPORTED_OPCODE;
+      goto VM_EXIT;
+    }
     }
   }
 VM_EXIT:
-  vm->error = status;
+#ifdef VM_GUARDED_STACK
+  faulting_vm = previous_vm;
+#endif
+  vm->diag.error = status;
+  if (status != SUCCESS) {
+    report_source_location(vm);
+  }
   log_info("VM execution ended with status: %d", status);
   return status;
 }
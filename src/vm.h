@@ -1,32 +1,197 @@
+#ifndef VM_H
+#define VM_H
+
+#include "alloc.h"
 #include "errno.h"
+#include "program.h"
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 
+#ifndef VM_STACK_SIZE
+#ifdef VM_GUARDED_STACK
+// Reserved, not committed: pages are only backed once the stack reaches them
+#define VM_STACK_SIZE (16 * 1024 * 1024)
+#else
 #define VM_STACK_SIZE 1024
-#define VM_MAX_CALL_DEPTH 64
-#define VM_MAX_LOCALS 256
+#endif
+#endif
+#define VM_INITIAL_CALL_DEPTH 16 // Frames reserved up front by init_vm
+#define VM_MAX_CALL_DEPTH 65536  // Default limit the call stack may grow to
+#define VM_INITIAL_LOCALS 256    // Local slots reserved up front by init_vm
+#define VM_MAX_LOCALS 256        // Locals addressable by a single frame
+#define VM_CACHE_LINE_SIZE 64
 
 typedef struct {
-  int32_t locals[VM_MAX_LOCALS]; // Local variables
-  size_t return_address;         // Return address for CALL/RET
-  size_t prev_sp;                // Stack pointer
+  size_t return_address; // Return address for CALL/RET
+  size_t prev_sp;        // Stack pointer
+  size_t locals_base;    // Index of the frame's first local in vm->locals
+  size_t module;         // Module of the caller, restored by RET
 } VM_Frame;
 
+#define VM_UNRESOLVED_IMPORT UINT32_MAX
+
+// Import slot of a module, filled in on the first CALLX through it
+typedef struct {
+  uint32_t module; // Index in vm->modules, or VM_UNRESOLVED_IMPORT
+  uint32_t entry;  // Code offset of the function in that module
+} VM_Import;
+
+/* A program attached to a VM with attach_module, or the main program as
+ * module 0. The registers are copied into the VM when control enters it.
+ */
+typedef struct {
+  Program *program;         // NULL for code from load_program/bind_program
+  const uint8_t *code;      // Bytecode instructions
+  size_t code_size;         // Size of the bytecode
+  const int32_t *constants; // Constant pool
+  size_t constant_count;    // Entries in constants
+  int32_t *globals;         // This VM's copy of the module's globals
+  size_t global_count;      // Entries in globals
+  VM_Import *imports;       // One slot per entry of the symbol table
+  size_t import_count;      // Entries in imports
+} VM_Module;
+
+// Entry of the VM's open-addressing table of every module's exports
 typedef struct {
-  uint8_t *code;     // Pointer to the bytecode instructions
-  size_t code_size;  // Size of the bytecode instructions
-  size_t ip;         // Instruction pointer
-  int32_t *stack;    // Stack for the VM
-  size_t stack_size; // Size of the stack
-  size_t sp;         // Stack pointer
-  VM_Frame call_stack[VM_MAX_CALL_DEPTH]; // Call stack for function calls
-  size_t call_sp;                         // Call stack pointer
-  size_t max_call_sp;                     // Maximum call stack depth
-  ErrorCode error;                        // Error code for the last operation
+  const char *name; // Inside the module's names section; NULL if free
+  uint32_t length;  // Length of the name
+  uint32_t hash;    // FNV-1a hash of the name
+  uint32_t module;  // Index in vm->modules
+  uint32_t entry;   // Code offset of the function
+} VM_Export;
+
+typedef struct {
+  size_t max_call_sp; // Deepest call stack reached
+  ErrorCode error;    // Error code for the last operation
+} VM_Diagnostics;
+
+/* VM state is laid out by access frequency. The first cache line holds the
+ * registers every dispatch reads; locals, constants and globals start on the
+ * next line, and limits and diagnostics trail at the end. The
+ * operand stack, frames and locals are separate allocations, so the struct
+ * itself stays a few cache lines and VMs can be packed densely.
+ */
+typedef struct {
+  // Hot: interpreter registers
+  _Alignas(VM_CACHE_LINE_SIZE) const uint8_t *code; // Bytecode instructions
+  size_t code_size;                                 // Size of the bytecode
+  size_t ip;                                        // Instruction pointer
+  int32_t *stack;                                   // Stack for the VM
+  size_t stack_size;                                // Size of the stack
+  size_t sp;                                        // Stack pointer
+  VM_Frame *call_stack; // Call stack for function calls
+  size_t call_sp;       // Call stack pointer
+
+  // Warm: locals, constants and globals used by the data instructions
+  _Alignas(VM_CACHE_LINE_SIZE) int32_t *locals; // Locals of all active frames
+  size_t locals_top;        // Local slots in use by the active frames
+  size_t locals_capacity;   // Number of slots allocated in locals
+  const int32_t *constants; // Constant pool of the attached program
+  size_t constant_count;    // Entries in constants
+  int32_t *globals;         // This VM's copy of the program's globals
+  size_t global_count;      // Entries in globals
+  size_t call_capacity;     // Number of frames allocated in call_stack
+  size_t module;            // Index of the running module in modules
+
+  // Cold: limits, diagnostics and ownership
+  size_t max_call_depth;  // Limit the call stack may grow to
+  size_t entry_point;     // Instruction pointer restored by reset_vm
+  VM_Diagnostics diag;
+  VM_Allocator allocator; // Source of the code, stack, frames and locals
+  VM_Arena *arena;        // Arena of a VM made by init_vm_in_buffer, or NULL
+  size_t arena_mark;      // Arena usage below which blocks outlive the code
+  bool owns_code;         // Whether code was copied in by load_program
+  Program *program;       // Shared program the code belongs to, if any
+  VM_Module *modules;     // Main program and attached modules, or NULL
+  size_t module_count;    // Entries in modules
+  VM_Export *exports;     // Exports of every module, by name hash
+  size_t export_capacity; // Slots in exports, a power of two
+  size_t export_count;    // Slots in use
 } Nano_VM;
 
+_Static_assert(offsetof(Nano_VM, locals) == VM_CACHE_LINE_SIZE,
+               "Nano_VM interpreter registers must fit in one cache line");
+
 ErrorCode init_vm(Nano_VM *vm);
+
+/* Initializes a VM whose code, stack, frames and locals all come from the
+ * given allocator. init_vm uses vm_default_allocator. In a VM_GUARDED_STACK
+ * build the operand stack is the exception: it is always mapped with mmap
+ * between guard pages, outside the allocator.
+ * Parameters:
+ *   vm - VM instance to initialize
+ *   allocator - Allocator to use; copied into the VM
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode init_vm_with_allocator(Nano_VM *vm, const VM_Allocator *allocator);
+
+/* Initializes a VM that lives entirely inside a caller-supplied buffer and
+ * never touches the heap. Loaded code and any call stack growth are carved
+ * from the same buffer, so size it for the program being run. The arena
+ * never frees single blocks, so releasing the code rewinds it instead:
+ * loading another program reuses the previous one's space, and only each
+ * step of call stack or locals growth strands a bounded amount.
+ * Parameters:
+ *   vm - VM instance to initialize
+ *   buffer - Backing memory; must outlive the VM
+ *   size - Size of buffer in bytes
+ * Returns:
+ *   ErrorCode indicating success or type of failure (ERR_OUT_OF_MEMORY if
+ *   the buffer is too small, ERR_INVALID_OPERAND in a VM_GUARDED_STACK
+ *   build, whose operand stack cannot come from the buffer)
+ */
+ErrorCode init_vm_in_buffer(Nano_VM *vm, void *buffer, size_t size);
 ErrorCode load_program(Nano_VM *vm, const uint8_t *code, size_t code_size,
                        uint32_t entry_point);
 ErrorCode free_vm(Nano_VM *vm);
 ErrorCode execute_vm(Nano_VM *vm);
+
+/* Points the VM at bytecode it does not own, without copying it. Use this
+ * for code that is mapped or otherwise kept alive by the caller; the code
+ * must stay valid and unchanged until the VM is freed or rebound.
+ * Parameters:
+ *   vm - VM instance
+ *   code - Bytecode instructions
+ *   code_size - Size of the bytecode in bytes
+ *   entry_point - Entry point of the bytecode
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode bind_program(Nano_VM *vm, const uint8_t *code, size_t code_size,
+                       uint32_t entry_point);
+
+/* Returns a VM to the state load_program left it in so the same program can
+ * be run again without reallocating or reloading. Locals are zeroed lazily,
+ * so apart from restoring the program's globals the cost does not depend on
+ * how much of the VM the last run touched.
+ * Parameters:
+ *   vm - VM instance with a program loaded
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode reset_vm(Nano_VM *vm);
+
+/* Attaches the VM to a shared program, taking a reference to it. The code and
+ * constant pool are not copied; the VM gets its own copy of the globals. The
+ * reference is dropped when the VM is freed or reloaded.
+ * Parameters:
+ *   vm - VM instance
+ *   program - Program to execute
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode attach_program(Nano_VM *vm, Program *program);
+
+/* Sets the maximum depth the call stack may grow to.
+ * Parameters:
+ *   vm - VM instance
+ *   max_depth - Maximum number of frames, including the entry frame
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode set_call_depth_limit(Nano_VM *vm, size_t max_depth);
+
+#endif // VM_H
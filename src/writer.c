@@ -0,0 +1,184 @@
+#include "writer.h"
+#include "bytecode_format.h"
+#include "log.h"
+#include "lz.h"
+#include <stdio.h>
+#include <string.h>
+
+typedef struct {
+  uint16_t type;
+  const void *contents;
+  size_t size;
+} PendingSection;
+
+static size_t align_offset(size_t offset) {
+  return (offset + BYTECODE_SECTION_ALIGNMENT - 1) &
+         ~(size_t)(BYTECODE_SECTION_ALIGNMENT - 1);
+}
+
+/* Compresses the code section, returning NULL (and leaving the code
+ * stored as is) if that fails or would not save anything.
+ */
+static uint8_t *compress_code(const BytecodeImage *image,
+                              const VM_Allocator *allocator,
+                              size_t *compressed_size) {
+  size_t capacity = lz_compress_bound(image->code_size);
+  uint8_t *compressed = allocator->alloc(allocator->ctx, capacity);
+  if (NULL == compressed) {
+    log_warn("No memory to compress code; storing it uncompressed");
+    return NULL;
+  }
+  if (lz_compress(image->code, image->code_size, compressed, capacity,
+                  compressed_size) != SUCCESS ||
+      *compressed_size >= image->code_size) {
+    allocator->free(allocator->ctx, compressed);
+    log_info("Code does not compress; storing it uncompressed");
+    return NULL;
+  }
+  return compressed;
+}
+
+ErrorCode serialize_bytecode(const BytecodeImage *image, uint16_t flags,
+                             const VM_Allocator *allocator, uint8_t **buffer,
+                             size_t *size) {
+  if (NULL == image || NULL == image->code || NULL == allocator) {
+    log_error("Bytecode image, code or allocator is NULL");
+    return ERR_NULL_POINTER;
+  }
+  if (image->compressed_code_size != 0 ||
+      (flags & ~BYTECODE_KNOWN_FLAGS) != 0) {
+    log_error("Cannot encode compressed code or unknown flags 0x%04X", flags);
+    return ERR_INVALID_OPERAND;
+  }
+
+  uint8_t *compressed = NULL;
+  size_t compressed_size = 0;
+  if (flags & BYTECODE_FLAG_COMPRESSED_CODE) {
+    compressed = compress_code(image, allocator, &compressed_size);
+    if (NULL == compressed) {
+      flags &= (uint16_t)~BYTECODE_FLAG_COMPRESSED_CODE;
+    }
+  }
+
+  PendingSection candidates[] = {
+      {SECTION_CODE, NULL == compressed ? image->code : compressed,
+       NULL == compressed ? image->code_size : compressed_size},
+      {SECTION_CONSTANTS, image->constants,
+       image->constant_count * sizeof(int32_t)},
+      {SECTION_FUNCTIONS, image->functions,
+       image->function_count * sizeof(BytecodeFunction)},
+      {SECTION_GLOBALS, image->globals, image->global_count * sizeof(int32_t)},
+      {SECTION_SYMBOLS, image->symbols,
+       image->symbol_count * sizeof(BytecodeSymbol)},
+      {SECTION_RELOCATIONS, image->relocations,
+       image->relocation_count * sizeof(BytecodeRelocation)},
+      {SECTION_NAMES, image->names, image->names_size},
+      // Last, so a mapped program only pages it in when it is looked up
+      {SECTION_DEBUG, image->debug, image->debug_size},
+  };
+  size_t candidate_count = sizeof(candidates) / sizeof(candidates[0]);
+
+  PendingSection sections[BYTECODE_MAX_SECTIONS];
+  size_t section_count = 0;
+  for (size_t i = 0; i < candidate_count; i++) {
+    if (candidates[i].size > 0) {
+      sections[section_count++] = candidates[i];
+    }
+  }
+
+  // Header, then the section table, then each section on its own boundary
+  size_t table_offset = BYTECODE_V2_HEADER_SIZE;
+  size_t offset = align_offset(table_offset +
+                               section_count * sizeof(BytecodeSection));
+  size_t offsets[BYTECODE_MAX_SECTIONS];
+  for (size_t i = 0; i < section_count; i++) {
+    offsets[i] = offset;
+    offset = align_offset(offset + sections[i].size);
+  }
+
+  uint8_t *out = NULL;
+  if (offset <= MAX_BYTECODE_SIZE) {
+    out = allocator->alloc(allocator->ctx, offset);
+  }
+  if (NULL == out) {
+    if (NULL != compressed) {
+      allocator->free(allocator->ctx, compressed);
+    }
+    if (offset > MAX_BYTECODE_SIZE) {
+      log_error("Encoded bytecode would be too large: %zu bytes", offset);
+      return ERR_FILE_TOO_LARGE;
+    }
+    log_error("Failed to allocate memory for encoded bytecode");
+    return ERR_OUT_OF_MEMORY;
+  }
+  memset(out, 0, offset);
+
+  BytecodeHeaderV2 header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BYTECODE_MAGIC, sizeof(header.magic));
+  header.version = BYTECODE_VERSION;
+  header.flags = flags | BYTECODE_FLAG_CHECKSUM;
+  header.entry_point = image->entry_point;
+  header.section_count = (uint32_t)section_count;
+  header.section_table_offset = (uint32_t)table_offset;
+  memcpy(out, &header, sizeof(header));
+
+  for (size_t i = 0; i < section_count; i++) {
+    BytecodeSection entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.type = sections[i].type;
+    entry.offset = (uint32_t)offsets[i];
+    entry.size = (uint32_t)sections[i].size;
+    if (entry.type == SECTION_CODE && NULL != compressed) {
+      entry.uncompressed_size = (uint32_t)image->code_size;
+    }
+    memcpy(out + table_offset + i * sizeof(entry), &entry, sizeof(entry));
+    memcpy(out + offsets[i], sections[i].contents, sections[i].size);
+  }
+
+  uint32_t checksum = bytecode_checksum(out, offset);
+  memcpy(out + BYTECODE_CHECKSUM_OFFSET, &checksum, sizeof(checksum));
+
+  if (NULL != compressed) {
+    allocator->free(allocator->ctx, compressed);
+    log_info("Code compressed from %zu to %zu bytes", image->code_size,
+             compressed_size);
+  }
+
+  *buffer = out;
+  *size = offset;
+  return SUCCESS;
+}
+
+ErrorCode write_bytecode(const char *filename, const BytecodeImage *image,
+                         uint16_t flags) {
+  uint8_t *buffer = NULL;
+  size_t size = 0;
+  ErrorCode status =
+      serialize_bytecode(image, flags, &vm_default_allocator, &buffer, &size);
+  if (status != SUCCESS) {
+    return status;
+  }
+
+  FILE *file = fopen(filename, "wb");
+  if (NULL == file) {
+    vm_default_allocator.free(NULL, buffer);
+    log_error("Failed to create bytecode file: %s", filename);
+    return ERR_FILE_NOT_FOUND;
+  }
+
+  if (fwrite(buffer, 1, size, file) != size) {
+    status = ERR_FILE_WRITE;
+    log_error("Failed to write bytecode file: %s", filename);
+  }
+  if (fclose(file) != 0 && status == SUCCESS) {
+    status = ERR_FILE_WRITE;
+    log_error("Failed to write bytecode file: %s", filename);
+  }
+  vm_default_allocator.free(NULL, buffer);
+
+  if (status == SUCCESS) {
+    log_info("Bytecode written to '%s' (%zu bytes)", filename, size);
+  }
+  return status;
+}
@@ -0,0 +1,39 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include "alloc.h"
+#include "errno.h"
+#include "loader.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Encodes an image as a version 0.2 bytecode file in memory. Sections the
+ * image does not have are omitted; the version field of the image is
+ * ignored. The file always carries a checksum (BYTECODE_FLAG_CHECKSUM).
+ * Parameters:
+ *   image - Sections to encode; code is required and must not be compressed
+ *   flags - BYTECODE_FLAG_* options. With BYTECODE_FLAG_COMPRESSED_CODE the
+ *           code section is LZ-compressed, unless that would not make it
+ *           smaller
+ *   allocator - Allocator for the output buffer
+ *   buffer - Receives the encoded file
+ *   size - Receives the size of the encoded file in bytes
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode serialize_bytecode(const BytecodeImage *image, uint16_t flags,
+                             const VM_Allocator *allocator, uint8_t **buffer,
+                             size_t *size);
+
+/* Encodes an image as a version 0.2 bytecode file and writes it to disk.
+ * Parameters:
+ *   filename - Path of the file to create or replace
+ *   image - Sections to encode; code is required
+ *   flags - BYTECODE_FLAG_* options, as for serialize_bytecode
+ * Returns:
+ *   ErrorCode indicating success or type of failure
+ */
+ErrorCode write_bytecode(const char *filename, const BytecodeImage *image,
+                         uint16_t flags);
+
+#endif // WRITER_H
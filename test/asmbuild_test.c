@@ -0,0 +1,153 @@
+#include "asmbuild.h"
+#include "assembler.h"
+#include "errno.h"
+#include "linker.h"
+#include "loader.h"
+#include "program.h"
+#include "unity.h"
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FILE_COUNT 4
+
+static char directory[] = "asmbuild_test_XXXXXX";
+static char sources[FILE_COUNT][64];
+static char objects[FILE_COUNT][64];
+static char stamps[FILE_COUNT][64 + sizeof(ASMBUILD_STAMP_SUFFIX)];
+static char include[64];
+static const char *source_paths[FILE_COUNT];
+static const char *object_paths[FILE_COUNT];
+
+static void write_file(const char *path, const char *text) {
+  FILE *fp = fopen(path, "w");
+  TEST_ASSERT_NOT_NULL(fp);
+  fputs(text, fp);
+  fclose(fp);
+}
+
+static bool exists(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0;
+}
+
+void setUp(void) {
+  strcpy(directory, "asmbuild_test_XXXXXX");
+  TEST_ASSERT_NOT_NULL(mkdtemp(directory));
+  snprintf(include, sizeof(include), "%s/value.inc", directory);
+  write_file(include, "    push 21\n");
+  for (int i = 0; i < FILE_COUNT; i++) {
+    snprintf(sources[i], sizeof(sources[i]), "%s/part%d.asm", directory, i);
+    snprintf(objects[i], sizeof(objects[i]), "%s/part%d.nvo", directory, i);
+    snprintf(stamps[i], sizeof(stamps[i]), "%s%s", objects[i],
+             ASMBUILD_STAMP_SUFFIX);
+    source_paths[i] = sources[i];
+    object_paths[i] = objects[i];
+  }
+  // part0 calls the function part1 exports; part2 and part3 stand alone
+  write_file(sources[0], ".import twice\n"
+                         ".include \"value.inc\"\n"
+                         "    call twice\n"
+                         "    halt\n");
+  write_file(sources[1], ".export twice\n"
+                         "twice:\n"
+                         "    push 0\n"
+                         "    add\n"
+                         "    dup\n"
+                         "    add\n"
+                         "    ret\n");
+  write_file(sources[2], "push 2\nhalt\n");
+  write_file(sources[3], "push 3\nhalt\n");
+}
+
+void tearDown(void) {
+  for (int i = 0; i < FILE_COUNT; i++) {
+    remove(sources[i]);
+    remove(objects[i]);
+    remove(stamps[i]);
+  }
+  remove(include);
+  rmdir(directory);
+}
+
+static size_t build(uint32_t peephole, bool incremental, ErrorCode expected) {
+  AssembleFilesOptions options = {peephole, 2, incremental, false};
+  ErrorCode statuses[FILE_COUNT];
+  size_t rebuilt = 0;
+  TEST_ASSERT_EQUAL_INT(expected,
+                        assemble_files(source_paths, object_paths, FILE_COUNT,
+                                       &options, statuses, &rebuilt));
+  return rebuilt;
+}
+
+void test_objects_link_into_a_program(void) {
+  TEST_ASSERT_EQUAL_size_t(FILE_COUNT, build(PEEPHOLE_ALL, false, SUCCESS));
+  MappedBytecode mapped[2];
+  BytecodeImage images[2];
+  for (int i = 0; i < 2; i++) {
+    TEST_ASSERT_EQUAL_INT(SUCCESS, map_bytecode(objects[i], &mapped[i]));
+    images[i] = mapped[i].image;
+  }
+  BytecodeImage linked;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, link_bytecode(images, 2, &linked));
+  Program *program = NULL;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, create_program_from_image(&linked, &program));
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&vm, program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_INT32(42, vm.stack[vm.sp - 1]);
+  free_vm(&vm);
+  release_program(program);
+  free_linked_bytecode(&linked);
+  unmap_bytecode(&mapped[0]);
+  unmap_bytecode(&mapped[1]);
+}
+
+void test_incremental_builds_skip_unchanged_files(void) {
+  TEST_ASSERT_EQUAL_size_t(FILE_COUNT, build(PEEPHOLE_ALL, true, SUCCESS));
+  TEST_ASSERT_EQUAL_size_t(0, build(PEEPHOLE_ALL, true, SUCCESS));
+
+  // Rewriting a file with the same text changes nothing
+  write_file(sources[3], "push 3\nhalt\n");
+  TEST_ASSERT_EQUAL_size_t(0, build(PEEPHOLE_ALL, true, SUCCESS));
+
+  write_file(sources[2], "push 4\nhalt\n");
+  TEST_ASSERT_EQUAL_size_t(1, build(PEEPHOLE_ALL, true, SUCCESS));
+  // An edit to an included file rebuilds the file including it
+  write_file(include, "    push 22\n");
+  TEST_ASSERT_EQUAL_size_t(1, build(PEEPHOLE_ALL, true, SUCCESS));
+  // So does a missing object
+  remove(objects[1]);
+  TEST_ASSERT_EQUAL_size_t(1, build(PEEPHOLE_ALL, true, SUCCESS));
+  // Other peephole rules give other code
+  TEST_ASSERT_EQUAL_size_t(FILE_COUNT, build(0, true, SUCCESS));
+  // Without incremental mode everything is rebuilt
+  TEST_ASSERT_EQUAL_size_t(FILE_COUNT, build(0, false, SUCCESS));
+}
+
+void test_failed_files_are_reported_and_rebuilt(void) {
+  TEST_ASSERT_EQUAL_size_t(FILE_COUNT, build(PEEPHOLE_ALL, true, SUCCESS));
+  write_file(sources[2], "push\n");
+  AssembleFilesOptions options = {PEEPHOLE_ALL, 2, true, false};
+  ErrorCode statuses[FILE_COUNT];
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT,
+                        assemble_files(source_paths, object_paths, FILE_COUNT,
+                                       &options, statuses, NULL));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, statuses[0]);
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT, statuses[2]);
+  // Its old object must not pass for up to date, even unchanged
+  TEST_ASSERT_FALSE(exists(stamps[2]));
+  TEST_ASSERT_EQUAL_size_t(1, build(PEEPHOLE_ALL, true, ERR_INVALID_FORMAT));
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_objects_link_into_a_program);
+  RUN_TEST(test_incremental_builds_skip_unchanged_files);
+  RUN_TEST(test_failed_files_are_reported_and_rebuilt);
+  return UNITY_END();
+}
@@ -0,0 +1,315 @@
+#include "assembler.h"
+#include "bytecode.h"
+#include "errno.h"
+#include "linker.h"
+#include "module.h"
+#include "program.h"
+#include "unity.h"
+#include "vm.h"
+#include <stdlib.h>
+#include <string.h>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static const char countdown[] = "; countdown from 10 to 0\n"
+                                "Start:\n"
+                                "    push 10\n"
+                                "Loop:\n"
+                                "    dup\n"
+                                "    jz End\n"
+                                "    push 1\n"
+                                "    sub\n"
+                                "    jmp Loop\n"
+                                "End:\n"
+                                "    halt\n";
+
+void test_assemble_program_runs_without_files(void) {
+  Program *program = NULL;
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        assemble_program(countdown, strlen(countdown),
+                                         "countdown", NULL, &program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&vm, program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_size_t(1, vm.sp);
+  TEST_ASSERT_EQUAL_INT32(0, vm.stack[0]);
+  free_vm(&vm);
+  release_program(program);
+}
+
+void test_assemble_code_pads_and_patches_forward_jumps(void) {
+  const char source[] = "jmp End\n"
+                        "push 7\n"
+                        "End: push8 3\n"
+                        "halt\n";
+  uint8_t *code = NULL;
+  size_t code_size = 0;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, assemble_code(source, strlen(source), NULL,
+                                               NULL, &code, &code_size));
+  // Each 32-bit operand starts on a 4-byte boundary
+  const uint8_t expected[] = {OP_NOP, OP_NOP,   OP_NOP, OP_JMP,  16, 0, 0, 0,
+                              OP_NOP, OP_NOP,   OP_NOP, OP_PUSH, 7,  0, 0, 0,
+                              OP_PUSH8, 3,      OP_HALT};
+  TEST_ASSERT_EQUAL_size_t(sizeof(expected), code_size);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, code, sizeof(expected));
+
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, load_program(&vm, code, code_size, 0));
+  free(code);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_size_t(1, vm.sp);
+  TEST_ASSERT_EQUAL_INT32(3, vm.stack[0]);
+  free_vm(&vm);
+}
+
+void test_assemble_code_reads_numbers_and_relative_jumps(void) {
+  // Not NUL-terminated, with CRLF line ends and a label sharing a line
+  const char source[] = "push 0x10\r\n"
+                        "push 3 ; comment\r\n"
+                        "Back: push8 -1\r\n"
+                        "add\r\n"
+                        "dup\r\n"
+                        "jnz8 Back\r\n"
+                        "halt";
+  uint8_t *code = NULL;
+  size_t code_size = 0;
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        assemble_code(source, sizeof(source) - 1, "numbers",
+                                      NULL, &code, &code_size));
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, load_program(&vm, code, code_size, 0));
+  free(code);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_size_t(2, vm.sp);
+  TEST_ASSERT_EQUAL_INT32(16, vm.stack[0]);
+  TEST_ASSERT_EQUAL_INT32(0, vm.stack[1]);
+  free_vm(&vm);
+}
+
+void test_assemble_code_rejects_errors(void) {
+  const char *sources[] = {
+      "jmp Nowhere\nhalt\n", // Undefined label
+      "load 256\nhalt\n",    // Index too wide for its operand
+      "A: halt\nA: halt\n",  // Label defined twice
+      "push\n",              // Missing operand
+      "frobnicate\n",        // Unknown instruction
+      "; nothing\n",         // No instructions
+  };
+  for (size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+    uint8_t *code = NULL;
+    size_t code_size = 0;
+    TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT,
+                          assemble_code(sources[i], strlen(sources[i]),
+                                        "bad", NULL, &code, &code_size));
+    TEST_ASSERT_NULL(code);
+  }
+}
+
+void test_peephole_rules_remove_instructions(void) {
+  const char source[] = "push 5\n"
+                        "push 0\n"
+                        "add\n"     // push 0; add goes
+                        "dup\n"
+                        "pop\n"     // dup; pop goes
+                        "swap\n"
+                        "swap\n"    // swap; swap goes
+                        "push8 1\n"
+                        "sub\n"     // Becomes dec
+                        "push 9\n"
+                        "jz Next\n" // Becomes pop, which cancels push 9
+                        "Next:\n"
+                        "jmp End\n" // Jumps to the next instruction
+                        "End:\n"
+                        "halt\n";
+  AssemblerOptions options = {.peephole = PEEPHOLE_ALL};
+  uint8_t *code = NULL;
+  size_t code_size = 0;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, assemble_code(source, strlen(source), NULL,
+                                               &options, &code, &code_size));
+  const uint8_t expected[] = {OP_NOP, OP_NOP, OP_NOP, OP_PUSH, 5, 0,
+                              0,      0,      OP_DEC, OP_HALT};
+  TEST_ASSERT_EQUAL_size_t(sizeof(expected), code_size);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, code, sizeof(expected));
+  TEST_ASSERT_EQUAL_size_t(10, options.removed);
+  free(code);
+
+  options.peephole = 0;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, assemble_code(source, strlen(source), NULL,
+                                               &options, &code, &code_size));
+  TEST_ASSERT_EQUAL_size_t(0, options.removed);
+  TEST_ASSERT_TRUE(code_size > sizeof(expected));
+  free(code);
+}
+
+void test_peephole_rules_stop_at_labels(void) {
+  // Loop can be reached from the jnz, so the dup before it has to stay
+  const char source[] = "push 3\n"
+                        "dup\n"
+                        "Loop: pop\n"
+                        "push 0\n"
+                        "dup\n"
+                        "jnz Loop\n"
+                        "halt\n";
+  AssemblerOptions options = {.peephole = PEEPHOLE_ALL};
+  Program *program = NULL;
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        assemble_program(source, strlen(source), NULL,
+                                         &options, &program));
+  TEST_ASSERT_EQUAL_size_t(0, options.removed);
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&vm, program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_size_t(2, vm.sp);
+  TEST_ASSERT_EQUAL_INT32(3, vm.stack[0]);
+  TEST_ASSERT_EQUAL_INT32(0, vm.stack[1]);
+  free_vm(&vm);
+  release_program(program);
+}
+
+void test_numeric_targets_turn_peephole_rules_off(void) {
+  // Offset 20 is the halt only while dup; pop stay in place
+  const char source[] = "push 1\n"
+                        "dup\n"
+                        "pop\n"
+                        "nop\n"
+                        "nop\n"
+                        "jmp 20\n"
+                        "halt\n";
+  AssemblerOptions options = {.peephole = PEEPHOLE_ALL};
+  uint8_t *code = NULL;
+  size_t code_size = 0;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, assemble_code(source, strlen(source), NULL,
+                                               &options, &code, &code_size));
+  TEST_ASSERT_EQUAL_size_t(0, options.removed);
+  TEST_ASSERT_EQUAL_size_t(21, code_size);
+  TEST_ASSERT_EQUAL_UINT8(OP_HALT, code[20]);
+  free(code);
+}
+
+static const char library[] = ".export double\n"
+                              "double:\n"
+                              "    dup\n"
+                              "    add\n"
+                              "    ret\n";
+
+void test_assembled_objects_link(void) {
+  const char main_source[] = ".import double\n"
+                             "    push 21\n"
+                             "    call double\n"
+                             "    call Triple\n"
+                             "    halt\n"
+                             "Triple:\n"
+                             "    store 1\n"
+                             "    load 1\n"
+                             "    load 1\n"
+                             "    add\n"
+                             "    load 1\n"
+                             "    add\n"
+                             "    ret\n";
+  BytecodeImage modules[2];
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        assemble_image(main_source, strlen(main_source),
+                                       "main", NULL, &modules[0]));
+  TEST_ASSERT_EQUAL_size_t(1, modules[0].symbol_count);
+  TEST_ASSERT_EQUAL_UINT16(SYMBOL_IMPORT, modules[0].symbols[0].kind);
+  TEST_ASSERT_EQUAL_size_t(1, modules[0].relocation_count);
+  // Triple is called, so it starts a function using locals 0 and 1
+  TEST_ASSERT_EQUAL_size_t(1, modules[0].function_count);
+  TEST_ASSERT_EQUAL_UINT16(2, modules[0].functions[0].local_count);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, assemble_image(library, strlen(library),
+                                                "library", NULL,
+                                                &modules[1]));
+  TEST_ASSERT_EQUAL_UINT16(SYMBOL_EXPORT, modules[1].symbols[0].kind);
+  TEST_ASSERT_EQUAL_UINT32(modules[1].functions[0].entry,
+                           modules[1].symbols[0].value);
+
+  BytecodeImage linked;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, link_bytecode(modules, 2, &linked));
+  Program *program = NULL;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, create_program_from_image(&linked, &program));
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&vm, program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_INT32(126, vm.stack[vm.sp - 1]);
+  free_vm(&vm);
+  release_program(program);
+  free_linked_bytecode(&linked);
+  free_assembled_image(&modules[0]);
+  free_assembled_image(&modules[1]);
+}
+
+void test_assembled_programs_call_modules(void) {
+  const char main_source[] = ".import double\n"
+                             "    push 5\n"
+                             "    callx double\n"
+                             "    halt\n";
+  Program *program = NULL;
+  Program *module = NULL;
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        assemble_program(main_source, strlen(main_source),
+                                         "main", NULL, &program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        assemble_program(library, strlen(library), "library",
+                                         NULL, &module));
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&vm, program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_module(&vm, module));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_INT32(10, vm.stack[vm.sp - 1]);
+  free_vm(&vm);
+  release_program(module);
+  release_program(program);
+}
+
+void test_symbols_reject_errors(void) {
+  const char *sources[] = {
+      ".export f\nhalt\n",           // Exported label not defined
+      ".import f\njmp f\n",          // Only calls can reach an import
+      ".import f\nf: halt\n",        // Imported label defined here
+      ".export f\n.import f\nhalt\n", // Both exported and imported
+      "callx f\nf: halt\n",          // CALLX to a label of this source
+      ".frobnicate\nhalt\n",         // Unknown directive
+      ".include \"missing.asm\"\n",  // File that is not there
+  };
+  for (size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+    BytecodeImage image;
+    TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT,
+                          assemble_image(sources[i], strlen(sources[i]),
+                                         "bad", NULL, &image));
+    TEST_ASSERT_NULL(image.code);
+  }
+
+  // Only the linker can patch a CALL to an import
+  const char call[] = ".import f\ncall f\nhalt\n";
+  Program *program = NULL;
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND,
+                        assemble_program(call, strlen(call), NULL, NULL,
+                                         &program));
+  uint8_t *code = NULL;
+  size_t code_size = 0;
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND,
+                        assemble_code(library, strlen(library), NULL, NULL,
+                                      &code, &code_size));
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_assemble_program_runs_without_files);
+  RUN_TEST(test_assemble_code_pads_and_patches_forward_jumps);
+  RUN_TEST(test_assemble_code_reads_numbers_and_relative_jumps);
+  RUN_TEST(test_assemble_code_rejects_errors);
+  RUN_TEST(test_peephole_rules_remove_instructions);
+  RUN_TEST(test_peephole_rules_stop_at_labels);
+  RUN_TEST(test_numeric_targets_turn_peephole_rules_off);
+  RUN_TEST(test_assembled_objects_link);
+  RUN_TEST(test_assembled_programs_call_modules);
+  RUN_TEST(test_symbols_reject_errors);
+  return UNITY_END();
+}
@@ -0,0 +1,133 @@
+#include "bulk.h"
+#include "bytecode.h"
+#include "bytecode_format.h"
+#include "errno.h"
+#include "program.h"
+#include "unity.h"
+#include "vm.h"
+#include "writer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FILE_COUNT 150
+
+static char names[FILE_COUNT][32];
+static const char *filenames[FILE_COUNT];
+
+/* Writes a program that pushes `value` and halts to `filename`. */
+static void write_program(const char *filename, int32_t value,
+                          uint16_t flags) {
+  static uint8_t code[65]; // The PUSH operand lands on offset 60
+  memset(code, OP_NOP, sizeof(code));
+  code[sizeof(code) - 6] = OP_PUSH;
+  memcpy(code + sizeof(code) - 5, &value, sizeof(value));
+  code[sizeof(code) - 1] = OP_HALT;
+  BytecodeImage image = {0};
+  image.code = code;
+  image.code_size = sizeof(code);
+  uint8_t *file = NULL;
+  size_t size = 0;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, serialize_bytecode(&image, flags,
+                                                    &vm_default_allocator,
+                                                    &file, &size));
+  FILE *out = fopen(filename, "wb");
+  TEST_ASSERT_NOT_NULL(out);
+  TEST_ASSERT_EQUAL_size_t(size, fwrite(file, 1, size, out));
+  fclose(out);
+  free(file);
+}
+
+static int32_t run_program(Program *program) {
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&vm, program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  int32_t result = vm.stack[vm.sp - 1];
+  free_vm(&vm);
+  return result;
+}
+
+void setUp(void) {
+  for (int i = 0; i < FILE_COUNT; i++) {
+    snprintf(names[i], sizeof(names[i]), "test_bulk_%d.nvm", i);
+    filenames[i] = names[i];
+    write_program(names[i], i * 7, i % 3 ? 0 : BYTECODE_FLAG_COMPRESSED_CODE);
+  }
+}
+
+void tearDown(void) {
+  for (int i = 0; i < FILE_COUNT; i++) {
+    remove(names[i]);
+  }
+}
+
+/* Loads every file with `backend` and checks each program runs. */
+static void check_backend(BulkBackend backend, unsigned depth) {
+  static Program *programs[FILE_COUNT];
+  static ErrorCode statuses[FILE_COUNT];
+  BulkLoadOptions options = {backend, depth, 3};
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        open_programs_bulk(filenames, FILE_COUNT, &options,
+                                           programs, statuses));
+  for (int i = 0; i < FILE_COUNT; i++) {
+    TEST_ASSERT_EQUAL_INT(SUCCESS, statuses[i]);
+    TEST_ASSERT_NOT_NULL(programs[i]);
+    TEST_ASSERT_EQUAL_INT32(i * 7, run_program(programs[i]));
+    release_program(programs[i]);
+  }
+}
+
+void test_bulk_load_with_io_uring(void) {
+  if (!bulk_io_uring_available()) {
+    TEST_IGNORE_MESSAGE("io_uring is not available");
+  }
+  check_backend(BULK_IO_URING, 0);
+  check_backend(BULK_IO_URING, 1); // One file in flight at a time
+}
+
+void test_bulk_load_with_threads(void) { check_backend(BULK_THREADS, 0); }
+
+void test_bulk_load_reports_failures_per_file(void) {
+  // A missing file, one too short to hold a header and one that fails
+  // verification, among good ones
+  FILE *out = fopen(names[2], "wb");
+  TEST_ASSERT_NOT_NULL(out);
+  fputs("NVM", out);
+  fclose(out);
+  out = fopen(names[3], "r+b");
+  TEST_ASSERT_NOT_NULL(out);
+  fseek(out, -1, SEEK_END);
+  fputc(0xFF, out); // HALT becomes an unknown opcode
+  fclose(out);
+  remove(names[1]);
+
+  const BulkBackend backends[] = {BULK_AUTO, BULK_THREADS};
+  for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+    Program *programs[5];
+    ErrorCode statuses[5];
+    BulkLoadOptions options = {backends[b], 2, 2};
+    TEST_ASSERT_EQUAL_INT(ERR_FILE_NOT_FOUND,
+                          open_programs_bulk(filenames, 5, &options,
+                                             programs, statuses));
+    TEST_ASSERT_EQUAL_INT(SUCCESS, statuses[0]);
+    TEST_ASSERT_EQUAL_INT(ERR_FILE_NOT_FOUND, statuses[1]);
+    TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT, statuses[2]);
+    TEST_ASSERT_NOT_EQUAL(SUCCESS, statuses[3]);
+    TEST_ASSERT_EQUAL_INT(SUCCESS, statuses[4]);
+    TEST_ASSERT_NULL(programs[1]);
+    TEST_ASSERT_NULL(programs[2]);
+    TEST_ASSERT_NULL(programs[3]);
+    TEST_ASSERT_EQUAL_INT32(28, run_program(programs[4]));
+    release_program(programs[0]);
+    release_program(programs[4]);
+  }
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_bulk_load_with_io_uring);
+  RUN_TEST(test_bulk_load_with_threads);
+  RUN_TEST(test_bulk_load_reports_failures_per_file);
+  return UNITY_END();
+}
@@ -0,0 +1,167 @@
+#include "bundle.h"
+#include "bytecode.h"
+#include "bytecode_format.h"
+#include "errno.h"
+#include "program.h"
+#include "unity.h"
+#include "vm.h"
+#include "writer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMBER_COUNT 50
+
+static const char *filename = "test_bundle.nvb";
+static uint8_t *files[MEMBER_COUNT];
+static size_t sizes[MEMBER_COUNT];
+static char names[MEMBER_COUNT][16];
+static BundleMember members[MEMBER_COUNT];
+
+/* Encodes a program that pushes `value` and halts. */
+static void encode_program(int32_t value, uint16_t flags, uint8_t **file,
+                           size_t *size) {
+  static uint8_t code[65]; // The PUSH operand lands on offset 60
+  memset(code, OP_NOP, sizeof(code));
+  code[sizeof(code) - 6] = OP_PUSH;
+  memcpy(code + sizeof(code) - 5, &value, sizeof(value));
+  code[sizeof(code) - 1] = OP_HALT;
+  BytecodeImage image = {0};
+  image.code = code;
+  image.code_size = sizeof(code);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, serialize_bytecode(&image, flags,
+                                                    &vm_default_allocator,
+                                                    file, size));
+}
+
+static int32_t run_program(Program *program) {
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&vm, program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  int32_t result = vm.stack[vm.sp - 1];
+  free_vm(&vm);
+  return result;
+}
+
+void setUp(void) {
+  for (int i = 0; i < MEMBER_COUNT; i++) {
+    encode_program(i * 3, i % 2 ? BYTECODE_FLAG_COMPRESSED_CODE : 0,
+                   &files[i], &sizes[i]);
+    snprintf(names[i], sizeof(names[i]), "prog-%d", i);
+    members[i].name = names[i];
+    members[i].data = files[i];
+    members[i].size = sizes[i];
+  }
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        write_bundle(filename, members, MEMBER_COUNT));
+}
+
+void tearDown(void) {
+  for (int i = 0; i < MEMBER_COUNT; i++) {
+    free(files[i]);
+  }
+  remove(filename);
+}
+
+void test_open_every_member_by_name(void) {
+  Bundle *bundle = NULL;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, open_bundle(filename, &bundle));
+  TEST_ASSERT_EQUAL_size_t(MEMBER_COUNT, bundle->entry_count);
+
+  for (int i = MEMBER_COUNT - 1; i >= 0; i--) {
+    const uint8_t *data = NULL;
+    size_t size = 0;
+    TEST_ASSERT_EQUAL_INT(SUCCESS,
+                          find_bundle_member(bundle, names[i], &data, &size));
+    TEST_ASSERT_EQUAL_size_t(sizes[i], size);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(files[i], data, size);
+    TEST_ASSERT_EQUAL_size_t(0, (uintptr_t)data % BUNDLE_MEMBER_ALIGNMENT);
+
+    Program *program = NULL;
+    TEST_ASSERT_EQUAL_INT(SUCCESS,
+                          open_bundle_program(bundle, names[i], &program));
+    TEST_ASSERT_EQUAL_INT(i % 2 ? PROGRAM_HEAP : PROGRAM_BUNDLE,
+                          program->backing);
+    TEST_ASSERT_EQUAL_INT32(i * 3, run_program(program));
+    release_program(program);
+  }
+
+  Program *program = NULL;
+  TEST_ASSERT_EQUAL_INT(ERR_FILE_NOT_FOUND,
+                        open_bundle_program(bundle, "prog-50", &program));
+  TEST_ASSERT_EQUAL_INT(ERR_FILE_NOT_FOUND,
+                        open_bundle_program(bundle, "", &program));
+  release_bundle(bundle);
+}
+
+void test_program_outlives_bundle_handle(void) {
+  Bundle *bundle = NULL;
+  Program *program = NULL;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, open_bundle(filename, &bundle));
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        open_bundle_program(bundle, "prog-10", &program));
+  TEST_ASSERT_EQUAL_size_t(2, atomic_load(&bundle->refcount));
+  release_bundle(bundle);
+  TEST_ASSERT_EQUAL_INT32(30, run_program(program));
+  release_program(program);
+}
+
+void test_write_rejects_bad_members(void) {
+  BundleMember bad[2] = {members[0], members[1]};
+  bad[1].name = members[0].name;
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND,
+                        write_bundle("bad_bundle.nvb", bad, 2));
+
+  bad[1].name = "truncated";
+  bad[1].size = sizes[1] - 8;
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT,
+                        write_bundle("bad_bundle.nvb", bad, 2));
+  remove("bad_bundle.nvb");
+}
+
+/* Flips one bit of the bundle file at `offset`. */
+static void corrupt(size_t offset) {
+  FILE *file = fopen(filename, "r+b");
+  TEST_ASSERT_NOT_NULL(file);
+  fseek(file, (long)offset, SEEK_SET);
+  int byte = fgetc(file);
+  fseek(file, (long)offset, SEEK_SET);
+  fputc(byte ^ 0x10, file);
+  fclose(file);
+}
+
+void test_corruption_is_detected(void) {
+  Bundle *bundle = NULL;
+  Program *program = NULL;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, open_bundle(filename, &bundle));
+  const uint8_t *data = NULL;
+  size_t size = 0;
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        find_bundle_member(bundle, "prog-7", &data, &size));
+  size_t member = (size_t)(data - (const uint8_t *)bundle->mapping);
+  release_bundle(bundle);
+
+  // A damaged member only fails when that member is opened
+  corrupt(member + size - 3);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, open_bundle(filename, &bundle));
+  TEST_ASSERT_EQUAL_INT(ERR_CHECKSUM_MISMATCH,
+                        open_bundle_program(bundle, "prog-7", &program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        open_bundle_program(bundle, "prog-8", &program));
+  release_program(program);
+  release_bundle(bundle);
+
+  // A damaged index fails the whole bundle
+  corrupt(BUNDLE_HEADER_SIZE + 2);
+  TEST_ASSERT_EQUAL_INT(ERR_CHECKSUM_MISMATCH, open_bundle(filename, &bundle));
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_open_every_member_by_name);
+  RUN_TEST(test_program_outlives_bundle_handle);
+  RUN_TEST(test_write_rejects_bad_members);
+  RUN_TEST(test_corruption_is_detected);
+  return UNITY_END();
+}
@@ -0,0 +1,202 @@
+#include "bytecode.h"
+#include "bytecode_format.h"
+#include "cache.h"
+#include "errno.h"
+#include "program.h"
+#include "unity.h"
+#include "vm.h"
+#include "writer.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char directory[] = "cache_test_XXXXXX";
+static ProgramCacheOptions options;
+static uint8_t code[4096];
+
+/* A compressible program that pushes 1 and halts. */
+static void write_program(const char *filename, uint16_t flags) {
+  memset(code, OP_NOP, sizeof(code));
+  code[sizeof(code) - 2] = OP_PUSH_1;
+  code[sizeof(code) - 1] = OP_HALT;
+  BytecodeImage image = {0};
+  image.code = code;
+  image.code_size = sizeof(code);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, write_bytecode(filename, &image, flags));
+}
+
+/* Counts the entries in the cache directory, returning the last one. */
+static int find_entries(char *path, size_t size) {
+  int count = 0;
+  DIR *dir = opendir(directory);
+  if (NULL == dir) {
+    return 0;
+  }
+  struct dirent *item;
+  while (NULL != (item = readdir(dir))) {
+    if (NULL != strstr(item->d_name, PROGRAM_CACHE_SUFFIX)) {
+      snprintf(path, size, "%s/%s", directory, item->d_name);
+      count++;
+    }
+  }
+  closedir(dir);
+  return count;
+}
+
+static void run_program(Program *program) {
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&vm, program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_INT32(1, vm.stack[vm.sp - 1]);
+  free_vm(&vm);
+}
+
+void setUp(void) {
+  strcpy(directory, "cache_test_XXXXXX");
+  TEST_ASSERT_NOT_NULL(mkdtemp(directory));
+  options.directory = directory;
+  options.compact = false;
+  write_program("cached_program.nvm", BYTECODE_FLAG_COMPRESSED_CODE);
+}
+
+void tearDown(void) {
+  clear_program_cache(&options);
+  rmdir(directory);
+  remove("cached_program.nvm");
+}
+
+void test_miss_then_hit(void) {
+  char entry[512];
+  Program *program = NULL;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, open_program_cached("cached_program.nvm",
+                                                     &options, &program));
+  TEST_ASSERT_EQUAL_INT(PROGRAM_HEAP, program->backing);
+  run_program(program);
+  release_program(program);
+  TEST_ASSERT_EQUAL_INT(1, find_entries(entry, sizeof(entry)));
+
+  TEST_ASSERT_EQUAL_INT(SUCCESS, open_program_cached("cached_program.nvm",
+                                                     &options, &program));
+  TEST_ASSERT_EQUAL_INT(PROGRAM_MAPPED, program->backing);
+  TEST_ASSERT_EQUAL_size_t(0, program->image.compressed_code_size);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(code, program->image.code, sizeof(code));
+  run_program(program);
+  release_program(program);
+}
+
+void test_changed_source_misses(void) {
+  char entry[512];
+  Program *program = NULL;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, open_program_cached("cached_program.nvm",
+                                                     &options, &program));
+  release_program(program);
+
+  write_program("cached_program.nvm", 0);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, open_program_cached("cached_program.nvm",
+                                                     &options, &program));
+  TEST_ASSERT_EQUAL_INT(PROGRAM_HEAP, program->backing);
+  release_program(program);
+  TEST_ASSERT_EQUAL_INT(2, find_entries(entry, sizeof(entry)));
+}
+
+void test_damaged_entry_is_rebuilt(void) {
+  char entry[512];
+  Program *program = NULL;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, open_program_cached("cached_program.nvm",
+                                                     &options, &program));
+  release_program(program);
+  TEST_ASSERT_EQUAL_INT(1, find_entries(entry, sizeof(entry)));
+
+  // Turn the last NOP into HALT; the checksum no longer matches
+  FILE *fp = fopen(entry, "r+b");
+  TEST_ASSERT_NOT_NULL(fp);
+  fseek(fp, -3, SEEK_END);
+  fputc(OP_HALT, fp);
+  fclose(fp);
+
+  TEST_ASSERT_EQUAL_INT(SUCCESS, open_program_cached("cached_program.nvm",
+                                                     &options, &program));
+  TEST_ASSERT_EQUAL_INT(PROGRAM_HEAP, program->backing);
+  run_program(program);
+  release_program(program);
+
+  TEST_ASSERT_EQUAL_INT(SUCCESS, open_program_cached("cached_program.nvm",
+                                                     &options, &program));
+  TEST_ASSERT_EQUAL_INT(PROGRAM_MAPPED, program->backing);
+  run_program(program);
+  release_program(program);
+}
+
+void test_compact_entries_are_separate(void) {
+  char entry[512];
+  Program *program = NULL;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, open_program_cached("cached_program.nvm",
+                                                     &options, &program));
+  release_program(program);
+
+  options.compact = true;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, open_program_cached("cached_program.nvm",
+                                                     &options, &program));
+  release_program(program);
+  TEST_ASSERT_EQUAL_INT(2, find_entries(entry, sizeof(entry)));
+
+  TEST_ASSERT_EQUAL_INT(SUCCESS, open_program_cached("cached_program.nvm",
+                                                     &options, &program));
+  TEST_ASSERT_EQUAL_INT(PROGRAM_MAPPED, program->backing);
+  TEST_ASSERT_TRUE(program->image.code_size < sizeof(code));
+  run_program(program);
+  release_program(program);
+}
+
+void test_shared_directory_is_not_used(void) {
+  char entry[512];
+  Program *program = NULL;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, open_program_cached("cached_program.nvm",
+                                                     &options, &program));
+  release_program(program);
+  TEST_ASSERT_EQUAL_INT(1, find_entries(entry, sizeof(entry)));
+
+  // Anyone could have planted the entry, so it is not run
+  TEST_ASSERT_EQUAL_INT(0, chmod(directory, 0777));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, open_program_cached("cached_program.nvm",
+                                                     &options, &program));
+  TEST_ASSERT_EQUAL_INT(PROGRAM_HEAP, program->backing);
+  run_program(program);
+  release_program(program);
+  TEST_ASSERT_EQUAL_INT(0, chmod(directory, 0700));
+}
+
+void test_directory_from_environment(void) {
+  char path[512];
+  setenv(PROGRAM_CACHE_ENV, "/tmp/nanovm-env-cache", 1);
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        program_cache_directory(NULL, path, sizeof(path)));
+  TEST_ASSERT_EQUAL_STRING("/tmp/nanovm-env-cache", path);
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        program_cache_directory(&options, path, sizeof(path)));
+  TEST_ASSERT_EQUAL_STRING(directory, path);
+  unsetenv(PROGRAM_CACHE_ENV);
+
+  setenv("XDG_CACHE_HOME", "/tmp/xdg", 1);
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        program_cache_directory(NULL, path, sizeof(path)));
+  TEST_ASSERT_EQUAL_STRING("/tmp/xdg/nanovm", path);
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND,
+                        program_cache_directory(NULL, path, 4));
+  unsetenv("XDG_CACHE_HOME");
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_miss_then_hit);
+  RUN_TEST(test_changed_source_misses);
+  RUN_TEST(test_damaged_entry_is_rebuilt);
+  RUN_TEST(test_compact_entries_are_separate);
+  RUN_TEST(test_shared_directory_is_not_used);
+  RUN_TEST(test_directory_from_environment);
+  return UNITY_END();
+}
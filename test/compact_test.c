@@ -0,0 +1,214 @@
+#include "bytecode.h"
+#include "bytecode_format.h"
+#include "compact.h"
+#include "errno.h"
+#include "program.h"
+#include "unity.h"
+#include "verify.h"
+#include "vm.h"
+#include <string.h>
+
+static uint8_t code[70000];
+static size_t code_size;
+static BytecodeImage image;
+static BytecodeImage compacted;
+
+void setUp(void) {
+  code_size = 0;
+  memset(&image, 0, sizeof(image));
+  memset(&compacted, 0, sizeof(compacted));
+  image.version = BYTECODE_VERSION_V1;
+  image.code = code;
+}
+
+void tearDown(void) { free_compacted_bytecode(&compacted); }
+
+static size_t emit(Opcode opcode) {
+  size_t offset = code_size;
+  code[code_size++] = opcode;
+  return offset;
+}
+
+static size_t emit_u32(Opcode opcode, uint32_t operand) {
+  size_t offset = emit(opcode);
+  memcpy(code + code_size, &operand, sizeof(operand));
+  code_size += sizeof(operand);
+  return offset;
+}
+
+static void patch_u32(size_t offset, uint32_t operand) {
+  memcpy(code + offset + 1, &operand, sizeof(operand));
+}
+
+/* Runs an image to HALT and returns the value on top of the stack. */
+static int32_t run(const BytecodeImage *source) {
+  Program *program = NULL;
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, create_program_from_image(source, &program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&vm, program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  TEST_ASSERT_TRUE(vm.sp > 0);
+  int32_t top = vm.stack[vm.sp - 1];
+  free_vm(&vm);
+  release_program(program);
+  return top;
+}
+
+void test_push_uses_shortest_form(void) {
+  const int32_t values[] = {0, 1, -5, 300, -100000};
+  const uint8_t expected[] = {OP_PUSH_0, OP_PUSH_1, OP_PUSH8, OP_PUSH16,
+                              OP_PUSH};
+  for (size_t i = 0; i < 5; i++) {
+    emit_u32(OP_PUSH, (uint32_t)values[i]);
+  }
+  for (size_t i = 0; i < 4; i++) {
+    emit(OP_ADD);
+  }
+  emit(OP_HALT);
+  image.code_size = code_size;
+
+  TEST_ASSERT_EQUAL_INT(SUCCESS, compact_bytecode(&image, &compacted));
+  // 1 + 1 + 2 + 3 + 5 (operand already aligned), then ADD x4 and HALT
+  TEST_ASSERT_EQUAL_size_t(17, compacted.code_size);
+  const uint8_t *p = compacted.code;
+  for (size_t i = 0; i < 5; i++) {
+    while (*p == OP_NOP) {
+      p++;
+    }
+    TEST_ASSERT_EQUAL_UINT8(expected[i], *p);
+    p += instruction_length(p, compacted.code_size - (p - compacted.code));
+  }
+  TEST_ASSERT_EQUAL_INT32(run(&image), run(&compacted));
+  TEST_ASSERT_EQUAL_INT32(-99704, run(&compacted));
+}
+
+void test_loop_uses_short_relative_jump(void) {
+  // counter = 10; do { counter-- } while (counter != 0)
+  emit_u32(OP_PUSH, 10);
+  size_t loop = emit(OP_DEC);
+  emit(OP_DUP);
+  emit_u32(OP_JMPNZ, (uint32_t)loop);
+  emit_u32(OP_PUSH, 42);
+  emit(OP_HALT);
+  image.code_size = code_size;
+
+  TEST_ASSERT_EQUAL_INT(SUCCESS, compact_bytecode(&image, &compacted));
+  const uint8_t expected[] = {OP_PUSH8, 10,  OP_DEC, OP_DUP,
+                              OP_JMPNZ8, 0xFE, OP_PUSH8, 42, OP_HALT};
+  TEST_ASSERT_EQUAL_size_t(sizeof(expected), compacted.code_size);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, compacted.code, sizeof(expected));
+  TEST_ASSERT_EQUAL_INT32(42, run(&compacted));
+}
+
+void test_far_jumps_grow(void) {
+  size_t forward = emit_u32(OP_JMP, 0);
+  for (size_t i = 0; i < 200; i++) {
+    emit(OP_NOP);
+  }
+  size_t loop = emit(OP_POP);
+  for (size_t i = 0; i < 200; i++) {
+    emit(OP_DUP);
+  }
+  emit_u32(OP_JMP, (uint32_t)loop);
+  for (size_t i = 0; i < 40000; i++) {
+    emit(OP_DUP);
+  }
+  size_t end = emit_u32(OP_PUSH, 7);
+  emit(OP_HALT);
+  patch_u32(forward, (uint32_t)end);
+  image.code_size = code_size;
+
+  TEST_ASSERT_EQUAL_INT(SUCCESS, compact_bytecode(&image, &compacted));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, verify_code(&compacted));
+  // Too far for 16 bits: stays absolute, padded to align its operand
+  size_t entry = compacted.entry_point;
+  TEST_ASSERT_EQUAL_UINT8(OP_JMP, compacted.code[entry]);
+  TEST_ASSERT_EQUAL_size_t(0, (entry + 1) % BYTECODE_OPERAND_ALIGNMENT);
+  // The NOPs are dropped, and the backward jump fits in 16 bits
+  TEST_ASSERT_EQUAL_UINT8(OP_POP, compacted.code[entry + 5]);
+  TEST_ASSERT_EQUAL_UINT8(OP_JMP16, compacted.code[entry + 6 + 200]);
+  TEST_ASSERT_EQUAL_INT32(7, run(&compacted));
+}
+
+void test_calls_functions_and_indices_are_remapped(void) {
+  // main: CALL f; GLOAD 0; PUSHK 1; ADD; HALT   f: PUSH 5; GSTORE 0; RET
+  size_t call = emit_u32(OP_CALL, 0);
+  emit_u32(OP_GLOAD, 0);
+  emit_u32(OP_PUSHK, 1);
+  emit(OP_ADD);
+  emit(OP_HALT);
+  size_t f = emit_u32(OP_PUSH, 5);
+  emit_u32(OP_GSTORE, 0);
+  emit(OP_RET);
+  patch_u32(call, (uint32_t)f);
+  const int32_t constants[] = {0, 37};
+  const int32_t globals[] = {0};
+  BytecodeFunction functions[] = {{0, (uint32_t)f, 0, 2, 0},
+                                  {(uint32_t)f, (uint32_t)(code_size - f), 0,
+                                   1, 0}};
+  image.code_size = code_size;
+  image.constants = constants;
+  image.constant_count = 2;
+  image.globals = globals;
+  image.global_count = 1;
+  image.functions = functions;
+  image.function_count = 2;
+
+  TEST_ASSERT_EQUAL_INT(SUCCESS, compact_bytecode(&image, &compacted));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, verify_code(&compacted));
+  TEST_ASSERT_TRUE(compacted.code_size < image.code_size);
+  TEST_ASSERT_EQUAL_UINT8(OP_PUSH8,
+                          compacted.code[compacted.functions[1].entry]);
+  TEST_ASSERT_EQUAL_UINT32(compacted.code_size,
+                           compacted.functions[1].entry +
+                               compacted.functions[1].size);
+  TEST_ASSERT_EQUAL_INT32(42, run(&compacted));
+}
+
+void test_compaction_is_idempotent(void) {
+  emit_u32(OP_PUSH, 1000);
+  size_t loop = emit(OP_DEC);
+  emit(OP_DUP);
+  emit_u32(OP_JMPNZ, (uint32_t)loop);
+  emit(OP_HALT);
+  image.code_size = code_size;
+
+  TEST_ASSERT_EQUAL_INT(SUCCESS, compact_bytecode(&image, &compacted));
+  BytecodeImage again;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, compact_bytecode(&compacted, &again));
+  TEST_ASSERT_EQUAL_size_t(compacted.code_size, again.code_size);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(compacted.code, again.code, again.code_size);
+  free_compacted_bytecode(&again);
+}
+
+void test_leb128_round_trip(void) {
+  const uint32_t values[] = {0, 127, 128, 16383, 16384, UINT32_MAX};
+  const size_t sizes[] = {1, 1, 2, 2, 3, 5};
+  for (size_t i = 0; i < 6; i++) {
+    uint8_t bytes[LEB128_MAX_BYTES];
+    uint32_t decoded = 0;
+    TEST_ASSERT_EQUAL_size_t(sizes[i], encode_uleb128(values[i], bytes));
+    TEST_ASSERT_EQUAL_size_t(sizes[i], uleb128_size(values[i]));
+    TEST_ASSERT_EQUAL_size_t(sizes[i],
+                             decode_uleb128(bytes, sizes[i], &decoded));
+    TEST_ASSERT_EQUAL_UINT32(values[i], decoded);
+    // Truncated encodings are rejected
+    TEST_ASSERT_EQUAL_size_t(0,
+                             decode_uleb128(bytes, sizes[i] - 1, &decoded));
+  }
+  const uint8_t too_wide[] = {0xFF, 0xFF, 0xFF, 0xFF, 0x1F};
+  uint32_t decoded;
+  TEST_ASSERT_EQUAL_size_t(0, decode_uleb128(too_wide, 5, &decoded));
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_push_uses_shortest_form);
+  RUN_TEST(test_loop_uses_short_relative_jump);
+  RUN_TEST(test_far_jumps_grow);
+  RUN_TEST(test_calls_functions_and_indices_are_remapped);
+  RUN_TEST(test_compaction_is_idempotent);
+  RUN_TEST(test_leb128_round_trip);
+  return UNITY_END();
+}
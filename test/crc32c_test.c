@@ -0,0 +1,49 @@
+#include "crc32c.h"
+#include "unity.h"
+#include <stdlib.h>
+#include <string.h>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_known_vectors(void) {
+  TEST_ASSERT_EQUAL_HEX32(0x00000000, crc32c(0, "", 0));
+  TEST_ASSERT_EQUAL_HEX32(0xE3069283, crc32c(0, "123456789", 9));
+  TEST_ASSERT_EQUAL_HEX32(0xE3069283, crc32c_portable(0, "123456789", 9));
+
+  uint8_t zeros[32] = {0};
+  TEST_ASSERT_EQUAL_HEX32(0x8A9136AA, crc32c(0, zeros, sizeof(zeros)));
+}
+
+void test_incremental_matches_one_shot(void) {
+  const char *text = "The quick brown fox jumps over the lazy dog";
+  size_t size = strlen(text);
+  uint32_t whole = crc32c(0, text, size);
+  for (size_t split = 0; split <= size; split++) {
+    uint32_t crc = crc32c(0, text, split);
+    TEST_ASSERT_EQUAL_HEX32(whole, crc32c(crc, text + split, size - split));
+  }
+}
+
+void test_hardware_matches_portable(void) {
+  static uint8_t data[4096 + 16];
+  srand(7);
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (uint8_t)rand();
+  }
+  // Every alignment and a spread of tail lengths
+  for (size_t offset = 0; offset < 16; offset++) {
+    for (size_t size = 0; size < 4096; size += 97) {
+      TEST_ASSERT_EQUAL_HEX32(crc32c_portable(0, data + offset, size),
+                              crc32c(0, data + offset, size));
+    }
+  }
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_known_vectors);
+  RUN_TEST(test_incremental_matches_one_shot);
+  RUN_TEST(test_hardware_matches_portable);
+  return UNITY_END();
+}
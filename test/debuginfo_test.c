@@ -0,0 +1,189 @@
+#include "assembler.h"
+#include "bytecode_format.h"
+#include "debuginfo.h"
+#include "errno.h"
+#include "program.h"
+#include "unity.h"
+#include "vm.h"
+#include "writer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char directory[] = "debuginfo_test_XXXXXX";
+static char include[64];
+static char source_path[64]; // Only names the source, so includes resolve
+static char program_path[64];
+
+void setUp(void) {
+  strcpy(directory, "debuginfo_test_XXXXXX");
+  TEST_ASSERT_NOT_NULL(mkdtemp(directory));
+  snprintf(include, sizeof(include), "%s/divide.inc", directory);
+  snprintf(source_path, sizeof(source_path), "%s/main.asm", directory);
+  snprintf(program_path, sizeof(program_path), "%s/main.nvm", directory);
+}
+
+void tearDown(void) {
+  remove(include);
+  remove(program_path);
+  rmdir(directory);
+}
+
+static const char tripled[] = "    push 6\n"      // 1: offsets 0-7
+                              "    call triple\n" // 2: 8-15
+                              "    halt\n"        // 3: 16
+                              "triple:\n"         // 4
+                              "    dup\n"         // 5: 17
+                              "    dup\n"         // 6
+                              "    add\n"         // 7
+                              "    add\n"         // 8
+                              "    ret\n";        // 9: 21
+
+static void assemble_with_debug(const char *source, const char *name,
+                                BytecodeImage *image) {
+  AssemblerOptions options = {.peephole = PEEPHOLE_ALL, .debug_info = true};
+  TEST_ASSERT_EQUAL_INT(SUCCESS, assemble_image(source, strlen(source), name,
+                                                &options, image));
+  TEST_ASSERT_NOT_NULL(image->debug);
+}
+
+static void assert_location(const BytecodeImage *image, uint32_t offset,
+                            const char *function, const char *file,
+                            uint32_t line) {
+  SourceLocation location;
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        find_source_location(image, offset, &location));
+  TEST_ASSERT_EQUAL_UINT32(strlen(function), location.function_length);
+  TEST_ASSERT_EQUAL_MEMORY(function, location.function,
+                           location.function_length);
+  TEST_ASSERT_EQUAL_UINT32(strlen(file), location.file_length);
+  TEST_ASSERT_EQUAL_MEMORY(file, location.file, location.file_length);
+  TEST_ASSERT_EQUAL_UINT32(line, location.line);
+}
+
+void test_offsets_map_to_functions_and_lines(void) {
+  BytecodeImage image;
+  assemble_with_debug(tripled, "tripled.asm", &image);
+  assert_location(&image, 0, "<main>", "tripled.asm", 1);
+  // The NOPs that align an operand belong to its instruction
+  assert_location(&image, 9, "<main>", "tripled.asm", 2);
+  assert_location(&image, 16, "<main>", "tripled.asm", 3);
+  assert_location(&image, 17, "triple", "tripled.asm", 5);
+  assert_location(&image, 21, "triple", "tripled.asm", 9);
+
+  SourceLocation location;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, find_source_location(&image, 19, &location));
+  TEST_ASSERT_EQUAL_UINT32(17, location.entry);
+  free_assembled_image(&image);
+}
+
+void test_long_functions_span_blocks(void) {
+  // One byte per line, so offset i is line i + 1
+  char source[4 * DEBUG_BLOCK_ROWS * 4 + 8] = "";
+  for (int i = 0; i < 4 * DEBUG_BLOCK_ROWS; i++) {
+    strcat(source, "inc\n");
+  }
+  strcat(source, "halt\n");
+  BytecodeImage image;
+  assemble_with_debug(source, "long.asm", &image);
+  for (uint32_t offset = 0; offset <= 4 * DEBUG_BLOCK_ROWS; offset++) {
+    assert_location(&image, offset, "<main>", "long.asm", offset + 1);
+  }
+  free_assembled_image(&image);
+}
+
+void test_peephole_rewrites_keep_the_first_line(void) {
+  const char source[] = "push 5\n" // 1: offsets 0-7
+                        "push 1\n" // 2: becomes inc at 8
+                        "add\n"    // 3
+                        "dup\n"    // 4: dropped with the pop
+                        "pop\n"    // 5
+                        "halt\n";  // 6: 9
+  BytecodeImage image;
+  assemble_with_debug(source, "rewritten.asm", &image);
+  TEST_ASSERT_EQUAL_size_t(10, image.code_size);
+  assert_location(&image, 8, "<main>", "rewritten.asm", 2);
+  assert_location(&image, 9, "<main>", "rewritten.asm", 6);
+  free_assembled_image(&image);
+}
+
+void test_failed_runs_are_located_in_included_files(void) {
+  FILE *fp = fopen(include, "w");
+  TEST_ASSERT_NOT_NULL(fp);
+  fputs("divide:\n    div\n    ret\n", fp);
+  fclose(fp);
+  const char source[] = "    push 7\n"
+                        "    push 0\n"
+                        "    call divide\n"
+                        "    halt\n"
+                        ".include \"divide.inc\"\n";
+  BytecodeImage image;
+  assemble_with_debug(source, source_path, &image);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, write_bytecode(program_path, &image, 0));
+  free_assembled_image(&image);
+
+  // The section survives the file, and is read from the mapping as is
+  Program *program = NULL;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, open_program(program_path, &program));
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&vm, program));
+  TEST_ASSERT_EQUAL_INT(ERR_DIVIDE_BY_ZERO, execute_vm(&vm));
+  assert_location(&program->image, (uint32_t)vm.ip, "divide", include, 2);
+  free_vm(&vm);
+  release_program(program);
+}
+
+void test_missing_and_damaged_sections_are_rejected(void) {
+  BytecodeImage image;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, assemble_image(tripled, strlen(tripled),
+                                                NULL, NULL, &image));
+  TEST_ASSERT_NULL(image.debug);
+  SourceLocation location;
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND,
+                        find_source_location(&image, 0, &location));
+  free_assembled_image(&image);
+
+  assemble_with_debug(tripled, "tripled.asm", &image);
+  uint8_t *debug = (uint8_t *)image.debug;
+  DebugInfoHeader header;
+  memcpy(&header, debug, sizeof(header));
+  TEST_ASSERT_EQUAL_UINT32(2, header.function_count);
+
+  // Sizes that do not add up to the section
+  header.lines_size++;
+  memcpy(debug, &header, sizeof(header));
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT,
+                        find_source_location(&image, 0, &location));
+  header.lines_size--;
+  memcpy(debug, &header, sizeof(header));
+
+  // A line row cut short
+  size_t lines = sizeof(header) +
+                 header.function_count * sizeof(DebugFunction) +
+                 header.block_count * sizeof(DebugLineBlock) +
+                 header.file_count * sizeof(DebugFile);
+  memset(debug + lines, 0x80, header.lines_size);
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT,
+                        find_source_location(&image, 17, &location));
+
+  // A function name outside the strings
+  DebugFunction function;
+  memcpy(&function, debug + sizeof(header), sizeof(function));
+  function.name_length = header.strings_size + 1;
+  memcpy(debug + sizeof(header), &function, sizeof(function));
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT,
+                        find_source_location(&image, 0, &location));
+  free_assembled_image(&image);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_offsets_map_to_functions_and_lines);
+  RUN_TEST(test_long_functions_span_blocks);
+  RUN_TEST(test_peephole_rewrites_keep_the_first_line);
+  RUN_TEST(test_failed_runs_are_located_in_included_files);
+  RUN_TEST(test_missing_and_damaged_sections_are_rejected);
+  return UNITY_END();
+}
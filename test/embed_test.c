@@ -0,0 +1,77 @@
+#include "bytecode_format.h"
+#include "embed.h"
+#include "errno.h"
+#include "program.h"
+#include "unity.h"
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EMBEDDED_FILE "test/data/test_program.nvm"
+
+// Links the test program in the way src/embed_image.S does for `make embed`
+__asm__(".section .rodata.nanovm_image, \"a\"\n"
+        ".balign 8\n"
+        ".globl nanovm_embedded_image\n"
+        "nanovm_embedded_image:\n"
+        ".incbin \"" EMBEDDED_FILE "\"\n"
+        ".globl nanovm_embedded_image_end\n"
+        "nanovm_embedded_image_end:\n"
+        ".previous\n");
+
+void setUp(void) {}
+
+void tearDown(void) {}
+
+void test_embedded_image_matches_file(void) {
+  const uint8_t *data = NULL;
+  size_t size = 0;
+  TEST_ASSERT_TRUE(find_embedded_image(&data, &size));
+  TEST_ASSERT_EQUAL_size_t(0, (uintptr_t)data % BYTECODE_SECTION_ALIGNMENT);
+
+  FILE *file = fopen(EMBEDDED_FILE, "rb");
+  TEST_ASSERT_NOT_NULL(file);
+  uint8_t *expected = malloc(size + 1);
+  TEST_ASSERT_EQUAL_size_t(size, fread(expected, 1, size + 1, file));
+  fclose(file);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, data, size);
+  free(expected);
+}
+
+void test_embedded_program_runs_in_place(void) {
+  const uint8_t *data = NULL;
+  size_t size = 0;
+  Program *program = NULL;
+  TEST_ASSERT_TRUE(find_embedded_image(&data, &size));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, open_embedded_program(&program));
+  TEST_ASSERT_EQUAL_INT(PROGRAM_STATIC, program->backing);
+  TEST_ASSERT_EQUAL_PTR(data + BYTECODE_HEADER_SIZE, program->image.code);
+
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&vm, program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  free_vm(&vm);
+  release_program(program);
+}
+
+void test_static_image_is_verified(void) {
+  const uint8_t *data = NULL;
+  size_t size = 0;
+  Program *program = NULL;
+  TEST_ASSERT_TRUE(find_embedded_image(&data, &size));
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT,
+                        create_program_from_static(data, 8, &program));
+  TEST_ASSERT_EQUAL_INT(ERR_NULL_POINTER,
+                        create_program_from_static(NULL, size, &program));
+  TEST_ASSERT_NULL(program);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_embedded_image_matches_file);
+  RUN_TEST(test_embedded_program_runs_in_place);
+  RUN_TEST(test_static_image_is_verified);
+  return UNITY_END();
+}
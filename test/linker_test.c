@@ -0,0 +1,190 @@
+#include "bytecode.h"
+#include "bytecode_format.h"
+#include "errno.h"
+#include "linker.h"
+#include "loader.h"
+#include "program.h"
+#include "unity.h"
+#include "vm.h"
+#include "writer.h"
+#include <stdio.h>
+#include <string.h>
+
+// Main module: calls the imported store_k and halts; dead_a is never called
+static uint8_t main_code[14];
+static const BytecodeFunction main_functions[] = {{12, 2, 0, 0, 0}};
+static const int32_t main_constants[] = {100};
+static const int32_t main_globals[] = {0};
+static const char main_names[] = "store_k";
+static const BytecodeSymbol main_symbols[] = {{0, 7, 0, SYMBOL_IMPORT, 0}};
+static const BytecodeRelocation main_relocations[] = {{3, 0}};
+
+// Library module: store_k calls helper, which stores constant 42 in its
+// global; unused_b is never called
+static uint8_t library_code[33];
+static const BytecodeFunction library_functions[] = {
+    {0, 17, 0, 1, 0}, {20, 9, 0, 0, 0}, {32, 1, 0, 0, 0}};
+static const int32_t library_constants[] = {42};
+static const int32_t library_globals[] = {5};
+static const char library_names[] = "helperstore_kunused_b";
+static const BytecodeSymbol library_symbols[] = {
+    {0, 6, 0, SYMBOL_EXPORT, 0},
+    {6, 7, 20, SYMBOL_EXPORT, 0},
+    {13, 8, 32, SYMBOL_EXPORT, 0}};
+
+// Unused module, dropped whole
+static const uint8_t other_code[] = {OP_RET};
+static const BytecodeFunction other_functions[] = {{0, 1, 0, 0, 0}};
+static const int32_t other_constants[] = {1, 2, 3};
+static const char other_names[] = "other";
+static const BytecodeSymbol other_symbols[] = {{0, 5, 0, SYMBOL_EXPORT, 0}};
+
+static BytecodeImage modules[3];
+
+static void put_u32(uint8_t *code, size_t offset, uint32_t value) {
+  memcpy(code + offset, &value, sizeof(value));
+}
+
+void setUp(void) {
+  memset(main_code, OP_NOP, sizeof(main_code));
+  main_code[3] = OP_CALL;
+  put_u32(main_code, 4, 0xFFFFFFFF); // Placeholder until linked
+  main_code[11] = OP_HALT;
+  main_code[12] = 0xFF; // Never read, since dead_a is dropped
+  main_code[13] = OP_RET;
+
+  memset(library_code, OP_NOP, sizeof(library_code));
+  library_code[3] = OP_PUSHK;
+  put_u32(library_code, 4, 0);
+  library_code[11] = OP_GSTORE;
+  put_u32(library_code, 12, 0);
+  library_code[16] = OP_RET;
+  library_code[23] = OP_CALL;
+  put_u32(library_code, 24, 0);
+  library_code[28] = OP_RET;
+  library_code[32] = OP_RET;
+
+  memset(modules, 0, sizeof(modules));
+  for (size_t i = 0; i < 3; i++) {
+    modules[i].version = BYTECODE_VERSION;
+  }
+  modules[0].code = main_code;
+  modules[0].code_size = sizeof(main_code);
+  modules[0].functions = main_functions;
+  modules[0].function_count = 1;
+  modules[0].constants = main_constants;
+  modules[0].constant_count = 1;
+  modules[0].globals = main_globals;
+  modules[0].global_count = 1;
+  modules[0].symbols = main_symbols;
+  modules[0].symbol_count = 1;
+  modules[0].relocations = main_relocations;
+  modules[0].relocation_count = 1;
+  modules[0].names = main_names;
+  modules[0].names_size = sizeof(main_names) - 1;
+
+  modules[1].code = library_code;
+  modules[1].code_size = sizeof(library_code);
+  modules[1].functions = library_functions;
+  modules[1].function_count = 3;
+  modules[1].constants = library_constants;
+  modules[1].constant_count = 1;
+  modules[1].globals = library_globals;
+  modules[1].global_count = 1;
+  modules[1].symbols = library_symbols;
+  modules[1].symbol_count = 3;
+  modules[1].names = library_names;
+  modules[1].names_size = sizeof(library_names) - 1;
+
+  modules[2].code = other_code;
+  modules[2].code_size = sizeof(other_code);
+  modules[2].functions = other_functions;
+  modules[2].function_count = 1;
+  modules[2].constants = other_constants;
+  modules[2].constant_count = 3;
+  modules[2].symbols = other_symbols;
+  modules[2].symbol_count = 1;
+  modules[2].names = other_names;
+  modules[2].names_size = sizeof(other_names) - 1;
+}
+
+void tearDown(void) {}
+
+void test_link_resolves_and_drops_dead_code(void) {
+  BytecodeImage linked;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, link_bytecode(modules, 3, &linked));
+
+  // main (12 bytes), helper at 12 and store_k padded out to 32
+  TEST_ASSERT_EQUAL_size_t(41, linked.code_size);
+  TEST_ASSERT_EQUAL_size_t(2, linked.function_count);
+  TEST_ASSERT_EQUAL_UINT32(12, linked.functions[0].entry);
+  TEST_ASSERT_EQUAL_UINT32(32, linked.functions[1].entry);
+  TEST_ASSERT_EQUAL_UINT16(1, linked.functions[0].max_stack);
+  TEST_ASSERT_EQUAL_size_t(2, linked.constant_count);
+  TEST_ASSERT_EQUAL_size_t(2, linked.global_count);
+  TEST_ASSERT_EQUAL_size_t(0, linked.symbol_count);
+
+  uint32_t target;
+  memcpy(&target, linked.code + 4, sizeof(target));
+  TEST_ASSERT_EQUAL_UINT32(32, target);
+  memcpy(&target, linked.code + 36, sizeof(target));
+  TEST_ASSERT_EQUAL_UINT32(12, target);
+
+  Program *program = NULL;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, create_program_from_image(&linked, &program));
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&vm, program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_INT32(0, vm.globals[0]);
+  TEST_ASSERT_EQUAL_INT32(42, vm.globals[1]);
+  free_vm(&vm);
+  release_program(program);
+  free_linked_bytecode(&linked);
+}
+
+void test_link_reports_symbol_errors(void) {
+  BytecodeImage linked;
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND,
+                        link_bytecode(modules, 1, &linked));
+  TEST_ASSERT_NULL(linked.code);
+
+  BytecodeImage twice[3] = {modules[0], modules[1], modules[1]};
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND,
+                        link_bytecode(twice, 3, &linked));
+
+  // A relocation has to name a CALL to an import
+  BytecodeRelocation relocation = {8, 0};
+  modules[0].relocations = &relocation;
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT,
+                        link_bytecode(modules, 3, &linked));
+}
+
+void test_module_symbols_survive_a_file(void) {
+  const char *filename = "test_module.nvm";
+  TEST_ASSERT_EQUAL_INT(SUCCESS, write_bytecode(filename, &modules[1], 0));
+  MappedBytecode mapped;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, map_bytecode(filename, &mapped));
+  TEST_ASSERT_EQUAL_size_t(3, mapped.image.symbol_count);
+  TEST_ASSERT_EQUAL_size_t(0, mapped.image.relocation_count);
+  TEST_ASSERT_EQUAL_MEMORY(library_symbols, mapped.image.symbols,
+                           sizeof(library_symbols));
+  TEST_ASSERT_EQUAL_size_t(sizeof(library_names) - 1,
+                           mapped.image.names_size);
+
+  BytecodeImage pair[2] = {modules[0], mapped.image};
+  BytecodeImage linked;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, link_bytecode(pair, 2, &linked));
+  TEST_ASSERT_EQUAL_size_t(41, linked.code_size);
+  free_linked_bytecode(&linked);
+  unmap_bytecode(&mapped);
+  remove(filename);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_link_resolves_and_drops_dead_code);
+  RUN_TEST(test_link_reports_symbol_errors);
+  RUN_TEST(test_module_symbols_survive_a_file);
+  return UNITY_END();
+}
@@ -1,8 +1,12 @@
+#include "bytecode.h"
 #include "bytecode_format.h"
 #include "errno.h"
 #include "loader.h"
 #include "unity.h"
+#include "writer.h"
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 static const char *filename;
 static uint8_t *buffer = NULL;
@@ -58,7 +62,6 @@ void test_load_file_too_small(void) {
   remove(filename);
 }
 void test_load_file_too_large(void) {
-  // TODO: Make sure to gitignore this test file
   filename = "test/data/too_large.nvm";
   FILE *f = fopen(filename, "rb");
   if (!f) {
@@ -99,6 +102,335 @@ void test_free_bytecode_buffer(void) {
   free_bytecode(&test_buffer);
   TEST_ASSERT_NULL(test_buffer);
 }
+void test_map_bytecode_valid_file(void) {
+  MappedBytecode mapped = {0};
+  ErrorCode result = map_bytecode(filename, &mapped);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, result);
+  TEST_ASSERT_NOT_NULL(mapped.mapping);
+  TEST_ASSERT_EQUAL_PTR((uint8_t *)mapped.mapping + BYTECODE_HEADER_SIZE,
+                        mapped.image.code);
+  TEST_ASSERT(mapped.image.code_size > 0);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, unmap_bytecode(&mapped));
+  TEST_ASSERT_NULL(mapped.mapping);
+}
+
+void test_map_bytecode_invalid_file(void) {
+  MappedBytecode mapped = {0};
+  TEST_ASSERT_EQUAL_INT(ERR_FILE_NOT_FOUND,
+                        map_bytecode("non_existent_file.nvm", &mapped));
+
+  filename = "too_small.nvm";
+  FILE *fp = fopen(filename, "wb");
+  fwrite("NB", 1, 2, fp);
+  fclose(fp);
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT, map_bytecode(filename, &mapped));
+  TEST_ASSERT_NULL(mapped.mapping);
+  remove(filename);
+}
+
+void test_v2_sections_round_trip(void) {
+  const uint8_t code[] = {OP_NOP, OP_NOP, OP_NOP, OP_PUSHK, 0, 0, 0, 0,
+                          OP_HALT};
+  const int32_t constants[] = {42, -7};
+  const int32_t globals[] = {5};
+  const BytecodeFunction functions[] = {{0, sizeof(code), 0, 1, 0}};
+  BytecodeImage image = {0};
+  image.entry_point = 3;
+  image.code = code;
+  image.code_size = sizeof(code);
+  image.constants = constants;
+  image.constant_count = 2;
+  image.globals = globals;
+  image.global_count = 1;
+  image.functions = functions;
+  image.function_count = 1;
+
+  filename = "round_trip.nvm";
+  TEST_ASSERT_EQUAL_INT(SUCCESS, write_bytecode(filename, &image, 0));
+
+  MappedBytecode mapped = {0};
+  TEST_ASSERT_EQUAL_INT(SUCCESS, map_bytecode(filename, &mapped));
+  TEST_ASSERT_EQUAL_HEX16(BYTECODE_VERSION, mapped.image.version);
+  TEST_ASSERT_EQUAL_UINT32(3, mapped.image.entry_point);
+  TEST_ASSERT_EQUAL_size_t(sizeof(code), mapped.image.code_size);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(code, mapped.image.code, sizeof(code));
+  TEST_ASSERT_EQUAL_size_t(0, (uintptr_t)mapped.image.code %
+                                  BYTECODE_SECTION_ALIGNMENT);
+  TEST_ASSERT_EQUAL_size_t(2, mapped.image.constant_count);
+  TEST_ASSERT_EQUAL_INT32_ARRAY(constants, mapped.image.constants, 2);
+  TEST_ASSERT_EQUAL_size_t(1, mapped.image.global_count);
+  TEST_ASSERT_EQUAL_size_t(1, mapped.image.function_count);
+  TEST_ASSERT_EQUAL_UINT16(1, mapped.image.functions[0].max_stack);
+  TEST_ASSERT_NULL(mapped.image.debug);
+
+  // The legacy API still hands back just the code segment
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        load_bytecode(filename, &buffer, &size, &entry_point));
+  TEST_ASSERT_EQUAL_size_t(sizeof(code), size);
+  TEST_ASSERT_EQUAL_UINT32(3, entry_point);
+
+  unmap_bytecode(&mapped);
+  remove(filename);
+}
+
+void test_v2_section_out_of_bounds(void) {
+  const uint8_t code[] = {OP_HALT};
+  BytecodeImage image = {0};
+  image.code = code;
+  image.code_size = sizeof(code);
+  uint8_t *encoded = NULL;
+  size_t encoded_size = 0;
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        serialize_bytecode(&image, 0, &vm_default_allocator,
+                                           &encoded, &encoded_size));
+
+  BytecodeImage parsed;
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        parse_bytecode(encoded, encoded_size, &parsed));
+  // A truncated file leaves the code section hanging off the end
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT,
+                        parse_bytecode(encoded, encoded_size - 8, &parsed));
+  free(encoded);
+}
+
+void test_compressed_code_round_trip(void) {
+  static uint8_t code[8192];
+  for (size_t i = 0; i < sizeof(code); i++) {
+    code[i] = i % 16 == 15 ? OP_POP : OP_DUP;
+  }
+  code[sizeof(code) - 1] = OP_HALT;
+  BytecodeImage image = {0};
+  image.code = code;
+  image.code_size = sizeof(code);
+  image.entry_point = 16;
+
+  filename = "compressed.nvm";
+  TEST_ASSERT_EQUAL_INT(
+      SUCCESS, write_bytecode(filename, &image, BYTECODE_FLAG_COMPRESSED_CODE));
+
+  MappedBytecode mapped = {0};
+  TEST_ASSERT_EQUAL_INT(SUCCESS, map_bytecode(filename, &mapped));
+  TEST_ASSERT_EQUAL_size_t(sizeof(code), mapped.image.code_size);
+  TEST_ASSERT_TRUE(mapped.image.compressed_code_size > 0);
+  TEST_ASSERT_TRUE(mapped.image.compressed_code_size < sizeof(code) / 8);
+  unmap_bytecode(&mapped);
+
+  // load_bytecode hands back the decompressed code
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        load_bytecode(filename, &buffer, &size, &entry_point));
+  TEST_ASSERT_EQUAL_size_t(sizeof(code), size);
+  TEST_ASSERT_EQUAL_UINT32(16, entry_point);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(code, buffer, sizeof(code));
+  remove(filename);
+}
+
+void test_incompressible_code_is_stored(void) {
+  const uint8_t code[] = {OP_DUP, OP_POP, OP_HALT};
+  BytecodeImage image = {0};
+  image.code = code;
+  image.code_size = sizeof(code);
+  uint8_t *encoded = NULL;
+  size_t encoded_size = 0;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, serialize_bytecode(
+                                     &image, BYTECODE_FLAG_COMPRESSED_CODE,
+                                     &vm_default_allocator, &encoded,
+                                     &encoded_size));
+
+  BytecodeImage parsed;
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        parse_bytecode(encoded, encoded_size, &parsed));
+  TEST_ASSERT_EQUAL_size_t(0, parsed.compressed_code_size);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(code, parsed.code, sizeof(code));
+  free(encoded);
+}
+
+void test_corrupt_compressed_code(void) {
+  static uint8_t code[4096];
+  memset(code, OP_DUP, sizeof(code));
+  code[sizeof(code) - 1] = OP_HALT;
+  BytecodeImage image = {0};
+  image.code = code;
+  image.code_size = sizeof(code);
+  uint8_t *encoded = NULL;
+  size_t encoded_size = 0;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, serialize_bytecode(
+                                     &image, BYTECODE_FLAG_COMPRESSED_CODE,
+                                     &vm_default_allocator, &encoded,
+                                     &encoded_size));
+
+  // Claim more code than the stream holds
+  BytecodeSection section;
+  memcpy(&section, encoded + BYTECODE_V2_HEADER_SIZE, sizeof(section));
+  section.uncompressed_size += 1;
+  memcpy(encoded + BYTECODE_V2_HEADER_SIZE, &section, sizeof(section));
+
+  filename = "corrupt.nvm";
+  FILE *file = fopen(filename, "wb");
+  fwrite(encoded, 1, encoded_size, file);
+  fclose(file);
+  free(encoded);
+
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT,
+                        load_bytecode(filename, &buffer, &size, &entry_point));
+  TEST_ASSERT_NULL(buffer);
+  remove(filename);
+}
+
+/* Writes `image` with the given flags, then flips one bit of the file at
+ * `offset` from the end of the file.
+ */
+static void write_corrupted(const BytecodeImage *image, uint16_t flags,
+                            size_t offset) {
+  uint8_t *encoded = NULL;
+  size_t encoded_size = 0;
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        serialize_bytecode(image, flags, &vm_default_allocator,
+                                           &encoded, &encoded_size));
+  encoded[encoded_size - offset] ^= 0x10;
+  FILE *file = fopen(filename, "wb");
+  fwrite(encoded, 1, encoded_size, file);
+  fclose(file);
+  free(encoded);
+}
+
+void test_checksum_detects_corruption(void) {
+  static uint8_t code[1000];
+  memset(code, OP_DUP, sizeof(code));
+  code[sizeof(code) - 1] = OP_HALT;
+  const int32_t globals[] = {1, 2};
+  BytecodeImage image = {0};
+  image.code = code;
+  image.code_size = sizeof(code);
+  image.globals = globals;
+  image.global_count = 2;
+  filename = "checksummed.nvm";
+
+  TEST_ASSERT_EQUAL_INT(SUCCESS, write_bytecode(filename, &image, 0));
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        load_bytecode(filename, &buffer, &size, &entry_point));
+  free(buffer);
+  buffer = NULL;
+
+  // A flipped bit in the globals, which load_bytecode does not return,
+  // still fails the load
+  write_corrupted(&image, 0, 4);
+  TEST_ASSERT_EQUAL_INT(ERR_CHECKSUM_MISMATCH,
+                        load_bytecode(filename, &buffer, &size, &entry_point));
+  TEST_ASSERT_NULL(buffer);
+  MappedBytecode mapped = {0};
+  TEST_ASSERT_EQUAL_INT(ERR_CHECKSUM_MISMATCH, map_bytecode(filename, &mapped));
+
+  // Same for compressed code: here the flip lands in the code section
+  image.global_count = 0;
+  write_corrupted(&image, BYTECODE_FLAG_COMPRESSED_CODE, 12);
+  ErrorCode status = load_bytecode(filename, &buffer, &size, &entry_point);
+  TEST_ASSERT_TRUE(status == ERR_CHECKSUM_MISMATCH ||
+                   status == ERR_INVALID_FORMAT);
+  TEST_ASSERT_EQUAL_INT(ERR_CHECKSUM_MISMATCH, map_bytecode(filename, &mapped));
+  remove(filename);
+}
+
+/* Returns the read end of a pipe holding `size` bytes of `data` followed
+ * by `trailer`, with the write end already closed.
+ */
+static int pipe_with(const uint8_t *data, size_t size, const char *trailer) {
+  int fds[2];
+  TEST_ASSERT_EQUAL_INT(0, pipe(fds));
+  TEST_ASSERT_EQUAL_INT((int)size, (int)write(fds[1], data, size));
+  TEST_ASSERT_EQUAL_INT((int)strlen(trailer),
+                        (int)write(fds[1], trailer, strlen(trailer)));
+  close(fds[1]);
+  return fds[0];
+}
+
+void test_load_bytecode_from_pipe(void) {
+  static uint8_t code[2048];
+  memset(code, OP_DUP, sizeof(code));
+  code[sizeof(code) - 1] = OP_HALT;
+  const int32_t globals[] = {1, 2};
+  BytecodeImage image = {0};
+  image.code = code;
+  image.code_size = sizeof(code);
+  image.entry_point = 8;
+  image.globals = globals;
+  image.global_count = 2;
+  uint8_t *encoded = NULL;
+  size_t encoded_size = 0;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, serialize_bytecode(
+                                     &image, BYTECODE_FLAG_COMPRESSED_CODE,
+                                     &vm_default_allocator, &encoded,
+                                     &encoded_size));
+
+  // The globals after the code are read to be checksummed, and nothing past
+  // the end of the file is consumed
+  int fd = pipe_with(encoded, encoded_size, "next");
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        load_bytecode_fd(fd, &vm_default_allocator, &buffer,
+                                         &size, &entry_point));
+  TEST_ASSERT_EQUAL_size_t(sizeof(code), size);
+  TEST_ASSERT_EQUAL_UINT32(8, entry_point);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(code, buffer, sizeof(code));
+  char rest[8] = {0};
+  TEST_ASSERT_EQUAL_INT(4, (int)read(fd, rest, sizeof(rest)));
+  TEST_ASSERT_EQUAL_STRING("next", rest);
+  close(fd);
+  free(buffer);
+  buffer = NULL;
+
+  encoded[encoded_size - 4] ^= 0x10;
+  fd = pipe_with(encoded, encoded_size, "");
+  TEST_ASSERT_EQUAL_INT(ERR_CHECKSUM_MISMATCH,
+                        load_bytecode_fd(fd, &vm_default_allocator, &buffer,
+                                         &size, &entry_point));
+  TEST_ASSERT_NULL(buffer);
+  close(fd);
+
+  // A stream that ends early is a format error, not a hang
+  fd = pipe_with(encoded, encoded_size / 2, "");
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT,
+                        load_bytecode_fd(fd, &vm_default_allocator, &buffer,
+                                         &size, &entry_point));
+  close(fd);
+  free(encoded);
+}
+
+void test_read_bytecode_fd_reads_whole_file(void) {
+  const uint8_t v1[] = {'N', 'B', 'V', 'M', 1, 0, 0, 0, 2, 0,
+                        0,   0,   1,   0,   0, 0, OP_NOP, OP_HALT};
+  int fd = pipe_with(v1, sizeof(v1), "x");
+  TEST_ASSERT_EQUAL_INT(SUCCESS, read_bytecode_fd(fd, &vm_default_allocator,
+                                                  &buffer, &size));
+  TEST_ASSERT_EQUAL_size_t(sizeof(v1), size);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(v1, buffer, sizeof(v1));
+  close(fd);
+  free(buffer);
+  buffer = NULL;
+
+  const uint8_t code[] = {OP_NOP, OP_NOP, OP_NOP, OP_PUSHK, 1, 0, 0, 0,
+                          OP_HALT};
+  const int32_t constants[] = {42, -7};
+  BytecodeImage image = {0};
+  image.code = code;
+  image.code_size = sizeof(code);
+  image.constants = constants;
+  image.constant_count = 2;
+  uint8_t *encoded = NULL;
+  size_t encoded_size = 0;
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        serialize_bytecode(&image, 0, &vm_default_allocator,
+                                           &encoded, &encoded_size));
+  fd = pipe_with(encoded, encoded_size, "");
+  TEST_ASSERT_EQUAL_INT(SUCCESS, read_bytecode_fd(fd, &vm_default_allocator,
+                                                  &buffer, &size));
+  TEST_ASSERT_EQUAL_size_t(encoded_size, size);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(encoded, buffer, encoded_size);
+  BytecodeImage parsed;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, parse_bytecode(buffer, size, &parsed));
+  TEST_ASSERT_EQUAL_INT32(-7, parsed.constants[1]);
+  close(fd);
+  free(encoded);
+}
+
 // TODO: Implement rest
 void test_load_entry_point_out_of_bounds(void);
 void test_load_out_of_memory(void);
@@ -113,5 +445,15 @@ int main(void) {
   RUN_TEST(test_load_file_too_large);
   RUN_TEST(test_load_code_size_exceeds_file);
   RUN_TEST(test_free_bytecode_buffer);
+  RUN_TEST(test_map_bytecode_valid_file);
+  RUN_TEST(test_map_bytecode_invalid_file);
+  RUN_TEST(test_v2_sections_round_trip);
+  RUN_TEST(test_v2_section_out_of_bounds);
+  RUN_TEST(test_compressed_code_round_trip);
+  RUN_TEST(test_incompressible_code_is_stored);
+  RUN_TEST(test_corrupt_compressed_code);
+  RUN_TEST(test_checksum_detects_corruption);
+  RUN_TEST(test_load_bytecode_from_pipe);
+  RUN_TEST(test_read_bytecode_fd_reads_whole_file);
   return UNITY_END();
 }
@@ -0,0 +1,108 @@
+#include "errno.h"
+#include "lz.h"
+#include "unity.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SAMPLE_SIZE 100000
+
+static uint8_t input[SAMPLE_SIZE];
+static uint8_t output[SAMPLE_SIZE];
+static uint8_t *compressed;
+static size_t compressed_size;
+
+void setUp(void) {
+  compressed = malloc(lz_compress_bound(SAMPLE_SIZE));
+  compressed_size = 0;
+  memset(output, 0, sizeof(output));
+}
+
+void tearDown(void) { free(compressed); }
+
+static void compress(size_t size) {
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        lz_compress(input, size, compressed,
+                                    lz_compress_bound(size), &compressed_size));
+}
+
+static void fill_repetitive(size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    input[i] = (uint8_t)(i % 7 == 0 ? i / 7 : i % 7);
+  }
+}
+
+void test_round_trip_repetitive(void) {
+  fill_repetitive(SAMPLE_SIZE);
+  compress(SAMPLE_SIZE);
+  TEST_ASSERT_TRUE(compressed_size < SAMPLE_SIZE / 2);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, lz_decompress(compressed, compressed_size,
+                                               output, SAMPLE_SIZE));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(input, output, SAMPLE_SIZE);
+}
+
+void test_round_trip_random_and_tiny(void) {
+  srand(42);
+  for (size_t i = 0; i < SAMPLE_SIZE; i++) {
+    input[i] = (uint8_t)rand();
+  }
+  const size_t sizes[] = {0, 1, 5, 9, 300, SAMPLE_SIZE};
+  for (size_t i = 0; i < 6; i++) {
+    compress(sizes[i]);
+    TEST_ASSERT_TRUE(compressed_size <= lz_compress_bound(sizes[i]));
+    TEST_ASSERT_EQUAL_INT(SUCCESS, lz_decompress(compressed, compressed_size,
+                                                 output, sizes[i]));
+    if (sizes[i] > 0) {
+      TEST_ASSERT_EQUAL_UINT8_ARRAY(input, output, sizes[i]);
+    }
+  }
+}
+
+void test_streaming_one_byte_at_a_time(void) {
+  // A long run exercises the length extension bytes and overlapping copies
+  memset(input, 'a', 5000);
+  fill_repetitive(SAMPLE_SIZE - 5000);
+  memmove(input + 5000, input, SAMPLE_SIZE - 5000);
+  memset(input, 'a', 5000);
+  compress(SAMPLE_SIZE);
+
+  LZ_Decoder decoder;
+  lz_decoder_init(&decoder, output, SAMPLE_SIZE);
+  for (size_t i = 0; i < compressed_size; i++) {
+    TEST_ASSERT_EQUAL_INT(SUCCESS, lz_decode(&decoder, compressed + i, 1));
+  }
+  TEST_ASSERT_EQUAL_INT(SUCCESS, lz_decoder_finish(&decoder));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(input, output, SAMPLE_SIZE);
+}
+
+void test_rejects_corrupt_streams(void) {
+  fill_repetitive(1000);
+  compress(1000);
+
+  // Truncated
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT,
+                        lz_decompress(compressed, compressed_size - 1, output,
+                                      1000));
+  // Declared size too small for the stream
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT,
+                        lz_decompress(compressed, compressed_size, output,
+                                      999));
+  // Trailing data
+  compressed[compressed_size] = 0;
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT,
+                        lz_decompress(compressed, compressed_size + 1, output,
+                                      1000));
+  // A match reaching back before the start of the output
+  const uint8_t bad_offset[] = {0x10, 'x', 0x02, 0x00};
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT,
+                        lz_decompress(bad_offset, sizeof(bad_offset), output,
+                                      10));
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_round_trip_repetitive);
+  RUN_TEST(test_round_trip_random_and_tiny);
+  RUN_TEST(test_streaming_one_byte_at_a_time);
+  RUN_TEST(test_rejects_corrupt_streams);
+  return UNITY_END();
+}
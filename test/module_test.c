@@ -0,0 +1,183 @@
+#include "bytecode.h"
+#include "bytecode_format.h"
+#include "errno.h"
+#include "module.h"
+#include "program.h"
+#include "unity.h"
+#include "vm.h"
+#include <string.h>
+
+// Main program: calls the imported bump twice, then increments its global
+static uint8_t main_code[33];
+static const int32_t main_globals[] = {7};
+static const char main_names[] = "bumpmissing";
+static const BytecodeSymbol main_symbols[] = {
+    {0, 4, 0, SYMBOL_IMPORT, 0}, {4, 7, 0, SYMBOL_IMPORT, 0}};
+
+// Library: bump increments the library's own global
+static uint8_t library_code[17];
+static const BytecodeFunction library_functions[] = {{0, 17, 0, 1, 0}};
+static const int32_t library_globals[] = {40};
+static const char library_names[] = "bump";
+static const BytecodeSymbol library_symbols[] = {
+    {0, 4, 0, SYMBOL_EXPORT, 0}};
+
+static Program *main_program;
+static Program *library;
+
+static void put_u32(uint8_t *code, size_t offset, uint32_t value) {
+  memcpy(code + offset, &value, sizeof(value));
+}
+
+static Program *create(const uint8_t *code, size_t code_size,
+                       const BytecodeFunction *functions,
+                       size_t function_count, const int32_t *globals,
+                       const BytecodeSymbol *symbols, size_t symbol_count,
+                       const char *names) {
+  BytecodeImage image;
+  memset(&image, 0, sizeof(image));
+  image.version = BYTECODE_VERSION;
+  image.code = code;
+  image.code_size = code_size;
+  image.functions = functions;
+  image.function_count = function_count;
+  image.globals = globals;
+  image.global_count = 1;
+  image.symbols = symbols;
+  image.symbol_count = symbol_count;
+  image.names = names;
+  image.names_size = strlen(names);
+  Program *program = NULL;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, create_program_from_image(&image, &program));
+  return program;
+}
+
+void setUp(void) {
+  memset(main_code, OP_NOP, sizeof(main_code));
+  main_code[3] = OP_CALLX;
+  put_u32(main_code, 4, 0);
+  main_code[11] = OP_CALLX;
+  put_u32(main_code, 12, 0);
+  main_code[19] = OP_GLOAD;
+  put_u32(main_code, 20, 0);
+  main_code[24] = OP_INC;
+  main_code[27] = OP_GSTORE;
+  put_u32(main_code, 28, 0);
+  main_code[32] = OP_HALT;
+
+  memset(library_code, OP_NOP, sizeof(library_code));
+  library_code[3] = OP_GLOAD;
+  put_u32(library_code, 4, 0);
+  library_code[8] = OP_INC;
+  library_code[11] = OP_GSTORE;
+  put_u32(library_code, 12, 0);
+  library_code[16] = OP_RET;
+
+  main_program = create(main_code, sizeof(main_code), NULL, 0, main_globals,
+                        main_symbols, 2, main_names);
+  library = create(library_code, sizeof(library_code), library_functions, 1,
+                   library_globals, library_symbols, 1, library_names);
+}
+
+void tearDown(void) {
+  release_program(main_program);
+  release_program(library);
+}
+
+void test_callx_runs_in_the_module(void) {
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&vm, main_program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_module(&vm, library));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+
+  // Each side updated its own globals, and the slot was resolved once
+  TEST_ASSERT_EQUAL_size_t(0, vm.module);
+  TEST_ASSERT_EQUAL_INT32(8, vm.globals[0]);
+  TEST_ASSERT_EQUAL_INT32(42, vm.modules[1].globals[0]);
+  TEST_ASSERT_EQUAL_UINT32(1, vm.modules[0].imports[0].module);
+  TEST_ASSERT_EQUAL_UINT32(VM_UNRESOLVED_IMPORT,
+                           vm.modules[0].imports[1].module);
+
+  TEST_ASSERT_EQUAL_INT(SUCCESS, reset_vm(&vm));
+  TEST_ASSERT_EQUAL_INT32(40, vm.modules[1].globals[0]);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_INT32(42, vm.modules[1].globals[0]);
+  free_vm(&vm);
+}
+
+void test_module_is_shared_between_vms(void) {
+  Nano_VM first;
+  Nano_VM second;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&first));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&second));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&first, main_program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&second, main_program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_module(&first, library));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_module(&second, library));
+  TEST_ASSERT_EQUAL_size_t(3, atomic_load(&library->refcount));
+
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&first));
+  TEST_ASSERT_EQUAL_INT32(42, first.modules[1].globals[0]);
+  TEST_ASSERT_EQUAL_INT32(40, second.modules[1].globals[0]);
+  TEST_ASSERT_EQUAL_PTR(first.modules[1].code, second.modules[1].code);
+
+  free_vm(&first);
+  free_vm(&second);
+  TEST_ASSERT_EQUAL_size_t(1, atomic_load(&library->refcount));
+}
+
+void test_unresolved_and_duplicate_symbols(void) {
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND, attach_module(&vm, library));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&vm, main_program));
+
+  // Without modules there is nothing to call into
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND, execute_vm(&vm));
+
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_module(&vm, library));
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND, attach_module(&vm, library));
+  TEST_ASSERT_EQUAL_size_t(2, vm.module_count);
+
+  // The second import names a function nobody exports
+  put_u32(main_code, 12, 1);
+  Program *calls_missing = create(main_code, sizeof(main_code), NULL, 0,
+                                  main_globals, main_symbols, 2, main_names);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&vm, calls_missing));
+  TEST_ASSERT_NULL(vm.modules);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_module(&vm, library));
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_INT32(41, vm.modules[1].globals[0]);
+  free_vm(&vm);
+  release_program(calls_missing);
+}
+
+void test_callx_must_name_an_import(void) {
+  BytecodeImage image;
+  memset(&image, 0, sizeof(image));
+  image.version = BYTECODE_VERSION;
+  image.code = main_code;
+  image.code_size = sizeof(main_code);
+  image.globals = main_globals;
+  image.global_count = 1;
+  image.symbols = library_symbols;
+  image.symbol_count = 1;
+  image.names = library_names;
+  image.names_size = 4;
+  Program *program = NULL;
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND,
+                        create_program_from_image(&image, &program));
+  image.symbol_count = 0;
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND,
+                        create_program_from_image(&image, &program));
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_callx_runs_in_the_module);
+  RUN_TEST(test_module_is_shared_between_vms);
+  RUN_TEST(test_unresolved_and_duplicate_symbols);
+  RUN_TEST(test_callx_must_name_an_import);
+  return UNITY_END();
+}
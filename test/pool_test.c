@@ -0,0 +1,118 @@
+#include "bytecode.h"
+#include "errno.h"
+#include "pool.h"
+#include "unity.h"
+#include <pthread.h>
+
+#define POOL_THREADS 4
+#define POOL_RUNS_PER_THREAD 200
+
+static const uint8_t program[] = {OP_LOAD, 3, OP_LOAD, 3, OP_ADD, OP_HALT};
+static Program *shared;
+static VM_Pool pool;
+
+void setUp(void) {
+  TEST_ASSERT_EQUAL_INT(
+      SUCCESS, create_program(program, sizeof(program), 0, &shared));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm_pool(&pool, 2, shared));
+}
+
+void tearDown(void) {
+  free_vm_pool(&pool);
+  release_program(shared);
+}
+
+void test_pool_shares_program_code(void) {
+  TEST_ASSERT_EQUAL_size_t(3, atomic_load(&shared->refcount));
+  TEST_ASSERT_EQUAL_PTR(shared->image.code, pool.vms[0].code);
+  TEST_ASSERT_EQUAL_PTR(shared->image.code, pool.vms[1].code);
+}
+
+void test_acquire_and_release(void) {
+  Nano_VM *vm = NULL;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, acquire_vm(&pool, &vm));
+  TEST_ASSERT_NOT_NULL(vm);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(vm));
+  TEST_ASSERT_EQUAL_size_t(1, vm->sp);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, release_vm(&pool, vm));
+
+  // The released instance comes back reset and runs again
+  Nano_VM *again = NULL;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, acquire_vm(&pool, &again));
+  TEST_ASSERT_EQUAL_PTR(vm, again);
+  TEST_ASSERT_EQUAL_size_t(0, again->sp);
+  TEST_ASSERT_EQUAL_size_t(0, again->ip);
+  TEST_ASSERT_EQUAL_size_t(0, again->locals_top);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(again));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, release_vm(&pool, again));
+}
+
+void test_pool_exhausted(void) {
+  Nano_VM *first = NULL;
+  Nano_VM *second = NULL;
+  Nano_VM *third = NULL;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, acquire_vm(&pool, &first));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, acquire_vm(&pool, &second));
+  TEST_ASSERT_EQUAL_INT(ERR_OUT_OF_MEMORY, acquire_vm(&pool, &third));
+  release_vm(&pool, first);
+  release_vm(&pool, second);
+}
+
+void test_release_foreign_vm(void) {
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND, release_vm(&pool, &vm));
+}
+
+void test_release_twice(void) {
+  Nano_VM *vm = NULL;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, acquire_vm(&pool, &vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, release_vm(&pool, vm));
+  TEST_ASSERT_EQUAL_size_t(2, pool.free_count);
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND, release_vm(&pool, vm));
+  TEST_ASSERT_EQUAL_size_t(2, pool.free_count);
+
+  // Never acquired, or not at the start of an instance
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND, release_vm(&pool, &pool.vms[1]));
+  Nano_VM *inside = (Nano_VM *)((uint8_t *)&pool.vms[0] + 8);
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND, release_vm(&pool, inside));
+  TEST_ASSERT_EQUAL_size_t(2, pool.free_count);
+}
+
+static void *run_from_pool(void *arg) {
+  int *failures = (int *)arg;
+  for (int i = 0; i < POOL_RUNS_PER_THREAD; i++) {
+    Nano_VM *vm = NULL;
+    if (acquire_vm(&pool, &vm) != SUCCESS) {
+      continue; // Every instance is busy; try again
+    }
+    if (execute_vm(vm) != SUCCESS || vm->sp != 1) {
+      (*failures)++;
+    }
+    release_vm(&pool, vm);
+  }
+  return NULL;
+}
+
+void test_concurrent_acquire_release(void) {
+  pthread_t threads[POOL_THREADS];
+  int failures[POOL_THREADS] = {0};
+  for (int i = 0; i < POOL_THREADS; i++) {
+    pthread_create(&threads[i], NULL, run_from_pool, &failures[i]);
+  }
+  for (int i = 0; i < POOL_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    TEST_ASSERT_EQUAL_INT(0, failures[i]);
+  }
+  TEST_ASSERT_EQUAL_size_t(pool.capacity, pool.free_count);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_pool_shares_program_code);
+  RUN_TEST(test_acquire_and_release);
+  RUN_TEST(test_pool_exhausted);
+  RUN_TEST(test_release_foreign_vm);
+  RUN_TEST(test_release_twice);
+  RUN_TEST(test_concurrent_acquire_release);
+  return UNITY_END();
+}
@@ -0,0 +1,260 @@
+#include "bytecode.h"
+#include "bytecode_format.h"
+#include "errno.h"
+#include "program.h"
+#include "unity.h"
+#include "vm.h"
+#include "writer.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_create_program_copies_code(void) {
+  uint8_t code[] = {OP_LOAD, 0, OP_HALT};
+  Program *program = NULL;
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        create_program(code, sizeof(code), 2, &program));
+  TEST_ASSERT_TRUE(program->image.code != code);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(code, program->image.code, sizeof(code));
+  TEST_ASSERT_EQUAL_UINT32(2, program->image.entry_point);
+  TEST_ASSERT_EQUAL_size_t(1, atomic_load(&program->refcount));
+  release_program(program);
+}
+
+void test_create_program_invalid_entry_point(void) {
+  uint8_t code[] = {OP_HALT};
+  Program *program = NULL;
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND,
+                        create_program(code, sizeof(code), 1, &program));
+}
+
+void test_open_program_maps_file(void) {
+  Program *program = NULL;
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        open_program("test/data/test_program.nvm", &program));
+  TEST_ASSERT_EQUAL_INT(PROGRAM_MAPPED, program->backing);
+  TEST_ASSERT_EQUAL_PTR((uint8_t *)program->mapping + BYTECODE_HEADER_SIZE,
+                        program->image.code);
+  release_program(program);
+}
+
+void test_vms_share_and_release_program(void) {
+  const uint8_t code[] = {OP_LOAD, 0, OP_HALT};
+  Program *program = NULL;
+  Nano_VM first;
+  Nano_VM second;
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        create_program(code, sizeof(code), 0, &program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&first));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&second));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&first, program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&second, program));
+  TEST_ASSERT_EQUAL_PTR(program->image.code, first.code);
+  TEST_ASSERT_EQUAL_PTR(program->image.code, second.code);
+  TEST_ASSERT_EQUAL_size_t(3, atomic_load(&program->refcount));
+
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&first));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&second));
+
+  free_vm(&first);
+  TEST_ASSERT_EQUAL_size_t(2, atomic_load(&program->refcount));
+  free_vm(&second);
+  TEST_ASSERT_EQUAL_size_t(1, atomic_load(&program->refcount));
+  release_program(program);
+}
+
+void test_create_program_rejects_invalid_code(void) {
+  uint8_t code[] = {OP_JMP, 2, 0, 0, 0};
+  Program *program = NULL;
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND,
+                        create_program(code, sizeof(code), 0, &program));
+  TEST_ASSERT_NULL(program);
+}
+
+void test_program_constants_and_globals(void) {
+  // GLOAD 0; PUSHK 1; ADD; GSTORE 0; GLOAD 0; HALT
+  const uint8_t code[] = {OP_NOP,    OP_NOP, OP_NOP, OP_GLOAD, 0,      0,
+                          0,         0,      OP_NOP, OP_NOP,   OP_NOP, OP_PUSHK,
+                          1,         0,      0,      0,        OP_ADD, OP_NOP,
+                          OP_NOP,    OP_GSTORE, 0,   0,        0,      0,
+                          OP_NOP,    OP_NOP, OP_NOP, OP_GLOAD, 0,      0,
+                          0,         0,      OP_HALT};
+  const int32_t constants[] = {100, 7};
+  const int32_t globals[] = {35};
+  BytecodeImage image = {0};
+  image.version = BYTECODE_VERSION;
+  image.code = code;
+  image.code_size = sizeof(code);
+  image.constants = constants;
+  image.constant_count = 2;
+  image.globals = globals;
+  image.global_count = 1;
+
+  Program *program = NULL;
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, create_program_from_image(&image, &program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&vm, program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_INT32(42, vm.stack[vm.sp - 1]);
+  TEST_ASSERT_EQUAL_INT32(42, vm.globals[0]);
+  // Globals belong to the VM; the program keeps its initial values
+  TEST_ASSERT_EQUAL_INT32(35, program->image.globals[0]);
+
+  TEST_ASSERT_EQUAL_INT(SUCCESS, reset_vm(&vm));
+  TEST_ASSERT_EQUAL_INT32(35, vm.globals[0]);
+  free_vm(&vm);
+  release_program(program);
+}
+
+void test_open_program_decompresses_code(void) {
+  static uint8_t code[4096];
+  memset(code, OP_NOP, sizeof(code));
+  code[sizeof(code) - 2] = OP_PUSH_1;
+  code[sizeof(code) - 1] = OP_HALT;
+  BytecodeImage image = {0};
+  image.code = code;
+  image.code_size = sizeof(code);
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        write_bytecode("compressed_program.nvm", &image,
+                                       BYTECODE_FLAG_COMPRESSED_CODE));
+
+  Program *program = NULL;
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        open_program("compressed_program.nvm", &program));
+  remove("compressed_program.nvm");
+  TEST_ASSERT_EQUAL_INT(PROGRAM_HEAP, program->backing);
+  TEST_ASSERT_EQUAL_size_t(0, program->image.compressed_code_size);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(code, program->image.code, sizeof(code));
+
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&vm, program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_INT32(1, vm.stack[vm.sp - 1]);
+  free_vm(&vm);
+  release_program(program);
+}
+
+void test_read_program_from_pipe(void) {
+  // PUSHK 1; HALT
+  const uint8_t code[] = {OP_NOP, OP_NOP, OP_NOP, OP_PUSHK, 1, 0, 0, 0,
+                          OP_HALT};
+  const int32_t constants[] = {100, 7};
+  BytecodeImage image = {0};
+  image.code = code;
+  image.code_size = sizeof(code);
+  image.constants = constants;
+  image.constant_count = 2;
+  uint8_t *encoded = NULL;
+  size_t encoded_size = 0;
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        serialize_bytecode(&image, 0, &vm_default_allocator,
+                                           &encoded, &encoded_size));
+  int fds[2];
+  TEST_ASSERT_EQUAL_INT(0, pipe(fds));
+  TEST_ASSERT_EQUAL_INT((int)encoded_size,
+                        (int)write(fds[1], encoded, encoded_size));
+  close(fds[1]);
+  free(encoded);
+
+  Program *program = NULL;
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, read_program_fd(fds[0], &program));
+  close(fds[0]);
+  TEST_ASSERT_EQUAL_INT(PROGRAM_READ, program->backing);
+  // Code sits in the read buffer, after the header and two table entries
+  size_t code_offset =
+      BYTECODE_V2_HEADER_SIZE + 2 * BYTECODE_SECTION_ENTRY_SIZE;
+  TEST_ASSERT_EQUAL_PTR((uint8_t *)program->mapping + code_offset,
+                        program->image.code);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&vm, program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_INT32(7, vm.stack[vm.sp - 1]);
+  free_vm(&vm);
+  release_program(program);
+}
+
+/* Writes a program whose main code calls the function at `callee`: either
+ * the one at 12, which sets global 0 to 42, or the broken one at 29.
+ */
+static void write_lazy_program(const char *filename, uint32_t callee) {
+  uint8_t code[31];
+  memset(code, OP_NOP, sizeof(code));
+  code[3] = OP_CALL;
+  memcpy(code + 4, &callee, sizeof(callee));
+  code[11] = OP_HALT; // Main cannot fall through into the function at 12
+  int32_t value = 42;
+  uint32_t global = 0;
+  code[15] = OP_PUSH;
+  memcpy(code + 16, &value, sizeof(value));
+  code[23] = OP_GSTORE;
+  memcpy(code + 24, &global, sizeof(global));
+  code[28] = OP_RET;
+  code[29] = 0xFF; // Never verified unless it is called
+  code[30] = OP_RET;
+
+  const BytecodeFunction functions[] = {{12, 17, 0, 1, 0}, {29, 2, 0, 0, 0}};
+  const int32_t globals[] = {0};
+  BytecodeImage image = {0};
+  image.code = code;
+  image.code_size = sizeof(code);
+  image.functions = functions;
+  image.function_count = 2;
+  image.globals = globals;
+  image.global_count = 1;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, write_bytecode(filename, &image, 0));
+}
+
+void test_lazy_program_verifies_functions_when_called(void) {
+  const char *filename = "test_lazy.nvm";
+  write_lazy_program(filename, 12);
+  Program *program = NULL;
+  TEST_ASSERT_EQUAL_INT(ERR_UNSUPPORTED_OPCODE,
+                        open_program(filename, &program));
+
+  // Only the main code is checked up front
+  TEST_ASSERT_EQUAL_INT(SUCCESS, open_program_lazy(filename, &program));
+  TEST_ASSERT_NOT_NULL(program->verified);
+  TEST_ASSERT_TRUE(program_region_verified(program, 0));
+  TEST_ASSERT_FALSE(program_region_verified(program, 12));
+
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&vm, program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_INT32(42, vm.globals[0]);
+  TEST_ASSERT_TRUE(program_region_verified(program, 12));
+  TEST_ASSERT_FALSE(program_region_verified(program, 29));
+  free_vm(&vm);
+  release_program(program);
+
+  // Calling the broken function fails when the call is reached
+  write_lazy_program(filename, 29);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, open_program_lazy(filename, &program));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, attach_program(&vm, program));
+  TEST_ASSERT_EQUAL_INT(ERR_UNSUPPORTED_OPCODE, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_size_t(3, vm.ip);
+  free_vm(&vm);
+  release_program(program);
+  remove(filename);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_create_program_copies_code);
+  RUN_TEST(test_create_program_invalid_entry_point);
+  RUN_TEST(test_open_program_maps_file);
+  RUN_TEST(test_vms_share_and_release_program);
+  RUN_TEST(test_create_program_rejects_invalid_code);
+  RUN_TEST(test_program_constants_and_globals);
+  RUN_TEST(test_open_program_decompresses_code);
+  RUN_TEST(test_read_program_from_pipe);
+  RUN_TEST(test_lazy_program_verifies_functions_when_called);
+  return UNITY_END();
+}
@@ -0,0 +1,209 @@
+#include "bytecode.h"
+#include "errno.h"
+#include "unity.h"
+#include "verify.h"
+#include <string.h>
+
+static BytecodeImage image;
+
+void setUp(void) {
+  memset(&image, 0, sizeof(image));
+  image.version = BYTECODE_VERSION;
+}
+
+void tearDown(void) {}
+
+static void use_code(const uint8_t *code, size_t size) {
+  image.code = code;
+  image.code_size = size;
+}
+
+void test_verify_accepts_aligned_code(void) {
+  // NOP padding puts each 32-bit operand on a 4-byte boundary
+  const uint8_t code[] = {OP_NOP, OP_NOP, OP_NOP, OP_PUSH, 1, 0, 0, 0,
+                          OP_NOP, OP_NOP, OP_NOP, OP_JMP,  3, 0, 0, 0};
+  use_code(code, sizeof(code));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, verify_code(&image));
+}
+
+void test_verify_rejects_misaligned_operand(void) {
+  const uint8_t code[] = {OP_PUSH, 1, 0, 0, 0, OP_HALT};
+  use_code(code, sizeof(code));
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT, verify_code(&image));
+
+  // Version 0.1 code carries no alignment guarantee
+  image.version = BYTECODE_VERSION_V1;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, verify_code(&image));
+}
+
+void test_verify_rejects_truncated_instruction(void) {
+  const uint8_t code[] = {OP_HALT, OP_LOAD};
+  use_code(code, sizeof(code));
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT, verify_code(&image));
+}
+
+void test_verify_rejects_unknown_opcode(void) {
+  const uint8_t code[] = {OP_COUNT};
+  use_code(code, sizeof(code));
+  TEST_ASSERT_EQUAL_INT(ERR_UNSUPPORTED_OPCODE, verify_code(&image));
+}
+
+void test_verify_rejects_jump_into_instruction(void) {
+  image.version = BYTECODE_VERSION_V1;
+  const uint8_t code[] = {OP_PUSH, 1, 0, 0, 0, OP_JMP, 2, 0, 0, 0};
+  use_code(code, sizeof(code));
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND, verify_code(&image));
+}
+
+void test_verify_checks_indices(void) {
+  image.version = BYTECODE_VERSION_V1;
+  const uint8_t code[] = {OP_PUSHK, 1, 0, 0, 0, OP_HALT};
+  const int32_t constants[] = {7};
+  use_code(code, sizeof(code));
+  image.constants = constants;
+  image.constant_count = 1;
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND, verify_code(&image));
+  image.constant_count = 0;
+  const uint8_t store[] = {OP_GSTORE, 0, 0, 0, 0, OP_HALT};
+  use_code(store, sizeof(store));
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND, verify_code(&image));
+}
+
+void test_verify_checks_function_table(void) {
+  image.version = BYTECODE_VERSION_V1;
+  // main: CALL f; HALT  f: LOAD 2; RET
+  const uint8_t code[] = {OP_CALL, 6, 0, 0, 0, OP_HALT, OP_LOAD, 2, OP_RET};
+  BytecodeFunction functions[] = {{0, 6, 0, 0, 0}, {6, 3, 3, 1, 0}};
+  use_code(code, sizeof(code));
+  image.functions = functions;
+  image.function_count = 2;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, verify_code(&image));
+
+  functions[1].local_count = 2;
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND, verify_code(&image));
+
+  // Calls must land on a declared function entry
+  functions[1].local_count = 3;
+  functions[1].entry = 8;
+  functions[1].size = 1;
+  functions[0].size = 8;
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND, verify_code(&image));
+}
+
+void test_verify_code_region(void) {
+  image.version = BYTECODE_VERSION_V1;
+  // main: CALL f; NOP  f: JMP8 +2; NOP; RET  g: bad opcode
+  const uint8_t code[] = {OP_CALL, 6,      0,      0,    0,   OP_NOP,
+                          OP_JMP8, 2,      OP_RET, 0xFF, OP_RET};
+  const BytecodeFunction functions[] = {{6, 3, 0, 0, 0}, {9, 2, 0, 0, 0}};
+  use_code(code, sizeof(code));
+  image.functions = functions;
+  image.function_count = 2;
+
+  size_t start = 0;
+  size_t end = 0;
+  find_code_region(&image, 2, &start, &end);
+  TEST_ASSERT_EQUAL_size_t(0, start);
+  TEST_ASSERT_EQUAL_size_t(6, end);
+  find_code_region(&image, 10, &start, &end);
+  TEST_ASSERT_EQUAL_size_t(9, start);
+  TEST_ASSERT_EQUAL_size_t(11, end);
+
+  // The call may leave main; main's last NOP falls through into f
+  bool falls_through = false;
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        verify_code_region(&image, 0, 6, 0, &falls_through));
+  TEST_ASSERT_TRUE(falls_through);
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        verify_code_region(&image, 6, 9, 6, &falls_through));
+  TEST_ASSERT_FALSE(falls_through);
+  TEST_ASSERT_EQUAL_INT(ERR_UNSUPPORTED_OPCODE,
+                        verify_code_region(&image, 9, 11, 9, &falls_through));
+
+  // A jump may not leave its region, even onto an instruction
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND,
+                        verify_code_region(&image, 6, 8, 6, &falls_through));
+}
+
+void test_verify_skips_runs_of_plain_instructions(void) {
+  uint8_t code[48];
+  memset(code, OP_NOP, sizeof(code));
+  code[17] = OP_ADD;
+  code[sizeof(code) - 1] = OP_HALT;
+  use_code(code, sizeof(code));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, verify_code(&image));
+
+  // Odd bytes inside a run, and a wide operand right after one
+  code[20] = 0xFF;
+  TEST_ASSERT_EQUAL_INT(ERR_UNSUPPORTED_OPCODE, verify_code(&image));
+  code[20] = OP_NOP;
+  code[33] = OP_PUSH;
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_FORMAT, verify_code(&image));
+}
+
+#define PARALLEL_FUNCTIONS 64
+#define PARALLEL_FUNCTION_SIZE 512
+
+static void put_instruction(uint8_t *code, size_t offset, uint8_t opcode,
+                            uint32_t operand) {
+  code[offset] = opcode;
+  memcpy(code + offset + 1, &operand, sizeof(operand));
+}
+
+static void assert_same_result(ErrorCode expected) {
+  TEST_ASSERT_EQUAL_INT(expected, verify_code_parallel(&image, 1));
+  TEST_ASSERT_EQUAL_INT(expected, verify_code_parallel(&image, 4));
+}
+
+void test_verify_parallel_matches_sequential(void) {
+  static uint8_t code[PARALLEL_FUNCTIONS * PARALLEL_FUNCTION_SIZE];
+  static BytecodeFunction functions[PARALLEL_FUNCTIONS];
+  memset(code, OP_NOP, sizeof(code));
+  for (uint32_t i = 0; i < PARALLEL_FUNCTIONS; i++) {
+    uint32_t entry = i * PARALLEL_FUNCTION_SIZE;
+    functions[i] = (BytecodeFunction){entry, PARALLEL_FUNCTION_SIZE, 0, 1, 0};
+    put_instruction(code, entry + 7, OP_PUSH, i);
+    code[entry + 12] = OP_POP;
+    code[entry + PARALLEL_FUNCTION_SIZE - 1] = OP_RET;
+  }
+  // Function 0 jumps into function 40 and calls the last one
+  uint32_t landing = 40 * PARALLEL_FUNCTION_SIZE + 12;
+  put_instruction(code, 15, OP_JMPZ, landing);
+  put_instruction(code, 23, OP_CALL, 63 * PARALLEL_FUNCTION_SIZE);
+  use_code(code, sizeof(code));
+  image.functions = functions;
+  image.function_count = PARALLEL_FUNCTIONS;
+  assert_same_result(SUCCESS);
+
+  // A jump into the middle of an instruction in another chunk
+  put_instruction(code, 15, OP_JMPZ, landing - 4);
+  assert_same_result(ERR_INVALID_OPERAND);
+  put_instruction(code, 15, OP_JMPZ, landing);
+
+  code[41 * PARALLEL_FUNCTION_SIZE + 100] = OP_COUNT;
+  assert_same_result(ERR_UNSUPPORTED_OPCODE);
+  code[41 * PARALLEL_FUNCTION_SIZE + 100] = OP_NOP;
+
+  // Function entries swallowed by the instruction before them, inside a
+  // chunk and where one chunk ends and the next begins
+  put_instruction(code, 50 * PARALLEL_FUNCTION_SIZE - 1, OP_PUSH, 0);
+  assert_same_result(ERR_INVALID_FORMAT);
+  memset(code + 50 * PARALLEL_FUNCTION_SIZE - 1, OP_NOP, 5);
+  put_instruction(code, 56 * PARALLEL_FUNCTION_SIZE - 1, OP_PUSH, 0);
+  assert_same_result(ERR_INVALID_FORMAT);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_verify_accepts_aligned_code);
+  RUN_TEST(test_verify_rejects_misaligned_operand);
+  RUN_TEST(test_verify_rejects_truncated_instruction);
+  RUN_TEST(test_verify_rejects_unknown_opcode);
+  RUN_TEST(test_verify_rejects_jump_into_instruction);
+  RUN_TEST(test_verify_checks_indices);
+  RUN_TEST(test_verify_checks_function_table);
+  RUN_TEST(test_verify_code_region);
+  RUN_TEST(test_verify_skips_runs_of_plain_instructions);
+  RUN_TEST(test_verify_parallel_matches_sequential);
+  return UNITY_END();
+}
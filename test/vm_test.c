@@ -1,9 +1,10 @@
-
+#include "bytecode.h"
 #include "errno.h"
 #include "loader.h"
 #include "unity.h"
 #include "unity_internals.h"
 #include "vm.h"
+#include <string.h>
 
 void setUp(void) {}
 void tearDown(void) {}
@@ -12,6 +13,7 @@ void test_init_vm_success(void) {
   Nano_VM vm;
   ErrorCode err = init_vm(&vm);
   TEST_ASSERT_EQUAL_INT(SUCCESS, err);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, free_vm(&vm));
 }
 
 void test_load_program_invalid_args(void) {
@@ -39,6 +41,8 @@ void test_execute_vm_halt(void) {
   TEST_ASSERT_EQUAL_INT(SUCCESS, status);
   status = free_bytecode(&bytecode_buffer);
   TEST_ASSERT_EQUAL_INT(SUCCESS, status);
+  status = free_vm(&vm);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, status);
 }
 
 void test_free_vm_null(void) {
@@ -46,9 +50,197 @@ void test_free_vm_null(void) {
   TEST_ASSERT_EQUAL_INT(ERR_NULL_POINTER, err);
 }
 
+void test_call_stack_grows_to_limit(void) {
+  // CALL 0 recurses until the call depth limit is reached
+  const uint8_t code[] = {OP_CALL, 0, 0, 0, 0};
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, set_call_depth_limit(&vm, 1000));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, load_program(&vm, code, sizeof(code), 0));
+  TEST_ASSERT_EQUAL_INT(ERR_STACK_OVERFLOW, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_size_t(1000, vm.call_sp);
+  TEST_ASSERT_EQUAL_size_t(1000, vm.diag.max_call_sp);
+  TEST_ASSERT_EQUAL_size_t(1000, vm.call_capacity);
+  free_vm(&vm);
+}
+
+void test_untouched_local_reads_zero(void) {
+  const uint8_t code[] = {OP_LOAD, 200, OP_HALT};
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, load_program(&vm, code, sizeof(code), 0));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_size_t(1, vm.sp);
+  TEST_ASSERT_EQUAL_INT32(0, vm.stack[0]);
+  TEST_ASSERT_EQUAL_size_t(201, vm.locals_top);
+  free_vm(&vm);
+}
+
+void test_operand_stack_overflow(void) {
+  // LOAD 0 followed by a jump back to it pushes until the stack is full
+  const uint8_t code[] = {OP_LOAD, 0, OP_JMP, 0, 0, 0, 0};
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, load_program(&vm, code, sizeof(code), 0));
+  TEST_ASSERT_EQUAL_INT(ERR_STACK_OVERFLOW, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(ERR_STACK_OVERFLOW, vm.diag.error);
+  free_vm(&vm);
+}
+
+void test_operand_stack_underflow(void) {
+  const uint8_t code[] = {OP_ADD, OP_HALT};
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, load_program(&vm, code, sizeof(code), 0));
+  TEST_ASSERT_EQUAL_INT(ERR_STACK_UNDERFLOW, execute_vm(&vm));
+  free_vm(&vm);
+}
+
+void test_pop_on_empty_stack_underflows(void) {
+  // POP moves sp without touching the stack, so no guard page catches it
+  const uint8_t code[] = {OP_POP, OP_HALT};
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, load_program(&vm, code, sizeof(code), 0));
+  TEST_ASSERT_EQUAL_INT(ERR_STACK_UNDERFLOW, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_size_t(0, vm.sp);
+  free_vm(&vm);
+}
+
+typedef struct {
+  int allocs;
+  int frees;
+} AllocCounter;
+
+static void *counting_alloc(void *ctx, size_t size) {
+  ((AllocCounter *)ctx)->allocs++;
+  return malloc(size);
+}
+
+static void counting_free(void *ctx, void *ptr) {
+  ((AllocCounter *)ctx)->frees++;
+  free(ptr);
+}
+
+void test_vm_uses_supplied_allocator(void) {
+  const uint8_t code[] = {OP_LOAD, 0, OP_HALT};
+  AllocCounter counter = {0, 0};
+  VM_Allocator allocator = {counting_alloc, counting_free, &counter};
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm_with_allocator(&vm, &allocator));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, load_program(&vm, code, sizeof(code), 0));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, free_vm(&vm));
+#ifdef VM_GUARDED_STACK
+  // The operand stack is mapped between guard pages instead
+  TEST_ASSERT_EQUAL_INT(3, counter.allocs);
+#else
+  TEST_ASSERT_EQUAL_INT(4, counter.allocs);
+#endif
+  TEST_ASSERT_EQUAL_INT(counter.allocs, counter.frees);
+}
+
+void test_vm_runs_inside_buffer(void) {
+  static uint8_t buffer[16 * 1024];
+  const uint8_t code[] = {OP_LOAD, 0, OP_HALT};
+  Nano_VM vm;
+#ifdef VM_GUARDED_STACK
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND,
+                        init_vm_in_buffer(&vm, buffer, sizeof(buffer)));
+  return;
+#endif
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        init_vm_in_buffer(&vm, buffer, sizeof(buffer)));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, load_program(&vm, code, sizeof(code), 0));
+  TEST_ASSERT_TRUE(vm.code >= buffer && vm.code < buffer + sizeof(buffer));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, free_vm(&vm));
+}
+
+void test_vm_buffer_too_small(void) {
+  uint8_t buffer[256];
+  Nano_VM vm;
+#ifdef VM_GUARDED_STACK
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND,
+                        init_vm_in_buffer(&vm, buffer, sizeof(buffer)));
+  return;
+#endif
+  TEST_ASSERT_EQUAL_INT(ERR_OUT_OF_MEMORY,
+                        init_vm_in_buffer(&vm, buffer, sizeof(buffer)));
+}
+
+void test_vm_in_buffer_reloads_in_place(void) {
+  static uint8_t buffer[64 * 1024];
+  static uint8_t code[4096]; // Far more than the buffer holds 64 copies of
+  const uint8_t recurse[] = {OP_CALL, 0, 0, 0, 0};
+  memset(code, OP_NOP, sizeof(code));
+  code[sizeof(code) - 1] = OP_HALT;
+  Nano_VM vm;
+#ifdef VM_GUARDED_STACK
+  TEST_ASSERT_EQUAL_INT(ERR_INVALID_OPERAND,
+                        init_vm_in_buffer(&vm, buffer, sizeof(buffer)));
+  return;
+#endif
+  TEST_ASSERT_EQUAL_INT(SUCCESS,
+                        init_vm_in_buffer(&vm, buffer, sizeof(buffer)));
+  for (int i = 0; i < 64; i++) {
+    TEST_ASSERT_EQUAL_INT(SUCCESS,
+                          load_program(&vm, code, sizeof(code), 0));
+    TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+    if (i == 32) {
+      // Growing the call stack keeps it, and the code, below the mark
+      TEST_ASSERT_EQUAL_INT(SUCCESS, set_call_depth_limit(&vm, 64));
+      TEST_ASSERT_EQUAL_INT(SUCCESS,
+                            load_program(&vm, recurse, sizeof(recurse), 0));
+      TEST_ASSERT_EQUAL_INT(ERR_STACK_OVERFLOW, execute_vm(&vm));
+      TEST_ASSERT_EQUAL_INT(SUCCESS, reset_vm(&vm));
+    }
+  }
+  TEST_ASSERT_EQUAL_INT(SUCCESS, free_vm(&vm));
+}
+
+void test_reset_vm_reruns_program(void) {
+  const uint8_t code[] = {OP_LOAD, 9, OP_LOAD, 9, OP_HALT};
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, load_program(&vm, code, sizeof(code), 0));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_size_t(2, vm.sp);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, reset_vm(&vm));
+  TEST_ASSERT_EQUAL_size_t(0, vm.sp);
+  TEST_ASSERT_EQUAL_size_t(0, vm.ip);
+  TEST_ASSERT_EQUAL_size_t(1, vm.call_sp);
+  TEST_ASSERT_EQUAL_size_t(0, vm.locals_top);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_size_t(2, vm.sp);
+  free_vm(&vm);
+}
+
+void test_bind_program_does_not_copy(void) {
+  const uint8_t code[] = {OP_LOAD, 1, OP_HALT};
+  Nano_VM vm;
+  TEST_ASSERT_EQUAL_INT(SUCCESS, init_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, bind_program(&vm, code, sizeof(code), 0));
+  TEST_ASSERT_EQUAL_PTR(code, vm.code);
+  TEST_ASSERT_EQUAL_INT(SUCCESS, execute_vm(&vm));
+  TEST_ASSERT_EQUAL_INT(SUCCESS, free_vm(&vm));
+  TEST_ASSERT_EQUAL_UINT8(OP_LOAD, code[0]);
+}
+
 int main(void) {
   RUN_TEST(test_init_vm_success);
   RUN_TEST(test_load_program_invalid_args);
   RUN_TEST(test_execute_vm_halt);
   RUN_TEST(test_free_vm_null);
+  RUN_TEST(test_call_stack_grows_to_limit);
+  RUN_TEST(test_untouched_local_reads_zero);
+  RUN_TEST(test_operand_stack_overflow);
+  RUN_TEST(test_operand_stack_underflow);
+  RUN_TEST(test_pop_on_empty_stack_underflows);
+  RUN_TEST(test_vm_uses_supplied_allocator);
+  RUN_TEST(test_vm_runs_inside_buffer);
+  RUN_TEST(test_vm_buffer_too_small);
+  RUN_TEST(test_vm_in_buffer_reloads_in_place);
+  RUN_TEST(test_reset_vm_reruns_program);
+  RUN_TEST(test_bind_program_does_not_copy);
 }